@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../Lower/json.hpp"
+
+/*
+
+bench [--sizes 1K,10K,...] [--stages lex,parse,lower,codegen,opt,load,load-dom] [--runs N] [--timeout S] [--memory MB]
+      [--bin <dir>] [--work <dir>] [--keep] [cfgen options...]
+
+Scaling study of the pipeline. For every size cfgen writes a program of about that many bytes (any option
+bench does not know is passed on to cfgen: --depth, --structs, --seed, ...), then every stage runs on it
+as its own process and one CSV line per stage goes to stdout:
+
+    size,source_bytes,stage,input_bytes,seconds,mb_per_s,peak_rss_kb,status
+
+    lex      lex -o <tokens> <file.cf>                 input: the source
+    parse    parser <tokens>, parsing and type checking input: the lex -o token stream
+    lower    cflatc --emit lir-json <file.cf>          input: the source
+    codegen  codegen <lir.json>                        input: the LIR JSON
+    opt      opt <lir.json>                            input: the LIR JSON
+    load     lower <ast.json> -load                    input: the cflatc --emit ast-json dump
+    load-dom lower <ast.json> -load -dom               input: the same dump
+
+lower has no input format of its own that the parser writes, so it is measured inside cflatc: its seconds
+are the lowerProgram and outputLIRJson timers from CFLAT_METRICS, its peak RSS the process's peak when
+they end. The LIR JSON cflatc prints is what codegen and opt are fed.
+
+load and load-dom only read an AST dump into lower's AST, streaming it through the SAX loader or through
+the json DOM parseAST walks; they are not in the default stages, their dumps run to several times the
+source's size.
+
+seconds is the fastest of --runs runs (default 3; a stage that takes over 5 s runs once), peak_rss_kb the
+largest. A run is killed after --timeout seconds (default 300) and limited to --memory MB of address space
+(default half the machine); status is then timeout or failed, and the stages after it are skipped.
+
+*/
+
+namespace {
+
+using json = nlohmann::json;
+
+struct Measurement {
+    double seconds = 0;
+    long peakRssKB = 0;
+    std::string status = "ok";
+};
+
+std::string binDir, workDir = "bench-work";
+int runs = 3, timeoutSeconds = 300;
+long memoryMB = 0;
+
+uint64_t parseSize(const std::string& text) {
+    size_t end = 0;
+    uint64_t value = std::stoull(text, &end);
+    std::string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k") value <<= 10;
+    else if (suffix == "M" || suffix == "m") value <<= 20;
+    else if (suffix == "G" || suffix == "g") value <<= 30;
+    else if (!suffix.empty()) throw std::invalid_argument(text);
+    return value;
+}
+
+std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream in(list);
+    for (std::string item; std::getline(in, item, ','); ) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+long long fileSize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? static_cast<long long>(st.st_size) : -1;
+}
+
+// Runs args with stdout sent to out, waits for it and measures it; the rusage of the wait is the child's own
+Measurement run(const std::vector<std::string>& args, const std::string& out, const std::vector<std::string>& env = {}) {
+    Measurement m;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        m.status = "failed";
+        return m;
+    }
+    if (pid == 0) {
+        int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) _exit(127);
+        close(fd);
+        for (const auto& assignment : env) putenv(const_cast<char*>(assignment.c_str()));
+        if (memoryMB > 0) {
+            struct rlimit limit;
+            limit.rlim_cur = limit.rlim_max = static_cast<rlim_t>(memoryMB) << 20;
+            setrlimit(RLIMIT_AS, &limit);
+        }
+        if (timeoutSeconds > 0) alarm(timeoutSeconds); // survives the exec, SIGALRM ends the stage
+        std::vector<char*> argv;
+        for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        dprintf(STDERR_FILENO, "bench: cannot run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {}
+    m.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    m.peakRssKB = usage.ru_maxrss;
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) m.status = "timeout";
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) m.status = "failed";
+    return m;
+}
+
+// lower's share of a cflatc run, from the metrics it wrote at exit
+Measurement lowerShare(const Measurement& whole, const std::string& metricsPath) {
+    Measurement m = whole;
+    if (m.status != "ok") return m;
+    std::ifstream in(metricsPath);
+    json metrics = json::parse(in, nullptr, false);
+    if (metrics.is_discarded() || !metrics.contains("timers")) {
+        m.status = "failed";
+        return m;
+    }
+    m.seconds = 0;
+    m.peakRssKB = 0;
+    for (const auto& timer : metrics["timers"]) {
+        std::string name = timer["name"];
+        if (name != "lowerProgram" && name != "outputLIRJson") continue;
+        m.seconds += timer["ms"].get<double>() / 1e3;
+        m.peakRssKB = std::max(m.peakRssKB, timer["peak_rss_kb"].get<long>());
+    }
+    return m;
+}
+
+// The best of the runs: the fastest time and the largest peak, a failure ends the series
+Measurement repeat(const std::function<Measurement()>& once) {
+    Measurement best = once();
+    for (int r = 1; r < runs && best.status == "ok" && best.seconds < 5; r++) {
+        Measurement m = once();
+        if (m.status != "ok") return m;
+        best.seconds = std::min(best.seconds, m.seconds);
+        best.peakRssKB = std::max(best.peakRssKB, m.peakRssKB);
+    }
+    return best;
+}
+
+void row(const std::string& size, long long sourceBytes, const std::string& stage, long long inputBytes, const Measurement& m) {
+    std::cout << size << ',' << sourceBytes << ',' << stage << ',' << inputBytes << ',';
+    if (m.status == "ok") {
+        double mbPerSecond = m.seconds > 0 ? inputBytes / 1048576.0 / m.seconds : 0;
+        std::cout << std::fixed << std::setprecision(6) << m.seconds << ',' << std::setprecision(2) << mbPerSecond << ',' << m.peakRssKB;
+    } else {
+        std::cout << ",," << (m.status == "skipped" ? "" : std::to_string(m.peakRssKB));
+    }
+    std::cout << ',' << m.status << std::endl;
+}
+
+bool wants(const std::vector<std::string>& stages, const std::string& stage) {
+    return std::find(stages.begin(), stages.end(), stage) != stages.end();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> sizes = {"1K", "10K", "100K", "1M", "10M", "100M"};
+    std::vector<std::string> stages = {"lex", "parse", "lower", "codegen", "opt"};
+    std::vector<std::string> generatorOptions;
+    bool keep = false;
+    try {
+        for (int a = 1; a < argc; a++) {
+            std::string arg = argv[a];
+            if (arg == "--keep") keep = true;
+            else if (a + 1 >= argc) throw std::invalid_argument(arg);
+            else if (arg == "--sizes") sizes = split(argv[++a]);
+            else if (arg == "--stages") stages = split(argv[++a]);
+            else if (arg == "--runs") runs = std::max(1, std::stoi(argv[++a]));
+            else if (arg == "--timeout") timeoutSeconds = std::stoi(argv[++a]);
+            else if (arg == "--memory") memoryMB = std::stol(argv[++a]);
+            else if (arg == "--bin") binDir = argv[++a];
+            else if (arg == "--work") workDir = argv[++a];
+            else if (arg.compare(0, 2, "--") == 0) {
+                generatorOptions.push_back(arg);
+                generatorOptions.push_back(argv[++a]);
+            } else {
+                throw std::invalid_argument(arg);
+            }
+        }
+        for (const auto& size : sizes) parseSize(size);
+        for (const auto& stage : stages) {
+            if (stage != "lex" && stage != "parse" && stage != "lower" && stage != "codegen" && stage != "opt" && stage != "load" && stage != "load-dom") {
+                throw std::invalid_argument(stage);
+            }
+        }
+    } catch (const std::exception&) {
+        std::cerr << "Usage: " << argv[0] << " [--sizes 1K,10K,...] [--stages lex,parse,lower,codegen,opt,load,load-dom] [--runs N] [--timeout S] [--memory MB] [--bin <dir>] [--work <dir>] [--keep] [cfgen options...]" << std::endl;
+        return 1;
+    }
+
+    if (binDir.empty()) { // the stages are built next to bench
+        std::string self = argv[0];
+        size_t slash = self.rfind('/');
+        binDir = slash == std::string::npos ? "." : self.substr(0, slash);
+    }
+    if (memoryMB == 0) memoryMB = sysconf(_SC_PHYS_PAGES) / 2 * (sysconf(_SC_PAGESIZE) / 1024) / 1024;
+    mkdir(workDir.c_str(), 0755);
+
+    std::cout << "size,source_bytes,stage,input_bytes,seconds,mb_per_s,peak_rss_kb,status" << std::endl;
+    for (const auto& size : sizes) {
+        std::string base = workDir + "/" + size;
+        std::string source = base + ".cf", tokens = base + ".tok", lir = base + ".lir.json", metrics = base + ".metrics.json";
+        std::string ast = base + ".ast.json";
+
+        std::vector<std::string> generate = {binDir + "/cfgen", "--size", size};
+        generate.insert(generate.end(), generatorOptions.begin(), generatorOptions.end());
+        if (run(generate, source).status != "ok") {
+            std::cerr << "bench: cfgen failed for size " << size << std::endl;
+            return 1;
+        }
+        long long sourceBytes = fileSize(source);
+        std::cerr << "bench: " << size << " (" << sourceBytes << " bytes)" << std::endl;
+
+        bool tokensReady = false, lirReady = false;
+        if (wants(stages, "lex") || wants(stages, "parse")) {
+            Measurement m = repeat([&] { return run({binDir + "/lex", "-o", tokens, source}, "/dev/null"); });
+            tokensReady = m.status == "ok";
+            if (wants(stages, "lex")) row(size, sourceBytes, "lex", sourceBytes, m);
+        }
+        if (wants(stages, "parse")) {
+            Measurement m;
+            m.status = "skipped";
+            if (tokensReady) m = repeat([&] { return run({binDir + "/parser", tokens}, "/dev/null"); });
+            row(size, sourceBytes, "parse", fileSize(tokens), m);
+        }
+        if (wants(stages, "lower") || wants(stages, "codegen") || wants(stages, "opt")) {
+            Measurement m = repeat([&] {
+                unlink(metrics.c_str()); // CFLAT_METRICS_FILE appends
+                return lowerShare(run({binDir + "/cflatc", "--emit", "lir-json", source}, lir,
+                                      {"CFLAT_METRICS=json", "CFLAT_METRICS_FILE=" + metrics}), metrics);
+            });
+            lirReady = m.status == "ok";
+            if (wants(stages, "lower")) row(size, sourceBytes, "lower", sourceBytes, m);
+        }
+        for (const std::string stage : {"codegen", "opt"}) {
+            if (!wants(stages, stage)) continue;
+            Measurement m;
+            m.status = "skipped";
+            if (lirReady) m = repeat([&] { return run({binDir + "/" + stage, lir}, "/dev/null"); });
+            row(size, sourceBytes, stage, lirReady ? fileSize(lir) : -1, m);
+        }
+        if (wants(stages, "load") || wants(stages, "load-dom")) {
+            bool astReady = run({binDir + "/cflatc", "--emit", "ast-json", source}, ast).status == "ok";
+            for (const std::string stage : {"load", "load-dom"}) {
+                if (!wants(stages, stage)) continue;
+                std::vector<std::string> args = {binDir + "/lower", ast, "-load"};
+                if (stage == "load-dom") args.push_back("-dom");
+                Measurement m;
+                m.status = "skipped";
+                if (astReady) m = repeat([&] { return run(args, "/dev/null"); });
+                row(size, sourceBytes, stage, astReady ? fileSize(ast) : -1, m);
+            }
+        }
+
+        if (!keep) {
+            for (const auto& path : {source, tokens, lir, metrics, ast}) unlink(path.c_str());
+        }
+    }
+    if (!keep) rmdir(workDir.c_str());
+    return 0;
+}
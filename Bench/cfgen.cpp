@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+
+cfgen [--functions N] [--size BYTES] [--statements N] [--depth D] [--loops L] [--structs S] [--pointers P]
+      [--calls C] [--seed N]
+
+Prints a random CFlat program (Parse/grammar-3.md) that lexes, parses and type checks, for scaling studies
+of the pipeline. The same options and seed always give the same program.
+
+    --functions N   functions besides test and main (default 8); ignored when --size is given
+    --size BYTES    keep adding functions until the program is at least this long (K, M and G suffixes)
+    --statements N  top-level statements in every function (default 3 to 8 at random); large values give
+                    the long function bodies lowering and codegen are measured on
+    --depth D       deepest nesting of if and while statements (default 3)
+    --loops L       deepest nesting of while loops, at most D (default 2)
+    --structs S     struct types, each function works on one of them (default 2; 0 leaves out fields)
+    --pointers P    percent of statements that go through a pointer: *q, q[i], n.f (default 25)
+    --calls C       percent of expression leaves that call an earlier function or an extern (default 15)
+
+Every function f<k>(a: int, b: int, p: &s<j>) -> int declares the same locals (x, y, z: int, q: &int,
+n: &s<j>) and ends in a return, so every statement the generator picks is well typed wherever it lands.
+Calls only go to functions defined earlier, which keeps main's call graph a DAG. fn test takes and uses
+ints only: it is the function opt analyses.
+
+*/
+
+namespace {
+
+struct Shape {
+    uint64_t functions = 8;
+    uint64_t size = 0;
+    int statements = 0;
+    int depth = 3;
+    int loops = 2;
+    int structs = 2;
+    int pointers = 25;
+    int calls = 15;
+    uint64_t seed = 1;
+};
+
+class Generator {
+public:
+    explicit Generator(const Shape& shape) : shape(shape), random(shape.seed) {}
+
+    void run() {
+        header();
+        function("test", -1, false);
+        for (uint64_t k = 0; shape.size ? written < shape.size : k < shape.functions; k++) {
+            function("f" + std::to_string(k), static_cast<int64_t>(k), true);
+            defined = k + 1;
+        }
+        mainFunction();
+    }
+
+private:
+    const Shape shape;
+    std::mt19937_64 random;
+    std::string out;
+    uint64_t written = 0;
+    uint64_t defined = 0; // f0 .. f<defined-1> exist and may be called
+    int64_t current = -1; // the function being generated, -1 for test
+    bool pointers = false; // whether the current function may use q, n and p
+
+    int below(int n) { return static_cast<int>(random() % static_cast<uint64_t>(n)); }
+    bool percent(int p) { return below(100) < p; }
+
+    std::string structName(int64_t k) const { return "s" + std::to_string(k % shape.structs); }
+
+    void flush() {
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        written += out.size();
+        out.clear();
+    }
+
+    void indent(int level) { out.append(2 * level, ' '); }
+
+    void header() {
+        for (int s = 0; s < shape.structs; s++) {
+            out += "struct s" + std::to_string(s) + " { v: int, w: int, next: &s" + std::to_string(s) + ", items: &int }\n";
+        }
+        out += "let g0: int, g1: int;\n";
+        out += "extern print: (int) -> _;\n";
+        out += "extern input: () -> int;\n\n";
+        flush();
+    }
+
+    void function(const std::string& name, int64_t k, bool usesPointers) {
+        current = k;
+        pointers = usesPointers && shape.pointers > 0 && shape.structs > 0;
+        out += "fn " + name + "(a: int, b: int";
+        if (pointers) out += ", p: &" + structName(k);
+        out += ") -> int {\n";
+        out += "  let x: int = a, y: int = b, z: int = 0";
+        if (pointers) out += ", q: &int, n: &" + structName(k);
+        out += ";\n";
+        if (pointers) {
+            out += "  q = new int 8;\n";
+            out += "  n = new " + structName(k) + ";\n";
+        }
+        int statements = shape.statements > 0 ? shape.statements : 3 + below(6);
+        for (int i = 0; i < statements; i++) statement(1, 0, 0);
+        out += "  return " + exp(2) + ";\n}\n\n";
+        flush();
+    }
+
+    void mainFunction() {
+        out += "fn main() -> int {\n  let r: int = 0;\n";
+        out += "  r = test(1, 2);\n";
+        if (defined > 0) {
+            std::string last = "f" + std::to_string(defined - 1);
+            out += "  r = r + " + last + "(r, 3" + std::string(shape.pointers > 0 && shape.structs > 0 ? ", nil" : "") + ");\n";
+        }
+        out += "  print(r);\n  return r;\n}\n";
+        flush();
+    }
+
+    std::string variable() {
+        static const char* const ints[] = {"x", "y", "z", "a", "b", "g0", "g1"};
+        return ints[below(7)];
+    }
+
+    std::string number() { return std::to_string(below(100)); }
+
+    // An int-typed expression at most depth operators deep
+    std::string exp(int depth) {
+        if (depth == 0 || percent(35)) return leaf(depth);
+        static const char* const ops[] = {" + ", " - ", " * ", " / "};
+        if (percent(10)) return "-" + leaf(depth);
+        std::string left = exp(depth - 1); // one statement each, so the draws happen in a fixed order
+        std::string op = ops[below(4)];
+        return left + op + exp(depth - 1);
+    }
+
+    std::string leaf(int depth) {
+        if (depth > 0 && percent(shape.calls)) return call(depth - 1);
+        if (pointers && percent(shape.pointers)) {
+            switch (below(5)) {
+                case 0: return "*q";
+                case 1: return "q[" + number() + "]";
+                case 2: return "n.v";
+                case 3: return "p.w";
+                default: return "n.next.v";
+            }
+        }
+        return percent(70) ? variable() : number();
+    }
+
+    std::string call(int depth) {
+        if (current < 0 || defined == 0 || percent(20)) return "input()";
+        uint64_t callee = defined - 1 - static_cast<uint64_t>(below(static_cast<int>(std::min<uint64_t>(defined, 16))));
+        std::string text = "f" + std::to_string(callee) + "(" + exp(depth);
+        text += ", " + exp(depth);
+        if (shape.pointers > 0 && shape.structs > 0) {
+            text += pointers && callee % shape.structs == static_cast<uint64_t>(current) % shape.structs ? ", n" : ", nil";
+        }
+        return text + ")";
+    }
+
+    std::string condition() {
+        static const char* const rops[] = {" < ", " <= ", " > ", " >= ", " == ", " != "};
+        if (pointers && percent(shape.pointers)) return percent(50) ? "n != nil" : "n.next == nil";
+        std::string left = exp(1);
+        std::string op = rops[below(6)];
+        return left + op + exp(1);
+    }
+
+    void block(int level, int depth, int loops, int inLoop) {
+        out += " {\n";
+        int statements = 1 + below(3);
+        for (int i = 0; i < statements; i++) statement(level + 1, depth, loops, inLoop);
+        if (inLoop && percent(15)) {
+            indent(level + 1);
+            out += percent(50) ? "break;\n" : "continue;\n";
+        }
+        indent(level);
+        out += "}";
+    }
+
+    void statement(int level, int depth, int loops, int inLoop = 0) {
+        int pick = below(100);
+        if (depth < shape.depth && pick < 15) {
+            indent(level);
+            out += "if " + condition();
+            block(level, depth + 1, loops, inLoop);
+            if (percent(50)) {
+                out += " else";
+                block(level, depth + 1, loops, inLoop);
+            }
+            out += "\n";
+            return;
+        }
+        if (depth < shape.depth && loops < shape.loops && pick < 25) {
+            indent(level);
+            out += "while " + condition();
+            block(level, depth + 1, loops + 1, 1);
+            out += "\n";
+            return;
+        }
+        indent(level);
+        if (pick < 30) {
+            out += "print(" + exp(2) + ");\n";
+        } else if (pointers && percent(shape.pointers)) {
+            switch (below(6)) {
+                case 0: out += "*q = " + exp(2) + ";\n"; break;
+                case 1: out += "q[" + number() + "] = " + exp(2) + ";\n"; break;
+                case 2: out += "n.v = " + exp(2) + ";\n"; break;
+                case 3: out += "n.next = " + std::string(percent(50) ? "n" : "nil") + ";\n"; break;
+                case 4: out += "n.items = q;\n"; break;
+                default: out += "n = new " + structName(current) + ";\n"; break;
+            }
+        } else {
+            static const char* const targets[] = {"x", "y", "z", "g0", "g1"};
+            out += std::string(targets[below(5)]) + " = " + exp(3) + ";\n";
+        }
+    }
+};
+
+uint64_t parseSize(const std::string& text) {
+    size_t end = 0;
+    uint64_t value = std::stoull(text, &end);
+    std::string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k") value <<= 10;
+    else if (suffix == "M" || suffix == "m") value <<= 20;
+    else if (suffix == "G" || suffix == "g") value <<= 30;
+    else if (!suffix.empty()) throw std::invalid_argument(text);
+    return value;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Shape shape;
+    try {
+        for (int a = 1; a < argc; a++) {
+            std::string arg = argv[a];
+            if (a + 1 >= argc) throw std::invalid_argument(arg);
+            std::string value = argv[++a];
+            if (arg == "--functions") shape.functions = parseSize(value);
+            else if (arg == "--size") shape.size = parseSize(value);
+            else if (arg == "--statements") shape.statements = std::stoi(value);
+            else if (arg == "--depth") shape.depth = std::stoi(value);
+            else if (arg == "--loops") shape.loops = std::stoi(value);
+            else if (arg == "--structs") shape.structs = std::stoi(value);
+            else if (arg == "--pointers") shape.pointers = std::stoi(value);
+            else if (arg == "--calls") shape.calls = std::stoi(value);
+            else if (arg == "--seed") shape.seed = std::stoull(value);
+            else throw std::invalid_argument(arg);
+        }
+        if (shape.statements < 0 || shape.depth < 0 || shape.loops < 0 || shape.structs < 0 || shape.pointers < 0 || shape.calls < 0) {
+            throw std::invalid_argument("negative shape");
+        }
+    } catch (const std::exception&) {
+        std::cerr << "Usage: " << argv[0] << " [--functions N] [--size BYTES] [--statements N] [--depth D] [--loops L] [--structs S] [--pointers P] [--calls C] [--seed N]" << std::endl;
+        return 1;
+    }
+
+    Generator(shape).run();
+    return 0;
+}
@@ -1,28 +1,54 @@
 #include "json.hpp"
+#include "../Common/metrics.hpp"
+#include "../Lower/lir.hpp"
 #include <algorithm>
 #include <cctype>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 using json = nlohmann::json;
 
+// The LIR comes in two forms: the reference JSON (codegen <lir.json>), or the LIR::Program lowerProgram()
+// built, read in place when lowering runs in the same process (cflatc). Both are decoded one instruction at a
+// time into the same emitters, and the LIR::Program is walked in the order its JSON lists things, so both
+// forms of one program give the same assembly.
 class LIRToX86CodeGenerator {
 public:
-    LIRToX86CodeGenerator(const std::string& lirProgram) : lirProgram(lirProgram), lirJson(json::parse(lirProgram)) {
+    LIRToX86CodeGenerator(const std::string& lirProgram) : lirJson(json::parse(lirProgram)) {
         buildStructFieldOffsets(lirJson);
     }
 
+    explicit LIRToX86CodeGenerator(const LIR::Program& lir) : program(&lir) {
+        buildStructFieldOffsets(lir);
+    }
+
     std::string generate() {
+        metrics::Scope scope("generate");
         generateAssembly();
         return getAssemblyCode();
     }
 
 private:
-    std::string lirProgram;
+    // An operand as the emitters read it: a CInt, a Var, or neither. fnGlobal marks a global function
+    // pointer, whose value lives at name_, and is only worked out where an emitter asks for it.
+    struct Operand {
+        enum class Kind { None, CInt, Var } kind = Kind::None;
+        int value = 0;
+        std::string name;
+        bool fnGlobal = false;
+    };
+
     nlohmann::json lirJson;
+    const LIR::Program* program = nullptr; // the LIR when it is read in place
+    const LIR::Function* function = nullptr; // the function of program being generated
+    std::vector<Operand> arguments; // a call's, reused from call to call
     std::vector<std::string> instructions;
     std::unordered_map<std::string, int> localOffsets;
     int stackSize;
@@ -76,6 +102,29 @@ private:
         }
     }
 
+    // The same layouts from the LIR's own types, shaped as their JSON would be (see Shape)
+    void buildStructFieldOffsets(const LIR::Program& lir) {
+        for (const auto& [structName, fields] : lir.structs) {
+            int offset = 0;
+            for (const auto& [fieldName, type] : fields) {
+                Shape shape = shapeOf(type);
+                if (shape == Shape::Null) {
+                    std::cerr << "Missing 'typ' in field definition of struct: " << structName << std::endl;
+                    throw std::runtime_error("Invalid field definition in struct: " + structName);
+                }
+                structFieldOffsets[structName][fieldName] = offset;
+                if (shape == Shape::Ptr && shapeOf(type.params[0]) == Shape::Null) {
+                    std::cerr << "Invalid 'Ptr' type in field definition of struct: " << structName << std::endl;
+                    throw std::runtime_error("Invalid 'Ptr' type in field definition of struct: " + structName);
+                } else if (shape == Shape::Struct || shape == Shape::Fn) {
+                    std::cerr << "Invalid 'typ' in field definition of struct: " << structName << std::endl;
+                    throw std::runtime_error("Invalid 'typ' in field definition of struct: " + structName);
+                }
+                offset += 8; // pointers and everything else are 8 bytes
+            }
+        }
+    }
+
     int getFieldOffset(const std::string& structName, const std::string& fieldName) const {
         auto structIt = structFieldOffsets.find(structName);
         if (structIt != structFieldOffsets.end()) {
@@ -87,106 +136,55 @@ private:
         return -1; // return invalid offset if not found
     }
 
-    void processInstruction(const json& inst) {
-        if (inst.contains("Copy")) { // COPY INSTRUCTIONS
-            auto copyInst = inst["Copy"];
-            std::string lhs = copyInst["lhs"]["name"];
-            std::string lhsAccess = getAccessMode(lhs); // determine lhs access mode (local or global)
-
-            std::string rhs;
-            std::string rhsAccess;
-
-            // determine rhs access mode (local or global)
-            if (copyInst["op"].contains("CInt")) {
-                rhs = "$" + std::to_string(static_cast<int>(copyInst["op"]["CInt"]));
-            } else if (copyInst["op"].contains("Var")) {
-                rhs = copyInst["op"]["Var"]["name"];
-                rhsAccess = getAccessMode(rhs);
-
-                //check if variable type is a function pointer
-                if (copyInst["op"]["Var"]["typ"].contains("Ptr") && copyInst["op"]["Var"]["typ"]["Ptr"].contains("Fn")) {
-                    // check if variable is global
-                    if (copyInst["op"]["Var"]["scope"].is_null() || copyInst["op"]["Var"]["scope"] == "global") {
-                        rhs = rhs + "_";
-                        rhsAccess = rhs + "(%rip)";
-                    }
-                }
-            }
+    // The JSON form: each instruction and terminator is decoded into the emitters' operands
 
-            // Emit appropriate movq instructions
-            if (copyInst["op"].contains("CInt")) {
-                emit("  movq " + rhs + ", " + lhsAccess);
-            } else {
-                emit("  movq " + rhsAccess + ", %r8");
-                
-                // emit movq with underscore for global function pointers
-                if (copyInst["lhs"]["typ"].contains("Ptr") && copyInst["lhs"]["typ"]["Ptr"].contains("Fn") &&
-                    (copyInst["lhs"]["scope"].is_null() || copyInst["lhs"]["scope"] == "global")) {
-                        lhs += "_";
-                }
+    static bool isGlobalFnPointer(const json& var) {
+        return var.contains("typ") && var["typ"].contains("Ptr") && var["typ"]["Ptr"].contains("Fn") &&
+               (!var.contains("scope") || var["scope"].is_null() || var["scope"] == "global");
+    }
 
-                lhsAccess = getAccessMode(lhs);
+    static Operand operand(const json& op) {
+        Operand out;
+        if (op.contains("CInt")) {
+            out.kind = Operand::Kind::CInt;
+            out.value = op["CInt"];
+        } else if (op.contains("Var")) {
+            out.kind = Operand::Kind::Var;
+            out.name = op["Var"]["name"];
+            out.fnGlobal = isGlobalFnPointer(op["Var"]);
+        }
+        return out;
+    }
 
-                emit("  movq %r8, " + lhsAccess);
+    // A call's arguments; a Var without a name is only rejected where the call is a terminator
+    static std::vector<Operand> callArguments(const json& args, bool checked) {
+        std::vector<Operand> out;
+        for (const auto& arg : args) {
+            if (checked && arg.contains("Var") && !(arg["Var"].contains("name") && arg["Var"]["name"].is_string())) {
+                throw std::runtime_error("Malformed argument: Var name is missing or not a string");
             }
+            out.push_back(operand(arg));
+        }
+        return out;
+    }
+
+    void processInstruction(const json& inst) {
+        if (inst.contains("Copy")) { // COPY INSTRUCTIONS
+            auto copyInst = inst["Copy"];
+            Operand lhs;
+            lhs.name = copyInst["lhs"]["name"];
+            lhs.fnGlobal = isGlobalFnPointer(copyInst["lhs"]);
+            copy(lhs, operand(copyInst["op"]));
         } else if (inst.contains("Arith")) { // ARITHMETIC INSTRUCTIONS
             auto arithInst = inst["Arith"];
             std::string lhs = arithInst["lhs"]["name"];
             std::string op = arithInst["aop"];
-            std::string rhs1 = getOperandAccess(arithInst["op1"]);
-            std::string rhs2 = getOperandAccess(arithInst["op2"]);
-
-            if (op == "Add") {
-                emit("  movq " + rhs1 + ", %r8");
-                emit("  addq " + rhs2 + ", %r8");
-                emit("  movq %r8, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-            } else if (op == "Subtract") {
-                emit("  movq " + rhs1 + ", %r8");
-                emit("  subq " + rhs2 + ", %r8");
-                emit("  movq %r8, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-            } else if (op == "Multiply") {
-                emit("  movq " + rhs1 + ", %r8");
-                emit("  imulq " + rhs2 + ", %r8");
-                emit("  movq %r8, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-            } else if (op == "Divide") {
-                emit("  movq " + rhs1 + ", %rax");
-                emit("  cqo");
-                if (arithInst["op2"].contains("CInt")) {
-                    emit("  movq " + rhs2 + ", %r8");
-                    emit("  idivq %r8");
-                } else {
-                    emit("  idivq " + rhs2);
-                }
-                emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-            }
+            arith(lhs, op, operand(arithInst["op1"]), operand(arithInst["op2"]));
         } else if (inst.contains("Cmp")) { // COMPARE INSTRUCTIONS
             auto cmpInst = inst["Cmp"];
             std::string lhs = cmpInst["lhs"]["name"];
             std::string rop = cmpInst["rop"];
-            std::string op1 = getOperandAccess(cmpInst["op1"]);
-            std::string op2 = getOperandAccess(cmpInst["op2"]);
-
-            if (cmpInst["op1"].contains("CInt")) {
-                emit("  movq " + op1 + ", %r8");
-                emit("  cmpq " + op2 + ", %r8");
-            } else if (cmpInst["op2"].contains("CInt")) {
-                emit("  cmpq " + op2 + ", " + op1);
-            } else { // both operands are variables
-                emit("  movq " + op1 + ", %r8");
-                emit("  cmpq " + op2 + ", %r8");
-            }
-
-            std::string setInstr;
-            if (rop == "Eq") setInstr = "sete";
-            else if (rop == "Neq") setInstr = "setne";
-            else if (rop == "Less") setInstr = "setl";
-            else if (rop == "LessEq") setInstr = "setle";
-            else if (rop == "Greater") setInstr = "setg";
-            else if (rop == "GreaterEq") setInstr = "setge";
-
-            emit("  movq $0, %r8");
-            emit("  " + setInstr + " %r8b");
-            emit("  movq %r8, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+            compare(lhs, rop, operand(cmpInst["op1"]), operand(cmpInst["op2"]));
         } else if (inst.contains("CallExt")) { // EXTERNAL CALL INSTRUCTIONS
             auto callExtInst = inst["CallExt"];
             if (callExtInst.contains("ext_callee") && !callExtInst["ext_callee"].is_null()) {
@@ -195,185 +193,38 @@ private:
                 if (callExtInst.contains("lhs") && !callExtInst["lhs"].is_null() && callExtInst["lhs"].contains("name") && callExtInst["lhs"]["name"].is_string()) {
                     lhs = callExtInst["lhs"]["name"];
                 }
-                std::vector<std::string> argRegisters = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-                int numArgs = callExtInst["args"].size();
-                int numStackArgs = numArgs > 6 ? numArgs - 6 : 0;
-
-                // emit instructions for first 6 arguments
-                for (int i = 0; i < std::min(numArgs, 6); ++i) {
-                    const auto& arg = callExtInst["args"][i];
-                    if (arg.contains("Var")) {
-                        std::string varName = arg["Var"]["name"];
-                        std::string varAccess = getAccessMode(varName);
-                        emit("  movq " + varAccess + ", " + argRegisters[i]);
-                    } else if (arg.contains("CInt")) {
-                        int constValue = arg["CInt"];
-                        emit("  movq $" + std::to_string(constValue) + ", " + argRegisters[i]);
-                    }
-                }
-                    
-                // emit instructions for additional arguments to be pushed onto the stack
-                for (int i = numArgs - 1; i >= 6; --i) {
-                    const auto& arg = callExtInst["args"][i];
-                    if (arg.contains("Var")) {
-                        std::string varName = arg["Var"]["name"];
-                        std::string varAccess = getAccessMode(varName);
-                        emit("  pushq " + varAccess);
-                    } else if (arg.contains("CInt")) {
-                        int constValue = arg["CInt"];
-                        emit("  pushq $" + std::to_string(constValue));
-                    }
-                }
-
-                if (numStackArgs > 0 && numStackArgs % 2 != 0) {
-                    emit("  subq $8, %rsp");
-                }
-
-                // generate call to external function
-                emit("  call " + extCallee);
-
-                // move result from %rax to lhs if lhs is NOT null
-                if (callExtInst.contains("lhs") && !callExtInst["lhs"].is_null()) {
-                    // std::string lhs = callExtInst["lhs"]["name"];
-                    emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-                }
-
-                // adjust stack pointer to remove pushed arguments plus any alignment adjustment
-                if (numStackArgs > 0) {
-                    int stackAdjustment = numStackArgs * 8;
-                    if (numStackArgs % 2 != 0) {
-                        stackAdjustment += 8;
-                    }
-                    emit("  addq $" + std::to_string(stackAdjustment) + ", %rsp");
-                }
+                bool hasLhs = callExtInst.contains("lhs") && !callExtInst["lhs"].is_null();
+                callExt(extCallee, hasLhs, lhs, callArguments(callExtInst["args"], false));
             } else {
                 throw std::runtime_error("Malformed CallExt instruction: ext_callee is missing or null");
             }
         } else if (inst.contains("Load")) { // LOAD INSTRUCTIONS
             auto loadInst = inst["Load"];
-            std::string lhs = loadInst["lhs"]["name"];
-            std::string lhsAccess = getAccessMode(lhs);
-
-            std::string src = loadInst["src"]["name"];
-            std::string srcAccess = getAccessMode(src);
-
-            emit("  movq " + srcAccess + ", %r8"); // load address of source into %r8
-            emit("  movq 0(%r8), %r9"); // load value at address in %r8 into %r9
-            emit("  movq %r9, " + lhsAccess); // store value from %r9 into destination
+            load(loadInst["lhs"]["name"], loadInst["src"]["name"]);
         } else if (inst.contains("Gep")) { // GET ELEMENT POINTER INSTRUCTIONS
             auto gepInst = inst["Gep"];
-            std::string lhs = gepInst["lhs"]["name"];
-            std::string lhsAccess = getAccessMode(lhs);
-
-            std::string src = gepInst["src"]["name"];
-            std::string srcAccess = getAccessMode(src);
-
-            std::string idx, idxAccess;
-            bool isConstantIndex = false;
-            if (gepInst["idx"].contains("Var")) {
-                idx = gepInst["idx"]["Var"]["name"];
-                idxAccess = getAccessMode(idx);
-            } else if (gepInst["idx"].contains("CInt")) {
-                idx = "$" + std::to_string(static_cast<int>(gepInst["idx"]["CInt"]));
-                isConstantIndex = true;
-            }
-
-            // generate assembly code for GEP instruction
-            if (isConstantIndex) {
-                emit("  movq " + idx + ", %r8"); // load constant index into %r8
-            } else {
-                emit("  movq " + idxAccess + ", %r8");
-            }
-
-            emit("  cmpq $0, %r8");
-            emit("  jl .out_of_bounds");
-            emit("  movq " + srcAccess + ", %r9");
-            emit("  movq -8(%r9), %r10");
-            emit("  cmpq %r10, %r8");
-            emit("  jge .out_of_bounds");
-            emit("  imulq $8, %r8");
-            emit("  addq %r9, %r8");
-            emit("  movq %r8, " + lhsAccess);
+            gep(gepInst["lhs"]["name"], gepInst["src"]["name"], operand(gepInst["idx"]));
         } else if (inst.contains("Alloc")) { // ALLOC INSTRUCTIONS
             auto allocInst = inst["Alloc"];
-            std::string lhs = allocInst["lhs"]["name"];
-            std::string lhsAccess = getAccessMode(lhs);
-
-            std::string allocID = allocInst["id"]["name"];
-            std::string allocAccess = getAccessMode(allocID);
-
-            if (allocInst["num"].contains("CInt")) {
-                int numElements = allocInst["num"]["CInt"];
-                emit("  movq $" + std::to_string(numElements) + ", %r8");
-                emit("  cmpq $0, %r8");
-                emit("  jle .invalid_alloc_length");
-                emit("  movq $1, %rdi");
-                emit("  imulq %r8, %rdi");
-                emit("  incq %rdi");
-                emit("  call _cflat_alloc");
-                emit("  movq $" + std::to_string(numElements) + ", %r8");
-            } else {
-                std::string numVarName = allocInst["num"]["Var"]["name"];
-                std::string numAccess = getAccessMode(numVarName);
-
-                emit("  cmpq $0, " + numAccess);
-                emit("  jle .invalid_alloc_length");
-                emit("  movq $1, %rdi");
-                emit("  imulq " + numAccess + ", %rdi");
-                emit("  incq %rdi");
-                emit("  call _cflat_alloc");
-                emit("  movq " + numAccess + ", %r8");
+            Operand num = operand(allocInst["num"]);
+            if (num.kind == Operand::Kind::None) {
+                throw std::runtime_error("Malformed Alloc instruction: num is neither a CInt nor a Var");
             }
-
-            emit("  movq %r8, 0(%rax)");
-            emit("  addq $8, %rax");
-            emit("  movq %rax, " + lhsAccess);
+            alloc(allocInst["lhs"]["name"], num, allocInst["id"]["name"]);
         } else if (inst.contains("Store")) { // STORE INSTRUCTIONS
             auto storeInst = inst["Store"];
-            std::string dst = storeInst["dst"]["name"];
-            std::string dstAccess = getAccessMode(dst);
-
-            std::string src;
-            std::string srcAccess;
-            
-            if (storeInst["op"].contains("Var")) {
-                src = storeInst["op"]["Var"]["name"];
-                srcAccess = getAccessMode(src);
-
-                // check if src is a global function pointer
-                if (storeInst["op"]["Var"]["typ"].contains("Ptr") && storeInst["op"]["Var"]["typ"]["Ptr"].contains("Fn")) {
-                    if (storeInst["op"]["Var"]["scope"].is_null() || storeInst["op"]["Var"]["scope"] == "global") {
-                        src += "_";
-                        srcAccess = src + "(%rip)";
-                    }
-                }
-                emit("  movq " + srcAccess + ", %r8");
-            } else if (storeInst["op"].contains("CInt")) {
-                int constValue = storeInst["op"]["CInt"];
-                emit("  movq $" + std::to_string(constValue) + ", %r8");
-            }
-
-            emit("  movq " + dstAccess + ", %r9");
-            emit("  movq %r8, 0(%r9)");
+            store(storeInst["dst"]["name"], operand(storeInst["op"]));
         } else if (inst.contains("Gfp")) { // GFP INSTRUCTIONS
             auto gfpInst = inst["Gfp"];
             std::string lhs = gfpInst["lhs"]["name"];
-            // std::cerr << lhs << std::endl;
-            std::string lhsAccess = getAccessMode(lhs);
-
             std::string src = gfpInst["src"]["name"];
-            // std::cerr << src << std::endl;
-            std::string srcAccess = getAccessMode(src);
-
             std::string field = gfpInst["field"]["name"];
-            // std::cerr << field << std::endl;
             std::string structName;
 
             if (gfpInst["src"]["typ"].is_object() && gfpInst["src"]["typ"].contains("Ptr")) {
                 const auto& ptrType = gfpInst["src"]["typ"]["Ptr"];
                 if (ptrType.is_object() && ptrType.contains("Struct")) {
                     structName = ptrType["Struct"];
-                    // std::cerr << structName << std::endl;
                 } else {
                     throw std::runtime_error("Invalid 'Ptr' type in 'src.typ' of Gfp isntruction");
                 }
@@ -381,59 +232,24 @@ private:
                 throw std::runtime_error("Invalid 'typ' in 'src' of Gfp instruction");
             }
 
-            int fieldOffset = getFieldOffset(structName, field);
-
-            if (fieldOffset == -1) {
-                throw std::runtime_error("Invalid field offset for structure: " + field);
-            }
-
-            emit("  movq " + srcAccess + ", %r8");
-            emit("  leaq " + std::to_string(fieldOffset) + "(%r8), %r9");
-            emit("  movq %r9, " + lhsAccess);
+            gfp(lhs, src, field, structName);
         }
     }
 
     void processTerminalConditions(const json& term, const std::string & funcName) {
         if (term.contains("Ret")) { // RETURN INSTRUCTIONS
-            auto retInst = term["Ret"];
-
-            if (retInst.contains("Var")) {
-                std::string varName = retInst["Var"]["name"];
-                std::string varAccess = getAccessMode(varName);
-
-                emit("  movq " + varAccess + ", %rax");
-            } else if (retInst.contains("CInt")) {
-                int constValue = retInst["CInt"];
-                emit("  movq $" + std::to_string(constValue) + ", %rax");
-            }
-
-            emit("  jmp " + funcName + "_epilogue\n");
+            ret(funcName, operand(term["Ret"]));
         } else if (term.contains("Jump")) { // JUMP INSTRUCTIONS
             std::string target = term["Jump"];
             emit("  jmp " + funcName + "_" + target + "\n");
         } else if (term.contains("Branch")) { // BRANCH INSTRUCTIONS
             auto branchInst = term["Branch"];
-            std::string cond;
             std::string tt = branchInst["tt"];
             std::string ff = branchInst["ff"];
-
-            if (branchInst["cond"].contains("CInt")) {
-                cond = "$" + std::to_string(static_cast<int>(branchInst["cond"]["CInt"]));
-                emit("  movq " + cond + ", %r8");
-                emit("  cmpq $0, %r8");
-            } else if (branchInst["cond"].contains("Var")) {
-                std::string varName = branchInst["cond"]["Var"]["name"];
-                cond = getAccessMode(varName);
-                emit("  cmpq $0, " + cond);
-            }
-
-            emit("  jne " + funcName + "_" + tt);
-            emit("  jmp " + funcName + "_" + ff + "\n");
+            branch(funcName, operand(branchInst["cond"]), tt, ff);
         } else if (term.contains("CallDirect")) { // DIRECT CALL INSTRUCTIONS (TERMINAL)
             auto callDirectInst = term["CallDirect"];
 
-            // std::cout << "Debug: CallDirect instruction: " << callDirectInst.dump(4) << std::endl;
-
             if (callDirectInst.contains("callee") && callDirectInst["callee"].is_string()) {
                 std::string callee = callDirectInst["callee"];
                 std::string lhs, next_bb;
@@ -448,56 +264,7 @@ private:
                     throw std::runtime_error("Malformed CallDirect instruction: next_bb is missing or not a string (null)");
                 }
 
-                // calculate if need to align stack
-                if (!callDirectInst["args"].empty()) {
-                    int numArgs = callDirectInst["args"].size();
-                    bool needAlignment = (numArgs % 2 != 0);
-                    if (needAlignment) {
-                        emit("  subq $8, %rsp");
-                    }
-
-                    // push arguments onto the stack in reverse order (right-to-left evaluation)
-                    for (auto it = callDirectInst["args"].rbegin(); it != callDirectInst["args"].rend(); ++it) {
-                        const auto& arg = *it;
-                        if (arg.contains("Var")) {
-                            if (arg["Var"].contains("name") && arg["Var"]["name"].is_string()) {
-                                std::string varName = arg["Var"]["name"];
-                                std::string varAccess = getAccessMode(varName);
-                                emit("  pushq " + varAccess);
-                            } else {
-                                throw std::runtime_error("Malformed argument: Var name is missing or not a string");
-                            }
-                        } else if (arg.contains("CInt")) {
-                            int constValue = arg["CInt"];
-                            emit("  pushq $" + std::to_string(constValue));
-                        }
-                    }
-
-                    // call the function
-                    emit("  call " + callee);
-
-                    // move the result to lhs if lhs is not null
-                    if (!lhs.empty()) {
-                        emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-                    }
-
-                    // adjust stack pointer to remove pushed arguments if any
-                    int stackAdjustment = numArgs * 8;
-                    if (needAlignment) {
-                        stackAdjustment += 8;
-                    }
-                    emit("  addq $" + std::to_string(stackAdjustment) + ", %rsp");
-                } else {
-                    // call function without arguments
-                    emit("  call " + callee);
-
-                    // move result to lhs if lhs is not null
-                    if (!lhs.empty()) {
-                        emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-                    }
-                }
-                // jump to next basic block
-                emit("  jmp " + funcName + "_" + next_bb + "\n");
+                callTerminal(funcName, "  call " + callee, lhs, callArguments(callDirectInst["args"], true), next_bb);
             } else {
                 throw std::runtime_error("Malformed CallDirect instruction: callee is missing or not a string");
             }
@@ -522,73 +289,534 @@ private:
                     throw std::runtime_error("Malformed CallIndirect instruction: next_bb is missing or not a string");
                 }
 
-                if (!callIndirectInst["args"].empty()) {
-                    int numArgs = callIndirectInst["args"].size();
-                    bool needAlignment = (numArgs % 2 != 0);
+                std::vector<Operand> args = callArguments(callIndirectInst["args"], true);
+                // call function indirectly
+                callTerminal(funcName, "  call *" + getAccessMode(callee), lhs, args, next_bb);
+            } else {
+                throw std::runtime_error("Malformed CallIndirect instruction: callee is missing or not an object");
+            }
+        }
+    }
 
-                    if (needAlignment) {
-                        emit("  subq $8, %rsp");
-                    }
+    // The emitters, one per instruction and terminator
 
-                    // push arguments onto stack in reverse order
-                    for (auto it = callIndirectInst["args"].rbegin(); it != callIndirectInst["args"].rend(); ++it) {
-                        const auto& arg = *it;
-                        if (arg.contains("Var")) {
-                            if (arg["Var"].contains("name") && arg["Var"]["name"].is_string()) {
-                                std::string varName = arg["Var"]["name"];
-                                std::string varAccess = getAccessMode(varName);
-                                emit("  pushq " + varAccess);
-                            } else {
-                                throw std::runtime_error("Malformed argument: Var name is missing or not a string");
-                            }
-                        } else if (arg.contains("CInt")) {
-                            int constValue = arg["CInt"];
-                            emit("  pushq $" + std::to_string(constValue));
-                        }
-                    }
+    void copy(Operand lhs, const Operand& op) {
+        std::string lhsAccess = getAccessMode(lhs.name); // determine lhs access mode (local or global)
 
-                    // call function indirectly
-                    std::string calleeAccess = getAccessMode(callee);
-                    emit("  call *" + calleeAccess);
+        std::string rhs;
+        std::string rhsAccess;
 
-                    // move result to lhs if lhs is not null
-                    if (!lhs.empty()) {
-                        emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-                    }
+        // determine rhs access mode (local or global)
+        if (op.kind == Operand::Kind::CInt) {
+            rhs = "$" + std::to_string(op.value);
+        } else if (op.kind == Operand::Kind::Var) {
+            rhs = op.name;
+            rhsAccess = getAccessMode(rhs);
 
-                    // adjust stack pointer to remove pushed arguments plus any alignment adjustment
-                    int stackAdjustment = numArgs * 8;
-                    if (needAlignment) {
-                        stackAdjustment += 8;
-                    }
-                    emit("  addq $" + std::to_string(stackAdjustment) + ", %rsp");
-                } else {
-                    // call function indirectly without arguments
-                    std::string calleeAccess = getAccessMode(callee);
-                    emit("  call *" + calleeAccess);
+            // a global function pointer's value is its name_
+            if (op.fnGlobal) {
+                rhs = rhs + "_";
+                rhsAccess = rhs + "(%rip)";
+            }
+        }
 
-                    // move result to lhs if not null
-                    if (!lhs.empty()) {
-                        emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
-                    }
-                }
+        // Emit appropriate movq instructions
+        if (op.kind == Operand::Kind::CInt) {
+            emit("  movq " + rhs + ", " + lhsAccess);
+        } else {
+            emit("  movq " + rhsAccess + ", %r8");
+
+            // emit movq with underscore for global function pointers
+            if (lhs.fnGlobal) {
+                lhs.name += "_";
+            }
 
-                // jump to next basic block
-                emit("  jmp " + funcName + "_" + next_bb + "\n");
+            lhsAccess = getAccessMode(lhs.name);
+
+            emit("  movq %r8, " + lhsAccess);
+        }
+    }
+
+    void arith(const std::string& lhs, std::string_view op, const Operand& op1, const Operand& op2) {
+        std::string rhs1 = getOperandAccess(op1);
+        std::string rhs2 = getOperandAccess(op2);
+
+        if (op == "Add") {
+            emit("  movq " + rhs1 + ", %r8");
+            emit("  addq " + rhs2 + ", %r8");
+            emit("  movq %r8, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+        } else if (op == "Subtract") {
+            emit("  movq " + rhs1 + ", %r8");
+            emit("  subq " + rhs2 + ", %r8");
+            emit("  movq %r8, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+        } else if (op == "Multiply") {
+            emit("  movq " + rhs1 + ", %r8");
+            emit("  imulq " + rhs2 + ", %r8");
+            emit("  movq %r8, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+        } else if (op == "Divide") {
+            emit("  movq " + rhs1 + ", %rax");
+            emit("  cqo");
+            if (op2.kind == Operand::Kind::CInt) {
+                emit("  movq " + rhs2 + ", %r8");
+                emit("  idivq %r8");
             } else {
-                throw std::runtime_error("Malformed CallIndirect instruction: callee is missing or not an object");
+                emit("  idivq " + rhs2);
+            }
+            emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+        }
+    }
+
+    void compare(const std::string& lhs, std::string_view rop, const Operand& op1, const Operand& op2) {
+        std::string access1 = getOperandAccess(op1);
+        std::string access2 = getOperandAccess(op2);
+
+        if (op1.kind == Operand::Kind::CInt) {
+            emit("  movq " + access1 + ", %r8");
+            emit("  cmpq " + access2 + ", %r8");
+        } else if (op2.kind == Operand::Kind::CInt) {
+            emit("  cmpq " + access2 + ", " + access1);
+        } else { // both operands are variables
+            emit("  movq " + access1 + ", %r8");
+            emit("  cmpq " + access2 + ", %r8");
+        }
+
+        std::string setInstr;
+        if (rop == "Eq") setInstr = "sete";
+        else if (rop == "Neq") setInstr = "setne";
+        else if (rop == "Less") setInstr = "setl";
+        else if (rop == "LessEq") setInstr = "setle";
+        else if (rop == "Greater") setInstr = "setg";
+        else if (rop == "GreaterEq") setInstr = "setge";
+
+        emit("  movq $0, %r8");
+        emit("  " + setInstr + " %r8b");
+        emit("  movq %r8, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+    }
+
+    void callExt(const std::string& extCallee, bool hasLhs, const std::string& lhs, const std::vector<Operand>& args) {
+        std::vector<std::string> argRegisters = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+        int numArgs = args.size();
+        int numStackArgs = numArgs > 6 ? numArgs - 6 : 0;
+
+        // emit instructions for first 6 arguments
+        for (int i = 0; i < std::min(numArgs, 6); ++i) {
+            const auto& arg = args[i];
+            if (arg.kind == Operand::Kind::Var) {
+                std::string varAccess = getAccessMode(arg.name);
+                emit("  movq " + varAccess + ", " + argRegisters[i]);
+            } else if (arg.kind == Operand::Kind::CInt) {
+                emit("  movq $" + std::to_string(arg.value) + ", " + argRegisters[i]);
             }
         }
+
+        // emit instructions for additional arguments to be pushed onto the stack
+        for (int i = numArgs - 1; i >= 6; --i) {
+            const auto& arg = args[i];
+            if (arg.kind == Operand::Kind::Var) {
+                std::string varAccess = getAccessMode(arg.name);
+                emit("  pushq " + varAccess);
+            } else if (arg.kind == Operand::Kind::CInt) {
+                emit("  pushq $" + std::to_string(arg.value));
+            }
+        }
+
+        if (numStackArgs > 0 && numStackArgs % 2 != 0) {
+            emit("  subq $8, %rsp");
+        }
+
+        // generate call to external function
+        emit("  call " + extCallee);
+
+        // move result from %rax to lhs if lhs is NOT null
+        if (hasLhs) {
+            emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+        }
+
+        // adjust stack pointer to remove pushed arguments plus any alignment adjustment
+        if (numStackArgs > 0) {
+            int stackAdjustment = numStackArgs * 8;
+            if (numStackArgs % 2 != 0) {
+                stackAdjustment += 8;
+            }
+            emit("  addq $" + std::to_string(stackAdjustment) + ", %rsp");
+        }
+    }
+
+    void load(const std::string& lhs, const std::string& src) {
+        std::string lhsAccess = getAccessMode(lhs);
+        std::string srcAccess = getAccessMode(src);
+
+        emit("  movq " + srcAccess + ", %r8"); // load address of source into %r8
+        emit("  movq 0(%r8), %r9"); // load value at address in %r8 into %r9
+        emit("  movq %r9, " + lhsAccess); // store value from %r9 into destination
     }
 
+    void gep(const std::string& lhs, const std::string& src, const Operand& idx) {
+        std::string lhsAccess = getAccessMode(lhs);
+        std::string srcAccess = getAccessMode(src);
+
+        std::string index, idxAccess;
+        bool isConstantIndex = false;
+        if (idx.kind == Operand::Kind::Var) {
+            idxAccess = getAccessMode(idx.name);
+        } else if (idx.kind == Operand::Kind::CInt) {
+            index = "$" + std::to_string(idx.value);
+            isConstantIndex = true;
+        }
+
+        // generate assembly code for GEP instruction
+        if (isConstantIndex) {
+            emit("  movq " + index + ", %r8"); // load constant index into %r8
+        } else {
+            emit("  movq " + idxAccess + ", %r8");
+        }
+
+        emit("  cmpq $0, %r8");
+        emit("  jl .out_of_bounds");
+        emit("  movq " + srcAccess + ", %r9");
+        emit("  movq -8(%r9), %r10");
+        emit("  cmpq %r10, %r8");
+        emit("  jge .out_of_bounds");
+        emit("  imulq $8, %r8");
+        emit("  addq %r9, %r8");
+        emit("  movq %r8, " + lhsAccess);
+    }
+
+    void alloc(const std::string& lhs, const Operand& num, const std::string& allocID) {
+        std::string lhsAccess = getAccessMode(lhs);
+        std::string allocAccess = getAccessMode(allocID);
+
+        if (num.kind == Operand::Kind::CInt) {
+            int numElements = num.value;
+            emit("  movq $" + std::to_string(numElements) + ", %r8");
+            emit("  cmpq $0, %r8");
+            emit("  jle .invalid_alloc_length");
+            emit("  movq $1, %rdi");
+            emit("  imulq %r8, %rdi");
+            emit("  incq %rdi");
+            emit("  call _cflat_alloc");
+            emit("  movq $" + std::to_string(numElements) + ", %r8");
+        } else {
+            std::string numAccess = getAccessMode(num.name);
+
+            emit("  cmpq $0, " + numAccess);
+            emit("  jle .invalid_alloc_length");
+            emit("  movq $1, %rdi");
+            emit("  imulq " + numAccess + ", %rdi");
+            emit("  incq %rdi");
+            emit("  call _cflat_alloc");
+            emit("  movq " + numAccess + ", %r8");
+        }
+
+        emit("  movq %r8, 0(%rax)");
+        emit("  addq $8, %rax");
+        emit("  movq %rax, " + lhsAccess);
+    }
+
+    void store(const std::string& dst, const Operand& op) {
+        std::string dstAccess = getAccessMode(dst);
+
+        if (op.kind == Operand::Kind::Var) {
+            std::string src = op.name;
+            std::string srcAccess = getAccessMode(src);
+
+            // check if src is a global function pointer
+            if (op.fnGlobal) {
+                src += "_";
+                srcAccess = src + "(%rip)";
+            }
+            emit("  movq " + srcAccess + ", %r8");
+        } else if (op.kind == Operand::Kind::CInt) {
+            emit("  movq $" + std::to_string(op.value) + ", %r8");
+        }
+
+        emit("  movq " + dstAccess + ", %r9");
+        emit("  movq %r8, 0(%r9)");
+    }
+
+    void gfp(const std::string& lhs, const std::string& src, const std::string& field, const std::string& structName) {
+        std::string lhsAccess = getAccessMode(lhs);
+        std::string srcAccess = getAccessMode(src);
+
+        int fieldOffset = getFieldOffset(structName, field);
+
+        if (fieldOffset == -1) {
+            throw std::runtime_error("Invalid field offset for structure: " + field);
+        }
+
+        emit("  movq " + srcAccess + ", %r8");
+        emit("  leaq " + std::to_string(fieldOffset) + "(%r8), %r9");
+        emit("  movq %r9, " + lhsAccess);
+    }
+
+    void ret(const std::string& funcName, const Operand& value) {
+        if (value.kind == Operand::Kind::Var) {
+            std::string varAccess = getAccessMode(value.name);
+
+            emit("  movq " + varAccess + ", %rax");
+        } else if (value.kind == Operand::Kind::CInt) {
+            emit("  movq $" + std::to_string(value.value) + ", %rax");
+        }
+
+        emit("  jmp " + funcName + "_epilogue\n");
+    }
+
+    void branch(const std::string& funcName, const Operand& cond, const std::string& tt, const std::string& ff) {
+        if (cond.kind == Operand::Kind::CInt) {
+            emit("  movq $" + std::to_string(cond.value) + ", %r8");
+            emit("  cmpq $0, %r8");
+        } else if (cond.kind == Operand::Kind::Var) {
+            emit("  cmpq $0, " + getAccessMode(cond.name));
+        }
+
+        emit("  jne " + funcName + "_" + tt);
+        emit("  jmp " + funcName + "_" + ff + "\n");
+    }
+
+    // A call that ends its block, direct or indirect: call is the call instruction itself
+    void callTerminal(const std::string& funcName, const std::string& call, const std::string& lhs,
+                    const std::vector<Operand>& args, const std::string& next_bb) {
+        // calculate if need to align stack
+        if (!args.empty()) {
+            int numArgs = args.size();
+            bool needAlignment = (numArgs % 2 != 0);
+            if (needAlignment) {
+                emit("  subq $8, %rsp");
+            }
+
+            // push arguments onto the stack in reverse order (right-to-left evaluation)
+            for (auto it = args.rbegin(); it != args.rend(); ++it) {
+                const auto& arg = *it;
+                if (arg.kind == Operand::Kind::Var) {
+                    std::string varAccess = getAccessMode(arg.name);
+                    emit("  pushq " + varAccess);
+                } else if (arg.kind == Operand::Kind::CInt) {
+                    emit("  pushq $" + std::to_string(arg.value));
+                }
+            }
+
+            // call the function
+            emit(call);
+
+            // move the result to lhs if lhs is not null
+            if (!lhs.empty()) {
+                emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+            }
+
+            // adjust stack pointer to remove pushed arguments if any
+            int stackAdjustment = numArgs * 8;
+            if (needAlignment) {
+                stackAdjustment += 8;
+            }
+            emit("  addq $" + std::to_string(stackAdjustment) + ", %rsp");
+        } else {
+            // call function without arguments
+            emit(call);
+
+            // move result to lhs if lhs is not null
+            if (!lhs.empty()) {
+                emit("  movq %rax, " + std::to_string(localOffsets[lhs]) + "(%rbp)");
+            }
+        }
+        // jump to next basic block
+        emit("  jmp " + funcName + "_" + next_bb + "\n");
+    }
+
+    // The LIR::Program form: what its JSON (lower -json) would say, read off the blocks, names and call_args
+
+    // What a type's JSON is: null, a name, or an object holding a Ptr, Struct or Fn
+    enum class Shape { Null, Name, Ptr, Struct, Fn };
+
+    static Shape shapeOf(const AST::Type& type) {
+        if (!type.params.empty()) {
+            if (type.name == "Ptr") return Shape::Ptr;
+            if (type.name == "Struct") return Shape::Struct;
+            if (type.name == "Fn") return Shape::Fn;
+        }
+        if (type.name == "void" || type.name == "_" || type.name.empty()) return Shape::Null;
+        return Shape::Name;
+    }
+
+    bool isParam(const std::string& name) const {
+        for (const auto& param : function->params) {
+            if (param.first == name) return true;
+        }
+        return false;
+    }
+
+    // A global the function sees: one no parameter or local of the function shadows
+    bool isGlobal(const std::string& name) const {
+        return program->globals.count(name) && !function->locals.count(name) && !isParam(name);
+    }
+
+    // The type of a Var as its JSON carries it, null when it has none (written as "Int")
+    const AST::Type* typeOf(const std::string& name) const {
+        return findVarType(*program, isGlobal(name) ? nullptr : function, name);
+    }
+
+    const std::string& nameOf(const LIR::Operand& op) const {
+        static const std::string none;
+        return op.kind == LIR::Operand::Kind::Var ? function->body.names[op.value] : none;
+    }
+
+    // Every operand that is not a constant is a Var in the JSON, a missing one with an empty name
+    Operand operand(const LIR::Operand& op, bool fnPointer = false) const {
+        Operand out;
+        if (op.kind == LIR::Operand::Kind::Const) {
+            out.kind = Operand::Kind::CInt;
+            out.value = op.value;
+            return out;
+        }
+        out.kind = Operand::Kind::Var;
+        out.name = nameOf(op);
+        if (fnPointer) {
+            const AST::Type* type = typeOf(out.name);
+            out.fnGlobal = type && shapeOf(*type) == Shape::Ptr && shapeOf(type->params[0]) == Shape::Fn &&
+                           (isGlobal(out.name) || function->name == "global");
+        }
+        return out;
+    }
+
+    const std::vector<Operand>& callArguments(const LIR::Instruction& call) {
+        arguments.clear();
+        for (uint32_t i = 0; i < call.argCount; i++) {
+            arguments.push_back(operand(function->body.call_args[call.firstArg + i]));
+        }
+        return arguments;
+    }
+
+    static bool isTerminator(const LIR::Instruction& instr) {
+        using Kind = LIR::Instruction::Kind;
+        return instr.kind == Kind::Jump || instr.kind == Kind::Branch || instr.kind == Kind::Ret;
+    }
+
+    // How many of ops an instruction's JSON names, in order
+    static size_t operandsNamed(const LIR::Instruction& instr) {
+        using Kind = LIR::Instruction::Kind;
+        switch (instr.kind) {
+            case Kind::Arith: case Kind::Cmp: case Kind::Gep: return 3;
+            case Kind::Copy: case Kind::Alloc: case Kind::Load: case Kind::Store: case Kind::Gfp: return 2;
+            case Kind::CallDir: case Kind::Branch: return 1;
+            case Kind::Ret: return instr.ops[0].kind == LIR::Operand::Kind::None ? 0 : 1;
+            default: return 0;
+        }
+    }
+
+    // The JSON's locals, in its order: the declared locals and every other name the blocks use up to their
+    // terminators that is not a global, parameter, function or extern
+    std::vector<std::string> localsOf(const LIR::Function& func) const {
+        std::vector<std::string_view> names;
+        for (const auto& local : func.locals) names.push_back(local.first);
+        auto use = [&](const LIR::Operand& op) {
+            if (op.kind == LIR::Operand::Kind::Const) return;
+            const std::string& name = nameOf(op);
+            if (!isGlobal(name) && !isParam(name) && !program->functions.count(name) && !program->externs.count(name)) {
+                names.push_back(name);
+            }
+        };
+        for (const auto& block : func.body.blocks) {
+            for (const auto& instr : block.instructions) {
+                for (size_t i = 0; i < operandsNamed(instr); i++) use(instr.ops[i]);
+                if (instr.kind == LIR::Instruction::Kind::CallDir) {
+                    for (uint32_t i = 0; i < instr.argCount; i++) use(func.body.call_args[instr.firstArg + i]);
+                }
+                if (isTerminator(instr)) break;
+            }
+        }
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        return std::vector<std::string>(names.begin(), names.end());
+    }
+
+    void processInstruction(const LIR::Instruction& instr) {
+        using Kind = LIR::Instruction::Kind;
+        const LIR::Names& names = function->body.names;
+        switch (instr.kind) {
+            case Kind::Copy: copy(operand(instr.ops[0], true), operand(instr.ops[1], true)); break;
+            case Kind::Arith: arith(nameOf(instr.ops[0]), arithOp(instr.op), operand(instr.ops[1]), operand(instr.ops[2])); break;
+            case Kind::Cmp: compare(nameOf(instr.ops[0]), cmpOp(instr.op), operand(instr.ops[1]), operand(instr.ops[2])); break;
+            case Kind::Alloc: alloc(nameOf(instr.ops[0]), operand(instr.ops[1]), nameOf(instr.ops[0])); break;
+            case Kind::Load: load(nameOf(instr.ops[0]), nameOf(instr.ops[1])); break;
+            case Kind::Store: store(nameOf(instr.ops[0]), operand(instr.ops[1], true)); break;
+            case Kind::Gep: gep(nameOf(instr.ops[0]), nameOf(instr.ops[1]), operand(instr.ops[2])); break;
+            case Kind::Gfp: {
+                const std::string& src = nameOf(instr.ops[1]);
+                const AST::Type* type = typeOf(src);
+                if (!type || shapeOf(*type) != Shape::Ptr) {
+                    throw std::runtime_error("Invalid 'typ' in 'src' of Gfp instruction");
+                }
+                if (shapeOf(type->params[0]) != Shape::Struct) {
+                    throw std::runtime_error("Invalid 'Ptr' type in 'src.typ' of Gfp isntruction");
+                }
+                gfp(nameOf(instr.ops[0]), src, names[instr.name], type->params[0].params[0].name);
+                break;
+            }
+            case Kind::CallDir: // only calls to externs stay in their block
+                callExt(names[instr.name], true, nameOf(instr.ops[0]), callArguments(instr));
+                break;
+            default:
+                break;
+        }
+    }
+
+    // The terminator of a block, nullptr for none, which returns
+    void processTerminalConditions(const LIR::Instruction* term, const std::string& funcName) {
+        const std::vector<std::string>& labels = function->body.labels;
+        if (!term || term->kind == LIR::Instruction::Kind::Ret) {
+            bool hasValue = term && term->ops[0].kind != LIR::Operand::Kind::None;
+            ret(funcName, hasValue ? operand(term->ops[0]) : Operand());
+        } else if (term->kind == LIR::Instruction::Kind::Jump) {
+            emit("  jmp " + funcName + "_" + labels[term->name] + "\n");
+        } else {
+            branch(funcName, operand(term->ops[0]), labels[term->name], labels[term->next]);
+        }
+    }
+
+    // The JSON's aop and rop names
+    static std::string_view arithOp(LIR::Instruction::Op op) {
+        if (op == LIR::Instruction::Op::Add) return "Add";
+        if (op == LIR::Instruction::Op::Sub || op == LIR::Instruction::Op::Neg) return "Subtract";
+        if (op == LIR::Instruction::Op::Mul) return "Multiply";
+        return "Divide";
+    }
+
+    static std::string_view cmpOp(LIR::Instruction::Op op) {
+        if (op == LIR::Instruction::Op::Equal) return "Eq";
+        if (op == LIR::Instruction::Op::NotEq) return "Neq";
+        if (op == LIR::Instruction::Op::Lt) return "Less";
+        if (op == LIR::Instruction::Op::Lte) return "LessEq";
+        if (op == LIR::Instruction::Op::Gt) return "Greater";
+        return "GreaterEq";
+    }
+
+    // What the JSON makes one block of: a block is cut after every call to a defined function, which ends
+    // its part as a CallDirect terminator whose next_bb is the part holding the rest
+    struct Part {
+        const LIR::BasicBlock* block = nullptr;
+        size_t first = 0, last = 0;              // the instructions before the terminator
+        const LIR::Instruction* term = nullptr;  // the call, Jump, Branch or Ret; none returns
+        std::string next;                        // a call's next_bb
+    };
+
     void generateAssembly() {
         emit(".data\n");
 
-        for (const auto& global : lirJson["globals"]) {
-            std::string name = global["name"];
+        std::vector<std::pair<std::string, bool>> globals; // name, is a function pointer
+        if (program) {
+            for (const auto& global : program->globals) {
+                const AST::Type* type = findVarType(*program, nullptr, global.first);
+                globals.emplace_back(global.first, type && shapeOf(*type) == Shape::Ptr && shapeOf(type->params[0]) == Shape::Fn);
+            }
+            std::sort(globals.begin(), globals.end());
+        } else {
+            for (const auto& global : lirJson["globals"]) {
+                globals.emplace_back(global["name"], global["typ"].contains("Ptr") && global["typ"]["Ptr"].contains("Fn"));
+            }
+        }
+        for (const auto& [name, fnPointer] : globals) {
             std::string underscoreName = name + "_";
 
-            if (global["typ"].contains("Ptr") && global["typ"]["Ptr"].contains("Fn")) { // global function pointer
+            if (fnPointer) { // global function pointer
                 emit(".globl " + underscoreName);
                 emit(underscoreName + ": .quad \"" + name + "\"");
             } else { // global variable
@@ -606,8 +834,17 @@ private:
         emit(".text\n");
 
         // Emit functions
-        for (const auto& [funcName, funcDetails] : lirJson["functions"].items()) {
-            emitFunction(funcName, funcDetails);
+        if (program) {
+            std::vector<const std::string*> names;
+            for (const auto& func : program->functions) names.push_back(&func.first);
+            std::sort(names.begin(), names.end(), [](const std::string* a, const std::string* b) { return *a < *b; });
+            for (const std::string* funcName : names) {
+                emitFunction(*funcName, program->functions.at(*funcName));
+            }
+        } else {
+            for (const auto& [funcName, funcDetails] : lirJson["functions"].items()) {
+                emitFunction(funcName, funcDetails);
+            }
         }
 
         // Out-of-bounds and invalid allocation handlers
@@ -621,20 +858,10 @@ private:
     }
 
     void emitFunction(const std::string& funcName, const json& funcDetails) {
-        emit(".globl " + funcName);
-        emit(funcName + ":");
-        emit("  pushq %rbp");
-        emit("  movq %rsp, %rbp");
-
-        int stackSize = calculateStackSize(funcDetails);
-        emit("  subq $" + std::to_string(stackSize) + ", %rsp");
-
-        zeroInitializeLocals(funcDetails["locals"]);
-
-        emit("  jmp " + funcName + "_entry\n");
-
-        // adjust local offsets to include parameters
-        adjustLocalOffsetsWithParams(funcDetails);
+        std::vector<std::string> params, locals;
+        for (const auto& param : funcDetails["params"]) params.push_back(param["name"]);
+        for (const auto& local : funcDetails["locals"]) locals.push_back(local["name"]);
+        emitPrologue(funcName, params, locals);
 
         // Emit function body
         for (const auto& [label, body] : funcDetails["body"].items()) {
@@ -649,26 +876,93 @@ private:
             processTerminalConditions(body["term"], funcName);
         }
 
-        // emit("\n");
+        emitEpilogue(funcName);
+    }
+
+    void emitFunction(const std::string& funcName, const LIR::Function& func) {
+        function = &func;
+        std::vector<std::string> params;
+        for (const auto& param : func.params) params.push_back(param.first);
+        emitPrologue(funcName, params, localsOf(func));
+
+        // The parts in the order of their ids, as the JSON's body object keeps them
+        const LIR::Names& names = func.body.names;
+        std::map<std::string, Part> parts;
+        for (size_t b = 0; b < func.body.blocks.size(); b++) {
+            const LIR::BasicBlock& block = func.body.blocks[b];
+            const std::string& label = func.body.labels[b];
+            std::string id = label;
+            const size_t count = block.instructions.size();
+            Part part{&block, 0, count};
+            int calls = 0;
+            for (size_t i = 0; i < count; i++) {
+                const LIR::Instruction& instr = block.instructions[i];
+                if (instr.kind == LIR::Instruction::Kind::CallDir && !program->externs.count(names[instr.name])) {
+                    part.last = i;
+                    part.term = &instr;
+                    part.next = label + ".call" + std::to_string(++calls);
+                    parts[id] = part;
+                    id = part.next;
+                    part = Part{&block, i + 1, count};
+                } else if (isTerminator(instr)) {
+                    part.last = i;
+                    part.term = &instr;
+                    break;
+                }
+            }
+            parts[id] = part;
+        }
+
+        for (const auto& [id, part] : parts) {
+            emit(funcName + "_" + id + ":");
+            for (size_t i = part.first; i < part.last; i++) {
+                processInstruction(part.block->instructions[i]);
+            }
+            if (part.term && part.term->kind == LIR::Instruction::Kind::CallDir) {
+                callTerminal(funcName, "  call " + names[part.term->name], nameOf(part.term->ops[0]),
+                           callArguments(*part.term), part.next);
+            } else {
+                processTerminalConditions(part.term, funcName);
+            }
+        }
+
+        emitEpilogue(funcName);
+        function = nullptr;
+    }
+
+    void emitPrologue(const std::string& funcName, const std::vector<std::string>& params, const std::vector<std::string>& locals) {
+        emit(".globl " + funcName);
+        emit(funcName + ":");
+        emit("  pushq %rbp");
+        emit("  movq %rsp, %rbp");
+
+        int stackSize = calculateStackSize(locals.size());
+        emit("  subq $" + std::to_string(stackSize) + ", %rsp");
+
+        zeroInitializeLocals(locals.size());
+
+        emit("  jmp " + funcName + "_entry\n");
 
-        // Emit epilogue
+        // adjust local offsets to include parameters
+        adjustLocalOffsetsWithParams(params, locals);
+    }
+
+    void emitEpilogue(const std::string& funcName) {
         emit(funcName + "_epilogue:");
         emit("  movq %rbp, %rsp");
         emit("  popq %rbp");
         emit("  ret\n");
     }
 
-    void adjustLocalOffsetsWithParams(const json& funcDetails) {
+    void adjustLocalOffsetsWithParams(const std::vector<std::string>& params, const std::vector<std::string>& locals) {
         int paramOffset = 16;
-        for (const auto& param : funcDetails["params"]) {
-            std::string paramName = param["name"];
+        for (const auto& paramName : params) {
             localOffsets[paramName] = paramOffset;
             paramOffset += 8;
         }
 
         int localOffset = -8;
-        for (const auto& local : funcDetails["locals"]) {
-            std::string localName = local["name"];
+        for (const auto& localName : locals) {
             localOffsets[localName] = localOffset;
             localOffset -= 8;
         }
@@ -682,9 +976,9 @@ private:
         }
     }
 
-    void zeroInitializeLocals(const json& locals) { // for function locals
+    void zeroInitializeLocals(size_t localCount) { // for function locals
         int currentOffset = -8;
-        for (const auto& local : locals) {
+        for (size_t i = 0; i < localCount; i++) {
             emit("  movq $0, " + std::to_string(currentOffset) + "(%rbp)");
             currentOffset -= 8;
         }
@@ -694,8 +988,7 @@ private:
         instructions.push_back(instruction);
     }
 
-    int calculateStackSize(const json& funcDetails) {
-        int localCount = funcDetails["locals"].size();
+    int calculateStackSize(int localCount) {
         int stackSize = localCount * 8;
 
         if (stackSize % 16 != 0) {
@@ -713,13 +1006,11 @@ private:
         }
     }
 
-    std::string getOperandAccess(const json& operand) {
-        if (operand.contains("CInt")) {
-            return "$" + std::to_string(static_cast<int>(operand["CInt"]));
-        } else if (operand.contains("Var")) {
-            std::string varName = operand["Var"]["name"];
-            return getAccessMode(varName);
+    std::string getOperandAccess(const Operand& operand) {
+        if (operand.kind == Operand::Kind::CInt) {
+            return "$" + std::to_string(operand.value);
         }
+        return getAccessMode(operand.name);
     }
 
     std::string getAssemblyCode() const {
@@ -745,8 +1036,12 @@ std::string readFile(const json& filePath) {
 int main(int argc, char *argv[]) {
     std::string lirProgram = readFile(argv[1]);
 
-    LIRToX86CodeGenerator generator(lirProgram);
-    std::string assemblyCode = generator.generate();
+    std::optional<LIRToX86CodeGenerator> generator;
+    {
+        metrics::Scope scope("load");
+        generator.emplace(lirProgram);
+    }
+    std::string assemblyCode = generator->generate();
 
     std::cout << assemblyCode << std::endl;
 
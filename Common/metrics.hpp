@@ -0,0 +1,255 @@
+#ifndef CFLAT_METRICS_HPP
+#define CFLAT_METRICS_HPP
+
+// Instrumentation shared by every stage: scoped timers, named counters, peak RSS and heap allocation counts.
+// It is always collecting: a timed scope costs two clock reads and a getrusage() call, an allocation one
+// relaxed add on a per-thread slot. Nothing is printed unless CFLAT_METRICS=table or CFLAT_METRICS=json is
+// set, in which case the report goes to stderr (or to CFLAT_METRICS_FILE) when the program exits; a driver
+// can also call metrics::report() itself.
+//
+//     metrics::Scope scope("lowerProgram");   // time, allocations and RSS of everything until scope ends
+//     metrics::counter("tokens") += tokens.size();
+//
+// Scopes are inclusive (constructCFG is also part of lowerProgram) and count the allocations of the thread
+// they are open on: what worker threads allocate shows in the scopes they open themselves and in the total
+// at the end of the report. Looking a timer or counter up by name takes a lock, so code that runs per
+// function resolves it once:
+//
+//     static metrics::Timer& timer = metrics::timer("constructCFG");
+//     metrics::Scope scope(timer);
+//
+// This header replaces the global operator new and delete to do the counting, so it is included from
+// exactly one translation unit per binary, which every stage already is.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sys/resource.h>
+
+namespace metrics {
+
+struct Timer {
+    const char* name;
+    std::atomic<uint64_t> calls{0}, nanoseconds{0}, allocations{0}, allocatedBytes{0};
+    std::atomic<long> peakRssKB{0}; // the process's peak as of the latest exit from the scope
+
+    explicit Timer(const char* name) : name(name) {}
+};
+
+struct Counter {
+    const char* name;
+    std::atomic<uint64_t> value{0};
+
+    explicit Counter(const char* name) : name(name) {}
+    Counter& operator+=(uint64_t n) {
+        value.fetch_add(n, std::memory_order_relaxed);
+        return *this;
+    }
+};
+
+namespace detail {
+
+// One slot per thread, so counting an allocation never contends; past MAX_SLOTS threads share them.
+struct alignas(64) AllocationSlot {
+    std::atomic<uint64_t> count{0}, bytes{0};
+};
+constexpr unsigned MAX_SLOTS = 256;
+inline AllocationSlot slots[MAX_SLOTS];
+inline std::atomic<unsigned> slotsClaimed{0};
+
+inline AllocationSlot& threadSlot() {
+    static thread_local AllocationSlot& slot = slots[slotsClaimed.fetch_add(1, std::memory_order_relaxed) % MAX_SLOTS];
+    return slot;
+}
+
+inline void noteAllocation(size_t size) {
+    AllocationSlot& slot = threadSlot();
+    slot.count.fetch_add(1, std::memory_order_relaxed);
+    slot.bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+void reportAtExit();
+
+struct Registry {
+    std::mutex lock;
+    std::deque<Timer> timers;     // in order of first use, which is the order of the report
+    std::deque<Counter> counters;
+
+    template <typename T>
+    static T& find(std::deque<T>& in, const char* name) {
+        for (T& item : in) {
+            if (item.name == name || std::strcmp(item.name, name) == 0) return item;
+        }
+        return in.emplace_back(name);
+    }
+};
+
+inline Registry& registry() {
+    static Registry instance;
+    static const bool reporting = (std::atexit(reportAtExit), true); // after instance, so it runs before ~Registry
+    (void)reporting;
+    return instance;
+}
+
+}  // namespace detail
+
+inline Timer& timer(const char* name) {
+    detail::Registry& r = detail::registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    return detail::Registry::find(r.timers, name);
+}
+
+inline Counter& counter(const char* name) {
+    detail::Registry& r = detail::registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    return detail::Registry::find(r.counters, name);
+}
+
+inline long peakRssKB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+struct AllocationTotals {
+    uint64_t count = 0, bytes = 0;
+};
+
+// The calling thread's allocations so far (and those of threads sharing its slot, past MAX_SLOTS threads)
+inline AllocationTotals threadAllocations() {
+    const detail::AllocationSlot& slot = detail::threadSlot();
+    return {slot.count.load(std::memory_order_relaxed), slot.bytes.load(std::memory_order_relaxed)};
+}
+
+// Every thread's allocations so far
+inline AllocationTotals allocations() {
+    AllocationTotals totals;
+    unsigned used = std::min(detail::slotsClaimed.load(std::memory_order_relaxed), detail::MAX_SLOTS);
+    for (unsigned i = 0; i < used; i++) {
+        totals.count += detail::slots[i].count.load(std::memory_order_relaxed);
+        totals.bytes += detail::slots[i].bytes.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+class Scope {
+public:
+    explicit Scope(const char* name) : Scope(metrics::timer(name)) {}
+    explicit Scope(Timer& timer) : timer(timer), before(threadAllocations()), start(std::chrono::steady_clock::now()) {}
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    ~Scope() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        AllocationTotals after = threadAllocations();
+        timer.calls.fetch_add(1, std::memory_order_relaxed);
+        timer.nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+        timer.allocations.fetch_add(after.count - before.count, std::memory_order_relaxed);
+        timer.allocatedBytes.fetch_add(after.bytes - before.bytes, std::memory_order_relaxed);
+        long rss = peakRssKB();
+        for (long seen = timer.peakRssKB.load(); seen < rss && !timer.peakRssKB.compare_exchange_weak(seen, rss); ) {}
+    }
+
+private:
+    Timer& timer;
+    AllocationTotals before;
+    std::chrono::steady_clock::time_point start;
+};
+
+inline void report(std::ostream& os, bool json) {
+    detail::Registry& r = detail::registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    AllocationTotals total = allocations();
+    long rss = peakRssKB();
+
+    if (json) {
+        os << "{\"timers\": [";
+        const char* sep = "";
+        for (const Timer& t : r.timers) {
+            os << sep << "{\"name\": \"" << t.name << "\", \"calls\": " << t.calls << ", \"ms\": "
+               << t.nanoseconds / 1e6 << ", \"allocations\": " << t.allocations << ", \"allocated_bytes\": "
+               << t.allocatedBytes << ", \"peak_rss_kb\": " << t.peakRssKB << "}";
+            sep = ", ";
+        }
+        os << "], \"counters\": {";
+        sep = "";
+        for (const Counter& c : r.counters) {
+            os << sep << "\"" << c.name << "\": " << c.value;
+            sep = ", ";
+        }
+        os << "}, \"allocations\": " << total.count << ", \"allocated_bytes\": " << total.bytes
+           << ", \"peak_rss_kb\": " << rss << "}" << std::endl;
+        return;
+    }
+
+    std::ios state(nullptr);
+    state.copyfmt(os);
+    os << std::left << std::setw(16) << "scope" << std::right << std::setw(8) << "calls" << std::setw(12) << "ms"
+       << std::setw(12) << "allocs" << std::setw(12) << "alloc KB" << std::setw(14) << "peak rss KB" << "\n";
+    for (const Timer& t : r.timers) {
+        os << std::left << std::setw(16) << t.name << std::right << std::setw(8) << t.calls << std::setw(12)
+           << std::fixed << std::setprecision(2) << t.nanoseconds / 1e6 << std::setw(12) << t.allocations
+           << std::setw(12) << t.allocatedBytes / 1024 << std::setw(14) << t.peakRssKB << "\n";
+    }
+    for (const Counter& c : r.counters) {
+        os << std::left << std::setw(16) << c.name << std::right << std::setw(8) << c.value << "\n";
+    }
+    os << "allocations     : " << total.count << " (" << total.bytes / 1024 << " KB)\n"
+       << "peak rss        : " << rss << " KB" << std::endl;
+    os.copyfmt(state);
+}
+
+inline void detail::reportAtExit() {
+    const char* format = std::getenv("CFLAT_METRICS");
+    if (!format || (std::strcmp(format, "table") != 0 && std::strcmp(format, "json") != 0)) return;
+    bool json = std::strcmp(format, "json") == 0;
+    const char* path = std::getenv("CFLAT_METRICS_FILE");
+    if (path && *path) {
+        std::ofstream out(path, std::ios::app);
+        report(out, json);
+    } else {
+        report(std::cerr, json);
+    }
+}
+
+}  // namespace metrics
+
+// Counting replacements for the global allocation functions (the sized and nothrow forms route here too)
+void* operator new(std::size_t size) {
+    metrics::detail::noteAllocation(size);
+    for (;;) {
+        if (void* p = std::malloc(size ? size : 1)) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+void* operator new[](std::size_t size) { return ::operator new(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return ::operator new(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return ::operator new(size, std::nothrow); }
+// Every delete form ends in the unsized one, the only call to free(). It stays out of line: inlined into
+// a caller that got its pointer from operator new, GCC would see new paired with free() and warn
+// (-Wmismatched-new-delete) in every stage.
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { ::operator delete(p); }
+void operator delete(void* p, std::size_t) noexcept { ::operator delete(p); }
+void operator delete[](void* p, std::size_t) noexcept { ::operator delete(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { ::operator delete(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { ::operator delete(p); }
+
+#endif
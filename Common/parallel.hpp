@@ -0,0 +1,64 @@
+#ifndef CFLAT_PARALLEL_HPP
+#define CFLAT_PARALLEL_HPP
+
+// The worker pool every stage splits its work over: the lexer its chunks, the checker and the lowerer their
+// functions. A stage asks how many threads its work is worth, then hands forEach() the indices:
+//
+//     const size_t threads = parallel::threadsFor(lowerThreads, count, PARALLEL_MIN_FUNCTIONS);
+//     parallel::forEach(count, threads, [&](size_t f) { lowered[f] = lowerFunction(ast.functions[f], lir); });
+//
+// Workers take the next index off a shared counter, so a long function does not hold up the ones after it.
+// Each index writes its own result slot and the stage merges them in index order, which is how every stage
+// produces the same output as one thread does.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+// What a -j option defaults to
+inline unsigned hardwareThreads() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+// The threads work units are split over when each thread should get at least minPerThread of them, at most
+// limit; below 2 the work stays on the calling thread
+inline size_t threadsFor(unsigned limit, size_t work, size_t minPerThread) {
+    return std::min<size_t>(limit, work / minPerThread);
+}
+
+// Runs body(i) for every i below count, on the calling thread when threads is below 2. An exception does not
+// stop the other indices; once all are done, the one the serial loop would have stopped at is rethrown.
+template <typename Body>
+void forEach(size_t count, size_t threads, Body body) {
+    if (threads < 2) {
+        for (size_t i = 0; i < count; i++) body(i);
+        return;
+    }
+
+    std::vector<std::exception_ptr> failures(count);
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&] {
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+                try {
+                    body(i);
+                } catch (...) {
+                    failures[i] = std::current_exception();
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+
+    for (const auto& failure : failures) {
+        if (failure) std::rethrow_exception(failure);
+    }
+}
+
+}  // namespace parallel
+
+#endif
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+
+cflat [--cache <dir> | --no-cache] [-v] <stage> [args...]
+
+Runs one pipeline stage (lex, parser, lower, codegen, opt) through a content-addressed cache. A stage is a
+pure function of its own binary, its arguments, the files they name, its stdin and the CFLAT_METRICS
+variables, so the cache key is a hash of exactly those bytes: the binary stands in for the tool's version,
+and an argument that names an existing file contributes its contents as well as its name. When an argument
+is -, stdin is read up front, hashed, and handed to the stage from that copy; otherwise the stage's stdin is
+/dev/null, so an inherited pipe is never waited on and never changes the key. A hit replays what the stage
+printed and wrote without starting it at all.
+
+Cache layout
+
+    <dir>/<key>/stdout, stderr : what the stage printed
+    <dir>/<key>/out<i>         : the file given to the i-th -o (lex -o <tokens>)
+
+An entry is assembled in a private directory and renamed into place, so concurrent runs of the same stage
+never see half an entry; the loser of a race just drops its copy. Only runs that exit 0 are stored.
+Without --cache (or $CFLAT_CACHE) the stage is simply run.
+
+*/
+
+namespace {
+
+bool verbose = false;
+
+// 128-bit FNV-1a, wide enough that distinct inputs never share a key in practice
+class Hasher {
+public:
+    void bytes(const char* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            state ^= static_cast<unsigned char>(data[i]);
+            state *= PRIME;
+        }
+    }
+
+    void text(const std::string& s) {
+        bytes(s.data(), s.size() + 1); // the terminator keeps ("ab", "c") apart from ("a", "bc")
+    }
+
+    bool file(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+        char buffer[1 << 16];
+        while (in.read(buffer, sizeof buffer) || in.gcount() > 0) bytes(buffer, in.gcount());
+        return true;
+    }
+
+    std::string hex() const {
+        static const char digits[] = "0123456789abcdef";
+        std::string out(32, '0');
+        unsigned __int128 v = state;
+        for (int i = 31; i >= 0; i--, v >>= 4) out[i] = digits[static_cast<unsigned>(v & 0xF)];
+        return out;
+    }
+
+private:
+    static constexpr unsigned __int128 PRIME = (static_cast<unsigned __int128>(1) << 88) + 0x13B;
+    unsigned __int128 state = (static_cast<unsigned __int128>(0x6C62272E07BB0142ull) << 64) | 0x62B821756295C58Dull;
+};
+
+bool isFile(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// The stage binary as execvp would find it, so its bytes can go into the key
+std::string resolve(const std::string& stage) {
+    if (stage.find('/') != std::string::npos) return stage;
+    const char* path = getenv("PATH");
+    std::stringstream dirs(path ? path : "");
+    for (std::string dir; std::getline(dirs, dir, ':'); ) {
+        std::string candidate = (dir.empty() ? "." : dir) + "/" + stage;
+        if (isFile(candidate) && access(candidate.c_str(), X_OK) == 0) return candidate;
+    }
+    return "";
+}
+
+bool copyFile(const std::string& from, const std::string& to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    if (!in || !out) return false;
+    out << in.rdbuf();
+    return static_cast<bool>(out);
+}
+
+void replay(const std::string& path, std::ostream& os) {
+    std::ifstream in(path, std::ios::binary);
+    if (in && in.peek() != std::ifstream::traits_type::eof()) os << in.rdbuf();
+    os.flush();
+}
+
+// Runs the stage with stdout and stderr sent to files and stdin read from in when there is one, returns its
+// exit status (127 when it could not start)
+int run(const std::vector<std::string>& args, const std::string& out, const std::string& err, const std::string& in) {
+    std::cout.flush();
+    std::cerr.flush();
+    pid_t pid = fork();
+    if (pid < 0) return 127;
+    if (pid == 0) {
+        int o = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int e = open(err.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (o < 0 || e < 0 || dup2(o, STDOUT_FILENO) < 0 || dup2(e, STDERR_FILENO) < 0) _exit(127);
+        close(o);
+        close(e);
+        if (!in.empty()) {
+            int i = open(in.c_str(), O_RDONLY);
+            if (i < 0 || dup2(i, STDIN_FILENO) < 0) _exit(127);
+            close(i);
+        }
+        std::vector<char*> argv;
+        for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        dprintf(STDERR_FILENO, "cflat: cannot run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    return 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+}
+
+// Drops an entry that was never renamed into place, it only ever holds stdout, stderr and out<i>
+void removeEntry(const std::string& dir, size_t outputs) {
+    unlink((dir + "/stdout").c_str());
+    unlink((dir + "/stderr").c_str());
+    for (size_t i = 0; i < outputs; i++) unlink((dir + "/out" + std::to_string(i)).c_str());
+    rmdir(dir.c_str());
+}
+
+int cachedRun(const std::string& cacheDir, const std::vector<std::string>& args) {
+    std::string binary = resolve(args[0]);
+    Hasher key;
+    if (binary.empty() || !key.file(binary)) {
+        std::cerr << "cflat: cannot find stage " << args[0] << std::endl;
+        return 127;
+    }
+
+    std::vector<std::string> outputs; // files the stage writes itself, cached next to its stdout
+    for (size_t a = 1; a < args.size(); a++) {
+        if (args[a - 1] == "-o") {
+            outputs.push_back(args[a]); // where it goes does not change what is written
+            continue;
+        }
+        key.text(args[a]);
+        if (isFile(args[a])) key.file(args[a]);
+    }
+
+    // The report the metrics header prints at exit goes into stderr or a file, depending on these
+    for (const char* name : {"CFLAT_METRICS", "CFLAT_METRICS_FILE"}) {
+        const char* value = getenv(name);
+        key.text(value ? std::string(name) + "=" + value : std::string(name));
+    }
+
+    // A stage only reads stdin when given "-" (parser -): buffered, what comes in goes into the key and to the stage
+    bool readsStdin = std::find(args.begin() + 1, args.end(), "-") != args.end();
+    std::string input;
+    if (readsStdin) {
+        input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+        key.text("stdin");
+        key.bytes(input.data(), input.size());
+    }
+
+    std::string entry = cacheDir + "/" + key.hex();
+    if (isFile(entry + "/stdout")) {
+        for (size_t i = 0; i < outputs.size(); i++) {
+            if (!copyFile(entry + "/out" + std::to_string(i), outputs[i])) {
+                std::cerr << "cflat: cannot write " << outputs[i] << std::endl;
+                return 1;
+            }
+        }
+        if (verbose) std::cerr << "cflat: " << args[0] << " cache hit " << key.hex() << std::endl;
+        replay(entry + "/stdout", std::cout);
+        replay(entry + "/stderr", std::cerr);
+        return 0;
+    }
+
+    mkdir(cacheDir.c_str(), 0755);
+    std::string temp = cacheDir + "/tmp." + std::to_string(getpid()) + "." + key.hex();
+    if (mkdir(temp.c_str(), 0755) != 0) {
+        std::cerr << "cflat: cannot use cache directory " << cacheDir << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::string in = "/dev/null";
+    if (readsStdin) {
+        in = temp + "/stdin";
+        std::ofstream file(in, std::ios::binary);
+        file << input;
+    }
+    int status = run(args, temp + "/stdout", temp + "/stderr", in);
+    if (readsStdin) unlink(in.c_str());
+    bool store = status == 0;
+    for (size_t i = 0; i < outputs.size() && store; i++) {
+        store = copyFile(outputs[i], temp + "/out" + std::to_string(i));
+    }
+    if (verbose) std::cerr << "cflat: " << args[0] << " cache miss " << key.hex() << std::endl;
+    replay(temp + "/stdout", std::cout);
+    replay(temp + "/stderr", std::cerr);
+
+    if (!store || rename(temp.c_str(), entry.c_str()) != 0) removeEntry(temp, outputs.size()); // a failed run, or lost a race
+    return status;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const char* env = getenv("CFLAT_CACHE");
+    std::string cacheDir = env ? env : "";
+    int a = 1;
+    for (; a < argc && argv[a][0] == '-'; a++) {
+        std::string arg = argv[a];
+        if (arg == "--cache" && a + 1 < argc) cacheDir = argv[++a];
+        else if (arg == "--no-cache") cacheDir.clear();
+        else if (arg == "-v") verbose = true;
+        else break;
+    }
+
+    if (a >= argc) {
+        std::cerr << "Usage: " << argv[0] << " [--cache <dir> | --no-cache] [-v] <stage> [args...]   (stage: lex, parser, lower, codegen, opt; --cache defaults to $CFLAT_CACHE)" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> args(argv + a, argv + argc);
+    if (cacheDir.empty()) {
+        execvp(argv[a], argv + a);
+        std::cerr << "cflat: cannot run " << argv[a] << ": " << strerror(errno) << std::endl;
+        return 127;
+    }
+    return cachedRun(cacheDir, args);
+}
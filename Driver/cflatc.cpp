@@ -0,0 +1,430 @@
+// The headers every stage includes, up front: each stage source below is then pulled into a namespace of its
+// own and only adds its own code there, so the stages link into one binary without their names colliding.
+#include <bits/stdc++.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../Lower/json.hpp"
+#include "../Common/metrics.hpp"
+#include "../Common/parallel.hpp"
+
+namespace lex {
+#include "../Lexer/lex.cpp"
+}
+namespace parse {
+#include "../Parse/parser.cpp"
+}
+namespace lower {
+#include "../Lower/lower.cpp"
+}
+namespace codegen { // its "json.hpp" is Lower's, found through -I../Lower; its lir.hpp is already in lower
+namespace AST = lower::AST;
+namespace LIR = lower::LIR;
+using lower::findVarType;
+#include "../Codegen/codegen.cpp"
+}
+
+/*
+
+cflatc [-j threads] [--max-errors N] [--emit asm|ast|ast-json|lir|lir-json] [--time] <file.cf>
+
+The whole compiler in one process: the lexer's vector<Token> is handed to the parser through a TokenSource,
+the checked parse::Program is turned into the lowerer's AST::Program node by node, lowerProgram() builds
+the LIR::Program, and codegen reads that in place and prints the x86 assembly. Nothing is written
+out and read back between stages, which is where the separate binaries spend most of their time on a large
+module.
+
+--emit asm is the default. --emit lir prints the LIR instead, --emit lir-json the reference JSON
+(lower -json) that codegen and opt read; opt stays a separate step. --emit ast-json prints the lowerer's
+AST as the dump lower reads (lower <ast.json>).
+
+-j sets the threads of every stage that has them: lexing, type checking and lowering, which all split
+the work by chunk or by function and produce the same output as one thread does.
+
+--time prints the metrics table (see Common/metrics.hpp) on stderr: time, allocations and peak RSS per stage.
+
+*/
+
+namespace {
+
+// The lexer's tokens as the parser wants them, converted one at a time as the parser pulls. The lexer's
+// token names and the parser's TokenType share their order (tokenStreamTypes), as they do in a lex -o stream.
+class LexedTokenSource : public parse::TokenSource {
+    const std::vector<lex::Token>& tokens;
+    size_t at = 0;
+    std::unordered_map<std::string_view, parse::TokenType> types;
+
+protected:
+    bool produce(parse::Token& out) override {
+        if (at == tokens.size()) return false;
+        const lex::Token& token = tokens[at++];
+        if (token.symbol != lex::Symbol_Table::NO_SYMBOL) {
+            out = parse::Token(parse::TokenType::Id, std::string(lex::SymbolTable.name(token.symbol)));
+        } else if (token.t.compare(0, 4, "Num(") == 0) {
+            out = parse::Token(parse::TokenType::Num, token.t.substr(4, token.t.length() - 5));
+        } else {
+            auto it = types.find(token.t);
+            if (it == types.end()) throw parse::TokenStreamError("Unknown token '" + token.t + "'");
+            out = parse::Token(it->second);
+        }
+        out.span = parse::Span{token.span.offset, token.span.length};
+        return true;
+    }
+
+public:
+    explicit LexedTokenSource(const std::vector<lex::Token>& tokens) : tokens(tokens) {
+        for (size_t k = 0; k < std::size(lex::tokenStreamTypes); k++) {
+            types[lex::tokenStreamTypes[k]] = static_cast<parse::TokenType>(k);
+        }
+    }
+};
+
+// parse::Program -> lower::AST::Program, the same tree parseAST() builds from an AST dump
+class AstBuilder {
+public:
+    lower::AST::Program build(const parse::Program& program) {
+        lower::AST::Program ast = declarations(program);
+        for (const auto& func : program.functions) ast.functions.push_back(function(func));
+        return ast;
+    }
+
+    // Everything but the functions, which --emit ast-json builds and writes one at a time
+    lower::AST::Program declarations(const parse::Program& program) {
+        lower::AST::Program ast;
+        for (const auto& global : program.globals) ast.globals[global.name] = type(global.type);
+        for (const auto& ext : program.externs) {
+            const auto* fn = parse::as<parse::Fn>(ext.type);
+            std::vector<lower::AST::Type> params;
+            for (parse::Type* param : fn->params) params.push_back(type(param));
+            ast.externs[ext.name] = {std::move(params), returnType(fn->ret)};
+        }
+        for (const auto& str : program.structs) {
+            auto& fields = ast.structs[str.name];
+            for (const auto& [name, fieldType] : str.fields) fields.emplace_back(name, type(fieldType));
+        }
+        return ast;
+    }
+
+    lower::AST::Function function(const parse::Function& func) {
+        lower::AST::Function out;
+        out.name = func.name;
+        for (const auto& param : func.params) out.params.emplace_back(param.name, type(param.type));
+        out.ret_type = returnType(func.rettyp);
+        for (const auto& [decl, init] : func.locals) {
+            out.locals.emplace_back(decl.name, type(decl.type));
+            if (init) { // initialisers become leading assignments, as in parseAST
+                auto assign = std::make_unique<lower::AST::Stmt>();
+                assign->kind = lower::AST::Stmt::Kind::Assign;
+                assign->assign_lhs = std::make_unique<lower::AST::Lval>();
+                assign->assign_lhs->name = decl.name;
+                assign->assign_rhs = exp(*init);
+                out.stmts.push_back(std::move(assign));
+            }
+        }
+        for (const parse::Stmt* s : func.stmts) out.stmts.push_back(stmt(*s));
+        return out;
+    }
+
+private:
+    static lower::AST::Type named(std::string name, std::vector<lower::AST::Type> params = {}) {
+        return lower::AST::Type{std::move(name), std::move(params)};
+    }
+
+    static lower::AST::Type returnType(parse::Type* ret) {
+        return ret ? type(ret) : named("void"); // what parseAST gives a function without a rettyp
+    }
+
+    static lower::AST::Type type(parse::Type* t) {
+        switch (t->kind) {
+            case parse::TypeKind::Int: return named("Int");
+            case parse::TypeKind::Any: return named("Nil");
+            case parse::TypeKind::Struct: return named("Struct", {named(parse::as<parse::Struct>(t)->name)});
+            case parse::TypeKind::Ptr: return named("Ptr", {type(parse::as<parse::Ptr>(t)->ref)});
+            case parse::TypeKind::Fn: {
+                const auto* fn = parse::as<parse::Fn>(t);
+                std::vector<lower::AST::Type> params;
+                for (parse::Type* param : fn->params) params.push_back(type(param));
+                params.push_back(returnType(fn->ret));
+                return named("Fn", std::move(params));
+            }
+        }
+        throw std::logic_error("unknown type kind");
+    }
+
+    template <typename List>
+    void stmts(const List& from, std::vector<std::unique_ptr<lower::AST::Stmt>>& to) {
+        for (const parse::Stmt* s : from) to.push_back(stmt(*s));
+    }
+
+    static std::string callee(const parse::Exp& e) {
+        if (e.kind != parse::ExpKind::Id) throw std::runtime_error("lower: only direct calls are lowered");
+        return parse::as<parse::IdExp>(&e)->name;
+    }
+
+    std::unique_ptr<lower::AST::Stmt> stmt(const parse::Stmt& s) {
+        using Kind = lower::AST::Stmt::Kind;
+        auto out = std::make_unique<lower::AST::Stmt>();
+        switch (s.kind) {
+            case parse::StmtKind::Break: out->kind = Kind::Break; break;
+            case parse::StmtKind::Continue: out->kind = Kind::Continue; break;
+            case parse::StmtKind::If: {
+                const auto* i = parse::as<parse::IfStmt>(&s);
+                out->kind = Kind::If;
+                out->if_guard = exp(*i->guard);
+                stmts(i->tt, out->if_then);
+                stmts(i->ff, out->if_else);
+                break;
+            }
+            case parse::StmtKind::While: {
+                const auto* w = parse::as<parse::WhileStmt>(&s);
+                out->kind = Kind::While;
+                out->while_guard = exp(*w->guard);
+                stmts(w->body, out->while_body);
+                break;
+            }
+            case parse::StmtKind::Return: {
+                const auto* r = parse::as<parse::ReturnStmt>(&s);
+                out->kind = Kind::Return;
+                if (r->exp) out->return_expr = exp(*r->exp);
+                break;
+            }
+            case parse::StmtKind::Assign: {
+                const auto* a = parse::as<parse::AssignStmt>(&s);
+                out->kind = Kind::Assign;
+                out->assign_lhs = lval(*a->lhs);
+                if (a->rhs->kind == parse::RhsKind::New) {
+                    const auto* n = parse::as<parse::NewRhs>(a->rhs);
+                    out->assign_rhs = std::make_unique<lower::AST::Expr>();
+                    out->assign_rhs->kind = lower::AST::Expr::Kind::New;
+                    out->assign_rhs->new_type = type(n->type);
+                    out->assign_rhs->new_size = exp(*n->amount);
+                } else {
+                    out->assign_rhs = exp(*parse::as<parse::RhsExp>(a->rhs)->exp);
+                }
+                break;
+            }
+            case parse::StmtKind::Call: {
+                const auto* c = parse::as<parse::CallStmt>(&s);
+                if (c->callee->kind != parse::LvalKind::Id) throw std::runtime_error("lower: only direct calls are lowered");
+                out->kind = Kind::Call;
+                out->call_callee = parse::as<parse::IdLval>(c->callee)->name;
+                for (const parse::Exp* arg : c->args) out->call_args.push_back(exp(*arg));
+                break;
+            }
+        }
+        return out;
+    }
+
+    // The lowerer keeps l-values flat: the name of an Id, or the pointer as an expression plus the index,
+    // field or the "Deref" marker
+    std::unique_ptr<lower::AST::Lval> lval(const parse::Lval& l) {
+        auto out = std::make_unique<lower::AST::Lval>();
+        switch (l.kind) {
+            case parse::LvalKind::Id: out->name = parse::as<parse::IdLval>(&l)->name; break;
+            case parse::LvalKind::Deref:
+                out->name = "Deref";
+                out->array_ptr = lvalExp(*parse::as<parse::DerefLval>(&l)->lval);
+                break;
+            case parse::LvalKind::ArrayAccess: {
+                const auto* a = parse::as<parse::ArrayAccessLval>(&l);
+                out->array_ptr = lvalExp(*a->ptr);
+                out->array_index = exp(*a->index);
+                break;
+            }
+            case parse::LvalKind::FieldAccess: {
+                const auto* f = parse::as<parse::FieldAccessLval>(&l);
+                out->array_ptr = lvalExp(*f->ptr);
+                out->field_name = f->field;
+                break;
+            }
+        }
+        return out;
+    }
+
+    // An l-value read as an expression, which is how an AST dump spells the pointer of an access
+    std::unique_ptr<lower::AST::Expr> lvalExp(const parse::Lval& l) {
+        using Kind = lower::AST::Expr::Kind;
+        auto out = std::make_unique<lower::AST::Expr>();
+        switch (l.kind) {
+            case parse::LvalKind::Id:
+                out->kind = Kind::Id;
+                out->id = parse::as<parse::IdLval>(&l)->name;
+                break;
+            case parse::LvalKind::Deref:
+                out->kind = Kind::UnOp;
+                out->unop = "Deref";
+                out->left = lvalExp(*parse::as<parse::DerefLval>(&l)->lval);
+                break;
+            case parse::LvalKind::ArrayAccess: {
+                const auto* a = parse::as<parse::ArrayAccessLval>(&l);
+                out->kind = Kind::ArrayAccess;
+                out->array_ptr = lvalExp(*a->ptr);
+                out->array_index = exp(*a->index);
+                break;
+            }
+            case parse::LvalKind::FieldAccess: {
+                const auto* f = parse::as<parse::FieldAccessLval>(&l);
+                out->kind = Kind::FieldAccess;
+                out->field_ptr = lvalExp(*f->ptr);
+                out->field_name = f->field;
+                break;
+            }
+        }
+        return out;
+    }
+
+    std::unique_ptr<lower::AST::Expr> exp(const parse::Exp& e) {
+        using Kind = lower::AST::Expr::Kind;
+        static const char* const binops[] = {"Add", "Sub", "Mul", "Div", "Equal", "NotEq", "Lt", "Lte", "Gt", "Gte"};
+        auto out = std::make_unique<lower::AST::Expr>();
+        switch (e.kind) {
+            case parse::ExpKind::Num:
+                out->kind = Kind::Num;
+                out->num = parse::as<parse::NumExp>(&e)->n;
+                break;
+            case parse::ExpKind::Id:
+                out->kind = Kind::Id;
+                out->id = parse::as<parse::IdExp>(&e)->name;
+                break;
+            case parse::ExpKind::Nil: out->kind = Kind::Nil; break;
+            case parse::ExpKind::UnOp: {
+                const auto* u = parse::as<parse::UnOpExp>(&e);
+                if (u->op == parse::UnaryOp::Addr) throw std::runtime_error("lower: & is not lowered");
+                out->kind = Kind::UnOp;
+                out->unop = u->op == parse::UnaryOp::Neg ? "Neg" : "Deref";
+                out->left = exp(*u->operand);
+                break;
+            }
+            case parse::ExpKind::BinOp: {
+                const auto* b = parse::as<parse::BinOpExp>(&e);
+                out->kind = Kind::BinOp;
+                out->binop = binops[static_cast<size_t>(b->op)];
+                out->left = exp(*b->left);
+                out->right = exp(*b->right);
+                break;
+            }
+            case parse::ExpKind::ArrayAccess: {
+                const auto* a = parse::as<parse::ArrayAccessExp>(&e);
+                out->kind = Kind::ArrayAccess;
+                out->array_ptr = exp(*a->ptr);
+                out->array_index = exp(*a->index);
+                break;
+            }
+            case parse::ExpKind::FieldAccess: {
+                const auto* f = parse::as<parse::FieldAccessExp>(&e);
+                out->kind = Kind::FieldAccess;
+                out->field_ptr = exp(*f->ptr);
+                out->field_name = f->field;
+                break;
+            }
+            case parse::ExpKind::Call: {
+                const auto* c = parse::as<parse::CallExp>(&e);
+                out->kind = Kind::Call;
+                out->callee = callee(*c->callee);
+                for (const parse::Exp* arg : c->args) out->args.push_back(exp(*arg));
+                break;
+            }
+        }
+        return out;
+    }
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::string filename, emit = "asm";
+    bool time = false;
+    size_t maxErrors = SIZE_MAX;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "-j" && a + 1 < argc) {
+            unsigned threads = std::max(1, atoi(argv[++a]));
+            lex::lexThreads = parse::checkThreads = lower::lowerThreads = threads;
+        }
+        else if (arg == "--max-errors" && a + 1 < argc) maxErrors = std::max(0, atoi(argv[++a]));
+        else if (arg == "--emit" && a + 1 < argc) emit = argv[++a];
+        else if (arg == "--time") time = true;
+        else if (filename.empty()) filename = arg;
+        else {
+            filename.clear(); // more than one input, print the usage
+            break;
+        }
+    }
+
+    if (filename.empty() || (emit != "asm" && emit != "ast" && emit != "ast-json" && emit != "lir" && emit != "lir-json")) {
+        std::cerr << "Usage: " << argv[0] << " [-j threads] [--max-errors N] [--emit asm|ast|ast-json|lir|lir-json] [--time] <file.cf>" << std::endl;
+        return 1;
+    }
+
+    int status = 0;
+    try {
+        std::string content;
+        {
+            metrics::Scope scope("read");
+            std::ifstream file(filename, std::ios::binary);
+            if (!file) throw std::runtime_error("Error opening file: " + filename);
+            content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+
+        std::vector<lex::Token> tokens;
+        lex::initialize_keywords();
+        lex::parallel_lexical_analysis(std::string_view(content), tokens);
+        metrics::counter("tokens") += tokens.size();
+
+        LexedTokenSource source(tokens);
+        parse::Parser parser(source);
+        std::unique_ptr<parse::Program> program = parser.parseProgram();
+
+        std::unordered_map<std::string, parse::Type*> gammaR0;
+        std::unordered_map<parse::StructId, std::unordered_map<std::string, parse::Type*>> delta;
+        parse::initialize_environment(*program, gammaR0, delta);
+        parse::type_check(*program, gammaR0, delta);
+
+        if (!parse::typeErrors.empty()) {
+            parse::reportTypeErrors(filename, maxErrors);
+            status = 1;
+        } else if (emit == "ast") {
+            metrics::Scope scope("printProgram");
+            parse::printProgram(*program);
+        } else if (emit == "ast-json") {
+            // A function's AST is written and dropped before the next is built: the whole AST of a large
+            // module takes several times the memory of its dump
+            metrics::Scope scope("outputASTJson");
+            AstBuilder builder;
+            lower::AstJsonWriter writer(builder.declarations(*program), std::cout);
+            for (const auto& func : program->functions) writer.function(builder.function(func));
+            writer.finish();
+        } else {
+            lower::AST::Program ast;
+            {
+                metrics::Scope scope("ast");
+                ast = AstBuilder().build(*program);
+            }
+            lower::LIR::Program lir;
+            lower::lowerProgram(ast, lir);
+            if (emit == "lir-json") {
+                lower::outputLIRJson(lir, std::cout);
+            } else if (emit == "lir") {
+                lower::outputLIR(lir);
+            } else {
+                codegen::LIRToX86CodeGenerator generator(lir);
+                std::cout << generator.generate() << std::endl;
+            }
+        }
+    } catch (const parse::TokenStreamError& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        status = 1;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        status = 1;
+    }
+
+    std::cout.flush();
+    if (time) metrics::report(std::cerr, false);
+    return status;
+}
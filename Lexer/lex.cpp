@@ -1,4 +1,14 @@
 #include<bits/stdc++.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define LEX_X86_KERNELS
+#endif
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#include"../Common/metrics.hpp"
+#include"../Common/parallel.hpp"
 using namespace std;
 
 /*
@@ -6,25 +16,36 @@ using namespace std;
 Global Variables
 
     - keywordTrie : a instance of keyword_Trie
-    - symbolTable : a instance of class Symbol_Table and object type data-structure
+    - SymbolTable : a instance of class Symbol_Table, the interned names of every identifier lexed so far
 
 
 Utils data-structures
 
     - keyword_node : a class data-type for keyword_Trie data-structure
     - keyword_Trie : a Trie data-structure to keywords
-    - Symbol_Table : a class type data-base to store real-time declared variables and provide them id
+    - Symbol_Table : interns identifier names, an arena-backed open-addressing hash of string_view to a dense 32-bit id
     - Token : a class to store string-type tokens
 
 
 Global Functions
 
     - lexical_analysis() : Lexically analyses a input-stream and returns a vectors of tokens 
+                           the file is read once into a single buffer and every recognizer works on a
+                           string_view of it, so tokens only carry a (offset, length) span into it
+    - dfa_lexical_analysis() : The same token stream from one compile-time DFA, one table lookup per byte
+    - stream_lexical_analysis() : The DFA a slice at a time, printing as it goes (text output that stays on one thread)
+    - parallel_lexical_analysis() : Splits large inputs into per-thread chunks at newlines, lexes them with the DFA and
+                                    stitches the chunks back in order, re-lexing where a chunk guessed its start wrong
+    - writeTokenStream() : lex -o <out> <file>, the tokens as a packed binary stream for the parser
+    - dumpTokenStream() : lex --dump <out>, a binary token stream printed back as text
+    - benchmark_lexers() : lex --bench <file>, MB/s of serial_lexical_analysis() against dfa_lexical_analysis()
+                           and parallel_lexical_analysis()
 
 
 Utils
 
-    - vector_to_string() : Functions to convert vector of character's to a string
+    - charAt() : Reads a character of the source view, '\0' past the end
+    - scanKernels : SSE2/AVX2/scalar kernels that skip whitespace, comment and identifier runs
 
 
 Serial lexical Analysis utils
@@ -41,91 +62,333 @@ Serial lexical Analysis utils
 */
 
 
-class identifier
+class Symbol_Table // interns identifier names : one copy of every name in an arena, a dense 32-bit id per name
 {
     public :
-    int id; // to store the id of the variable
-    string name; // to store the name of the variable
 
-    identifier() // a null identifier
+    static constexpr uint32_t NO_SYMBOL = 0; // ids start at 1
+
+    Symbol_Table()
     {
-        id=-1;
-        name="\0";
+        slots.assign(64, Slot{0, NO_SYMBOL});
+        names.push_back(string_view()); // id 0 is never handed out
     }
 
-    identifier(int id, string name)
+    uint32_t insert(string_view var) // the id of var, entering it on first sight
     {
-        this->id = id;
-        this->name = name;
-    }
-};
+        uint32_t h = hash(var);
+        size_t mask = slots.size() - 1;
 
-class Symbol_Table
-{
-    public :
+        for (size_t k = h & mask; ; k = (k + 1) & mask) // open addressing, linear probing
+        {
+            if (slots[k].id == NO_SYMBOL)
+            {
+                uint32_t id = names.size();
+                slots[k] = Slot{h, id};
+                names.push_back(store(var));
 
-    int current_size;
-    map<int,identifier> identifiers; // map with 'key : id' and 'value : identifier type object'
+                if (names.size() * 2 > slots.size()) // keep the table at most half full
+                    grow();
 
-    Symbol_Table()
-    {
-        current_size = 0; // no id's present at initialization
+                return id;
+            }
+
+            if (slots[k].hash == h && names[slots[k].id] == var)
+                return slots[k].id;
+        }
     }
 
-    int insert(string var) // returns valid 'integer' if insertions is successful, -1 if not successful
+    uint32_t find(string_view var) const // NO_SYMBOL if var was never entered
     {
-        bool allocate = true;
+        uint32_t h = hash(var);
+        size_t mask = slots.size() - 1;
 
-        // check if the variable is already declared of not, if not allocate position in map, if yes return -1
+        for (size_t k = h & mask; slots[k].id != NO_SYMBOL; k = (k + 1) & mask)
+            if (slots[k].hash == h && names[slots[k].id] == var)
+                return slots[k].id;
 
-        for(auto node : identifiers)
-        {
+        return NO_SYMBOL;
+    }
 
-            if(var.compare(node.second.name)==0) // using string::str.compare()
-            {allocate=false;break;}
-            
-        }
+    string_view name(uint32_t id) const { return names[id]; }
+
+    size_t size() const { return names.size() - 1; }
 
-        if(allocate==false)
-        return -1;
+    private :
 
-        int id = ++current_size;
+    struct Slot
+    {
+        uint32_t hash;
+        uint32_t id;
+    };
 
-        identifiers[id] = identifier(id,var);
+    static constexpr size_t ARENA_BLOCK = 64 * 1024;
 
-        return id;
+    vector<Slot> slots; // power of two long
+    vector<string_view> names; // id -> name, views into the arena
+    vector<unique_ptr<char[]>> arena; // blocks are never moved or freed while the table lives, so the views stay valid
+    char *arenaTop = nullptr;
+    size_t arenaLeft = 0;
+
+    static uint32_t hash(string_view var) // FNV-1a
+    {
+        uint32_t h = 2166136261u;
+        for (char c : var)
+            h = (h ^ (unsigned char)c) * 16777619u;
+        return h;
     }
 
-    void del(int id)
+    string_view store(string_view var)
     {
-        identifiers.erase(id);
+        if (var.length() > arenaLeft)
+        {
+            size_t block = max(ARENA_BLOCK, var.length());
+            arena.push_back(unique_ptr<char[]>(new char[block]));
+            arenaTop = arena.back().get();
+            arenaLeft = block;
+        }
+
+        memcpy(arenaTop, var.data(), var.length());
+        string_view stored(arenaTop, var.length());
+        arenaTop += var.length();
+        arenaLeft -= var.length();
+        return stored;
     }
 
-    void pop()
+    void grow()
     {
-        identifiers.erase(current_size);
-        current_size--;
+        vector<Slot> old(slots.size() * 2, Slot{0, NO_SYMBOL});
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+
+        for (const Slot &slot : old)
+        {
+            if (slot.id == NO_SYMBOL) continue;
+            size_t k = slot.hash & mask;
+            while (slots[k].id != NO_SYMBOL) k = (k + 1) & mask;
+            slots[k] = slot;
+        }
     }
 
 }SymbolTable;
 
-string vector_to_string(vector<char> str)
+// the recognizers look one past the end of the lexeme, std::string gave us a '\0' there for free, a string_view does not
+inline char charAt(string_view file_input, size_t pos)
+{
+    return pos < file_input.length() ? file_input[pos] : '\0';
+}
+
+/*
+
+Scanning kernels
+
+    Whitespace, comments and identifier runs are where lexing time goes, so those runs are not walked one
+    byte at a time : a kernel classifies 16 (SSE2) or 32 (AVX2) bytes at once and returns where the run ends.
+    selectScanKernels() picks the widest set the cpu supports (cpuid), the scalar set is the fallback and
+    also handles the tail of every vector loop.
+
+    - skipSpace() : first byte at or after pos that is not whitespace
+    - skipIdent() : first byte at or after pos that is not [a-zA-Z0-9]
+    - findNewline() : first '\n' at or after pos
+    - findCommentEnd() : index of the star that closes a c-comment, searching from pos
+
+    Every kernel returns n when the run reaches the end of the input.
+
+*/
+
+constexpr bool asciiIsSpace(int c) { return c==' ' || c=='\t' || c=='\n' || c=='\v' || c=='\f' || c=='\r'; }
+constexpr bool asciiIsDigit(int c) { return c>='0' && c<='9'; }
+constexpr bool asciiIsAlpha(int c) { return (c>='a' && c<='z') || (c>='A' && c<='Z'); }
+
+size_t scalarSkipSpace(const char* s, size_t pos, size_t n)
+{
+    while (pos < n && asciiIsSpace((unsigned char)s[pos])) pos++;
+    return pos;
+}
+
+size_t scalarSkipIdent(const char* s, size_t pos, size_t n)
+{
+    while (pos < n && (asciiIsAlpha((unsigned char)s[pos]) || asciiIsDigit((unsigned char)s[pos]))) pos++;
+    return pos;
+}
+
+size_t scalarFindNewline(const char* s, size_t pos, size_t n)
+{
+    while (pos < n && s[pos] != '\n') pos++;
+    return pos;
+}
+
+size_t scalarFindCommentEnd(const char* s, size_t pos, size_t n)
+{
+    for (; pos + 1 < n; pos++)
+        if (s[pos] == '*' && s[pos + 1] == '/') return pos;
+    return n;
+}
+
+#ifdef LEX_X86_KERNELS
+
+// byte lanes of v that lie in [lo, hi], unsigned
+__attribute__((target("sse2"))) inline __m128i sse2InRange(__m128i v, char lo, char hi)
+{
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(hi - lo)), d);
+}
+
+__attribute__((target("sse2"))) inline __m128i sse2IsSpace(__m128i v)
+{
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), sse2InRange(v, '\t', '\r'));
+}
+
+__attribute__((target("sse2"))) inline __m128i sse2IsAlnum(__m128i v)
+{
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20)); // folds A-Z onto a-z
+    return _mm_or_si128(sse2InRange(v, '0', '9'), sse2InRange(lower, 'a', 'z'));
+}
+
+__attribute__((target("sse2"))) size_t sse2SkipSpace(const char* s, size_t pos, size_t n)
+{
+    for (; pos + 16 <= n; pos += 16) {
+        unsigned mask = ~_mm_movemask_epi8(sse2IsSpace(_mm_loadu_si128((const __m128i*)(s + pos)))) & 0xFFFF;
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return scalarSkipSpace(s, pos, n);
+}
+
+__attribute__((target("sse2"))) size_t sse2SkipIdent(const char* s, size_t pos, size_t n)
+{
+    for (; pos + 16 <= n; pos += 16) {
+        unsigned mask = ~_mm_movemask_epi8(sse2IsAlnum(_mm_loadu_si128((const __m128i*)(s + pos)))) & 0xFFFF;
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return scalarSkipIdent(s, pos, n);
+}
+
+__attribute__((target("sse2"))) size_t sse2FindNewline(const char* s, size_t pos, size_t n)
+{
+    for (; pos + 16 <= n; pos += 16) {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s + pos)), _mm_set1_epi8('\n')));
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return scalarFindNewline(s, pos, n);
+}
+
+__attribute__((target("sse2"))) size_t sse2FindCommentEnd(const char* s, size_t pos, size_t n)
 {
-    string to_string(str.begin(),str.end());
+    for (; pos + 17 <= n; pos += 16) { // the '/' lanes are read one byte ahead
+        __m128i star = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s + pos)), _mm_set1_epi8('*'));
+        __m128i slash = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s + pos + 1)), _mm_set1_epi8('/'));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(star, slash));
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return scalarFindCommentEnd(s, pos, n);
+}
+
+__attribute__((target("avx2"))) inline __m256i avx2InRange(__m256i v, char lo, char hi)
+{
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(hi - lo)), d);
+}
 
-    return to_string;
+__attribute__((target("avx2"))) inline __m256i avx2IsSpace(__m256i v)
+{
+    return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), avx2InRange(v, '\t', '\r'));
 }
 
+__attribute__((target("avx2"))) inline __m256i avx2IsAlnum(__m256i v)
+{
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    return _mm256_or_si256(avx2InRange(v, '0', '9'), avx2InRange(lower, 'a', 'z'));
+}
+
+__attribute__((target("avx2"))) size_t avx2SkipSpace(const char* s, size_t pos, size_t n)
+{
+    for (; pos + 32 <= n; pos += 32) {
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(avx2IsSpace(_mm256_loadu_si256((const __m256i*)(s + pos))));
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper(); // the sse2 tail must not pay the avx/sse transition penalty
+    return sse2SkipSpace(s, pos, n);
+}
+
+__attribute__((target("avx2"))) size_t avx2SkipIdent(const char* s, size_t pos, size_t n)
+{
+    for (; pos + 32 <= n; pos += 32) {
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(avx2IsAlnum(_mm256_loadu_si256((const __m256i*)(s + pos))));
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return sse2SkipIdent(s, pos, n);
+}
+
+__attribute__((target("avx2"))) size_t avx2FindNewline(const char* s, size_t pos, size_t n)
+{
+    for (; pos + 32 <= n; pos += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + pos)), _mm256_set1_epi8('\n')));
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return sse2FindNewline(s, pos, n);
+}
+
+__attribute__((target("avx2"))) size_t avx2FindCommentEnd(const char* s, size_t pos, size_t n)
+{
+    for (; pos + 33 <= n; pos += 32) {
+        __m256i star = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + pos)), _mm256_set1_epi8('*'));
+        __m256i slash = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + pos + 1)), _mm256_set1_epi8('/'));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(star, slash));
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    _mm256_zeroupper();
+    return sse2FindCommentEnd(s, pos, n);
+}
+
+#endif
+
+struct ScanKernels
+{
+    const char* name;
+    size_t (*skipSpace)(const char* s, size_t pos, size_t n);
+    size_t (*skipIdent)(const char* s, size_t pos, size_t n);
+    size_t (*findNewline)(const char* s, size_t pos, size_t n);
+    size_t (*findCommentEnd)(const char* s, size_t pos, size_t n);
+};
+
+const ScanKernels scalarKernels = {"scalar", scalarSkipSpace, scalarSkipIdent, scalarFindNewline, scalarFindCommentEnd};
+#ifdef LEX_X86_KERNELS
+const ScanKernels sse2Kernels = {"sse2", sse2SkipSpace, sse2SkipIdent, sse2FindNewline, sse2FindCommentEnd};
+const ScanKernels avx2Kernels = {"avx2", avx2SkipSpace, avx2SkipIdent, avx2FindNewline, avx2FindCommentEnd};
+#endif
+
+// every kernel set this cpu can run, narrowest first
+vector<const ScanKernels*> supportedScanKernels()
+{
+    vector<const ScanKernels*> supported = {&scalarKernels};
+#ifdef LEX_X86_KERNELS
+    __builtin_cpu_init(); // we run from a static initializer, before main
+    if (__builtin_cpu_supports("sse2")) supported.push_back(&sse2Kernels);
+    if (__builtin_cpu_supports("avx2")) supported.push_back(&avx2Kernels);
+#endif
+    return supported;
+}
+
+const ScanKernels* scanKernels = supportedScanKernels().back();
+
+struct Span // where a lexeme sits in the source, 32 bits each so a token's position costs 8 bytes
+{
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
 class Token // class token to issue tokens - in this case RELOP tokens
 {
     public :
     string type;
     string t; // represents the token string for this simple operations
-    int startIndex; // Start index in the input string
-    int length; // Length of the lexeme
+    Span span; // the lexeme in the input string, empty for tokens the serial recognizers made without one
+    uint32_t symbol = Symbol_Table::NO_SYMBOL; // Id tokens : the interned name, later stages compare these instead of strings
 
     Token(string type, string lexeme, int startIndex, int length)
-        : t(type +'('+lexeme+')'), startIndex(startIndex), length(length) {}
+        : t(type +'('+lexeme+')'), span{(uint32_t)startIndex, (uint32_t)length} {}
 
 
     // Function to get a formatted string representation of the token
@@ -144,9 +407,19 @@ class Token // class token to issue tokens - in this case RELOP tokens
         t[0] = toupper(t[0]);
     }
 
-    Token(string token_type ,string token_value) //  name of the operator is provided ** Good for ->  or : or
+    Token(string token_type, int startIndex, int length) // keyword / operator token that also remembers where it came from
+        : Token(token_type)
     {
-        cout<<"printing a string: "<<token_value<<endl;
+        span = Span{(uint32_t)startIndex, (uint32_t)length};
+    }
+
+    // the lexeme is never copied out of the source, it is read back through the span
+    string_view lexeme(string_view file_input) const {
+        return file_input.substr(span.offset, span.length);
+    }
+
+    Token(string token_type ,string token_value) //  name of the operator is provided ** Good for ->  or : or
+    {                                            //  a fraction's line is printed with the token (see printToken)
         t = token_type + " , " + token_value;
     }
 
@@ -203,22 +476,20 @@ class keyword_Trie
             node->isTerminal = true; // Mark the end of a keyword
         }   
         
-        bool nfa(string file_input, vector<Token> &tokens,int &i)
+        bool nfa(string_view file_input, vector<Token> &tokens,int &i)
         {
             int pos = i;
             bool valid = false;
             bool loop = true;
             char data;
 
-            vector<char> word ;
-
             keyword_node *temp = root;
 
             while(loop)
             {
 
                 if(pos<=file_input.length())
-                data = file_input[pos];
+                data = charAt(file_input,pos);
                 else
                 {loop = false;data='\0';}
 
@@ -226,9 +497,7 @@ class keyword_Trie
                 if(temp->isTerminal && !isalnum(data))
                 {
                     valid=true;
-                    Token T ;
-                    T =  Token(vector_to_string(word));
-                    tokens.push_back(T);
+                    tokens.push_back(Token(string(file_input.substr(i,pos-i)),i,pos-i));
                     loop = false;
                 }
 
@@ -236,7 +505,6 @@ class keyword_Trie
                 {
                     temp = temp->dict[data];
                     pos++;
-                    word.push_back(data);
                 }
                 else
                 {
@@ -264,7 +532,7 @@ void initialize_keywords()
     }
 }
 
-bool getKeyword(string file_input, vector<Token> &tokens,int &i)
+bool getKeyword(string_view file_input, vector<Token> &tokens,int &i)
 {
     int pos = i;
 
@@ -274,7 +542,19 @@ bool getKeyword(string file_input, vector<Token> &tokens,int &i)
 }
 
 
-bool getVariable(string file_input, vector<Token> &tokens,int &i)
+Token identifierToken(string_view lexeme, int startIndex) // enters the lexeme into the Symbol Table and makes its token
+{
+    Token T("Id",string(lexeme),startIndex,lexeme.length());             // Token(string type, string lexeme, int startIndex, int length)
+    T.symbol = SymbolTable.insert(lexeme); // the same id every time the name comes back
+    return T;
+}
+
+void issueIdentifier(string_view lexeme, int startIndex, vector<Token> &tokens)
+{
+    tokens.push_back(identifierToken(lexeme, startIndex));
+}
+
+bool getVariable(string_view file_input, vector<Token> &tokens,int &i)
 {
 
     int pos = i;
@@ -283,8 +563,7 @@ bool getVariable(string file_input, vector<Token> &tokens,int &i)
 
     bool loop = true;
     bool valid = false;
-    string lexeme;
-    vector<char> var;
+    string_view lexeme;
 
     char c;
 
@@ -292,7 +571,7 @@ bool getVariable(string file_input, vector<Token> &tokens,int &i)
     {
 
         if(pos<=file_input.length())
-        c = file_input[pos];
+        c = charAt(file_input,pos);
         else
         {loop = false;c='\0';}
 
@@ -304,7 +583,6 @@ bool getVariable(string file_input, vector<Token> &tokens,int &i)
             case 0 : if(isalpha(c))
                     {
                         state=1;
-                        var.push_back(c);
                         pos++;
                     }
 
@@ -318,8 +596,7 @@ bool getVariable(string file_input, vector<Token> &tokens,int &i)
             case 1 : if(isalnum(c))
                     {
                         state=1;
-                        var.push_back(c);
-                        pos++;
+                        pos = scanKernels->skipIdent(file_input.data(), pos + 1, file_input.length()); // the rest of the run at once
                     }
 
                     else
@@ -338,20 +615,8 @@ bool getVariable(string file_input, vector<Token> &tokens,int &i)
                     - Enter this int Symbol Table
                     */
 
-                   lexeme = vector_to_string(var);
-                   int id = SymbolTable.insert(lexeme);
-
-
-                   if(id!=-1)
-                   {
-                       Token T("Id",lexeme,pos-lexeme.length(),lexeme.length());             // Token(string type, string lexeme, int startIndex, int length)
-                       tokens.push_back(T);
-                   }
-                   else
-                   {
-                       Token T;
-                       tokens.push_back(T); // it will return an un-identifiable Token found mean-while because token is already in symbol-table
-                   }
+                   lexeme = file_input.substr(i,pos-i); // a view into the source, no copy
+                   issueIdentifier(lexeme,i,tokens);
 
                     break;
         }
@@ -396,11 +661,11 @@ bool getNumber(string file_input, vector<Token>& tokens, int& i) {
 
 
 
-bool getArithmetic(string file_input, vector<Token> &tokens,int &i)
+bool getArithmetic(string_view file_input, vector<Token> &tokens,int &i)
 {
     bool valid = false;
 
-    char c = file_input[i];
+    char c = charAt(file_input,i);
 
     Token T;
 
@@ -437,11 +702,11 @@ bool getArithmetic(string file_input, vector<Token> &tokens,int &i)
     return valid;
 } 
 
-bool getParenthesis(string file_input, vector<Token> &tokens,int &i)
+bool getParenthesis(string_view file_input, vector<Token> &tokens,int &i)
 {
     bool valid = false;
 
-    char c = file_input[i];
+    char c = charAt(file_input,i);
 
     Token T;
 
@@ -528,18 +793,18 @@ bool getPunctuation(string file_input, vector<Token> &tokens,int &i)
 } */
 
 
-bool getPunctuation(string file_input, vector<Token> &tokens, int &i) {
-    map<char, string> punctuationMap = {
+bool getPunctuation(string_view file_input, vector<Token> &tokens, int &i) {
+    static const map<char, string> punctuationMap = {
         {':', "Colon"},
         {';', "Semicolon"},
         {',', "Comma"},
         // Add other punctuations as needed
     };
 
-    char currentChar = file_input[i];
+    char currentChar = charAt(file_input,i);
     auto it = punctuationMap.find(currentChar);
     if (it != punctuationMap.end()) {
-        tokens.push_back(Token(it->second));
+        tokens.push_back(Token(it->second, i, 1));
         i++;  // Move past the character
         return true;
     }
@@ -547,7 +812,7 @@ bool getPunctuation(string file_input, vector<Token> &tokens, int &i) {
 }
 
 
-bool getWhitespace(string file_input, vector<Token> &tokens,int &i)
+bool getWhitespace(string_view file_input, vector<Token> &tokens,int &i)
 {
     int pos = i;
 
@@ -561,7 +826,7 @@ bool getWhitespace(string file_input, vector<Token> &tokens,int &i)
     while(loop)
     {
         if(pos<=file_input.length())
-        c = file_input[pos];
+        c = charAt(file_input,pos);
         else
         {loop = false;c='\0';}
 
@@ -764,7 +1029,7 @@ bool getRelop(string file_input, vector<Token> &tokens,int &i)
 
 
 
-bool getNumber(string file_input, vector<Token> &tokens,int &i)
+bool getNumber(string_view file_input, vector<Token> &tokens,int &i)
 {
     int pos = i ; // saving the current position of the 'i' input stream pointer
 
@@ -773,15 +1038,14 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
     bool loop = true; // while we have to loop
     bool valid = false; // valid = True when something is found
 
-    vector<char> number_string;
-    string lexeme;
+    string_view lexeme; // the digits read so far are always file_input[i, pos-1)
 
     char c ;
 
     while(loop)
     {
         if(pos<=file_input.length())
-        c = file_input[pos];
+        c = charAt(file_input,pos);
         else
         {loop = false;c='\0';}
 
@@ -792,7 +1056,6 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
                 {
                     pos++;
                     state = 1;
-                    number_string.push_back(c);
                 }
 
                 else
@@ -808,21 +1071,18 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
                 {
                     pos++;
                     state = 1;
-                    number_string.push_back(c);
                 }
 
                 else if(c=='.')
                 {
                     pos++;
                     state = 3;
-                    number_string.push_back(c);
                 }
 
                 else if(c=='e')
                 {
                     pos++;
                     state = 6;
-                    number_string.push_back(c);
                 }
 
                 else
@@ -835,8 +1095,8 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
 
 
         case 2 :{ Token T; // put the number into the token
-                lexeme = vector_to_string(number_string);
-                T = Token("Num",lexeme,pos-lexeme.length(),lexeme.length());
+                lexeme = file_input.substr(i,pos-1-i);
+                T = Token("Num",string(lexeme),i,lexeme.length());
 
                 tokens.push_back(T);
 
@@ -851,7 +1111,6 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
                 {
                     pos++;
                     state = 4;
-                    number_string.push_back(c);
                 }
 
                 else
@@ -867,14 +1126,12 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
                 {
                     pos++;
                     state = 4;
-                    number_string.push_back(c);
                 }
 
                 else if(c=='e')
                 {
                     pos++;
                     state = 6;
-                    number_string.push_back(c);
                 }
 
                 else
@@ -888,7 +1145,9 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
 
         case 5 : { Token T; // put the number into the token
 
-                T = Token("NUM",vector_to_string(number_string));
+                lexeme = file_input.substr(i,pos-1-i);
+                T = Token("NUM",string(lexeme));
+                T.span = Span{(uint32_t)i, (uint32_t)lexeme.length()};
 
                 tokens.push_back(T);
 
@@ -903,14 +1162,12 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
                 {
                     pos++;
                     state = 8;
-                    number_string.push_back(c);
                 }
 
                 else if(c=='+' || c=='-')
                 {
                     pos++;
                     state = 7;
-                    number_string.push_back(c);
                 }
 
                 else
@@ -926,7 +1183,6 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
                 {
                     pos++;
                     state = 8;
-                    number_string.push_back(c);
                 }
 
                 else
@@ -942,7 +1198,6 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
                 {
                     pos++;
                     state = 8;
-                    number_string.push_back(c);
                 }
 
                 else
@@ -955,8 +1210,8 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
 
 
         case 9 : { Token T; // put the number into the token
-                lexeme = vector_to_string(number_string);
-                T = Token("Num",lexeme,pos-lexeme.length(),lexeme.length());
+                lexeme = file_input.substr(i,pos-1-i);
+                T = Token("Num",string(lexeme),i,lexeme.length());
 
                 tokens.push_back(T);
 
@@ -976,13 +1231,13 @@ bool getNumber(string file_input, vector<Token> &tokens,int &i)
     return valid; // either true or false
 } 
 
-bool getRelop(string file_input, vector<Token>& tokens, int& i) {
+bool getRelop(string_view file_input, vector<Token>& tokens, int& i) {
     int pos = i;
     bool matched = false;
 
     // Handle two-character relational operators first
     while (pos + 1 < file_input.length()) {
-        string twoCharOp = file_input.substr(pos, 2);
+        string_view twoCharOp = file_input.substr(pos, 2);
         if (twoCharOp == ">=" || twoCharOp == "==" || twoCharOp == "!=") {
             tokens.push_back(Token(twoCharOp == "!=" ? "NotEq" : (twoCharOp == "==" ? "Equal" : "Gte")));
             pos += 2;
@@ -1047,18 +1302,19 @@ bool getRelop(string file_input, vector<Token>& tokens, int& i) {
 
 
 
-bool skipComments(const string& file_input, int& i) {
+bool skipComments(string_view file_input, int& i) {
     if (i + 1 < file_input.length() && file_input[i] == '/') {
         if (file_input[i + 1] == '/') {
             // Skip C++ style comments
             i += 2; // Move past "//"
-            while (i < file_input.length() && file_input[i] != '\n') i++;
+            i = scanKernels->findNewline(file_input.data(), i, file_input.length());
             return true;
         } else if (file_input[i + 1] == '*') {
             // Skip C style comments
             i += 2; // Move past "/*"
-            while (i + 1 < file_input.length() && !(file_input[i] == '*' && file_input[i + 1] == '/')) i++;
-            if (i + 1 < file_input.length()) i += 2; // Move past "*/"
+            size_t end = scanKernels->findCommentEnd(file_input.data(), i, file_input.length());
+            if (end < file_input.length()) i = end + 2; // Move past "*/"
+            else i = max(i, (int)file_input.length() - 1); // unclosed, stop on the last character
             return true;
         }
     }
@@ -1066,37 +1322,32 @@ bool skipComments(const string& file_input, int& i) {
 }
 
 
-bool skipWhitespace(const string& file_input, int& i) {
-    bool found = false;
-    while (i < file_input.length() && isspace(file_input[i])) {
-        i++;
-        found = true;
-    }
+bool skipWhitespace(string_view file_input, int& i) {
+    int end = scanKernels->skipSpace(file_input.data(), i, file_input.length());
+    bool found = end > i;
+    i = end;
     return found;
 }
 
-void skipCppComment(const string& file_input, int& i) {
+void skipCppComment(string_view file_input, int& i) {
     // This function skips C++ style single line comments.
     if (i + 1 < file_input.length() && file_input[i] == '/' && file_input[i + 1] == '/') {
         i += 2; // Skip the "//"
-        while (i < file_input.length() && file_input[i] != '\n') {
-            i++; // Skip until the end of the line
-        }
+        i = scanKernels->findNewline(file_input.data(), i, file_input.length()); // Skip until the end of the line
     }
 }
 
-void skipCComment(const string& file_input, int& i) {
+void skipCComment(string_view file_input, int& i) {
     if (i + 1 < file_input.length() && file_input[i] == '/' && file_input[i + 1] == '*') {
         i += 2; // Skip the "/*"
-        while (i + 1 < file_input.length()) {
-            if (file_input[i] == '*' && file_input[i + 1] == '/') {
-                i += 2; // Skip the "*/"
-                return;  // Comment closed properly
-            }
-            i++;
+        size_t end = scanKernels->findCommentEnd(file_input.data(), i, file_input.length());
+        if (end < file_input.length()) {
+            i = end + 2; // Skip the "*/"
+            return;  // Comment closed properly
         }
-        // If the loop exits and no closing "*/" has been found, we are at the end of the file
+        // No closing "*/" has been found, we stop on the last character of the file
         // This handles unclosed comments by simply ending the parsing of this comment.
+        i = max(i, (int)file_input.length() - 1);
     }
 }
 
@@ -1108,8 +1359,8 @@ void skipCComment(const string& file_input, int& i) {
 
 
 
-bool getOperatorsAndSpecialChars(string file_input, vector<Token>& tokens, int& i) {
-    static map<string, string> operatorsMap = {
+bool getOperatorsAndSpecialChars(string_view file_input, vector<Token>& tokens, int& i) {
+    static const map<string, string, less<>> operatorsMap = { // less<> lets us look up string_view keys without building a string
         {":", "Colon"}, {"->", "Arrow"}, {"<", "Lt"}, {"<=", "Lte"}, {"==", "Equal"}, {"!=", "NotEq"},
         {">", "Gt"}, {">=", "Gte"}, {"=", "Gets"}, {"+", "Plus"}, {"-", "Dash"},
         {"*", "Star"}, {"/", "Slash"}, {"(", "OpenParen"}, {")", "CloseParen"},
@@ -1124,18 +1375,20 @@ bool getOperatorsAndSpecialChars(string file_input, vector<Token>& tokens, int&
             if (skipComments(file_input, i)) return true; // Skip the entire comment
         }
 
-        string longestMatch;
+        auto longestMatch = operatorsMap.end();
+        int matchLength = 0;
         for (int len = min((size_t)3, file_input.length() - i); len > 0; len--) {
-            string sub = file_input.substr(i, len);
-            if (operatorsMap.find(sub) != operatorsMap.end()) {
-                longestMatch = sub;
+            auto it = operatorsMap.find(file_input.substr(i, len));
+            if (it != operatorsMap.end()) {
+                longestMatch = it;
+                matchLength = len;
                 break;
             }
         }
         
-        if (!longestMatch.empty()) {
-            tokens.push_back(Token(operatorsMap[longestMatch]));
-            i += longestMatch.length();
+        if (longestMatch != operatorsMap.end()) {
+            tokens.push_back(Token(longestMatch->second, i, matchLength));
+            i += matchLength;
             found = true;
         } else {
             break; // No more operators at this point
@@ -1146,7 +1399,7 @@ bool getOperatorsAndSpecialChars(string file_input, vector<Token>& tokens, int&
 }
 
 
-void serial_lexical_analysis(const string& file_input, vector<Token>& tokens) {
+void serial_lexical_analysis(string_view file_input, vector<Token>& tokens) {
     int i = 0; // index where the file pointer is at the start
 
     while (i < file_input.length()) {
@@ -1172,133 +1425,680 @@ void serial_lexical_analysis(const string& file_input, vector<Token>& tokens) {
 
         // If no recognized token is found
         if (i < file_input.length()) {
-            tokens.push_back(Token("Error"));
+            tokens.push_back(Token("Error", i, 1));
             i++; // Increment to avoid getting stuck on the same character
         }
     }
 }
 
 
+/*
+
+DFA lexical analysis
+
+    One deterministic automaton, built at compile time, that recognizes whitespace, comments, keywords,
+    identifiers, numbers, operators and punctuation in a single pass with one table lookup per byte.
+    It reproduces serial_lexical_analysis() token for token, including its quirks :
 
-void parallel_lexical_analysis(string file_input, vector<Token> &tokens)
+    - a lexeme is never backtracked, if the automaton dies in a non-accepting state (e.g. "12." or "!")
+      one Error token is issued for the first character, exactly like the recognizer cascade
+    - keywords are threaded through the identifier states, so "if" is If and "ifx" is Id(ifx)
+    - an unclosed c-comment swallows everything but the last character of the file
+
+*/
+
+const int DFA_STATES = 128;
+const uint8_t DFA_DEAD = 0;
+const uint8_t DFA_START = 1;
+
+enum DfaAccept : uint8_t
 {
-    int i = 0; // index where the file pointer is at the start - acts like string pointer
+    ACCEPT_NONE, // not a token, issue an Error
+    ACCEPT_SKIP, // whitespace or a closed comment
+    ACCEPT_UNCLOSED_COMMENT,
+    ACCEPT_ID,
+    ACCEPT_KEYWORD,
+    ACCEPT_NUM,
+    ACCEPT_NUM_FRACTION, // "1.5", issued the way getNumber() issues it
+    ACCEPT_NAMED // operators and punctuation, the token is the state's name
+};
 
-    while(file_input[i]!='\0' && i<=file_input.length()) // till the input stream does not end
-    {
-        int final_pos[8] = {0,0,0,0,0,0,0,0}; // Order : keyword, Variable, Number, Relop, Arithmetic, Parenthesis, Punctuation, Whitespace
+enum DfaRun : uint8_t
+{
+    RUN_NONE,
+    RUN_SPACE, // the rest of the lexeme is handed to a scan kernel
+    RUN_IDENT,
+    RUN_LINE_COMMENT,
+    RUN_BLOCK_COMMENT
+};
 
-        vector<Token> temp_tokens; // will be deleted as the loop iterates
+struct DfaTables
+{
+    uint8_t next[DFA_STATES][256]; // next[state][byte], 0 is the dead state
+    uint8_t accept[DFA_STATES];
+    uint8_t run[DFA_STATES];
+    const char* name[DFA_STATES];
+    int count;
+};
 
-        for(int k=0;k<8;k++)
-        {
-            final_pos[k] = i;
+constexpr int dfaNewState(DfaTables &t, uint8_t accept, const char* name = nullptr)
+{
+    int s = t.count++;
+    t.accept[s] = accept;
+    t.name[s] = name;
+    return s;
+}
 
-            switch(k)
+constexpr DfaTables buildLexerDfa()
+{
+    DfaTables t{};
+
+    dfaNewState(t, ACCEPT_NONE); // DFA_DEAD, every transition we don't set leads here
+    dfaNewState(t, ACCEPT_NONE); // DFA_START
+
+    // whitespace = (' ' | '\t' | '\n' | '\r')+
+    int ws = dfaNewState(t, ACCEPT_SKIP);
+    t.run[ws] = RUN_SPACE;
+    for(int c=0;c<256;c++)
+        if(asciiIsSpace(c))
+            t.next[DFA_START][c] = t.next[ws][c] = ws;
+
+    // Id = [a-zA-Z][a-zA-Z0-9]*
+    int id = dfaNewState(t, ACCEPT_ID);
+    t.run[id] = RUN_IDENT; // keyword prefixes are walked byte by byte, plain identifiers are not
+    for(int c=0;c<256;c++)
+    {
+        if(asciiIsAlpha(c))
+            t.next[DFA_START][c] = id;
+        if(asciiIsAlpha(c) || asciiIsDigit(c))
+            t.next[id][c] = id;
+    }
+
+    // keywords, a trie laid over the identifier states : leaving the trie falls back to a plain Id
+    const char* keywords[] = {"int", "struct", "nil", "if", "else", "while", "break", "continue", "return", "new", "let", "extern", "fn"};
+    for(const char* keyword : keywords)
+    {
+        int s = DFA_START;
+        for(const char* ch = keyword; *ch; ch++)
+        {
+            int c = (unsigned char)*ch;
+            if(t.next[s][c] == id)
             {
-                case 0 : getKeyword(file_input,temp_tokens,final_pos[0]); break;
+                int n = dfaNewState(t, ACCEPT_ID);
+                for(int k=0;k<256;k++)
+                    t.next[n][k] = t.next[id][k];
+                t.next[s][c] = n;
+            }
+            s = t.next[s][c];
+        }
+        t.accept[s] = ACCEPT_KEYWORD;
+        t.name[s] = keyword;
+    }
 
-                case 1 : getVariable(file_input,temp_tokens,final_pos[1]); break;
+    // Num = [0-9]+ with the optional fraction and exponent getNumber() also accepts
+    int numInt = dfaNewState(t, ACCEPT_NUM);
+    int numDot = dfaNewState(t, ACCEPT_NONE);
+    int numFrac = dfaNewState(t, ACCEPT_NUM_FRACTION);
+    int numE = dfaNewState(t, ACCEPT_NONE);
+    int numSign = dfaNewState(t, ACCEPT_NONE);
+    int numExp = dfaNewState(t, ACCEPT_NUM);
+    for(int c='0';c<='9';c++)
+    {
+        t.next[DFA_START][c] = t.next[numInt][c] = numInt;
+        t.next[numDot][c] = t.next[numFrac][c] = numFrac;
+        t.next[numE][c] = t.next[numSign][c] = t.next[numExp][c] = numExp;
+    }
+    t.next[numInt]['.'] = numDot;
+    t.next[numInt]['e'] = t.next[numFrac]['e'] = numE;
+    t.next[numE]['+'] = t.next[numE]['-'] = numSign;
+
+    // operators and punctuation, single characters first so the two character ones can extend them
+    const char* operators[][2] = {
+        {":", "Colon"}, {";", "Semicolon"}, {",", "Comma"}, {"<", "Lt"}, {">", "Gt"}, {"=", "Gets"}, {"+", "Plus"},
+        {"-", "Dash"}, {"*", "Star"}, {"/", "Slash"}, {"(", "OpenParen"}, {")", "CloseParen"}, {"{", "OpenBrace"},
+        {"}", "CloseBrace"}, {"[", "OpenBracket"}, {"]", "CloseBracket"}, {"&", "Address"}, {".", "Dot"}, {"_", "Underscore"},
+        {"->", "Arrow"}, {"<=", "Lte"}, {"==", "Equal"}, {"!=", "NotEq"}, {">=", "Gte"}
+    };
+    for(const auto &op : operators)
+    {
+        int c0 = (unsigned char)op[0][0];
+        int c1 = (unsigned char)op[0][1];
+        if(c1 == 0)
+        {
+            t.next[DFA_START][c0] = dfaNewState(t, ACCEPT_NAMED, op[1]);
+            continue;
+        }
+        if(t.next[DFA_START][c0] == DFA_DEAD) // '!' is only ever the first half of "!="
+            t.next[DFA_START][c0] = dfaNewState(t, ACCEPT_NONE);
+        t.next[t.next[DFA_START][c0]][c1] = dfaNewState(t, ACCEPT_NAMED, op[1]);
+    }
 
-                case 2 : getNumber(file_input,temp_tokens,final_pos[2]); break;
+    // c++-comment = //[^'\n']*  and  c-comment = /*([^*]|*⋆[^*/])⋆*+/
+    int slash = t.next[DFA_START]['/'];
+    int line = dfaNewState(t, ACCEPT_SKIP);
+    int block = dfaNewState(t, ACCEPT_UNCLOSED_COMMENT);
+    int blockStar = dfaNewState(t, ACCEPT_UNCLOSED_COMMENT);
+    int blockEnd = dfaNewState(t, ACCEPT_SKIP);
+    t.run[line] = RUN_LINE_COMMENT;
+    t.run[block] = RUN_BLOCK_COMMENT;
+    t.next[slash]['/'] = line;
+    t.next[slash]['*'] = block;
+    for(int c=0;c<256;c++)
+    {
+        if(c != '\n')
+            t.next[line][c] = line;
+        t.next[block][c] = block;
+        t.next[blockStar][c] = block;
+    }
+    t.next[block]['*'] = t.next[blockStar]['*'] = blockStar;
+    t.next[blockStar]['/'] = blockEnd;
 
-                case 3 : getRelop(file_input,temp_tokens,final_pos[3]); break;
+    return t;
+}
 
-                case 4 : getArithmetic(file_input,temp_tokens,final_pos[4]); break;
+constexpr DfaTables lexerDfa = buildLexerDfa();
+static_assert(lexerDfa.count <= DFA_STATES, "the lexer DFA outgrew DFA_STATES");
 
-                case 5 : getParenthesis(file_input,temp_tokens,final_pos[5]); break;
+// a token whose text is only settled once everything before it has been issued, an Id
+Token pendingToken(string type, int startIndex, int length)
+{
+    Token T;
+    T.type = type;
+    T.span = Span{(uint32_t)startIndex, (uint32_t)length};
+    return T;
+}
 
-                case 6 : getPunctuation(file_input,temp_tokens,final_pos[6]); break;
+// lexes from begin until the first lexeme that starts at or after end, returns that position
+// with deferred set, identifiers are left pending (see finishDeferredTokens) so the symbol table is not touched
+int dfa_lex_range(string_view file_input, int begin, int end, vector<Token>& tokens, bool deferred)
+{
+    const int n = file_input.length();
+    int i = begin;
+
+    while (i < n && i < end) {
+        uint8_t state = DFA_START;
+        int pos = i;
+
+        // maximal munch, one table lookup per byte, except inside runs the scan kernels skip in one go
+        while (pos < n) {
+            uint8_t next = lexerDfa.next[state][(unsigned char)file_input[pos]];
+            if (next == DFA_DEAD) break;
+            state = next;
+            pos++;
 
-                case 7 : getWhitespace(file_input,temp_tokens,final_pos[7]); break;
+            switch (lexerDfa.run[state]) {
+                case RUN_SPACE: pos = scanKernels->skipSpace(file_input.data(), pos, n); break;
+                case RUN_IDENT: pos = scanKernels->skipIdent(file_input.data(), pos, n); break;
+                case RUN_LINE_COMMENT: pos = scanKernels->findNewline(file_input.data(), pos, n); break;
+                case RUN_BLOCK_COMMENT: pos = scanKernels->findCommentEnd(file_input.data(), pos, n); break; // the table finishes the "*/"
+                default: break;
             }
         }
 
+        string_view lexeme = file_input.substr(i, pos - i);
 
-        // see what to call finally
+        switch (lexerDfa.accept[state]) {
+            case ACCEPT_SKIP:
+                i = pos;
+                break;
 
-        int max_index = -1;
-        int max_pos = i;
+            case ACCEPT_UNCLOSED_COMMENT: // skipCComment() stops one short of the end of the file
+                i = max(i + 2, n - 1);
+                break;
 
+            case ACCEPT_ID:
+                if (deferred)
+                    tokens.push_back(pendingToken("Id", i, lexeme.length()));
+                else
+                    issueIdentifier(lexeme, i, tokens);
+                i = pos;
+                break;
 
-        for(int k=0;k<8;k++)
-        {
-            if(final_pos[k]>max_pos)
-            {
-                max_index = k;
-                max_pos = final_pos[k];
+            case ACCEPT_KEYWORD:
+            case ACCEPT_NAMED:
+                tokens.push_back(Token(lexerDfa.name[state], i, pos - i));
+                i = pos;
+                break;
+
+            case ACCEPT_NUM:
+                tokens.push_back(Token("Num", string(lexeme), i, lexeme.length()));
+                i = pos;
+                break;
+
+            case ACCEPT_NUM_FRACTION: {
+                Token T("NUM", string(lexeme));
+                T.span = Span{(uint32_t)i, (uint32_t)lexeme.length()};
+                tokens.push_back(T);
+                i = pos;
+                break;
             }
+
+            default: // no token, skip one character
+                tokens.push_back(Token("Error", i, 1));
+                i++;
+                break;
         }
+    }
 
+    return i;
+}
 
-        if(max_index == -1) // i.e no token is issued
-        {
-            Token T; // not an identifiabel token
-            tokens.push_back(T);
-            i++; // increment i
+void dfa_lexical_analysis(string_view file_input, vector<Token>& tokens)
+{
+    dfa_lex_range(file_input, 0, file_input.length(), tokens, false);
+}
+
+// one line of the text listing. A fraction's token is preceded by the "printing a string" line the lexer has
+// always printed for it, here rather than where the token is made, so every mode prints it in the same place
+void printToken(ostream &out, const Token &T)
+{
+    if (T.t.compare(0, 6, "NUM , ") == 0)
+        out << "printing a string: " << string_view(T.t).substr(6) << '\n';
+    out << T.t << '\n';
+}
+
+const int STREAM_SLICE = 64 * 1024;
+
+// prints the tokens a slice of the input at a time, so only one slice of tokens is ever held and a parser
+// reading the pipe starts before the lexer is done
+void stream_lexical_analysis(string_view file_input, ostream &out)
+{
+    metrics::Scope scope("lex");
+    vector<Token> tokens;
+    for (int i = 0; i < (int)file_input.length(); ) {
+        i = dfa_lex_range(file_input, i, i + STREAM_SLICE, tokens, false);
+        for (const Token &T : tokens)
+            printToken(out, T);
+        tokens.clear();
+    }
+    out.flush();
+}
+
+// settles the pending tokens of dfa_lex_range(..., deferred) in source order, so the symbol table sees
+// exactly what the serial path does
+void finishDeferredTokens(string_view file_input, vector<Token> &tokens)
+{
+    for (Token &T : tokens) {
+        if (T.type == "Id")
+            T = identifierToken(T.lexeme(file_input), T.span.offset);
+    }
+}
+
+const int PARALLEL_MIN_CHUNK = 256 * 1024; // below this a thread costs more than it lexes
+unsigned lexThreads = parallel::hardwareThreads();
+
+int parallelChunks(size_t n) // how many threads parallel_lexical_analysis() splits n bytes over, below 2 it stays serial
+{
+    return parallel::threadsFor(lexThreads, n, PARALLEL_MIN_CHUNK);
+}
+
+void parallel_lexical_analysis(string_view file_input, vector<Token> &tokens)
+{
+    metrics::Scope scope("lex");
+    const int n = file_input.length();
+    const int threads = parallelChunks(n);
+
+    if (threads < 2) {
+        dfa_lexical_analysis(file_input, tokens);
+        return;
+    }
+
+    // every chunk speculatively starts right after a newline, which is a token boundary unless it sits in a c-comment
+    vector<int> start(threads + 1, n);
+    start[0] = 0;
+    for (int j = 1; j < threads; j++) {
+        size_t nl = file_input.find('\n', (size_t)((long long)n * j / threads));
+        start[j] = nl == string_view::npos ? n : max<int>(start[j - 1], nl + 1);
+    }
+
+    vector<vector<Token>> parts(threads);
+    vector<int> stop(threads);
+    parallel::forEach(threads, threads, [&](size_t j) { stop[j] = dfa_lex_range(file_input, start[j], start[j + 1], parts[j], true); });
+
+    // stitch : pos is where the serial lexer would be. A chunk's tokens are taken from the first one that starts
+    // exactly at pos, the lexer state is nothing but the position so from there on both runs agree. Until then
+    // (a comment or a long lexeme crossed the chunk edge) the true path is re-lexed one lexeme at a time.
+    tokens.reserve(tokens.size() + accumulate(parts.begin(), parts.end(), (size_t)0,
+                                              [](size_t sum, const vector<Token> &part) { return sum + part.size(); }));
+    int pos = 0;
+    for (int j = 0; j < threads; j++) {
+        vector<Token> &part = parts[j];
+        size_t k = 0;
+
+        while (pos < stop[j]) {
+            while (k < part.size() && (int)part[k].span.offset < pos) k++;
+
+            if (pos == start[j] || (k < part.size() && (int)part[k].span.offset == pos)) {
+                tokens.insert(tokens.end(), make_move_iterator(part.begin() + k), make_move_iterator(part.end()));
+                pos = stop[j];
+                break;
+            }
+
+            pos = dfa_lex_range(file_input, pos, pos + 1, tokens, true); // resync pass
         }
-        else
-        {
+    }
 
-            // A Token will surely be issued
+    finishDeferredTokens(file_input, tokens);
+}
 
-            // correcting the Symbol Table
+/*
 
-            if(final_pos[1]>i)
-            SymbolTable.pop(); // popping the identifier if issued from the symbol table
+Binary token stream
 
-            // Now issuing the original token by using the max_index
+    lex -o <out> <file> writes the tokens in a packed form the parser maps straight into memory, instead of
+    the one-token-per-line text it has to re-parse. lex --dump <out> prints a stream back as text.
 
-            switch(max_index)
-            {
-                case 0 : getKeyword(file_input,tokens,i); break;
+    - "CFTK", a version byte, a flags byte (TOKEN_STREAM_SPANS)
+    - varint count, then that many (varint length, bytes) strings : SymbolTable names first, so symbol id k is string k
+    - varint count, then that many tokens : a type byte, its payload, and with TOKEN_STREAM_SPANS a varint start
+      (delta from the previous token's start) and a varint length
+        Id      : varint symbol id
+        Num     : varint value, when the lexeme is plain decimal that fits 64 bits
+        NumText : varint string id, any other Num lexeme
+        Raw     : varint string id, a text token the parser has no type for (Error, a fraction)
+        others  : no payload
 
-                case 1 : getVariable(file_input,tokens,i);break;
+    The type byte is the parser's TokenType (Parse/parser.cpp), both files have to list them in the same order.
+    Varints are unsigned LEB128.
 
-                case 2 : getNumber(file_input,tokens,i); break;
+*/
 
-                case 3 : getRelop(file_input,tokens,i); break;
+const char* tokenStreamTypes[] = {
+    "Fn", "Id", "OpenParen", "CloseParen", "Arrow", "Int", "OpenBrace", "CloseBrace", "Semicolon",
+    "Let", "Struct", "Colon", "Comma", "Return", "Num", "Nil", "If", "Else", "While", "Break", "Continue",
+    "Gets", "Star", "Address", "Plus", "Dash", "Equal", "NotEq", "Lt", "Lte", "Gt", "Gte", "Dot", "New", "Extern",
+    "Underscore", "OpenBracket", "CloseBracket", "Slash"
+};
 
-                case 4 : getArithmetic(file_input,tokens,i); break;
+const uint8_t TOKEN_STREAM_VERSION = 1;
+const uint8_t TOKEN_STREAM_SPANS = 1;
+const uint8_t TOKEN_ID = 1, TOKEN_NUM = 14, TOKEN_NUM_TEXT = 0xFE, TOKEN_RAW = 0xFF;
 
-                case 5 : getParenthesis(file_input,tokens,i); break;
+static_assert(sizeof(tokenStreamTypes) / sizeof(tokenStreamTypes[0]) == 39, "one name per parser TokenType");
 
-                case 6 : getPunctuation(file_input,tokens,i); break;
+void putVarint(string &out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
 
-                case 7 : getWhitespace(file_input,tokens,i); break;
+bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+bool plainDecimal(string_view lexeme) // round-trips through a uint64 varint
+{
+    return !lexeme.empty() && lexeme.length() <= 19 && (lexeme[0] != '0' || lexeme.length() == 1)
+        && all_of(lexeme.begin(), lexeme.end(), asciiIsDigit);
+}
+
+bool writeTokenStream(const char *filename, string_view file_input, const vector<Token> &tokens, bool spans)
+{
+    static const unordered_map<string_view, uint8_t> types = [] {
+        unordered_map<string_view, uint8_t> m;
+        for (uint8_t k = 0; k < sizeof(tokenStreamTypes) / sizeof(tokenStreamTypes[0]); k++)
+            m[tokenStreamTypes[k]] = k;
+        return m;
+    }();
+
+    vector<string_view> strings;
+    for (size_t id = 1; id <= SymbolTable.size(); id++)
+        strings.push_back(SymbolTable.name(id));
+
+    string body;
+    body.reserve(tokens.size() * (spans ? 5 : 2));
+    uint32_t previousStart = 0;
+
+    for (const Token &T : tokens) {
+        if (T.symbol != Symbol_Table::NO_SYMBOL) {
+            body.push_back(TOKEN_ID);
+            putVarint(body, T.symbol);
+        }
+        else if (T.t.compare(0, 4, "Num(") == 0) {
+            string_view lexeme = string_view(T.t).substr(4, T.t.length() - 5);
+            if (plainDecimal(lexeme)) {
+                body.push_back(TOKEN_NUM);
+                putVarint(body, stoull(string(lexeme)));
+            }
+            else {
+                body.push_back(TOKEN_NUM_TEXT);
+                putVarint(body, strings.size() + 1);
+                strings.push_back(lexeme);
+            }
+        }
+        else {
+            auto it = types.find(T.t);
+            if (it != types.end())
+                body.push_back(it->second);
+            else {
+                body.push_back(TOKEN_RAW);
+                putVarint(body, strings.size() + 1);
+                strings.push_back(T.t);
             }
+        }
 
+        if (spans) {
+            uint32_t start = max(T.span.offset, previousStart); // tokens come in source order, unplaced ones repeat the last start
+            putVarint(body, start - previousStart);
+            putVarint(body, T.span.length);
+            previousStart = start;
         }
-        
     }
 
+    string head = "CFTK";
+    head.push_back(TOKEN_STREAM_VERSION);
+    head.push_back(spans ? TOKEN_STREAM_SPANS : 0);
+    putVarint(head, strings.size());
+    for (string_view str : strings) {
+        putVarint(head, str.length());
+        head.append(str);
+    }
+    putVarint(head, tokens.size());
+
+    FILE *out = fopen(filename, "wb");
+    if (out == nullptr) return false;
+    bool ok = fwrite(head.data(), 1, head.size(), out) == head.size()
+           && fwrite(body.data(), 1, body.size(), out) == body.size();
+    return fclose(out) == 0 && ok;
 }
 
+// lex --dump <out> : a token stream back in the text form, through an mmap of the file
+bool dumpTokenStream(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+
+    const uint8_t *p = (const uint8_t *)mapped, *end = p + st.st_size;
+    bool ok = st.st_size >= 6 && memcmp(p, "CFTK", 4) == 0 && p[4] == TOKEN_STREAM_VERSION;
+    bool spans = ok && (p[5] & TOKEN_STREAM_SPANS);
+    p += 6;
+
+    vector<string_view> strings(1);
+    uint64_t count = 0, len = 0, v = 0;
+    ok = ok && getVarint(p, end, count);
+    for (uint64_t k = 0; ok && k < count; k++) {
+        ok = getVarint(p, end, len) && len <= (uint64_t)(end - p);
+        if (ok) {
+            strings.push_back(string_view((const char *)p, len));
+            p += len;
+        }
+    }
+
+    ok = ok && getVarint(p, end, count);
+    string text;
+    for (uint64_t k = 0; ok && k < count; k++) {
+        ok = p < end;
+        if (!ok) break;
+        uint8_t type = *p++;
+
+        if (type == TOKEN_ID || type == TOKEN_NUM_TEXT || type == TOKEN_RAW) {
+            ok = getVarint(p, end, v) && v >= 1 && v < strings.size();
+            if (!ok) break;
+            if (type == TOKEN_RAW) text.append(strings[v]);
+            else text.append(type == TOKEN_ID ? "Id(" : "Num(").append(strings[v]).append(")");
+        }
+        else if (type == TOKEN_NUM) {
+            ok = getVarint(p, end, v);
+            text.append("Num(").append(to_string(v)).append(")");
+        }
+        else {
+            ok = type < sizeof(tokenStreamTypes) / sizeof(tokenStreamTypes[0]);
+            if (ok) text.append(tokenStreamTypes[type]);
+        }
+        text.push_back('\n');
+
+        if (ok && spans)
+            ok = getVarint(p, end, v) && getVarint(p, end, v);
+    }
+
+    munmap(mapped, st.st_size);
+    if (ok) cout << text;
+    return ok;
+}
+
+// lex --bench <file> : MB/s of the recognizer cascade against the DFA, once per scan kernel set, then the chunked lexer
+void benchmark_lexers(string_view content)
+{
+    using clock = chrono::steady_clock;
+
+    auto run = [&](const char* label, void (*lexer)(string_view, vector<Token>&), vector<Token> &tokens) {
+        int reps = 0;
+        double seconds = 0;
+        while (reps < 3 || seconds < 1.0) {
+            tokens.clear();
+            SymbolTable = Symbol_Table(); // identifiers must be fresh for every run
+            auto start = clock::now();
+            lexer(content, tokens);
+            seconds += chrono::duration<double>(clock::now() - start).count();
+            reps++;
+        }
+        double mb = content.length() / (1024.0 * 1024.0);
+        cerr << label << " : " << tokens.size() << " tokens, " << reps << " runs, "
+             << fixed << setprecision(2) << (mb * reps / seconds) << " MB/s" << endl;
+    };
+
+    const ScanKernels* selected = scanKernels;
+    vector<Token> serialTokens, dfaTokens;
+    run("serial", serial_lexical_analysis, serialTokens);
+
+    for (const ScanKernels* kernels : supportedScanKernels()) {
+        scanKernels = kernels;
+        string label = string("dfa/") + kernels->name;
+        run(label.c_str(), dfa_lexical_analysis, dfaTokens);
+
+        bool same = serialTokens.size() == dfaTokens.size();
+        for (size_t k = 0; same && k < serialTokens.size(); k++)
+            same = serialTokens[k].t == dfaTokens[k].t;
+        cerr << (same ? "  token streams match" : "  token streams DIFFER") << endl;
+    }
+    scanKernels = selected;
+
+    // the chunked lexer at 2, 4, ... threads, up to lex -j N (default: every core)
+    unsigned threads = lexThreads;
+    vector<Token> parallelTokens;
+    for (lexThreads = 2; ; lexThreads = min(lexThreads * 2, threads)) {
+        string label = "parallel/" + to_string(lexThreads);
+        run(label.c_str(), parallel_lexical_analysis, parallelTokens);
+
+        bool same = dfaTokens.size() == parallelTokens.size();
+        for (size_t k = 0; same && k < dfaTokens.size(); k++)
+            same = dfaTokens[k].t == parallelTokens[k].t;
+        cerr << (same ? "  token streams match" : "  token streams DIFFER") << endl;
+
+        if (lexThreads >= threads) break;
+    }
+    lexThreads = threads;
+}
+
+
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <filename>" << std::endl;
+    bool bench = false, dump = false, spans = true;
+    const char* filename = nullptr;
+    const char* output = nullptr; // binary token stream, text on stdout when not given
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        if (arg == "--bench") bench = true;
+        else if (arg == "--dump") dump = true;
+        else if (arg == "--no-spans") spans = false; // smaller stream, but the parser cannot place its errors
+        else if (arg == "-j" && a + 1 < argc) lexThreads = max(1, atoi(argv[++a]));
+        else if (arg == "-o" && a + 1 < argc) output = argv[++a];
+        else filename = argv[a];
+    }
+
+    if (filename == nullptr) {
+        std::cerr << "Usage: " << argv[0] << " [--bench] [-j threads] [-o tokens [--no-spans]] <filename>" << std::endl;
+        std::cerr << "       " << argv[0] << " --dump <tokens>" << std::endl;
         return 1;
     }
 
-    ifstream file(argv[1]);
+    if (dump) {
+        if (!dumpTokenStream(filename)) {
+            std::cerr << "Error reading token stream: " << filename << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    ifstream file(filename);
     if (!file.is_open()) {
-        std::cerr << "Error opening file: " << argv[1] << std::endl;
+        std::cerr << "Error opening file: " << filename << std::endl;
         return 1;
     }
 
-    // Read the entire content of the file into a single string
-    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    // Read the entire content of the file into a single buffer, the lexer only ever looks at it through a string_view
+    file.seekg(0, ios::end);
+    std::string content(file.tellg(), '\0');
+    file.seekg(0, ios::beg);
+    file.read(&content[0], content.size());
     file.close();
 
     // Initialize necessary structures
     initialize_keywords();  
 
+    if (bench) {
+        benchmark_lexers(content);
+        return 0;
+    }
+
+    if (output == nullptr && parallelChunks(content.length()) < 2) {
+        stream_lexical_analysis(content, std::cout);
+        return 0;
+    }
+
     vector<Token> tokens;
-    serial_lexical_analysis(content, tokens);  // Pass the entire content for analysis
+    parallel_lexical_analysis(string_view(content), tokens);  // Pass the entire content for analysis, small files stay on one thread
+    metrics::counter("tokens") += tokens.size();
+
+    if (output != nullptr) {
+        if (!writeTokenStream(output, content, tokens, spans)) {
+            std::cerr << "Error writing token stream: " << output << std::endl;
+            return 1;
+        }
+        return 0;
+    }
 
     // Display tokens
     for (const auto& token : tokens) {
-        std::cout << token.t << std::endl;
+        printToken(std::cout, token);
     }
 
     return 0;
@@ -0,0 +1,144 @@
+#ifndef CFLAT_LIR_HPP
+#define CFLAT_LIR_HPP
+
+// The LIR lowerProgram() builds: lower prints it (lower -hr, -json), and codegen reads it straight from memory
+// when it runs in the same process (cflatc), so the program is never written out between them. Its types
+// are the AST's, which is all of the AST the LIR needs.
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace AST {
+struct Type {
+  std::string name;
+  std::vector<Type> params;
+};
+} // namespace AST
+
+namespace LIR {
+// Every variable, label, field and callee name a function refers to, stored once and referred to by a
+// 32-bit id. The deque keeps each string where it is as the table grows, so the index can view it.
+class Names {
+public:
+  Names() = default;
+  Names(const Names &) = delete; // the index views the strings, a copy would view the original's
+  Names &operator=(const Names &) = delete;
+  Names(Names &&) = default;
+  Names &operator=(Names &&) = default;
+
+  uint32_t intern(const std::string &name) {
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    uint32_t id = static_cast<uint32_t>(names.size());
+    ids.emplace(names.emplace_back(name), id);
+    return id;
+  }
+  const std::string &operator[](uint32_t id) const { return names[id]; }
+  size_t size() const { return names.size(); }
+
+private:
+  std::deque<std::string> names;
+  std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+struct Operand {
+  enum class Kind : uint8_t { None, Var, Const } kind = Kind::None;
+  int32_t value = 0; // the name id of a Var, the number of a Const
+};
+
+// One opcode and its operands in place, 44 bytes whatever the kind:
+//
+//   Copy(lhs, rhs)  Alloc(lhs, size)  Load(lhs, addr)  Store(addr, val)  Gep(lhs, ptr, idx)  Gfp(lhs, ptr)
+//   Arith(lhs, op1, op2)  Cmp(lhs, op1, op2)  Ret(val)  Branch(guard)  CallDir/CallExt(lhs)
+//   CallInd(lhs, ptr)
+//
+// name is the label of a Label, the target of a Jump, the true target of a Branch, the field of a Gfp and
+// the callee of a call; next is the false target of a Branch and the block a call returns to. Jump and
+// Branch targets are name ids while lowering and block ids once constructCFG has built the blocks. A
+// call's arguments are call_args[firstArg, firstArg + argCount) of the function body.
+struct Instruction {
+  enum class Kind : uint8_t {
+    Label,
+    Branch,
+    Jump,
+    Copy,
+    Alloc,
+    Store,
+    Load,
+    Gep,
+    Gfp,
+    CallExt,
+    CallDir,
+    CallInd,
+    Ret,
+    Arith,
+    Cmp
+  } kind;
+  enum class Op : uint8_t { None, Add, Sub, Mul, Div, Neg, Equal, NotEq, Lt, Lte, Gt, Gte } op = Op::None;
+  std::array<Operand, 3> ops{};
+  uint32_t name = 0;
+  uint32_t next = 0;
+  uint32_t firstArg = 0;
+  uint32_t argCount = 0;
+};
+
+struct BasicBlock {
+  std::vector<Instruction> instructions;
+  std::vector<uint32_t> successors;   // block ids, the Branch's true target first
+  std::vector<uint32_t> predecessors; // block ids, ascending
+};
+
+// The reachable blocks, indexed by a block id: the blocks are in the order of their labels, so entry is
+// block 0 and printing walks the ids in order. labels[id] is the label of block id.
+struct FunctionBody {
+  Names names;                   // what the instructions' Var operands and name ids refer to
+  std::vector<Operand> call_args; // every call's arguments, in the order the calls were lowered
+  std::vector<BasicBlock> blocks;
+  std::vector<std::string> labels;
+};
+
+struct Function {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> params;
+  std::string ret_type;
+  std::unordered_map<std::string, AST::Type> locals;
+  std::vector<std::pair<std::string, AST::Type>> temps; // in the order lowering made them
+  std::unordered_map<std::string, AST::Type> types;     // of the parameters, locals and temps
+  FunctionBody body;
+};
+
+struct Program {
+  std::unordered_map<std::string, std::string> globals;
+  std::unordered_map<std::string, AST::Type> global_types;
+  std::unordered_map<std::string,
+                     std::pair<std::vector<std::string>, std::string>>
+      externs;
+  std::unordered_map<std::string,
+                     std::vector<std::pair<std::string, AST::Type>>>
+      structs;
+  std::unordered_map<std::string, Function> functions;
+};
+
+} // namespace LIR
+
+// The type of a variable where function uses it: its parameters, locals and temps shadow the globals
+inline const AST::Type *findVarType(const LIR::Program &lir, const LIR::Function *function, const std::string &var) {
+  if (function) {
+    auto local = function->types.find(var);
+    if (local != function->types.end()) {
+      return &local->second;
+    }
+  }
+  auto global = lir.global_types.find(var);
+  return global != lir.global_types.end() ? &global->second : nullptr;
+}
+
+#endif
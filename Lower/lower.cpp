@@ -1,9 +1,18 @@
 #include "json.hpp"
+#include "../Common/metrics.hpp"
+#include "../Common/parallel.hpp"
+#include "lir.hpp"
 #include <algorithm>
+#include <array>
 #include <cctype>
+#include <cstdint>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -11,11 +20,6 @@ using namespace std;
 using json = nlohmann::json;
 
 namespace AST {
-struct Type {
-  std::string name;
-  std::vector<Type> params;
-};
-
 struct Expr;
 struct Stmt;
 
@@ -88,129 +92,135 @@ bool compareTypes(const Type &t1, const Type &t2) { return t1.name < t2.name; }
 } // namespace AST
 
 namespace LIR {
-struct Operand {
-  enum class Kind { Var, Const } kind;
-  std::string var;
-  int constant;
-};
+// One builder per Instruction shape (lir.hpp), so lowering says what it emits without spelling out Instruction's fields
+Instruction instruction(Instruction::Kind kind, Operand a = {}, Operand b = {}, Operand c = {}) {
+  Instruction inst{};
+  inst.kind = kind;
+  inst.ops = {a, b, c};
+  return inst;
+}
 
-struct Instruction {
-  enum class Kind {
-    Label,
-    Branch,
-    Jump,
-    Copy,
-    Alloc,
-    Store,
-    Load,
-    Gep,
-    Gfp,
-    CallExt,
-    CallDir,
-    CallInd,
-    Ret,
-    Arith,
-    Cmp
-  } kind;
-  std::string label;
-  Operand branch_guard;
-  std::string branch_tt;
-  std::string branch_ff;
-  std::string jump_target;
-  Operand copy_lhs;
-  Operand copy_rhs;
-  Operand alloc_lhs;
-  Operand alloc_size;
-  Operand store_addr;
-  Operand store_val;
-  Operand load_lhs;
-  Operand load_addr;
-  Operand gep_lhs;
-  Operand gep_ptr;
-  Operand gep_idx;
-  Operand gfp_lhs;
-  Operand gfp_ptr;
-  std::string gfp_field;
-  Operand callext_lhs;
-  std::string callext_name;
-  std::vector<Operand> callext_args;
-  Operand calldir_lhs;
-  std::string calldir_name;
-  std::vector<Operand> calldir_args;
-  std::string calldir_next;
-  Operand callind_lhs;
-  Operand callind_ptr;
-  std::vector<Operand> callind_args;
-  std::string callind_next;
-  Operand ret_val;
-  Operand arith_lhs;
-  std::string arith_op;
-  Operand arith_op1;
-  Operand arith_op2;
-  Operand cmp_lhs;
-  std::string cmp_op;
-  Operand cmp_op1;
-  Operand cmp_op2;
-};
+Instruction copy(Operand lhs, Operand rhs) { return instruction(Instruction::Kind::Copy, lhs, rhs); }
+Instruction alloc(Operand lhs, Operand size) { return instruction(Instruction::Kind::Alloc, lhs, size); }
+Instruction load(Operand lhs, Operand addr) { return instruction(Instruction::Kind::Load, lhs, addr); }
+Instruction store(Operand addr, Operand val) { return instruction(Instruction::Kind::Store, addr, val); }
+Instruction gep(Operand lhs, Operand ptr, Operand idx) { return instruction(Instruction::Kind::Gep, lhs, ptr, idx); }
+Instruction ret(Operand val = {}) { return instruction(Instruction::Kind::Ret, val); }
+
+Instruction gfp(Operand lhs, Operand ptr, uint32_t field) {
+  Instruction inst = instruction(Instruction::Kind::Gfp, lhs, ptr);
+  inst.name = field;
+  return inst;
+}
 
-struct BasicBlock {
-  std::string label;
-  std::vector<Instruction> instructions;
-};
+Instruction arith(Instruction::Op op, Operand lhs, Operand op1, Operand op2) {
+  Instruction inst = instruction(Instruction::Kind::Arith, lhs, op1, op2);
+  inst.op = op;
+  return inst;
+}
 
-struct FunctionBody {
-  std::unordered_map<std::string, BasicBlock> basic_blocks;
-};
+Instruction cmp(Instruction::Op op, Operand lhs, Operand op1, Operand op2) {
+  Instruction inst = instruction(Instruction::Kind::Cmp, lhs, op1, op2);
+  inst.op = op;
+  return inst;
+}
 
-struct Function {
-  std::string name;
-  std::vector<std::pair<std::string, std::string>> params;
-  std::string ret_type;
-  std::unordered_map<std::string, AST::Type> locals;
-  FunctionBody body;
-};
+Instruction label(uint32_t name) {
+  Instruction inst = instruction(Instruction::Kind::Label);
+  inst.name = name;
+  return inst;
+}
 
-struct Program {
-  std::unordered_map<std::string, std::string> globals;
-  std::unordered_map<std::string,
-                     std::pair<std::vector<std::string>, std::string>>
-      externs;
-  std::unordered_map<std::string,
-                     std::vector<std::pair<std::string, AST::Type>>>
-      structs;
-  std::unordered_map<std::string, Function> functions;
-};
+Instruction jump(uint32_t target) {
+  Instruction inst = instruction(Instruction::Kind::Jump);
+  inst.name = target;
+  return inst;
+}
+
+Instruction branch(Operand guard, uint32_t ifTrue, uint32_t ifFalse) {
+  Instruction inst = instruction(Instruction::Kind::Branch, guard);
+  inst.name = ifTrue;
+  inst.next = ifFalse;
+  return inst;
+}
+
+Instruction callDirect(Operand lhs, uint32_t callee, uint32_t firstArg, uint32_t argCount) {
+  Instruction inst = instruction(Instruction::Kind::CallDir, lhs);
+  inst.name = callee;
+  inst.firstArg = firstArg;
+  inst.argCount = argCount;
+  return inst;
+}
 } // namespace LIR
-std::string freshLabel(int &counter);
+
+// What lowering one function works on instead of globals: the program, which struct layouts and global
+// types are read from and which nothing writes while functions are lowered, and the function itself, which
+// owns its names, temporaries and their types. Temps and labels are numbered per function, so a function
+// lowers to the same LIR whichever thread lowers it and whatever was lowered before.
+struct LoweringContext {
+  const LIR::Program &lir;
+  LIR::Function *function = nullptr;
+  int labels = 1; // the lbl<n> numbering
+  int temps = 1;  // the _t<n> numbering
+};
+
+std::string freshLabel(LoweringContext &ctx);
 void lowerProgram(const AST::Program &ast, LIR::Program &lir);
+LIR::Function lowerFunction(const AST::Function &func, const LIR::Program &lir);
 void lowerStatements(const std::vector<std::unique_ptr<AST::Stmt>> &stmts,
                      std::vector<LIR::Instruction> &translationVector,
-                     int &counter, const std::string &loopStart = "",
+                     LoweringContext &ctx, const std::string &loopStart = "",
                      const std::string &loopEnd = "");
 LIR::Operand lowerExpression(const AST::Expr &expr,
                              std::vector<LIR::Instruction> &translationVector,
-                             int &counter);
+                             LoweringContext &ctx);
 LIR::Operand lowerLval(const AST::Lval &lval,
                        std::vector<LIR::Instruction> &translationVector,
-                       int &counter);
+                       LoweringContext &ctx);
 LIR::Operand lowerLvalAsExpr(const AST::Lval &lval,
                              std::vector<LIR::Instruction> &translationVector,
-                             int &counter);
-void constructCFG(const std::vector<LIR::Instruction> &translationVector,
+                             LoweringContext &ctx);
+void constructCFG(std::vector<LIR::Instruction> &&translationVector,
                   LIR::FunctionBody &functionBody);
 void outputLIR(const LIR::Program &lir);
+void outputLIRJson(const LIR::Program &lir, std::ostream &os);
 AST::Program parseAST(const json &ast_json);
 std::string formatType(const AST::Type &type);
-AST::Type getFieldTypeFromStruct(const std::string &variable, const std::string &field);
-AST::Type getVarType(const std::string &var);
-// Helper functions for creating fresh variables and labels
-std::vector<std::pair<std::string, std::string>> tempVars;
-std::unordered_map<std::string, AST::Type> varTypes;
- LIR::Program lir;
-
-AST::Type getFieldTypeFromStruct(const std::string &variable, const std::string &field) {
-    AST::Type varType = getVarType(variable);
-    
+AST::Type getFieldTypeFromStruct(LoweringContext &ctx, const std::string &variable, const std::string &field);
+AST::Type getVarType(LoweringContext &ctx, const std::string &var);
+
+LIR::Operand varOperand(LoweringContext &ctx, const std::string &name) {
+  return {LIR::Operand::Kind::Var, static_cast<int32_t>(ctx.function->body.names.intern(name))};
+}
+
+LIR::Operand constOperand(int value) {
+  return {LIR::Operand::Kind::Const, value};
+}
+
+uint32_t nameId(LoweringContext &ctx, const std::string &name) {
+  return ctx.function->body.names.intern(name);
+}
+
+// The variable an operand names, "" for a constant (which no lookup by name finds)
+const std::string &varName(LoweringContext &ctx, const LIR::Operand &operand) {
+  static const std::string none;
+  return operand.kind == LIR::Operand::Kind::Var ? ctx.function->body.names[operand.value] : none;
+}
+
+LIR::Instruction::Op lirOp(const std::string &op) {
+  static const std::unordered_map<std::string, LIR::Instruction::Op> ops = {
+      {"Add", LIR::Instruction::Op::Add},     {"Sub", LIR::Instruction::Op::Sub},
+      {"Mul", LIR::Instruction::Op::Mul},     {"Div", LIR::Instruction::Op::Div},
+      {"Neg", LIR::Instruction::Op::Neg},     {"Equal", LIR::Instruction::Op::Equal},
+      {"NotEq", LIR::Instruction::Op::NotEq}, {"Lt", LIR::Instruction::Op::Lt},
+      {"Lte", LIR::Instruction::Op::Lte},     {"Gt", LIR::Instruction::Op::Gt},
+      {"Gte", LIR::Instruction::Op::Gte}};
+  auto it = ops.find(op);
+  if (it == ops.end()) throw std::runtime_error("Unknown operator: " + op);
+  return it->second;
+}
+
+AST::Type getFieldType(const LIR::Program &lir, const AST::Type &varType, const std::string &field) {
     if (varType.name != "Ptr" || varType.params.empty()) {
         throw std::runtime_error("Variable is not a pointer.");
     }
@@ -239,6 +249,10 @@ AST::Type getFieldTypeFromStruct(const std::string &variable, const std::string
     throw std::runtime_error("Field not found in struct: " + field);
 }
 
+AST::Type getFieldTypeFromStruct(LoweringContext &ctx, const std::string &variable, const std::string &field) {
+  return getFieldType(ctx.lir, getVarType(ctx, variable), field);
+}
+
 
 
 
@@ -248,30 +262,29 @@ AST::Type defaultIntType() {
   return intType;
 }
 
-std::string freshVar(int &counter, const AST::Type &type = defaultIntType()) {
-  static int countert = 1;
-  std::string tempVar = "_t" + std::to_string(countert++);
-  varTypes[tempVar] = type;
+std::string freshVar(LoweringContext &ctx, const AST::Type &type = defaultIntType()) {
+  std::string tempVar = "_t" + std::to_string(ctx.temps++);
+  ctx.function->types[tempVar] = type;
   // cout<<"tempVar: "<<tempVar<<endl;
   // cout<<"type: "<<formatType(type)<<endl;
-  tempVars.push_back(std::make_pair(tempVar, formatType(type)));
+  ctx.function->temps.push_back(std::make_pair(tempVar, type));
   return tempVar;
 }
 
-AST::Type getVarType(const std::string &var) {
-  if (varTypes.find(var) != varTypes.end()) {
-    return varTypes[var];
+AST::Type getVarType(LoweringContext &ctx, const std::string &var) {
+  if (const AST::Type *type = findVarType(ctx.lir, ctx.function, var)) {
+    return *type;
   }
   throw std::runtime_error("Type not found for variable: " + var);
 }
-AST::Type getType(const AST::Expr &expr) {
+AST::Type getType(LoweringContext &ctx, const AST::Expr &expr) {
   switch (expr.kind) {
   case AST::Expr::Kind::Num:
     return {"Int"};
   case AST::Expr::Kind::Id:
-    return getVarType(expr.id);
+    return getVarType(ctx, expr.id);
   case AST::Expr::Kind::ArrayAccess: {
-    AST::Type ptrType = getType(*expr.array_ptr);
+    AST::Type ptrType = getType(ctx, *expr.array_ptr);
     if (ptrType.name == "Ptr" && !ptrType.params.empty()) {
       return ptrType.params[0];
     }
@@ -279,10 +292,10 @@ AST::Type getType(const AST::Expr &expr) {
   }
   case AST::Expr::Kind::FieldAccess:
     // Handle struct field access type
-    return getVarType(expr.field_name);
+    return getVarType(ctx, expr.field_name);
   case AST::Expr::Kind::New:
     if (expr.new_type.name == "Ptr") {
-      return {"Ptr", {getType(*expr.new_size)}};
+      return {"Ptr", {getType(ctx, *expr.new_size)}};
     }
     return {"Ptr", {{"Int"}}}; // Default to Int if no type provided
   default:
@@ -290,15 +303,21 @@ AST::Type getType(const AST::Expr &expr) {
   }
 }
 
-std::string freshLabel(int &counter) {
-  return "lbl" + std::to_string(counter++);
+std::string freshLabel(LoweringContext &ctx) {
+  return "lbl" + std::to_string(ctx.labels++);
 }
 
+const size_t PARALLEL_MIN_FUNCTIONS = 16; // per thread, below this a thread costs more than it lowers
+unsigned lowerThreads = parallel::hardwareThreads();
+
 // Lowering functions for programs, statements, expressions, and lvals
 void lowerProgram(const AST::Program &ast, LIR::Program &lir) {
+  metrics::Scope scope("lowerProgram");
+  metrics::counter("functions") += ast.functions.size();
   // Copy globals, externs, and structs to LIR
   for (const auto &global : ast.globals) {
     lir.globals[global.first] = global.second.name;
+    lir.global_types[global.first] = global.second;
   }
 
   for (const auto &extern_ : ast.externs) {
@@ -318,104 +337,105 @@ void lowerProgram(const AST::Program &ast, LIR::Program &lir) {
     lir.structs[struct_.first] = fields;
   }
 
-  // Lower each function
-  for (const auto &func : ast.functions) {
-    LIR::Function lirFunc;
-    lirFunc.name = func.name;
+  // Lower each function, on worker threads when there are enough of them
+  const size_t count = ast.functions.size();
+  std::vector<LIR::Function> lowered(count);
+  parallel::forEach(count, parallel::threadsFor(lowerThreads, count, PARALLEL_MIN_FUNCTIONS),
+                    [&](size_t f) { lowered[f] = lowerFunction(ast.functions[f], lir); });
 
-    // Copy function parameters to LIR
-    for (const auto &param : func.params) {
-      lirFunc.params.push_back(std::make_pair(param.first, param.second.name));
-    }
+  // Add the lowered functions to the LIR program, in the order the serial loop adds them
+  for (auto &lirFunc : lowered) {
+    std::string name = lirFunc.name;
+    lir.functions[name] = std::move(lirFunc);
+  }
+}
 
-    // Set the return type of the function
-    lirFunc.ret_type = func.ret_type.name;
+// Lowers one function into an LIR::Function of its own; lir is only read, so functions lower concurrently
+LIR::Function lowerFunction(const AST::Function &func, const LIR::Program &lir) {
+  LIR::Function lirFunc;
+  LoweringContext ctx{lir, &lirFunc};
+  lirFunc.name = func.name;
 
-    // Copy function locals to LIR
-    for (const auto &local : func.locals) {
-      varTypes[local.first] = local.second;
-      lirFunc.locals[local.first] = local.second;
-      //  cout<<"AJ"<<formatType(local.second)<<endl;
-    }
-
-    // Create a fresh variable counter for the function
-    int varCounter = 1;
-
-    // Create a translation vector to hold the lowered instructions
-    std::vector<LIR::Instruction> translationVector;
-    translationVector.emplace_back(
-        LIR::Instruction{LIR::Instruction::Kind::Label, "entry"});
-
-    // Eliminate local variable initializations
-
-    std::vector<std::unique_ptr<AST::Stmt>> stmts;
-
-    for (auto &stmt : func.stmts) {
-      stmts.emplace_back(std::make_unique<AST::Stmt>(std::move(*stmt)));
-    }
-
-    // Lower the function statements
-    lowerStatements(stmts, translationVector, varCounter);
-
-    // // Enforce having a single Return instruction
-    // std::string exitLabel;
-    // if (!translationVector.empty() && translationVector.back().kind ==
-    // LIR::Instruction::Kind::Label) {
-    //     exitLabel = translationVector.back().label;
-    // } else {
-    //     exitLabel = freshLabel(varCounter);
-    //     translationVector.emplace_back(LIR::Instruction{LIR::Instruction::Kind::Label,
-    //     exitLabel});
-    // }
-
-    // bool hasReturn = false;
-    // for (auto& instr : translationVector) {
-    //     if (instr.kind == LIR::Instruction::Kind::Ret) {
-    //         hasReturn = true;
-    //         break;
-    //     }
-    // }
-
-    // if (hasReturn) {
-    //     cout<<"has return"<<endl;
-    //     LIR::Operand retVal;
-    //     if (func.ret_type.name != "nil") {
-    //         cout<<"ret type is not nil"<<endl;
-    //         std::string retVarName = freshVar(varCounter);
-    //         retVal = LIR::Operand{LIR::Operand::Kind::Var, retVarName};
-    //         cout<<"retVal: "<<retVal.constant<<endl;
-    //         lirFunc.locals[retVarName] = func.ret_type.name;
-
-    //     } else {
-    //         translationVector.emplace_back(LIR::Instruction{LIR::Instruction::Kind::Ret});
-    //     }
-
-    //     for (auto it = translationVector.begin(); it !=
-    //     translationVector.end(); ++it) {
-    //         if (it->kind == LIR::Instruction::Kind::Ret) {
-    //             if (it->ret_val.kind == LIR::Operand::Kind::Var) {
-    //                 std::string retVarName = it->ret_val.var;
-    //                 it = translationVector.insert(it,
-    //                 LIR::Instruction{LIR::Instruction::Kind::Copy,
-    //                 retVal.var, LIR::Operand{LIR::Operand::Kind::Var,
-    //                 retVarName}});
-    //                 ++it;
-    //             }
-    //             it = translationVector.erase(it);
-    //             translationVector.insert(it,
-    //             LIR::Instruction{LIR::Instruction::Kind::Jump, exitLabel});
-    //         }
-    //     }
-    // } else {
-    //     translationVector.emplace_back(LIR::Instruction{LIR::Instruction::Kind::Ret});
-    // }
-
-    // Construct the CFG for the function body
-    constructCFG(translationVector, lirFunc.body);
-
-    // Add the lowered function to the LIR program
-    lir.functions[lirFunc.name] = std::move(lirFunc);
+  // Copy function parameters to LIR
+  for (const auto &param : func.params) {
+    lirFunc.params.push_back(std::make_pair(param.first, param.second.name));
+    lirFunc.types[param.first] = param.second;
+  }
+
+  // Set the return type of the function
+  lirFunc.ret_type = func.ret_type.name;
+
+  // Copy function locals to LIR
+  for (const auto &local : func.locals) {
+    lirFunc.types[local.first] = local.second;
+    lirFunc.locals[local.first] = local.second;
+    //  cout<<"AJ"<<formatType(local.second)<<endl;
   }
+
+  // Create a translation vector to hold the lowered instructions
+  std::vector<LIR::Instruction> translationVector;
+  translationVector.emplace_back(LIR::label(nameId(ctx, "entry")));
+
+  // Lower the function statements
+  lowerStatements(func.stmts, translationVector, ctx);
+
+  // // Enforce having a single Return instruction
+  // std::string exitLabel;
+  // if (!translationVector.empty() && translationVector.back().kind ==
+  // LIR::Instruction::Kind::Label) {
+  //     exitLabel = translationVector.back().label;
+  // } else {
+  //     exitLabel = freshLabel(ctx);
+  //     translationVector.emplace_back(LIR::Instruction{LIR::Instruction::Kind::Label,
+  //     exitLabel});
+  // }
+
+  // bool hasReturn = false;
+  // for (auto& instr : translationVector) {
+  //     if (instr.kind == LIR::Instruction::Kind::Ret) {
+  //         hasReturn = true;
+  //         break;
+  //     }
+  // }
+
+  // if (hasReturn) {
+  //     cout<<"has return"<<endl;
+  //     LIR::Operand retVal;
+  //     if (func.ret_type.name != "nil") {
+  //         cout<<"ret type is not nil"<<endl;
+  //         std::string retVarName = freshVar(ctx);
+  //         retVal = LIR::Operand{LIR::Operand::Kind::Var, retVarName};
+  //         cout<<"retVal: "<<retVal.constant<<endl;
+  //         lirFunc.locals[retVarName] = func.ret_type.name;
+
+  //     } else {
+  //         translationVector.emplace_back(LIR::Instruction{LIR::Instruction::Kind::Ret});
+  //     }
+
+  //     for (auto it = translationVector.begin(); it !=
+  //     translationVector.end(); ++it) {
+  //         if (it->kind == LIR::Instruction::Kind::Ret) {
+  //             if (it->ret_val.kind == LIR::Operand::Kind::Var) {
+  //                 std::string retVarName = it->ret_val.var;
+  //                 it = translationVector.insert(it,
+  //                 LIR::Instruction{LIR::Instruction::Kind::Copy,
+  //                 retVal.var, LIR::Operand{LIR::Operand::Kind::Var,
+  //                 retVarName}});
+  //                 ++it;
+  //             }
+  //             it = translationVector.erase(it);
+  //             translationVector.insert(it,
+  //             LIR::Instruction{LIR::Instruction::Kind::Jump, exitLabel});
+  //         }
+  //     }
+  // } else {
+  //     translationVector.emplace_back(LIR::Instruction{LIR::Instruction::Kind::Ret});
+  // }
+
+  // Construct the CFG for the function body, which takes the instructions over
+  constructCFG(std::move(translationVector), lirFunc.body);
+
+  return lirFunc;
 }
 bool isId(const AST::Lval& lval) {
     return lval.array_index == nullptr && lval.field_name.empty() && lval.name != "Deref";
@@ -423,7 +443,7 @@ bool isId(const AST::Lval& lval) {
 
 void lowerStatements(const std::vector<std::unique_ptr<AST::Stmt>> &stmts,
                      std::vector<LIR::Instruction> &translationVector,
-                     int &counter, const std::string &loopStart,
+                     LoweringContext &ctx, const std::string &loopStart,
                      const std::string &loopEnd) {
   for (const auto &stmt : stmts) {
     switch (stmt->kind) {
@@ -432,130 +452,99 @@ void lowerStatements(const std::vector<std::unique_ptr<AST::Stmt>> &stmts,
           // Check if lhs is Id(name)
           if (isId(*stmt->assign_lhs))  {
             LIR::Operand size = lowerExpression(*stmt->assign_rhs->new_size,
-                                                translationVector, counter);
-            translationVector.emplace_back(LIR::Instruction{
-                LIR::Instruction::Kind::Alloc,
-                .alloc_lhs = {LIR::Operand::Kind::Var, stmt->assign_lhs->name},
-                .alloc_size = size});
+                                                translationVector, ctx);
+            translationVector.emplace_back(LIR::alloc(varOperand(ctx, stmt->assign_lhs->name), size));
           } else {
             // Create fresh variable w for allocation
             AST::Type ptrType = {"Ptr", {stmt->assign_rhs->new_type}};
-            std::string tempVarAlloc = freshVar(counter, ptrType);
+            std::string tempVarAlloc = freshVar(ctx, ptrType);
             
       
             // Lower the lhs expression
-            LIR::Operand lhs = lowerLval(*stmt->assign_lhs, translationVector, counter);
+            LIR::Operand lhs = lowerLval(*stmt->assign_lhs, translationVector, ctx);
             // Lower the size expression
             LIR::Operand size = lowerExpression(*stmt->assign_rhs->new_size,
-                                                translationVector, counter);
-
-            translationVector.emplace_back(LIR::Instruction{
-                LIR::Instruction::Kind::Alloc,
-                .alloc_lhs = {LIR::Operand::Kind::Var, tempVarAlloc},
-                .alloc_size = size});
-            translationVector.emplace_back(LIR::Instruction{
-                LIR::Instruction::Kind::Store, .store_addr = lhs,
-                .store_val = {LIR::Operand::Kind::Var, tempVarAlloc}});
+                                                translationVector, ctx);
+
+            translationVector.emplace_back(LIR::alloc(varOperand(ctx, tempVarAlloc), size));
+            translationVector.emplace_back(LIR::store(lhs, varOperand(ctx, tempVarAlloc)));
           }
         } else {//JAssign(lhs, RhsExp(e))K
 
             //if lhs is Id(name)
           if (isId(*stmt->assign_lhs)) {
-              LIR::Operand rhs = lowerExpression(*stmt->assign_rhs, translationVector, counter);
+              LIR::Operand rhs = lowerExpression(*stmt->assign_rhs, translationVector, ctx);
 
-            translationVector.emplace_back(LIR::Instruction{
-                LIR::Instruction::Kind::Copy,
-                .copy_lhs = {LIR::Operand::Kind::Var, stmt->assign_lhs->name},
-                .copy_rhs = rhs});
+            translationVector.emplace_back(LIR::copy(varOperand(ctx, stmt->assign_lhs->name), rhs));
           } else {
-            LIR::Operand lhs = lowerLval(*stmt->assign_lhs, translationVector, counter);
-                LIR::Operand rhs = lowerExpression(*stmt->assign_rhs, translationVector, counter);
+            LIR::Operand lhs = lowerLval(*stmt->assign_lhs, translationVector, ctx);
+                LIR::Operand rhs = lowerExpression(*stmt->assign_rhs, translationVector, ctx);
 
-            translationVector.emplace_back(LIR::Instruction{
-                LIR::Instruction::Kind::Store, .store_addr = lhs,
-                .store_val = rhs});
+            translationVector.emplace_back(LIR::store(lhs, rhs));
           }
         }
         break;
       }
       case AST::Stmt::Kind::If: {
-        std::string labelTrue = freshLabel(counter);
-        std::string labelFalse = freshLabel(counter);
-        std::string labelEnd = freshLabel(counter);
+        std::string labelTrue = freshLabel(ctx);
+        std::string labelFalse = freshLabel(ctx);
+        std::string labelEnd = freshLabel(ctx);
 
         LIR::Operand guard =
-            lowerExpression(*stmt->if_guard, translationVector, counter);
-        translationVector.push_back(LIR::Instruction{
-            LIR::Instruction::Kind::Branch, .branch_guard = guard,
-            .branch_tt = labelTrue, .branch_ff = labelFalse});
+            lowerExpression(*stmt->if_guard, translationVector, ctx);
+        translationVector.push_back(LIR::branch(guard, nameId(ctx, labelTrue), nameId(ctx, labelFalse)));
 
-        translationVector.push_back(
-            LIR::Instruction{LIR::Instruction::Kind::Label, .label = labelTrue});
-        lowerStatements(stmt->if_then, translationVector, counter, loopStart,
+        translationVector.push_back(LIR::label(nameId(ctx, labelTrue)));
+        lowerStatements(stmt->if_then, translationVector, ctx, loopStart,
                         loopEnd);
-        translationVector.push_back(LIR::Instruction{LIR::Instruction::Kind::Jump,
-                                                     .jump_target = labelEnd});
+        translationVector.push_back(LIR::jump(nameId(ctx, labelEnd)));
 
-        translationVector.push_back(
-            LIR::Instruction{LIR::Instruction::Kind::Label, .label = labelFalse});
-        lowerStatements(stmt->if_else, translationVector, counter, loopStart,
+        translationVector.push_back(LIR::label(nameId(ctx, labelFalse)));
+        lowerStatements(stmt->if_else, translationVector, ctx, loopStart,
                         loopEnd);
-        translationVector.push_back(LIR::Instruction{LIR::Instruction::Kind::Jump,
-                                                     .jump_target = labelEnd});
+        translationVector.push_back(LIR::jump(nameId(ctx, labelEnd)));
 
-        translationVector.push_back(
-            LIR::Instruction{LIR::Instruction::Kind::Label, .label = labelEnd});
+        translationVector.push_back(LIR::label(nameId(ctx, labelEnd)));
         break;
       }
       case AST::Stmt::Kind::While: {
-        std::string labelHeader = freshLabel(counter);
-        std::string labelBody = freshLabel(counter);
-        std::string labelEnd = freshLabel(counter);
-
-        translationVector.push_back(LIR::Instruction{LIR::Instruction::Kind::Jump,
-                                                     .jump_target = labelHeader});
-        translationVector.push_back(LIR::Instruction{
-            LIR::Instruction::Kind::Label, .label = labelHeader});
+        std::string labelHeader = freshLabel(ctx);
+        std::string labelBody = freshLabel(ctx);
+        std::string labelEnd = freshLabel(ctx);
+
+        translationVector.push_back(LIR::jump(nameId(ctx, labelHeader)));
+        translationVector.push_back(LIR::label(nameId(ctx, labelHeader)));
         LIR::Operand guard =
-            lowerExpression(*stmt->while_guard, translationVector, counter);
-        translationVector.push_back(LIR::Instruction{
-            LIR::Instruction::Kind::Branch, .branch_guard = guard,
-            .branch_tt = labelBody, .branch_ff = labelEnd});
+            lowerExpression(*stmt->while_guard, translationVector, ctx);
+        translationVector.push_back(LIR::branch(guard, nameId(ctx, labelBody), nameId(ctx, labelEnd)));
 
-        translationVector.push_back(
-            LIR::Instruction{LIR::Instruction::Kind::Label, .label = labelBody});
-        lowerStatements(stmt->while_body, translationVector, counter, labelHeader,
+        translationVector.push_back(LIR::label(nameId(ctx, labelBody)));
+        lowerStatements(stmt->while_body, translationVector, ctx, labelHeader,
                         labelEnd);
-        translationVector.push_back(LIR::Instruction{LIR::Instruction::Kind::Jump,
-                                                     .jump_target = labelHeader});
+        translationVector.push_back(LIR::jump(nameId(ctx, labelHeader)));
 
-        translationVector.push_back(
-            LIR::Instruction{LIR::Instruction::Kind::Label, .label = labelEnd});
+        translationVector.push_back(LIR::label(nameId(ctx, labelEnd)));
         break;
       }
       case AST::Stmt::Kind::Continue: {
         if (!loopStart.empty()) {
-          translationVector.push_back(LIR::Instruction{
-              LIR::Instruction::Kind::Jump, .jump_target = loopStart});
+          translationVector.push_back(LIR::jump(nameId(ctx, loopStart)));
         }
         break;
       }
       case AST::Stmt::Kind::Break: {
         if (!loopEnd.empty()) {
-          translationVector.push_back(LIR::Instruction{
-              LIR::Instruction::Kind::Jump, .jump_target = loopEnd});
+          translationVector.push_back(LIR::jump(nameId(ctx, loopEnd)));
         }
         break;
       }
       case AST::Stmt::Kind::Return: {
         if (stmt->return_expr) {
           LIR::Operand retValue =
-              lowerExpression(*stmt->return_expr, translationVector, counter);
-          translationVector.push_back(
-              LIR::Instruction{LIR::Instruction::Kind::Ret, .ret_val = retValue});
+              lowerExpression(*stmt->return_expr, translationVector, ctx);
+          translationVector.push_back(LIR::ret(retValue));
         } else {
-          translationVector.push_back(
-              LIR::Instruction{LIR::Instruction::Kind::Ret});
+          translationVector.push_back(LIR::ret());
         }
         break;
       }
@@ -567,139 +556,110 @@ void lowerStatements(const std::vector<std::unique_ptr<AST::Stmt>> &stmts,
 
 LIR::Operand lowerExpression(const AST::Expr &expr,
                              std::vector<LIR::Instruction> &translationVector,
-                             int &counter) {
+                             LoweringContext &ctx) {
   switch (expr.kind) {
   case AST::Expr::Kind::Nil: {
-    return LIR::Operand{LIR::Operand::Kind::Const, .constant = 0};
+    return constOperand(0);
   }
   case AST::Expr::Kind::Num: {
-    return LIR::Operand{LIR::Operand::Kind::Const, .constant = expr.num};
+    return constOperand(expr.num);
   }
   case AST::Expr::Kind::Id:
-    return LIR::Operand{LIR::Operand::Kind::Var, .var = expr.id};
+    return varOperand(ctx, expr.id);
 
   case AST::Expr::Kind::UnOp: {
     // cout<<"UnOp"<<endl;
     if (expr.unop == "Deref") {
       LIR::Operand operand =
-          lowerExpression(*expr.left, translationVector, counter);
-      AST::Type operandType = getVarType(operand.var);
+          lowerExpression(*expr.left, translationVector, ctx);
+      AST::Type operandType = getVarType(ctx, varName(ctx, operand));
       if (operandType.name != "Ptr" || operandType.params.empty()) {
         throw std::runtime_error("Invalid operand type for dereference.");
       }
       AST::Type derefType = operandType.params[0];
       //<<"UNOP CREATE VAR in IF"<<endl;
-      std::string tempVar = freshVar(counter, derefType);
-      translationVector.push_back(
-          LIR::Instruction{LIR::Instruction::Kind::Load,
-                           .load_lhs = {LIR::Operand::Kind::Var, tempVar},
-                           .load_addr = operand});
-      return LIR::Operand{LIR::Operand::Kind::Var, tempVar};
+      std::string tempVar = freshVar(ctx, derefType);
+      translationVector.push_back(LIR::load(varOperand(ctx, tempVar), operand));
+      return varOperand(ctx, tempVar);
     } else {
     //  cout<<"UNOP CREATE VAR";
-      std::string tempVar = freshVar(counter);
+      std::string tempVar = freshVar(ctx);
       LIR::Operand operand =
-          lowerExpression(*expr.left, translationVector, counter);
-      translationVector.push_back(LIR::Instruction{
-          LIR::Instruction::Kind::Arith,
-          .arith_lhs = {LIR::Operand::Kind::Var, tempVar},
-          .arith_op = expr.unop,
-          .arith_op1 = {LIR::Operand::Kind::Const, .constant = 0},
-          .arith_op2 = operand});
-      return {LIR::Operand::Kind::Var, tempVar};
+          lowerExpression(*expr.left, translationVector, ctx);
+      translationVector.push_back(LIR::arith(lirOp(expr.unop), varOperand(ctx, tempVar), constOperand(0), operand));
+      return varOperand(ctx, tempVar);
     }
   }
   case AST::Expr::Kind::BinOp: {
-    LIR::Operand lhs = lowerExpression(*expr.left, translationVector, counter);
-    LIR::Operand rhs = lowerExpression(*expr.right, translationVector, counter);
-    std::string tempVar = freshVar(counter);
+    LIR::Operand lhs = lowerExpression(*expr.left, translationVector, ctx);
+    LIR::Operand rhs = lowerExpression(*expr.right, translationVector, ctx);
+    std::string tempVar = freshVar(ctx);
     if (expr.binop == "Add" || expr.binop == "Sub" || expr.binop == "Mul" ||
         expr.binop == "Div") {
-      translationVector.push_back(LIR::Instruction{
-          LIR::Instruction::Kind::Arith,
-          .arith_lhs = {LIR::Operand::Kind::Var, tempVar},
-          .arith_op = expr.binop, .arith_op1 = lhs, .arith_op2 = rhs});
-    } else if (expr.binop == "Equal" || expr.binop == "NotEq" ||
-               expr.binop == "Lt" || expr.binop == "Lte" ||
-               expr.binop == "Gt" || expr.binop == "Gte") {
-      translationVector.push_back(LIR::Instruction{
-          LIR::Instruction::Kind::Cmp,
-          .cmp_lhs = {LIR::Operand::Kind::Var, tempVar}, .cmp_op = expr.binop,
-          .cmp_op1 = lhs, .cmp_op2 = rhs});
-    }
-    return {LIR::Operand::Kind::Var, tempVar};
+      translationVector.push_back(LIR::arith(lirOp(expr.binop), varOperand(ctx, tempVar), lhs, rhs));
+    } else {
+      translationVector.push_back(LIR::cmp(lirOp(expr.binop), varOperand(ctx, tempVar), lhs, rhs));
+    }
+    return varOperand(ctx, tempVar);
   }
   case AST::Expr::Kind::Call: {
-    std::string tempVar = freshVar(counter);
+    std::string tempVar = freshVar(ctx);
     std::vector<LIR::Operand> args;
     for (const auto &arg : expr.args) {
-      args.push_back(lowerExpression(*arg, translationVector, counter));
+      args.push_back(lowerExpression(*arg, translationVector, ctx));
     }
+    // The arguments go to the side table once they are all lowered, nested calls add theirs first
+    uint32_t firstArg = static_cast<uint32_t>(ctx.function->body.call_args.size());
+    ctx.function->body.call_args.insert(ctx.function->body.call_args.end(), args.begin(), args.end());
     translationVector.push_back(
-        LIR::Instruction{LIR::Instruction::Kind::CallDir,
-                         .calldir_lhs = {LIR::Operand::Kind::Var, tempVar},
-                         .calldir_name = expr.callee, .calldir_args = args});
-    return {LIR::Operand::Kind::Var, tempVar};
+        LIR::callDirect(varOperand(ctx, tempVar), nameId(ctx, expr.callee), firstArg, static_cast<uint32_t>(args.size())));
+    return varOperand(ctx, tempVar);
   }
   case AST::Expr::Kind::ArrayAccess: {
     // cout<<"ArrayAccess"<<endl;
     LIR::Operand arrayPtr =
-        lowerExpression(*expr.array_ptr, translationVector, counter);
-    AST::Type arrayPtrType = getVarType(arrayPtr.var);
+        lowerExpression(*expr.array_ptr, translationVector, ctx);
+    AST::Type arrayPtrType = getVarType(ctx, varName(ctx, arrayPtr));
     if (arrayPtrType.name != "Ptr" || arrayPtrType.params.empty()) {
       throw std::runtime_error("Invalid array pointer type.");
     }
     AST::Type elementType = arrayPtrType.params[0];
     LIR::Operand idx =
-        lowerExpression(*expr.array_index, translationVector, counter);
+        lowerExpression(*expr.array_index, translationVector, ctx);
 
-    std::string ptrVar = freshVar(counter, arrayPtrType);
-    std::string elemVar = freshVar(counter, elementType);
-    translationVector.push_back(
-        LIR::Instruction{LIR::Instruction::Kind::Gep,
-                         .gep_lhs = {LIR::Operand::Kind::Var, ptrVar},
-                         .gep_ptr = arrayPtr, .gep_idx = idx});
-    translationVector.push_back(
-        LIR::Instruction{LIR::Instruction::Kind::Load,
-                         .load_lhs = {LIR::Operand::Kind::Var, elemVar},
-                         .load_addr = {LIR::Operand::Kind::Var, ptrVar}});
-    return {LIR::Operand::Kind::Var, elemVar};
+    std::string ptrVar = freshVar(ctx, arrayPtrType);
+    std::string elemVar = freshVar(ctx, elementType);
+    translationVector.push_back(LIR::gep(varOperand(ctx, ptrVar), arrayPtr, idx));
+    translationVector.push_back(LIR::load(varOperand(ctx, elemVar), varOperand(ctx, ptrVar)));
+    return varOperand(ctx, elemVar);
   }
       case AST::Expr::Kind::FieldAccess: {
       // Extract the struct pointer operand
-      LIR::Operand ptr = lowerExpression(*expr.field_ptr, translationVector, counter);
+      LIR::Operand ptr = lowerExpression(*expr.field_ptr, translationVector, ctx);
 
       // Get the type of the field being accessed
-      AST::Type fieldType = getFieldTypeFromStruct(ptr.var, expr.field_name);
+      AST::Type fieldType = getFieldTypeFromStruct(ctx, varName(ctx, ptr), expr.field_name);
 
       //  fresh variables for the field pointer and the field value
-      std::string fieldPtrVar = freshVar(counter, {"Ptr", {fieldType}});
-      std::string fieldValueVar = freshVar(counter, fieldType);
-
-      translationVector.push_back(
-          LIR::Instruction{LIR::Instruction::Kind::Gfp,
-                           .gfp_lhs = {LIR::Operand::Kind::Var, fieldPtrVar},
-                           .gfp_ptr = ptr, .gfp_field = expr.field_name});
-
-      translationVector.push_back(
-          LIR::Instruction{LIR::Instruction::Kind::Load,
-                           .load_lhs = {LIR::Operand::Kind::Var, fieldValueVar},
-                           .load_addr = {LIR::Operand::Kind::Var, fieldPtrVar}});
+      std::string fieldPtrVar = freshVar(ctx, {"Ptr", {fieldType}});
+      std::string fieldValueVar = freshVar(ctx, fieldType);
+
+      translationVector.push_back(LIR::gfp(varOperand(ctx, fieldPtrVar), ptr, nameId(ctx, expr.field_name)));
+
+      translationVector.push_back(LIR::load(varOperand(ctx, fieldValueVar), varOperand(ctx, fieldPtrVar)));
       
-      return {LIR::Operand::Kind::Var, fieldValueVar};
+      return varOperand(ctx, fieldValueVar);
     }
     
 
 
  case AST::Expr::Kind::New: {
     // Handle New expression
-    std::string tempVar = freshVar(counter);
+    std::string tempVar = freshVar(ctx);
     LIR::Operand size =
-        lowerExpression(*expr.new_size, translationVector, counter);
-    translationVector.push_back(LIR::Instruction{
-        LIR::Instruction::Kind::Alloc,
-        .alloc_lhs = {LIR::Operand::Kind::Var, tempVar}, .alloc_size = size});
-    return {LIR::Operand::Kind::Var, tempVar};
+        lowerExpression(*expr.new_size, translationVector, ctx);
+    translationVector.push_back(LIR::alloc(varOperand(ctx, tempVar), size));
+    return varOperand(ctx, tempVar);
   }
   default:
     throw std::runtime_error(
@@ -709,164 +669,240 @@ LIR::Operand lowerExpression(const AST::Expr &expr,
 
 LIR::Operand lowerLval(const AST::Lval &lval,
                        std::vector<LIR::Instruction> &translationVector,
-                       int &counter) {
+                       LoweringContext &ctx) {
   if (!lval.array_index && lval.field_name.empty() && lval.name != "Deref") {
-    return LIR::Operand{LIR::Operand::Kind::Var, lval.name};
+    return varOperand(ctx, lval.name);
   } else if (lval.array_index) {
     LIR::Operand arrayPtr =
-        lowerExpression(*lval.array_ptr, translationVector, counter);
+        lowerExpression(*lval.array_ptr, translationVector, ctx);
     LIR::Operand index =
-        lowerExpression(*lval.array_index, translationVector, counter);
+        lowerExpression(*lval.array_index, translationVector, ctx);
 
-    AST::Type arrayPtrType = getVarType(arrayPtr.var);
+    AST::Type arrayPtrType = getVarType(ctx, varName(ctx, arrayPtr));
     if (arrayPtrType.name != "Ptr" || arrayPtrType.params.empty()) {
       throw std::runtime_error("Invalid array pointer type.");
     }
 
-    std::string tempVar = freshVar(counter, arrayPtrType);
-    translationVector.push_back(
-        LIR::Instruction{LIR::Instruction::Kind::Gep,
-                         .gep_lhs = {LIR::Operand::Kind::Var, tempVar},
-                         .gep_ptr = arrayPtr, .gep_idx = index});
-    return {LIR::Operand::Kind::Var, tempVar};
+    std::string tempVar = freshVar(ctx, arrayPtrType);
+    translationVector.push_back(LIR::gep(varOperand(ctx, tempVar), arrayPtr, index));
+    return varOperand(ctx, tempVar);
   } else if (lval.name == "Deref") {
-    LIR::Operand ptr = lowerExpression(*lval.array_ptr, translationVector, counter);
-    AST::Type ptrType = getVarType(ptr.var);
+    LIR::Operand ptr = lowerExpression(*lval.array_ptr, translationVector, ctx);
+    AST::Type ptrType = getVarType(ctx, varName(ctx, ptr));
     if (ptrType.name != "Ptr" || ptrType.params.empty()) {
       throw std::runtime_error("Invalid pointer type for dereference.");
     }
     return ptr;
   } else if (!lval.field_name.empty()) {
         // Field access within a struct
-        LIR::Operand structPtr = lowerExpression(*lval.array_ptr, translationVector, counter);
-        AST::Type fieldType = getFieldTypeFromStruct(structPtr.var, lval.field_name);
+        LIR::Operand structPtr = lowerExpression(*lval.array_ptr, translationVector, ctx);
+        AST::Type fieldType = getFieldTypeFromStruct(ctx, varName(ctx, structPtr), lval.field_name);
 
-        std::string fieldPtrVar = freshVar(counter, {"Ptr", {fieldType}});
+        std::string fieldPtrVar = freshVar(ctx, {"Ptr", {fieldType}});
 
         translationVector.push_back(
-            LIR::Instruction{LIR::Instruction::Kind::Gfp,
-                             .gfp_lhs = {LIR::Operand::Kind::Var, fieldPtrVar},
-                             .gfp_ptr = structPtr, .gfp_field = lval.field_name});
+            LIR::gfp(varOperand(ctx, fieldPtrVar), structPtr, nameId(ctx, lval.field_name)));
 
-        return {LIR::Operand::Kind::Var, fieldPtrVar};
+        return varOperand(ctx, fieldPtrVar);
     }
   return LIR::Operand();
 }
 
 LIR::Operand lowerLvalAsExpr(const AST::Lval &lval,
                              std::vector<LIR::Instruction> &translationVector,
-                             int &counter) {
+                             LoweringContext &ctx) {
   if (!lval.array_index && lval.field_name.empty()) {
     // Simple identifier, directly get the value
-    return LIR::Operand{LIR::Operand::Kind::Var, lval.name};
+    return varOperand(ctx, lval.name);
   } else if (lval.array_index) {
     // Array access
-    std::string arrayBaseVar = freshVar(counter);
-    std::string indexVar = freshVar(counter);
-    std::string elemVar = freshVar(counter);
+    std::string arrayBaseVar = freshVar(ctx);
+    std::string indexVar = freshVar(ctx);
+    std::string elemVar = freshVar(ctx);
 
     // Lower the base pointer and index expressions
     LIR::Operand base =
-        lowerExpression(*lval.array_index, translationVector, counter);
+        lowerExpression(*lval.array_index, translationVector, ctx);
     LIR::Operand index =
-        lowerExpression(*lval.array_index, translationVector, counter);
+        lowerExpression(*lval.array_index, translationVector, ctx);
 
     // Compute the address using Gep and then load the value
-    translationVector.push_back(
-        LIR::Instruction{LIR::Instruction::Kind::Gep,
-                         .gep_lhs = {LIR::Operand::Kind::Var, arrayBaseVar},
-                         .gep_ptr = base, .gep_idx = index});
-    translationVector.push_back(
-        LIR::Instruction{LIR::Instruction::Kind::Load,
-                         .load_lhs = {LIR::Operand::Kind::Var, elemVar},
-                         .load_addr = {LIR::Operand::Kind::Var, arrayBaseVar}});
+    translationVector.push_back(LIR::gep(varOperand(ctx, arrayBaseVar), base, index));
+    translationVector.push_back(LIR::load(varOperand(ctx, elemVar), varOperand(ctx, arrayBaseVar)));
 
-    return {LIR::Operand::Kind::Var, elemVar};
+    return varOperand(ctx, elemVar);
   } else if (!lval.field_name.empty()) {
     // Field access within a struct
-    std::string structVar = freshVar(counter);
-    std::string fieldPtrVar = freshVar(counter);
-    std::string fieldValueVar = freshVar(counter);
+    std::string structVar = freshVar(ctx);
+    std::string fieldPtrVar = freshVar(ctx);
+    std::string fieldValueVar = freshVar(ctx);
 
     // Compute the field pointer and then load the field value
     translationVector.push_back(
-        LIR::Instruction{LIR::Instruction::Kind::Gfp,
-                         .gfp_lhs = {LIR::Operand::Kind::Var, fieldPtrVar},
-                         .gfp_ptr = {LIR::Operand::Kind::Var, lval.name},
-                         .gfp_field = lval.field_name});
-    translationVector.push_back(
-        LIR::Instruction{LIR::Instruction::Kind::Load,
-                         .load_lhs = {LIR::Operand::Kind::Var, fieldValueVar},
-                         .load_addr = {LIR::Operand::Kind::Var, fieldPtrVar}});
+        LIR::gfp(varOperand(ctx, fieldPtrVar), varOperand(ctx, lval.name), nameId(ctx, lval.field_name)));
+    translationVector.push_back(LIR::load(varOperand(ctx, fieldValueVar), varOperand(ctx, fieldPtrVar)));
 
-    return {LIR::Operand::Kind::Var, fieldValueVar};
+    return varOperand(ctx, fieldValueVar);
   }
 
   return LIR::Operand();
 }
 
-void constructCFG(const std::vector<LIR::Instruction> &translationVector,
+// Splits the translation vector into basic blocks. Every kept instruction is copied once (Instruction is
+// trivially copyable) into a vector reserved to its block's size beforehand, and that vector becomes the
+// block's own, so the allocations grow with the blocks and the instruction storage is allocated only once.
+void constructCFG(std::vector<LIR::Instruction> &&translationVector,
                   LIR::FunctionBody &functionBody) {
-  std::unordered_set<std::string> leaderLabels;
-  for (size_t i = 0; i < translationVector.size(); ++i) {
-    if (translationVector[i].kind == LIR::Instruction::Kind::Label) {
-      leaderLabels.insert(translationVector[i].label);
+  // Runs once per function on the workers, so the metrics are looked up once and not under the lock each time
+  static metrics::Timer &timer = metrics::timer("constructCFG");
+  static metrics::Counter &instructionCount = metrics::counter("instructions");
+  static metrics::Counter &blockCount = metrics::counter("blocks");
+  static metrics::Counter &lirBytes = metrics::counter("lir bytes");
+  metrics::Scope scope(timer);
+  instructionCount += translationVector.size();
+  constexpr uint32_t NONE = UINT32_MAX;
+  const LIR::Names &names = functionBody.names;
+  auto isTerminator = [](const LIR::Instruction &instr) {
+    return instr.kind == LIR::Instruction::Kind::Jump ||
+           instr.kind == LIR::Instruction::Kind::Branch ||
+           instr.kind == LIR::Instruction::Kind::Ret;
+  };
+
+  // Leader pre-pass: every Label leads a block in layout order. What follows a terminator up to the next
+  // Label can't be reached and is left out, the rest is counted so each block is allocated once.
+  std::vector<uint32_t> labelNames;                       // layout index -> name id of the label
+  std::vector<uint32_t> sizes;                            // layout index -> instructions kept
+  std::vector<uint32_t> blockOfName(names.size(), NONE); // name id of a label -> layout index
+  bool open = false;
+  for (const auto &instr : translationVector) {
+    if (instr.kind == LIR::Instruction::Kind::Label) {
+      blockOfName[instr.name] = static_cast<uint32_t>(labelNames.size());
+      labelNames.push_back(instr.name);
+      sizes.push_back(0);
+      open = true;
+    } else if (open) {
+      sizes.back()++;
+      open = !isTerminator(instr);
     }
   }
 
-  // Create basic blocks
-  std::string currentLabel;
-  LIR::BasicBlock currentBlock;
-  for (size_t i = 0; i < translationVector.size(); ++i) {
-    const auto &instr = translationVector[i];
-    if (leaderLabels.count(instr.label) > 0) {
-      if (!currentLabel.empty()) {
-        functionBody.basic_blocks[currentLabel] = std::move(currentBlock);
-      }
-      currentLabel = instr.label;
-      currentBlock = LIR::BasicBlock{currentLabel};
-      continue;
-    }
-    currentBlock.instructions.push_back(instr);
-    if (instr.kind == LIR::Instruction::Kind::Jump ||
-        instr.kind == LIR::Instruction::Kind::Branch ||
-        instr.kind == LIR::Instruction::Kind::Ret) {
-      functionBody.basic_blocks[currentLabel] = std::move(currentBlock);
-      currentLabel.clear();
+  std::vector<std::vector<LIR::Instruction>> laidOut(labelNames.size());
+  for (size_t block = 0; block < laidOut.size(); block++) {
+    laidOut[block].reserve(sizes[block]);
+  }
+  size_t current = 0;
+  open = false;
+  for (const auto &instr : translationVector) {
+    if (instr.kind == LIR::Instruction::Kind::Label) {
+      current = blockOfName[instr.name];
+      open = true;
+    } else if (open) {
+      open = !isTerminator(instr);
+      laidOut[current].push_back(instr);
     }
   }
-  if (!currentLabel.empty()) {
-    functionBody.basic_blocks[currentLabel] = std::move(currentBlock);
+  std::vector<LIR::Instruction>().swap(translationVector);
+
+  // The layout indices a block's terminator goes to; a block that falls off its end goes nowhere
+  struct Targets {
+    uint32_t to[2] = {};
+    uint32_t count = 0;
+  };
+  auto targets = [&](const std::vector<LIR::Instruction> &block) {
+    Targets targets;
+    if (block.empty()) {
+      return targets;
+    }
+    const auto &last = block.back();
+    if (last.kind == LIR::Instruction::Kind::Jump) {
+      targets.to[targets.count++] = last.name;
+    } else if (last.kind == LIR::Instruction::Kind::Branch) {
+      targets.to[targets.count++] = last.name;
+      targets.to[targets.count++] = last.next;
+    }
+    for (uint32_t i = 0; i < targets.count; i++) {
+      if (targets.to[i] >= blockOfName.size() || blockOfName[targets.to[i]] == NONE) {
+        throw std::runtime_error("Jump to an undefined label: " + names[targets.to[i]]);
+      }
+      targets.to[i] = blockOfName[targets.to[i]];
+    }
+    return targets;
+  };
+
+  // Remove unreachable basic blocks, walking from entry, the first block
+  std::vector<bool> reachable(laidOut.size(), false);
+  std::vector<uint32_t> worklist;
+  if (!laidOut.empty()) {
+    worklist.push_back(0);
   }
-
-  // Remove unreachable basic blocks
-  std::unordered_set<std::string> reachableLabels;
-  std::vector<std::string> worklist;
-  worklist.push_back("entry");
   while (!worklist.empty()) {
-    std::string label = worklist.back();
+    uint32_t block = worklist.back();
     worklist.pop_back();
-    if (reachableLabels.count(label) > 0) {
+    if (reachable[block]) {
       continue;
     }
-    reachableLabels.insert(label);
-    const auto &block = functionBody.basic_blocks[label];
-    const auto &lastInstr = block.instructions.back();
-    if (lastInstr.kind == LIR::Instruction::Kind::Jump) {
-      worklist.push_back(lastInstr.jump_target);
-    } else if (lastInstr.kind == LIR::Instruction::Kind::Branch) {
-      worklist.push_back(lastInstr.branch_tt);
-      worklist.push_back(lastInstr.branch_ff);
+    reachable[block] = true;
+    Targets out = targets(laidOut[block]);
+    worklist.insert(worklist.end(), out.to, out.to + out.count);
+  }
+
+  // Number the reachable blocks in label order and point the terminators at block ids
+  std::vector<uint32_t> order;
+  order.reserve(laidOut.size());
+  for (uint32_t block = 0; block < laidOut.size(); block++) {
+    if (reachable[block]) {
+      order.push_back(block);
     }
   }
-  for (auto it = functionBody.basic_blocks.begin();
-       it != functionBody.basic_blocks.end();) {
-    if (reachableLabels.count(it->first) == 0) {
-      it = functionBody.basic_blocks.erase(it);
-    } else {
-      ++it;
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return names[labelNames[a]] < names[labelNames[b]];
+  });
+  std::vector<uint32_t> idOf(laidOut.size(), NONE);
+  for (uint32_t id = 0; id < order.size(); id++) {
+    idOf[order[id]] = id;
+  }
+  std::vector<uint32_t> predecessorCount(order.size(), 0);
+  functionBody.blocks.resize(order.size());
+  functionBody.labels.reserve(order.size());
+  for (uint32_t id = 0; id < order.size(); id++) {
+    LIR::BasicBlock &block = functionBody.blocks[id];
+    Targets out = targets(laidOut[order[id]]);
+    block.successors.reserve(out.count);
+    for (uint32_t i = 0; i < out.count; i++) {
+      block.successors.push_back(idOf[out.to[i]]);
+      if (i == 0 || block.successors[1] != block.successors[0]) {
+        predecessorCount[block.successors[i]]++;
+      }
+    }
+    block.instructions = std::move(laidOut[order[id]]);
+    if (out.count > 0) {
+      auto &last = block.instructions.back();
+      last.name = block.successors[0];
+      if (out.count > 1) {
+        last.next = block.successors[1];
+      }
+    }
+    functionBody.labels.push_back(names[labelNames[order[id]]]);
+  }
+  for (uint32_t id = 0; id < order.size(); id++) {
+    functionBody.blocks[id].predecessors.reserve(predecessorCount[id]);
+  }
+  for (uint32_t id = 0; id < order.size(); id++) {
+    for (uint32_t successor : functionBody.blocks[id].successors) {
+      auto &predecessors = functionBody.blocks[successor].predecessors;
+      if (predecessors.empty() || predecessors.back() != id) {
+        predecessors.push_back(id);
+      }
     }
   }
+  blockCount += order.size();
+
+  // What the kept instructions and the call argument table take, for the memory benchmark
+  uint64_t bytes = functionBody.call_args.size() * sizeof(LIR::Operand);
+  for (const auto &block : functionBody.blocks) {
+    bytes += block.instructions.size() * sizeof(LIR::Instruction);
+  }
+  lirBytes += bytes;
 }
 
 void parseExpression(AST::Expr &expr, const json &expr_json);
@@ -894,6 +930,7 @@ AST::Type parseType(const json &type_json) {
 
 
 AST::Program parseAST(const json &ast_json) {
+  metrics::Scope scope("parseAST");
   AST::Program program;
 
   // Parse globals
@@ -918,7 +955,8 @@ AST::Program parseAST(const json &ast_json) {
       }
       AST::Type ret_type;
       if (extern_.value().contains("ret") &&
-          extern_.value()["ret"].contains("name")) {
+          (extern_.value()["ret"].is_string() ||
+           extern_.value()["ret"].contains("name"))) {
         ret_type = parseType(extern_.value()["ret"]);
       }
       program.externs[extern_.key()] = std::make_pair(param_types, ret_type);
@@ -948,11 +986,16 @@ AST::Program parseAST(const json &ast_json) {
         function.name = func["name"];
       }
 
-      // Parse parameters
+      // Parse parameters, a Decl or just the type
       if (func.contains("params") && func["params"].is_array()) {
         for (const auto &param : func["params"]) {
-          AST::Type param_type = parseType(param);
-          function.params.push_back(std::make_pair("", param_type));
+          if (param.is_object() && param.contains("typ")) {
+            std::string name = param.contains("name") ? param["name"].get<std::string>() : "";
+            function.params.push_back(std::make_pair(name, parseType(param["typ"])));
+          } else {
+            AST::Type param_type = parseType(param);
+            function.params.push_back(std::make_pair("", param_type));
+          }
         }
       }
 
@@ -1012,6 +1055,17 @@ AST::Program parseAST(const json &ast_json) {
   return program;
 }
 
+// The function a call names: only direct calls are lowered, so the callee is an Id
+std::string parseCallee(const json &callee_json) {
+    if (callee_json.is_string()) {
+        return callee_json.get<std::string>();
+    }
+    if (callee_json.is_object() && callee_json.contains("Id") && callee_json["Id"].is_string()) {
+        return callee_json["Id"].get<std::string>();
+    }
+    throw std::runtime_error("Only direct calls are lowered.");
+}
+
 void parseExpression(AST::Expr &expr, const json &expr_json) {
     if (expr_json.is_object() && expr_json.contains("Num")) {
         expr.kind = AST::Expr::Kind::Num;
@@ -1090,6 +1144,19 @@ void parseExpression(AST::Expr &expr, const json &expr_json) {
         }
           else if (expr_json.contains("RhsExp")) {
             parseExpression(expr, expr_json["RhsExp"]);
+        }
+        else if (expr_json.contains("Call")) {
+            expr.kind = AST::Expr::Kind::Call;
+            const auto &call_json = expr_json["Call"];
+            if (call_json.contains("callee")) {
+                expr.callee = parseCallee(call_json["callee"]);
+            }
+            if (call_json.contains("args") && call_json["args"].is_array()) {
+                for (const auto &arg : call_json["args"]) {
+                    expr.args.push_back(std::make_unique<AST::Expr>());
+                    parseExpression(*expr.args.back(), arg);
+                }
+            }
         }
          else {
             throw std::runtime_error("Unknown expression type.");
@@ -1188,14 +1255,620 @@ void parseStatement(std::unique_ptr<AST::Stmt> &statement, const json &stmt_json
                 statement->return_expr = std::make_unique<AST::Expr>();
                 parseExpression(*statement->return_expr, stmt_json["Return"]);
             }
+        } else if (stmt_json.contains("Call")) {
+            statement = std::make_unique<AST::Stmt>();
+            statement->kind = AST::Stmt::Kind::Call;
+            const auto &call_json = stmt_json["Call"];
+            if (call_json.contains("callee")) {
+                statement->call_callee = parseCallee(call_json["callee"]);
+            }
+            if (call_json.contains("args") && call_json["args"].is_array()) {
+                for (const auto &arg : call_json["args"]) {
+                    statement->call_args.push_back(std::make_unique<AST::Expr>());
+                    parseExpression(*statement->call_args.back(), arg);
+                }
+            }
         } else {
             throw std::runtime_error("Unrecognized statement type in JSON.");
         }
+    } else if (stmt_json == "Break" || stmt_json == "Continue") {
+        statement = std::make_unique<AST::Stmt>();
+        statement->kind = stmt_json == "Break" ? AST::Stmt::Kind::Break : AST::Stmt::Kind::Continue;
     } else {
         throw std::runtime_error("Invalid statement format in JSON.");
     }
 }
 
+// Builds the AST straight from the parser's SAX events, without the json DOM parseAST walks: the document
+// is never held, only the AST and one frame per open object or array. It reads what parseAST reads and gives
+// the same Program, errors included; a statement or expression object is decided by its first key rather
+// than by parseAST's order of contains() checks, which only differs on objects with several of them.
+class AstLoader : public nlohmann::json_sax<json> {
+public:
+  explicit AstLoader(AST::Program &program) : program(program) {}
+
+  bool null() override { return scalar(json::value_t::null); }
+  bool boolean(bool) override { return scalar(json::value_t::boolean); }
+  bool number_integer(number_integer_t value) override { return number(value); }
+  bool number_unsigned(number_unsigned_t value) override { return number(static_cast<number_integer_t>(value)); }
+  bool number_float(number_float_t value, const string_t &) override { return number(static_cast<number_integer_t>(value)); }
+  bool string(string_t &value) override { return scalar(json::value_t::string, &value); }
+  bool binary(binary_t &) override { return scalar(json::value_t::binary); }
+
+  bool start_object(std::size_t) override {
+    Slot slot = resolve(next(), false);
+    if (!isObject(slot.role)) {
+      other(slot, json::value_t::object);
+      slot = {};
+    } else if (slot.role == Role::Function) {
+      program.functions.emplace_back();
+      slot.target = &program.functions.back();
+    }
+    push(slot);
+    return true;
+  }
+
+  bool key(string_t &key) override {
+    Frame &frame = top();
+    frame.next = field(frame, key);
+    return true;
+  }
+
+  bool end_object() override {
+    finish(top());
+    depth--;
+    return true;
+  }
+
+  bool start_array(std::size_t) override {
+    Slot slot = resolve(next(), false);
+    if (!isList(slot.role)) {
+      other(slot, json::value_t::array);
+      slot = {};
+    }
+    push(slot).array = true;
+    return true;
+  }
+
+  bool end_array() override {
+    depth--;
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &ex) override {
+    throw std::runtime_error(ex.what());
+  }
+
+private:
+  // What a value means where it stands, named after the parseAST code that reads it
+  enum class Role {
+    Skip, Program, Globals, Global, Externs, Extern, TypeList, ExternRet, Structs, Struct, Fields, Field,
+    Functions, Function, Params, Param, Locals, Local, LocalDecl, LocalInit, Stmts, Stmt, Assign, If, While,
+    Return, CallStmt, Lval, LvalArray, LvalField, Expr, Exprs, Num, Name, DeclName, UnOp, BinOp, ArrayAccess, New,
+    FieldAccess, Call, Callee, CalleeId, Type
+  };
+
+  // A role and the AST node, string or frame the value is read into
+  struct Slot {
+    Role role = Role::Skip;
+    void *target = nullptr;
+  };
+
+  struct Frame {
+    Slot slot;
+    bool array = false;
+    Slot next;        // the value of an object's latest key
+    size_t index = 0; // an array's elements so far
+    bool done = false; // a statement, expression or l-value has its kind, a local its name, a callee its Id
+    // Declarations and type objects are only understood once they end, their parts wait here
+    std::string name;
+    json::value_t nameType = json::value_t::string; // what the name was, parseAST only reads it where it is used
+    AST::Type type, ptr, strct;
+    bool hasName = false, hasType = false, hasPtr = false, hasStruct = false;
+    std::vector<std::pair<std::string, AST::Type>> fields;
+    std::vector<std::unique_ptr<AST::Stmt>> stmts; // a function's, after its locals' initialisers
+  };
+
+  AST::Program &program;
+  // One frame per open object or array, reused as the depth goes up and down; a deque never moves them, so
+  // slots may point into the frames below
+  std::deque<Frame> stack;
+  size_t depth = 0;
+
+  Frame &push(const Slot &slot) {
+    if (depth == stack.size()) {
+      stack.emplace_back();
+    } else {
+      stack[depth] = Frame();
+    }
+    Frame &frame = stack[depth++];
+    frame.slot = slot;
+    return frame;
+  }
+
+  Frame &top() { return stack[depth - 1]; }
+
+  template <typename T> static T *make(std::unique_ptr<T> &node) {
+    node = std::make_unique<T>();
+    return node.get();
+  }
+
+  static bool isObject(Role role) {
+    switch (role) {
+    case Role::Program: case Role::Global: case Role::Externs: case Role::Extern: case Role::ExternRet:
+    case Role::Struct: case Role::Field: case Role::Function: case Role::Param: case Role::LocalDecl:
+    case Role::Stmt: case Role::Assign: case Role::If: case Role::While: case Role::CallStmt: case Role::Lval:
+    case Role::LvalArray: case Role::LvalField: case Role::Expr: case Role::UnOp: case Role::BinOp:
+    case Role::ArrayAccess: case Role::New: case Role::FieldAccess: case Role::Call: case Role::Callee:
+    case Role::Type:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  static bool isList(Role role) {
+    switch (role) {
+    case Role::Globals: case Role::TypeList: case Role::Structs: case Role::Fields: case Role::Functions:
+    case Role::Params: case Role::Locals: case Role::Local: case Role::Stmts: case Role::Exprs:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // The slot of the value starting now: the document, an array's next element or an object's latest key
+  Slot next() {
+    if (depth == 0) {
+      return {Role::Program, &program};
+    }
+    Frame &frame = top();
+    return frame.array ? element(frame) : frame.next;
+  }
+
+  Slot element(Frame &frame) {
+    void *target = frame.slot.target;
+    size_t index = frame.index++;
+    switch (frame.slot.role) {
+    case Role::Globals: return {Role::Global};
+    case Role::Structs: return {Role::Struct};
+    case Role::Functions: return {Role::Function};
+    case Role::Fields: return {Role::Field, target};
+    case Role::Params: return {Role::Param, target};
+    case Role::Locals: return {Role::Local, target};
+    case Role::Stmts: return {Role::Stmt, target};
+    case Role::TypeList: {
+      auto *types = static_cast<std::vector<AST::Type> *>(target);
+      types->emplace_back();
+      return {Role::Type, &types->back()};
+    }
+    case Role::Exprs: {
+      auto *exprs = static_cast<std::vector<std::unique_ptr<AST::Expr>> *>(target);
+      exprs->emplace_back();
+      return {Role::Expr, make(exprs->back())};
+    }
+    case Role::Local: // [Decl, initialiser]
+      if (index == 0) return {Role::LocalDecl, &frame};
+      if (index == 1) return {Role::LocalInit, &frame};
+      break;
+    default:
+      break;
+    }
+    return {};
+  }
+
+  Slot field(Frame &frame, const std::string &key) {
+    void *target = frame.slot.target;
+    switch (frame.slot.role) {
+    case Role::Program:
+      if (key == "globals") return {Role::Globals};
+      if (key == "externs") return {Role::Externs};
+      if (key == "structs") return {Role::Structs};
+      if (key == "functions") return {Role::Functions};
+      break;
+    case Role::Externs: {
+      auto &signature = program.externs[key];
+      signature = {};
+      return {Role::Extern, &signature};
+    }
+    case Role::Extern: {
+      auto *signature = static_cast<std::pair<std::vector<AST::Type>, AST::Type> *>(target);
+      if (key == "params") return {Role::TypeList, &signature->first};
+      if (key == "ret") return {Role::ExternRet, &signature->second};
+      break;
+    }
+    case Role::Struct:
+      if (key == "name") return {Role::Name, &frame.name};
+      if (key == "fields") return {Role::Fields, &frame.fields};
+      break;
+    case Role::Function: {
+      auto *function = static_cast<AST::Function *>(target);
+      if (key == "name") return {Role::Name, &function->name};
+      if (key == "params") return {Role::Params, function};
+      if (key == "locals") return {Role::Locals, function};
+      if (key == "stmts") return {Role::Stmts, &frame.stmts};
+      if (key == "rettyp") {
+        frame.hasType = true;
+        return {Role::Type, &function->ret_type};
+      }
+      break;
+    }
+    case Role::Global: case Role::Field: case Role::LocalDecl: case Role::Param: case Role::ExternRet:
+    case Role::Type:
+      if (key == "name") {
+        frame.hasName = true;
+        return {Role::DeclName, &frame};
+      }
+      if (key == "typ") {
+        frame.hasType = true;
+        return {Role::Type, &frame.type};
+      }
+      if (key == "Ptr") {
+        frame.hasPtr = true;
+        return {Role::Type, &frame.ptr};
+      }
+      if (key == "Struct") {
+        frame.hasStruct = true;
+        return {Role::Type, &frame.strct};
+      }
+      break;
+    case Role::Stmt: {
+      if (frame.done) break;
+      Role role;
+      AST::Stmt::Kind kind;
+      if (key == "Assign") role = Role::Assign, kind = AST::Stmt::Kind::Assign;
+      else if (key == "If") role = Role::If, kind = AST::Stmt::Kind::If;
+      else if (key == "While") role = Role::While, kind = AST::Stmt::Kind::While;
+      else if (key == "Return") role = Role::Return, kind = AST::Stmt::Kind::Return;
+      else if (key == "Call") role = Role::CallStmt, kind = AST::Stmt::Kind::Call;
+      else break;
+      auto *stmts = static_cast<std::vector<std::unique_ptr<AST::Stmt>> *>(target);
+      stmts->push_back(std::make_unique<AST::Stmt>());
+      stmts->back()->kind = kind;
+      frame.done = true;
+      return {role, stmts->back().get()};
+    }
+    case Role::Assign: {
+      auto *stmt = static_cast<AST::Stmt *>(target);
+      if (key == "lhs") return {Role::Lval, make(stmt->assign_lhs)};
+      if (key == "rhs") return {Role::Expr, make(stmt->assign_rhs)};
+      break;
+    }
+    case Role::If: {
+      auto *stmt = static_cast<AST::Stmt *>(target);
+      if (key == "guard") return {Role::Expr, make(stmt->if_guard)};
+      if (key == "tt") return {Role::Stmts, &stmt->if_then};
+      if (key == "ff") return {Role::Stmts, &stmt->if_else};
+      break;
+    }
+    case Role::While: {
+      auto *stmt = static_cast<AST::Stmt *>(target);
+      if (key == "guard") return {Role::Expr, make(stmt->while_guard)};
+      if (key == "body") return {Role::Stmts, &stmt->while_body};
+      break;
+    }
+    case Role::CallStmt: {
+      auto *stmt = static_cast<AST::Stmt *>(target);
+      if (key == "callee") return {Role::Callee, &stmt->call_callee};
+      if (key == "args") return {Role::Exprs, &stmt->call_args};
+      break;
+    }
+    case Role::Lval: {
+      if (frame.done) break;
+      auto *lval = static_cast<AST::Lval *>(target);
+      frame.done = true;
+      if (key == "Id") return {Role::Name, &lval->name};
+      if (key == "ArrayAccess") {
+        make(lval->array_ptr);
+        make(lval->array_index);
+        return {Role::LvalArray, lval};
+      }
+      if (key == "Deref") {
+        lval->name = "Deref";
+        return {Role::Expr, make(lval->array_ptr)};
+      }
+      if (key == "FieldAccess") {
+        make(lval->array_ptr);
+        return {Role::LvalField, lval};
+      }
+      frame.done = false;
+      break;
+    }
+    case Role::LvalArray: {
+      auto *lval = static_cast<AST::Lval *>(target);
+      if (key == "ptr") return {Role::Expr, lval->array_ptr.get()};
+      if (key == "index") return {Role::Expr, lval->array_index.get()};
+      break;
+    }
+    case Role::LvalField: {
+      auto *lval = static_cast<AST::Lval *>(target);
+      if (key == "ptr") return {Role::Expr, lval->array_ptr.get()};
+      if (key == "field") return {Role::Name, &lval->field_name};
+      break;
+    }
+    case Role::Expr:
+      if (!frame.done) return expression(frame, static_cast<AST::Expr *>(target), key);
+      break;
+    case Role::UnOp: {
+      auto *expr = static_cast<AST::Expr *>(target);
+      if (key == "op") return {Role::Name, &expr->unop};
+      if (key == "operand") {
+        frame.done = true;
+        return {Role::Expr, make(expr->left)};
+      }
+      break;
+    }
+    case Role::BinOp: {
+      auto *expr = static_cast<AST::Expr *>(target);
+      if (key == "op") return {Role::Name, &expr->binop};
+      if (key == "left") return {Role::Expr, make(expr->left)};
+      if (key == "right") return {Role::Expr, make(expr->right)};
+      break;
+    }
+    case Role::ArrayAccess: {
+      auto *expr = static_cast<AST::Expr *>(target);
+      if (key == "ptr") return {Role::Expr, make(expr->array_ptr)};
+      if (key == "index") return {Role::Expr, make(expr->array_index)};
+      break;
+    }
+    case Role::FieldAccess: {
+      auto *expr = static_cast<AST::Expr *>(target);
+      if (key == "ptr") return {Role::Expr, make(expr->field_ptr)};
+      if (key == "field") return {Role::Name, &expr->field_name};
+      break;
+    }
+    case Role::New: {
+      auto *expr = static_cast<AST::Expr *>(target);
+      if (key == "typ") return {Role::Type, &expr->new_type};
+      if (key == "amount") return {Role::Expr, make(expr->new_size)};
+      break;
+    }
+    case Role::Call: {
+      auto *expr = static_cast<AST::Expr *>(target);
+      if (key == "callee") return {Role::Callee, &expr->callee};
+      if (key == "args") return {Role::Exprs, &expr->args};
+      break;
+    }
+    case Role::Callee:
+      if (key == "Id") return {Role::CalleeId, target};
+      break;
+    default:
+      break;
+    }
+    return {};
+  }
+
+  Slot expression(Frame &frame, AST::Expr *expr, const std::string &key) {
+    using Kind = AST::Expr::Kind;
+    frame.done = true;
+    if (key == "Num") {
+      expr->kind = Kind::Num;
+      return {Role::Num, expr};
+    }
+    if (key == "Id") {
+      expr->kind = Kind::Id;
+      return {Role::Name, &expr->id};
+    }
+    if (key == "UnOp") {
+      expr->kind = Kind::UnOp;
+      return {Role::UnOp, expr};
+    }
+    if (key == "BinOp") {
+      expr->kind = Kind::BinOp;
+      return {Role::BinOp, expr};
+    }
+    if (key == "ArrayAccess") {
+      expr->kind = Kind::ArrayAccess;
+      return {Role::ArrayAccess, expr};
+    }
+    if (key == "New") {
+      expr->kind = Kind::New;
+      return {Role::New, expr};
+    }
+    if (key == "Deref") {
+      expr->kind = Kind::UnOp;
+      expr->unop = "Deref";
+      return {Role::Expr, make(expr->left)};
+    }
+    if (key == "FieldAccess") {
+      expr->kind = Kind::FieldAccess;
+      return {Role::FieldAccess, expr};
+    }
+    if (key == "RhsExp") {
+      return {Role::Expr, expr};
+    }
+    if (key == "Call") {
+      expr->kind = Kind::Call;
+      return {Role::Call, expr};
+    }
+    frame.done = false;
+    return {};
+  }
+
+  // A return value or local initialiser is an expression unless it is null; an initialiser becomes the
+  // leading assignment parseAST makes of it
+  Slot resolve(Slot slot, bool null) {
+    if (slot.role == Role::Return) {
+      if (null) return {};
+      return {Role::Expr, make(static_cast<AST::Stmt *>(slot.target)->return_expr)};
+    }
+    if (slot.role == Role::LocalInit) {
+      Frame *local = static_cast<Frame *>(slot.target);
+      if (null || !local->done) return {};
+      auto *function = static_cast<AST::Function *>(local->slot.target);
+      function->stmts.push_back(std::make_unique<AST::Stmt>());
+      AST::Stmt &assign = *function->stmts.back();
+      assign.kind = AST::Stmt::Kind::Assign;
+      make(assign.assign_lhs)->name = local->name;
+      return {Role::Expr, make(assign.assign_rhs)};
+    }
+    return slot;
+  }
+
+  bool number(number_integer_t value) {
+    Slot slot = next();
+    if (slot.role == Role::Num) {
+      static_cast<AST::Expr *>(slot.target)->num = static_cast<int>(value);
+    } else {
+      other(resolve(slot, false), json::value_t::number_integer);
+    }
+    return true;
+  }
+
+  bool scalar(json::value_t type, std::string *text = nullptr) {
+    other(resolve(next(), type == json::value_t::null), type, text);
+    return true;
+  }
+
+  // The error parseAST's conversion to std::string throws for a name that is not a string
+  static json::type_error notString(json::value_t type) {
+    return json::type_error::create(302, "type must be string, but is " + std::string(json(type).type_name()), nullptr);
+  }
+
+  // A value that is not the object or array its slot reads, of the given type: a string where one is allowed,
+  // otherwise ignored, or rejected with parseAST's error where parseAST rejects it
+  void other(const Slot &slot, json::value_t type, std::string *text = nullptr) {
+    switch (slot.role) {
+    case Role::Name:
+      if (!text) throw notString(type);
+      *static_cast<std::string *>(slot.target) = std::move(*text);
+      break;
+    case Role::DeclName: {
+      Frame *decl = static_cast<Frame *>(slot.target);
+      decl->nameType = type;
+      if (text) decl->name = std::move(*text);
+      break;
+    }
+    case Role::Type:
+    case Role::ExternRet:
+      if (text) static_cast<AST::Type *>(slot.target)->name = std::move(*text);
+      break;
+    case Role::Param: {
+      AST::Type type;
+      if (text) type.name = std::move(*text);
+      static_cast<AST::Function *>(slot.target)->params.emplace_back("", std::move(type));
+      break;
+    }
+    case Role::Expr:
+      if (text) {
+        auto *expr = static_cast<AST::Expr *>(slot.target);
+        if (*text == "Nil") {
+          expr->kind = AST::Expr::Kind::Nil;
+        } else {
+          expr->kind = AST::Expr::Kind::Id;
+          expr->id = std::move(*text);
+        }
+      }
+      break;
+    case Role::Stmt:
+      if (text && (*text == "Break" || *text == "Continue")) {
+        auto *stmts = static_cast<std::vector<std::unique_ptr<AST::Stmt>> *>(slot.target);
+        stmts->push_back(std::make_unique<AST::Stmt>());
+        stmts->back()->kind = *text == "Break" ? AST::Stmt::Kind::Break : AST::Stmt::Kind::Continue;
+        break;
+      }
+      throw std::runtime_error("Invalid statement format in JSON.");
+    case Role::Lval:
+      throw std::runtime_error("Unrecognized LHS in Assign statement.");
+    case Role::UnOp:
+      throw std::runtime_error("Dereference expression missing operand.");
+    case Role::Num:
+      throw std::runtime_error("Num expression is not a number.");
+    case Role::CalleeId:
+      if (text) top().done = true;
+      [[fallthrough]];
+    case Role::Callee:
+      if (!text) throw std::runtime_error("Only direct calls are lowered.");
+      *static_cast<std::string *>(slot.target) = std::move(*text);
+      break;
+    default:
+      break;
+    }
+  }
+
+  // A declaration's name where parseAST reads it, a string or parseAST's error
+  static std::string &nameOf(Frame &frame) {
+    if (frame.nameType != json::value_t::string) throw notString(frame.nameType);
+    return frame.name;
+  }
+
+  AST::Type typeOf(const Frame &frame) {
+    if (frame.hasPtr) return AST::Type{"Ptr", {frame.ptr}};
+    if (frame.hasStruct) return AST::Type{"Struct", {frame.strct}};
+    throw std::runtime_error("Unknown type structure in JSON.");
+  }
+
+  void finish(Frame &frame) {
+    void *target = frame.slot.target;
+    switch (frame.slot.role) {
+    case Role::Global:
+      if (frame.hasName && frame.hasType) program.globals[nameOf(frame)] = std::move(frame.type);
+      break;
+    case Role::Struct:
+      program.structs[frame.name] = std::move(frame.fields);
+      break;
+    case Role::Field:
+      if (frame.hasName && frame.hasType) {
+        static_cast<std::vector<std::pair<std::string, AST::Type>> *>(target)->emplace_back(
+            std::move(nameOf(frame)), std::move(frame.type));
+      }
+      break;
+    case Role::Function: {
+      auto *function = static_cast<AST::Function *>(target);
+      if (!frame.hasType) function->ret_type.name = "void";
+      for (auto &stmt : frame.stmts) function->stmts.push_back(std::move(stmt));
+      break;
+    }
+    case Role::Param: {
+      auto &params = static_cast<AST::Function *>(target)->params;
+      if (frame.hasType) params.emplace_back(std::move(nameOf(frame)), std::move(frame.type));
+      else params.emplace_back("", typeOf(frame));
+      break;
+    }
+    case Role::LocalDecl:
+      if (frame.hasName) {
+        Frame *local = static_cast<Frame *>(target);
+        static_cast<AST::Function *>(local->slot.target)->locals.emplace_back(nameOf(frame), std::move(frame.type));
+        local->name = std::move(frame.name);
+        local->done = true;
+      }
+      break;
+    case Role::ExternRet:
+      if (frame.hasName) *static_cast<AST::Type *>(target) = typeOf(frame);
+      break;
+    case Role::Type:
+      *static_cast<AST::Type *>(target) = typeOf(frame);
+      break;
+    case Role::Stmt:
+      if (!frame.done) throw std::runtime_error("Unrecognized statement type in JSON.");
+      break;
+    case Role::Lval:
+      if (!frame.done) throw std::runtime_error("Unrecognized LHS in Assign statement.");
+      break;
+    case Role::Expr:
+      if (!frame.done) throw std::runtime_error("Unknown expression type.");
+      break;
+    case Role::UnOp:
+      if (!frame.done) throw std::runtime_error("Dereference expression missing operand.");
+      break;
+    case Role::Callee:
+      if (!frame.done) throw std::runtime_error("Only direct calls are lowered.");
+      break;
+    default:
+      break;
+    }
+  }
+};
+
+// Reads an AST dump with AstLoader as it streams in; lower -dom reads it into a json DOM for parseAST instead
+AST::Program loadAST(std::istream &in) {
+  metrics::Scope scope("loadAST");
+  AST::Program program;
+  AstLoader loader(program);
+  json::sax_parse(in, &loader);
+  return program;
+}
+
 // Helper function to format types, handling nested types like Ptr(Int)
 std::string formatType(const AST::Type &type) {
   if (type.name == "Ptr" && !type.params.empty()) {
@@ -1210,8 +1883,27 @@ std::string formatType(const AST::Type &type) {
 
 
 
+// How outputLIR spells an operator: Neg is the subtraction from 0 it lowers to
+const char *opName(LIR::Instruction::Op op) {
+  switch (op) {
+  case LIR::Instruction::Op::Add: return "add";
+  case LIR::Instruction::Op::Sub:
+  case LIR::Instruction::Op::Neg: return "sub";
+  case LIR::Instruction::Op::Mul: return "mul";
+  case LIR::Instruction::Op::Div: return "div";
+  case LIR::Instruction::Op::Equal: return "eq";
+  case LIR::Instruction::Op::NotEq: return "neq";
+  case LIR::Instruction::Op::Lt: return "lt";
+  case LIR::Instruction::Op::Lte: return "lte";
+  case LIR::Instruction::Op::Gt: return "gt";
+  case LIR::Instruction::Op::Gte: return "gte";
+  default: return "";
+  }
+}
+
 // Function to output the LIR data structure
 void outputLIR(const LIR::Program &lir) {
+  metrics::Scope scope("outputLIR");
   // Output structs
   // Collect and sort struct names
   std::vector<std::string> structNames;
@@ -1264,11 +1956,9 @@ void outputLIR(const LIR::Program &lir) {
       allLocals.emplace_back(local);
     }
 
-    // Add global temporary variables to the vector
-    for (const auto &tempVar : tempVars) {
-      AST::Type tempVarType;
-      tempVarType.name = tempVar.second;
-      allLocals.emplace_back(tempVar.first, tempVarType);
+    // Add the function's temporary variables to the vector
+    for (const auto &temp : func.temps) {
+      allLocals.emplace_back(temp);
     }
     std::sort(allLocals.begin(), allLocals.end(),
               [](const auto &a, const auto &b) { return a.first < b.first; });
@@ -1277,172 +1967,68 @@ void outputLIR(const LIR::Program &lir) {
       std::cout << "    " << name << " : " << formatType(type) << "\n";
     }
 
-    // Output basic blocks
-    std::vector<std::string> sortedLabels;
-    for (const auto &block : func.body.basic_blocks) {
-      sortedLabels.push_back(block.first);
-    }
-    std::sort(sortedLabels.begin(), sortedLabels.end());
+    // Output basic blocks, which are numbered in label order
+    const std::vector<std::string> &labels = func.body.labels;
+    const LIR::Names &names = func.body.names;
+    auto operand = [&](const LIR::Operand &op) -> std::string {
+      if (op.kind == LIR::Operand::Kind::Const) {
+        return std::to_string(op.value);
+      }
+      return op.kind == LIR::Operand::Kind::Var ? names[op.value] : "";
+    };
 
-    for (const auto &label : sortedLabels) {
-      const auto &block = func.body.basic_blocks.at(label);
-      std::cout << "  " << block.label << ":\n";
+    for (uint32_t id = 0; id < func.body.blocks.size(); id++) {
+      const auto &block = func.body.blocks[id];
+      std::cout << "  " << labels[id] << ":\n";
       for (const auto &instr : block.instructions) {
         std::cout << "    ";
         switch (instr.kind) {
         case LIR::Instruction::Kind::Copy:
-          std::cout << "Copy(" << instr.copy_lhs.var << ", ";
-          if (instr.copy_rhs.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.copy_rhs.var;
-          } else {
-            std::cout << instr.copy_rhs.constant;
-          }
-          std::cout << ")\n";
+          std::cout << "Copy(" << operand(instr.ops[0]) << ", " << operand(instr.ops[1]) << ")\n";
           break;
 
-        case LIR::Instruction::Kind::Cmp: {
-          std::string cmpOp = instr.cmp_op;
-          if (cmpOp == "Equal")
-            cmpOp = "eq";
-          else if (cmpOp == "NotEq")
-            cmpOp = "neq";
-          else {
-            std::transform(cmpOp.begin(), cmpOp.end(), cmpOp.begin(),
-                           ::tolower);
-          }
-
-          std::cout << "Cmp(";
-          if (instr.cmp_lhs.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.cmp_lhs.var;
-          } else {
-            std::cout << instr.cmp_lhs.constant;
-          }
-          std::cout << ", " << cmpOp << ", ";
-          if (instr.cmp_op1.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.cmp_op1.var;
-          } else {
-            std::cout << instr.cmp_op1.constant;
-          }
-          std::cout << ", ";
-          if (instr.cmp_op2.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.cmp_op2.var;
-          } else {
-            std::cout << instr.cmp_op2.constant;
-          }
-          std::cout << ")\n";
+        case LIR::Instruction::Kind::Cmp:
+          std::cout << "Cmp(" << operand(instr.ops[0]) << ", " << opName(instr.op) << ", "
+                    << operand(instr.ops[1]) << ", " << operand(instr.ops[2]) << ")\n";
           break;
-        }
-
-        case LIR::Instruction::Kind::Arith: {
-          std::string arithOp = instr.arith_op;
-          if (arithOp == "Neg")
-            arithOp = "sub";
-          else {
-            std::transform(arithOp.begin(), arithOp.end(), arithOp.begin(),
-                           ::tolower);
-          }
 
-          std::cout << "Arith(" << instr.arith_lhs.var << ", " << arithOp
-                    << ", ";
-          if (instr.arith_op1.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.arith_op1.var;
-          } else {
-            std::cout << instr.arith_op1.constant;
-          }
-          std::cout << ", ";
-          if (instr.arith_op2.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.arith_op2.var;
-          } else {
-            std::cout << instr.arith_op2.constant;
-          }
-          std::cout << ")\n";
+        case LIR::Instruction::Kind::Arith:
+          std::cout << "Arith(" << operand(instr.ops[0]) << ", " << opName(instr.op) << ", "
+                    << operand(instr.ops[1]) << ", " << operand(instr.ops[2]) << ")\n";
           break;
-        }
 
         case LIR::Instruction::Kind::Branch:
-          std::cout << "Branch(";
-          if (instr.branch_guard.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.branch_guard.var;
-          } else {
-            std::cout << instr.branch_guard.constant;
-          }
-          std::cout << ", " << instr.branch_tt << ", " << instr.branch_ff
-                    << ")\n";
+          std::cout << "Branch(" << operand(instr.ops[0]) << ", " << labels[instr.name] << ", "
+                    << labels[instr.next] << ")\n";
           break;
 
         case LIR::Instruction::Kind::Jump:
-          std::cout << "Jump(" << instr.jump_target << ")\n";
+          std::cout << "Jump(" << labels[instr.name] << ")\n";
           break;
 
         case LIR::Instruction::Kind::Ret:
-          std::cout << "Ret(";
-          if (instr.ret_val.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.ret_val.var;
-          } else {
-            std::cout << instr.ret_val.constant;
-          }
-          std::cout << ")\n";
+          std::cout << "Ret(" << operand(instr.ops[0]) << ")\n";
           break;
 
         case LIR::Instruction::Kind::Alloc:
-          std::cout << "Alloc(" << instr.alloc_lhs.var << ", ";
-          if (instr.alloc_size.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.alloc_size.var;
-          } else {
-            std::cout << instr.alloc_size.constant;
-          }
-          std::cout << ")\n";
+          std::cout << "Alloc(" << operand(instr.ops[0]) << ", " << operand(instr.ops[1]) << ")\n";
           break;
 
         case LIR::Instruction::Kind::Gep:
-          std::cout << "Gep(" << instr.gep_lhs.var << ", ";
-          if (instr.gep_ptr.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.gep_ptr.var;
-          } else {
-            std::cout << instr.gep_ptr.constant;
-          }
-          std::cout << ", ";
-          if (instr.gep_idx.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.gep_idx.var;
-          } else {
-            std::cout << instr.gep_idx.constant;
-          }
-          std::cout << ")\n";
+          std::cout << "Gep(" << operand(instr.ops[0]) << ", " << operand(instr.ops[1]) << ", "
+                    << operand(instr.ops[2]) << ")\n";
           break;
 
         case LIR::Instruction::Kind::Load:
-          std::cout << "Load(" << instr.load_lhs.var << ", ";
-          if (instr.load_addr.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.load_addr.var;
-          } else {
-            std::cout << instr.load_addr.constant;
-          }
-          std::cout << ")\n";
+          std::cout << "Load(" << operand(instr.ops[0]) << ", " << operand(instr.ops[1]) << ")\n";
           break;
         case LIR::Instruction::Kind::Store:
-          std::cout << "Store(";
-          if (instr.store_addr.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.store_addr.var;
-          } else {
-            std::cout << instr.store_addr.constant;
-          }
-          std::cout << ", ";
-          if (instr.store_val.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.store_val.var;
-          } else {
-            std::cout << instr.store_val.constant;
-          }
-          std::cout << ")\n";
+          std::cout << "Store(" << operand(instr.ops[0]) << ", " << operand(instr.ops[1]) << ")\n";
           break;
 
-                case LIR::Instruction::Kind::Gfp:
-          std::cout << "Gfp(" << instr.gfp_lhs.var << ", ";
-          if (instr.gfp_ptr.kind == LIR::Operand::Kind::Var) {
-            std::cout << instr.gfp_ptr.var;
-          } else {
-            std::cout << instr.gfp_ptr.constant;
-          }
-          std::cout << ", " << instr.gfp_field << ")\n";
+        case LIR::Instruction::Kind::Gfp:
+          std::cout << "Gfp(" << operand(instr.ops[0]) << ", " << operand(instr.ops[1]) << ", "
+                    << names[instr.name] << ")\n";
           break;
         default:
           std::cout << "Unknown instruction kind\n";
@@ -1456,23 +2042,404 @@ void outputLIR(const LIR::Program &lir) {
   }
 }
 
+// The LIR as the reference JSON that codegen and opt read (lower -json). Types are "Int", {"Ptr": t},
+// {"Struct": name} or {"Fn": {"prms", "ret"}}; every variable carries its type and, unless it is a global,
+// the function it belongs to. Calls to defined functions end their block, as CallDirect terminators whose
+// next_bb is a block holding the rest of the instructions.
+json typeJson(const AST::Type &type) {
+  if (type.name == "Ptr" && !type.params.empty()) {
+    return {{"Ptr", typeJson(type.params[0])}};
+  } else if (type.name == "Struct" && !type.params.empty()) {
+    return {{"Struct", type.params[0].name}};
+  } else if (type.name == "Fn" && !type.params.empty()) {
+    json prms = json::array();
+    for (size_t i = 0; i + 1 < type.params.size(); i++) {
+      prms.push_back(typeJson(type.params[i]));
+    }
+    return {{"Fn", {{"prms", prms}, {"ret", typeJson(type.params.back())}}}};
+  } else if (type.name == "void" || type.name == "_" || type.name.empty()) {
+    return nullptr;
+  }
+  return formatType(type);
+}
+
+json varJson(const LIR::Program &lir, const LIR::Function *function, const std::string &name,
+             const std::unordered_set<std::string> &globalNames) {
+  bool global = globalNames.count(name) > 0;
+  const AST::Type *type = findVarType(lir, global ? nullptr : function, name);
+  return {{"name", name},
+          {"typ", type ? typeJson(*type) : json("Int")},
+          {"scope", global ? json(nullptr) : json(function->name)}};
+}
+
+std::string lirArithOp(LIR::Instruction::Op op) {
+  if (op == LIR::Instruction::Op::Add) return "Add";
+  if (op == LIR::Instruction::Op::Sub || op == LIR::Instruction::Op::Neg) return "Subtract";
+  if (op == LIR::Instruction::Op::Mul) return "Multiply";
+  return "Divide";
+}
+
+std::string lirCmpOp(LIR::Instruction::Op op) {
+  if (op == LIR::Instruction::Op::Equal) return "Eq";
+  if (op == LIR::Instruction::Op::NotEq) return "Neq";
+  if (op == LIR::Instruction::Op::Lt) return "Less";
+  if (op == LIR::Instruction::Op::Lte) return "LessEq";
+  if (op == LIR::Instruction::Op::Gt) return "Greater";
+  return "GreaterEq";
+}
+
+void outputLIRJson(const LIR::Program &lir, std::ostream &os) {
+  metrics::Scope scope("outputLIRJson");
+  json out;
+
+  out["structs"] = json::object();
+  for (const auto &[name, fields] : lir.structs) {
+    json jsonFields = json::array();
+    for (const auto &field : fields) {
+      jsonFields.push_back({{"name", field.first}, {"typ", typeJson(field.second)}});
+    }
+    out["structs"][name] = jsonFields;
+  }
+
+  std::unordered_set<std::string> globalNames;
+  std::vector<std::string> sortedGlobals;
+  for (const auto &global : lir.globals) {
+    globalNames.insert(global.first);
+    sortedGlobals.push_back(global.first);
+  }
+  std::sort(sortedGlobals.begin(), sortedGlobals.end());
+  out["globals"] = json::array();
+  for (const auto &name : sortedGlobals) {
+    out["globals"].push_back(varJson(lir, nullptr, name, globalNames));
+  }
+
+  // The LIR keeps only the names of extern parameter and return types
+  out["externs"] = json::object();
+  for (const auto &[name, signature] : lir.externs) {
+    AST::Type fn{"Fn"};
+    for (const auto &param : signature.first) fn.params.push_back({param});
+    fn.params.push_back({signature.second});
+    out["externs"][name] = typeJson(fn);
+  }
+
+  out["functions"] = json::object();
+  for (const auto &[funcName, func] : lir.functions) {
+    // A global is shadowed by a parameter or local of the same name
+    std::unordered_set<std::string> globalsHere = globalNames;
+    std::unordered_set<std::string> paramNames;
+    for (const auto &param : func.params) {
+      globalsHere.erase(param.first);
+      paramNames.insert(param.first);
+    }
+    std::set<std::string> locals; // the declared locals and every temporary the body uses
+    for (const auto &local : func.locals) {
+      globalsHere.erase(local.first);
+      locals.insert(local.first);
+    }
+    const LIR::Names &names = func.body.names;
+    auto operand = [&](const LIR::Operand &op) -> json {
+      if (op.kind == LIR::Operand::Kind::Const) {
+        return {{"CInt", op.value}};
+      }
+      static const std::string none;
+      const std::string &name = op.kind == LIR::Operand::Kind::Var ? names[op.value] : none;
+      if (!globalsHere.count(name) && !paramNames.count(name) &&
+          !lir.functions.count(name) && !lir.externs.count(name)) {
+        locals.insert(name);
+      }
+      return {{"Var", varJson(lir, &func, name, globalsHere)}};
+    };
+    auto var = [&](const LIR::Operand &op) { return operand(op)["Var"]; };
+    auto args = [&](const LIR::Instruction &call) {
+      json list = json::array();
+      for (uint32_t i = 0; i < call.argCount; i++) {
+        list.push_back(operand(func.body.call_args[call.firstArg + i]));
+      }
+      return list;
+    };
+
+    const std::vector<std::string> &labels = func.body.labels;
+    json body = json::object();
+    for (uint32_t block = 0; block < func.body.blocks.size(); block++) {
+      const std::string &label = labels[block];
+      std::string id = label;
+      json insts = json::array();
+      json term;
+      int calls = 0;
+      auto close = [&](json terminator) {
+        body[id] = {{"id", id}, {"insts", insts}, {"term", terminator}};
+        insts = json::array();
+      };
+
+      for (const auto &instr : func.body.blocks[block].instructions) {
+        switch (instr.kind) {
+        case LIR::Instruction::Kind::Copy:
+          insts.push_back({{"Copy", {{"lhs", var(instr.ops[0])}, {"op", operand(instr.ops[1])}}}});
+          break;
+        case LIR::Instruction::Kind::Arith:
+          insts.push_back({{"Arith", {{"lhs", var(instr.ops[0])}, {"aop", lirArithOp(instr.op)},
+                                      {"op1", operand(instr.ops[1])}, {"op2", operand(instr.ops[2])}}}});
+          break;
+        case LIR::Instruction::Kind::Cmp:
+          insts.push_back({{"Cmp", {{"lhs", var(instr.ops[0])}, {"rop", lirCmpOp(instr.op)},
+                                    {"op1", operand(instr.ops[1])}, {"op2", operand(instr.ops[2])}}}});
+          break;
+        case LIR::Instruction::Kind::Alloc:
+          insts.push_back({{"Alloc", {{"lhs", var(instr.ops[0])}, {"num", operand(instr.ops[1])},
+                                      {"id", var(instr.ops[0])}}}});
+          break;
+        case LIR::Instruction::Kind::Load:
+          insts.push_back({{"Load", {{"lhs", var(instr.ops[0])}, {"src", var(instr.ops[1])}}}});
+          break;
+        case LIR::Instruction::Kind::Store:
+          insts.push_back({{"Store", {{"dst", var(instr.ops[0])}, {"op", operand(instr.ops[1])}}}});
+          break;
+        case LIR::Instruction::Kind::Gep:
+          insts.push_back({{"Gep", {{"lhs", var(instr.ops[0])}, {"src", var(instr.ops[1])},
+                                    {"idx", operand(instr.ops[2])}, {"checked", true}}}});
+          break;
+        case LIR::Instruction::Kind::Gfp: {
+          const std::string &ptr = instr.ops[1].kind == LIR::Operand::Kind::Var ? names[instr.ops[1].value] : "";
+          const AST::Type *ptrType = findVarType(lir, globalsHere.count(ptr) ? nullptr : &func, ptr);
+          if (!ptrType) {
+            throw std::runtime_error("Type not found for variable: " + ptr);
+          }
+          insts.push_back({{"Gfp", {{"lhs", var(instr.ops[0])}, {"src", var(instr.ops[1])},
+                                    {"field", {{"name", names[instr.name]},
+                                               {"typ", typeJson(getFieldType(lir, *ptrType, names[instr.name]))}}}}}});
+          break;
+        }
+        case LIR::Instruction::Kind::CallDir:
+          if (lir.externs.count(names[instr.name])) {
+            insts.push_back({{"CallExt", {{"lhs", var(instr.ops[0])}, {"ext_callee", names[instr.name]},
+                                          {"args", args(instr)}}}});
+          } else {
+            std::string next = label + ".call" + std::to_string(++calls);
+            close({{"CallDirect", {{"lhs", var(instr.ops[0])}, {"callee", names[instr.name]},
+                                   {"args", args(instr)}, {"next_bb", next}}}});
+            id = next;
+          }
+          break;
+        case LIR::Instruction::Kind::Jump:
+          term = {{"Jump", labels[instr.name]}};
+          break;
+        case LIR::Instruction::Kind::Branch:
+          term = {{"Branch", {{"cond", operand(instr.ops[0])}, {"tt", labels[instr.name]},
+                              {"ff", labels[instr.next]}}}};
+          break;
+        case LIR::Instruction::Kind::Ret:
+          term = {{"Ret", instr.ops[0].kind == LIR::Operand::Kind::None ? json(nullptr) : operand(instr.ops[0])}};
+          break;
+        default:
+          break;
+        }
+        if (!term.is_null()) break;
+      }
+      close(term.is_null() ? json{{"Ret", nullptr}} : term); // falling off the end returns
+    }
+
+    json params = json::array();
+    for (const auto &param : func.params) {
+      params.push_back(varJson(lir, &func, param.first, globalsHere));
+    }
+    json jsonLocals = json::array();
+    for (const auto &name : locals) {
+      jsonLocals.push_back(varJson(lir, &func, name, globalsHere));
+    }
+    out["functions"][funcName] = {{"name", funcName},
+                                  {"params", params},
+                                  {"ret_ty", typeJson(AST::Type{func.ret_type})},
+                                  {"locals", jsonLocals},
+                                  {"body", body}};
+  }
+
+  os << out.dump() << "\n";
+}
+
+// The AST as the JSON dump lower reads (cflatc --emit ast-json), in the shapes parseAST and AstLoader
+// understand: types are "Int", {"Ptr": t} or {"Struct": name}, a function's parameters are Decls, and its
+// locals carry no initialisers since the AST already made them leading assignments.
+json astTypeJson(const AST::Type &type) {
+  if (type.name == "Ptr" && !type.params.empty()) {
+    return {{"Ptr", astTypeJson(type.params[0])}};
+  } else if (type.name == "Struct" && !type.params.empty()) {
+    return {{"Struct", type.params[0].name}};
+  }
+  return type.name;
+}
+
+json astExprJson(const AST::Expr &expr) {
+  using Kind = AST::Expr::Kind;
+  auto part = [](const std::unique_ptr<AST::Expr> &e) { return e ? astExprJson(*e) : json(nullptr); };
+  switch (expr.kind) {
+  case Kind::Num:
+    return {{"Num", expr.num}};
+  case Kind::Id:
+    return {{"Id", expr.id}};
+  case Kind::Nil:
+    return "Nil";
+  case Kind::UnOp:
+    return {{"UnOp", {{"op", expr.unop}, {"operand", part(expr.left)}}}};
+  case Kind::BinOp:
+    return {{"BinOp", {{"op", expr.binop}, {"left", part(expr.left)}, {"right", part(expr.right)}}}};
+  case Kind::ArrayAccess:
+    return {{"ArrayAccess", {{"ptr", part(expr.array_ptr)}, {"index", part(expr.array_index)}}}};
+  case Kind::FieldAccess:
+    return {{"FieldAccess", {{"ptr", part(expr.field_ptr)}, {"field", expr.field_name}}}};
+  case Kind::New:
+    return {{"New", {{"typ", astTypeJson(expr.new_type)}, {"amount", part(expr.new_size)}}}};
+  case Kind::Call: {
+    json args = json::array();
+    for (const auto &arg : expr.args) args.push_back(astExprJson(*arg));
+    return {{"Call", {{"callee", {{"Id", expr.callee}}}, {"args", args}}}};
+  }
+  }
+  return nullptr;
+}
+
+json astLvalJson(const AST::Lval &lval) {
+  if (!lval.array_ptr) {
+    return {{"Id", lval.name}};
+  } else if (lval.array_index) {
+    return {{"ArrayAccess", {{"ptr", astExprJson(*lval.array_ptr)}, {"index", astExprJson(*lval.array_index)}}}};
+  } else if (!lval.field_name.empty()) {
+    return {{"FieldAccess", {{"ptr", astExprJson(*lval.array_ptr)}, {"field", lval.field_name}}}};
+  }
+  return {{"Deref", astExprJson(*lval.array_ptr)}};
+}
+
+json astStmtsJson(const std::vector<std::unique_ptr<AST::Stmt>> &stmts);
+
+json astStmtJson(const AST::Stmt &stmt) {
+  using Kind = AST::Stmt::Kind;
+  switch (stmt.kind) {
+  case Kind::Assign:
+    return {{"Assign", {{"lhs", astLvalJson(*stmt.assign_lhs)}, {"rhs", astExprJson(*stmt.assign_rhs)}}}};
+  case Kind::If:
+    return {{"If", {{"guard", astExprJson(*stmt.if_guard)}, {"tt", astStmtsJson(stmt.if_then)}, {"ff", astStmtsJson(stmt.if_else)}}}};
+  case Kind::While:
+    return {{"While", {{"guard", astExprJson(*stmt.while_guard)}, {"body", astStmtsJson(stmt.while_body)}}}};
+  case Kind::Call: {
+    json args = json::array();
+    for (const auto &arg : stmt.call_args) args.push_back(astExprJson(*arg));
+    return {{"Call", {{"callee", {{"Id", stmt.call_callee}}}, {"args", args}}}};
+  }
+  case Kind::Continue:
+    return "Continue";
+  case Kind::Break:
+    return "Break";
+  case Kind::Return:
+    return {{"Return", stmt.return_expr ? astExprJson(*stmt.return_expr) : json(nullptr)}};
+  }
+  return nullptr;
+}
+
+json astStmtsJson(const std::vector<std::unique_ptr<AST::Stmt>> &stmts) {
+  json out = json::array();
+  for (const auto &stmt : stmts) out.push_back(astStmtJson(*stmt));
+  return out;
+}
+
+json astDeclsJson(const std::vector<std::pair<std::string, AST::Type>> &decls) {
+  json out = json::array();
+  for (const auto &[name, type] : decls) out.push_back({{"name", name}, {"typ", astTypeJson(type)}});
+  return out;
+}
+
+// Writes the dump a function at a time, so a caller building the AST as it goes (cflatc) never holds all of
+// it: the declarations are written when it is made, then function() for each function and finish()
+class AstJsonWriter {
+public:
+  AstJsonWriter(const AST::Program &declarations, std::ostream &os) : os(os) {
+    std::map<std::string, AST::Type> globals(declarations.globals.begin(), declarations.globals.end());
+    json globalsJson = json::array();
+    for (const auto &[name, type] : globals) globalsJson.push_back({{"name", name}, {"typ", astTypeJson(type)}});
+
+    std::map<std::string, std::vector<std::pair<std::string, AST::Type>>> structs(declarations.structs.begin(),
+                                                                                  declarations.structs.end());
+    json structsJson = json::array();
+    for (const auto &[name, fields] : structs) structsJson.push_back({{"name", name}, {"fields", astDeclsJson(fields)}});
+
+    json externsJson = json::object();
+    for (const auto &[name, signature] : declarations.externs) {
+      json params = json::array();
+      for (const auto &param : signature.first) params.push_back(astTypeJson(param));
+      externsJson[name] = {{"params", params}, {"ret", astTypeJson(signature.second)}};
+    }
+
+    os << "{\"globals\": " << globalsJson.dump() << ",\n\"structs\": " << structsJson.dump()
+       << ",\n\"externs\": " << externsJson.dump() << ",\n\"functions\": [";
+  }
+
+  void function(const AST::Function &func) {
+    json locals = json::array();
+    for (const auto &[name, type] : func.locals) {
+      locals.push_back({{{"name", name}, {"typ", astTypeJson(type)}}, nullptr});
+    }
+    json out = {{"name", func.name}, {"params", astDeclsJson(func.params)}, {"locals", locals}, {"stmts", astStmtsJson(func.stmts)}};
+    if (func.ret_type.name != "void") out["rettyp"] = astTypeJson(func.ret_type);
+    os << separator << out.dump();
+    separator = ",\n";
+  }
+
+  void finish() { os << "]}\n"; }
+
+private:
+  std::ostream &os;
+  const char *separator = "\n";
+};
+
+void outputASTJson(const AST::Program &ast, std::ostream &os) {
+  metrics::Scope scope("outputASTJson");
+  AstJsonWriter writer(ast, os);
+  for (const auto &func : ast.functions) writer.function(func);
+  writer.finish();
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3 && argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " <ast_file>" << std::endl;
+  std::string format = "-hr";
+  bool dom = false;
+  for (int a = 2; a < argc; a++) {
+    std::string arg = argv[a];
+    if (arg == "-j" && a + 1 < argc) {
+      lowerThreads = std::max(1, atoi(argv[++a]));
+    } else if (arg == "-dom") {
+      dom = true;
+    } else {
+      format = arg;
+    }
+  }
+  if (argc < 2 || (format != "-hr" && format != "-json" && format != "-load")) {
+    std::cerr << "Usage: " << argv[0] << " <ast_file> [-hr | -json | -load] [-dom] [-j threads]" << std::endl;
     return 1;
   }
 
+  // The AST streams in through AstLoader; -dom reads the whole document first, as parseAST needs it, and
+  // -load stops once the AST is built, to measure the two
   std::ifstream ast_file(argv[1]);
-  json ast_json;
-  ast_file >> ast_json;
-
-  AST::Program ast = parseAST(ast_json);
-
- 
+  AST::Program ast;
+  if (dom) {
+    json ast_json;
+    {
+      metrics::Scope scope("load");
+      ast_file >> ast_json;
+    }
+    ast = parseAST(ast_json);
+  } else {
+    ast = loadAST(ast_file);
+  }
+  if (format == "-load") {
+    return 0;
+  }
 
+  LIR::Program lir;
   lowerProgram(ast, lir);
 
-  outputLIR(lir);
+  if (format == "-json") {
+    outputLIRJson(lir, std::cout);
+  } else {
+    outputLIR(lir);
+  }
 
   return 0;
 }
@@ -5,9 +5,18 @@
 #include <optional>
 #include <variant>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <stdexcept>
 #include <exception>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <tuple>
+#include <string_view>
+#include <cstring>
+#include "../Common/metrics.hpp"
+#include "../Common/parallel.hpp"
 
 
 using namespace std;
@@ -16,387 +25,766 @@ using StructId = std::string;
 using FuncId = std::string;
 
 
-struct TypeError {
-    std::string message;
-    // Additional fields can be included, such as node position, etc.
+// Byte range of a token or node in the source file. Only lex -o token streams carry positions,
+// a span read from text tokens stays empty.
+struct Span {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+
+    bool valid() const { return length != 0; }
 
-    // Constructor for easy creation
-    TypeError(std::string msg) : message(msg) {}
+    // from the start of first to the end of last
+    static Span cover(Span first, Span last) {
+        if (!first.valid()) return last;
+        if (!last.valid() || last.offset + last.length < first.offset) return first;
+        return Span{first.offset, last.offset + last.length - first.offset};
+    }
 };
-std::vector<TypeError> typeErrors;     // Global variable to store type errors
 
-void addTypeError(const std::string& error) {   
-    typeErrors.push_back(TypeError(error));
-}
+// Byte offset -> line and column, from one scan for the newlines of the source. Only built when there
+// is an error to report, the lexer and parser never look at lines.
+class LineTable {
+    std::string text;
+    std::vector<uint32_t> lineStarts{0};
 
-void reportTypeErrors() {
-    std::sort(typeErrors.begin(), typeErrors.end(), [](const TypeError& a, const TypeError& b) {
-        return a.message < b.message;  // Sort based on the error message
-    });
+public:
+    explicit LineTable(std::string source) : text(std::move(source)) {
+        for (uint32_t i = 0; i < text.size(); i++) {
+            if (text[i] == '\n') lineStarts.push_back(i + 1);
+        }
+    }
 
-    for (const auto& error : typeErrors) {
-        std::cout << error.message << std::endl;
+    // 1-based line and column
+    std::pair<uint32_t, uint32_t> locate(uint32_t offset) const {
+        auto line = std::upper_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin();
+        return {static_cast<uint32_t>(line), offset - lineStarts[line - 1] + 1};
     }
+};
+
+struct Type;
+
+// The rule a type error breaks, one per message tag.
+enum class TypeErrorCode : uint8_t {
+    Array, AssignExp, AssignNew, BinopEq, BinopRest, Break, Continue, Deref, EcallAny, EcallExtern,
+    EcallInternal, Field, Function, Global, Id, If, Neg, Return1, Return2, ScallAny, ScallExtern,
+    ScallInternal, Struct, While
+};
+
+// Message text around the scope: "[ID] in function f: ...", "[GLOBAL] global g ...", "[STRUCT] struct s ..."
+struct TypeErrorTag {
+    const char* tag;
+    const char* before; // between the tag and the scope
+    const char* after;  // between the scope and the detail
+};
+const TypeErrorTag typeErrorTags[] = {
+    {"[ARRAY]", " in function ", ": "}, {"[ASSIGN-EXP]", " in function ", ": "},
+    {"[ASSIGN-NEW]", " in function ", ": "}, {"[BINOP-EQ]", " in function ", ": "},
+    {"[BINOP-REST]", " in function ", ": "}, {"[BREAK]", " in function ", ": "},
+    {"[CONTINUE]", " in function ", ": "}, {"[DEREF]", " in function ", ": "},
+    {"[ECALL-*]", " in function ", ": "}, {"[ECALL-EXTERN]", " in function ", ": "},
+    {"[ECALL-INTERNAL]", " in function ", ": "}, {"[FIELD]", " in function ", ": "},
+    {"[FUNCTION]", " in function ", ": "}, {"[GLOBAL]", " global ", " "},
+    {"[ID]", " in function ", ": "}, {"[IF]", " in function ", ": "},
+    {"[NEG]", " in function ", ": "}, {"[RETURN-1]", " in function ", ": "},
+    {"[RETURN-2]", " in function ", ": "}, {"[SCALL-*]", " in function ", ": "},
+    {"[SCALL-EXTERN]", " in function ", ": "}, {"[SCALL-INTERNAL]", " in function ", ": "},
+    {"[STRUCT]", " struct ", " "}, {"[WHILE]", " in function ", ": "},
+};
+
+// A type error is recorded as its pieces and only turned into text when it is printed. Names point into
+// the Program and types into the TypeContext, both outlive the report.
+using TypeErrorArg = std::variant<std::string_view, Type*, size_t>;
+struct TypeError {
+    TypeErrorCode code;
+    uint8_t argCount = 0;
+    Span span;              // the node the error is about, empty when the tokens had no positions
+    std::string_view scope; // the function it is in, or the global / struct it is about
+    const char* detail;     // the rest of the message, every {} is the next argument
+    TypeErrorArg args[3];
+    uint64_t key = 0;       // sort key, see reportTypeErrors
+
+    std::string detailText() const;
+};
+std::vector<TypeError> typeErrors;     // Global variable to store type errors
+thread_local std::vector<TypeError>* errorSink = nullptr; // a checker thread's own buffer, see function_check
+
+void addTypeError(TypeErrorCode code, std::string_view scope, const char* detail,
+                  std::initializer_list<TypeErrorArg> args = {}, Span span = Span()) {
+    TypeError error;
+    error.code = code;
+    error.span = span;
+    error.scope = scope;
+    error.detail = detail;
+    for (const auto& arg : args) error.args[error.argCount++] = arg;
+    (errorSink ? *errorSink : typeErrors).push_back(error);
 }
 
 
-// Base type class
+// Every Type and AST node carries its concrete class as a kind tag, set by the constructor. Dispatch
+// switches on the tag and as<T>() is the checked downcast, so none of it needs RTTI.
+enum class TypeKind { Any, Int, Struct, Fn, Ptr };
+enum class ExpKind { Num, Id, Nil, UnOp, BinOp, ArrayAccess, FieldAccess, Call };
+enum class LvalKind { Id, Deref, ArrayAccess, FieldAccess };
+enum class RhsKind { Exp, New };
+enum class StmtKind { Break, Continue, If, While, Return, Assign, Call };
+
+// as<T>(p) is p as a T when p is one, nullptr otherwise (p may be null)
+template <class T, class Base>
+T* as(Base* node) {
+    return node && node->kind == T::KIND ? static_cast<T*>(node) : nullptr;
+}
+template <class T, class Base>
+const T* as(const Base* node) {
+    return node && node->kind == T::KIND ? static_cast<const T*>(node) : nullptr;
+}
+
+// Base type class. Types are canonical: every distinct type exists once in the TypeContext, so two types
+// are equal when they are the same object. The only exception is `_`, which matches anything, also when
+// it sits inside a pointer or function type (nil is `&_`).
 struct Type {
-    virtual std::string toString() = 0;
+    const TypeKind kind;
+    const bool hasAny; // `_` appears somewhere in this type
+    explicit Type(TypeKind kind, bool hasAny = false) : kind(kind), hasAny(hasAny) {}
+    Type(const Type&) = delete;
+    Type& operator=(const Type&) = delete;
     virtual ~Type() = default;
-    virtual bool operator==(const Type& other) const = 0;
-    virtual std::unique_ptr<Type> clone() const = 0;
+    virtual std::string toString() = 0;
+
+    // toString() spelled once per canonical type, for the error report (not thread safe)
+    const std::string& text() {
+        if (spelling.empty()) spelling = toString();
+        return spelling;
+    }
+
+    bool operator==(const Type& other) const {
+        if (this == &other) return true;
+        if (!hasAny && !other.hasAny) return false;
+        return matches(other);
+    }
+protected:
+    // structural compare, only reached when one side mentions `_`
+    virtual bool matches(const Type& other) const = 0;
+private:
+    std::string spelling;
 };
 
 struct Any : Type{
-    bool operator==(const Type& other) const override {
-        return true;
-    }
+    static constexpr TypeKind KIND = TypeKind::Any;
+    Any() : Type(KIND, true) {}
     std::string toString() override { return "_"; }
-
-    std::unique_ptr<Type> clone() const override {
-        return std::make_unique<Any>();
+protected:
+    bool matches(const Type& other) const override {
+        return true;
     }
 };
 
 // Integer type
 struct Int : Type {
+    static constexpr TypeKind KIND = TypeKind::Int;
+    Int() : Type(KIND) {}
     std::string toString() override { return "int"; }
-    bool operator==(const Type& other) const override {
-        if (dynamic_cast<const Int*>(&other)) {
-            return true;
-        }
-        if (const Any* a = dynamic_cast<const Any*>(&other)) {
-            return true;
-        }
-        return false;
-    }
-    std::unique_ptr<Type> clone() const override {
-        return std::make_unique<Int>();
+protected:
+    bool matches(const Type& other) const override {
+        return as<Any>(&other) != nullptr;
     }
 };
 
-// Struct type
+// Struct type. The canonical type only carries the name; a declaration in Program::structs also lists
+// the fields.
 struct Struct : Type {
+    static constexpr TypeKind KIND = TypeKind::Struct;
     StructId name;
-    std::vector<std::pair<std::string, std::unique_ptr<Type>>> fields;
-
+    std::vector<std::pair<std::string, Type*>> fields;
 
-        Struct(StructId name, std::vector<std::pair<std::string, std::unique_ptr<Type>>> fields)
-        : name(std::move(name)), fields(std::move(fields)) {}
+        Struct(StructId name, std::vector<std::pair<std::string, Type*>> fields = {})
+        : Type(KIND), name(std::move(name)), fields(std::move(fields)) {}
+    Struct(Struct&& other) : Type(KIND), name(std::move(other.name)), fields(std::move(other.fields)) {}
 
     std::string toString() override {return name;}
-    bool operator==(const Type& other) const override {
-        if (const Struct* s = dynamic_cast<const Struct*>(&other)) {
-            return name == s->name;
-        }
-        if (const Any* a = dynamic_cast<const Any*>(&other)) {
-            return true;
-        }
-        return false;
-    }
-    std::unique_ptr<Type> clone() const override {
-        std::vector<std::pair<std::string, std::unique_ptr<Type>>> clonedFields;
-        for (const auto& field : fields) {
-            clonedFields.push_back({field.first, field.second->clone()});
-        }
-        return std::make_unique<Struct>(name, std::move(clonedFields));
+protected:
+    bool matches(const Type& other) const override {
+        return as<Any>(&other) != nullptr;
     }
 };
-struct Array : Type {
-    std::unique_ptr<Type> elemType;
-    Array(std::unique_ptr<Type> elemType) : elemType(std::move(elemType)) {}
-};
 // Function type
 struct Fn : Type {
-    std::vector<std::unique_ptr<Type>> params;
-    std::unique_ptr<Type> ret;
+    static constexpr TypeKind KIND = TypeKind::Fn;
+    std::vector<Type*> params;
+    Type* ret; // nullptr when the function returns nothing
 
-        Fn(std::vector<std::unique_ptr<Type>> params, std::unique_ptr<Type> ret)
-        : params(std::move(params)), ret(std::move(ret)) {}
+        Fn(std::vector<Type*> params, Type* ret)
+        : Type(KIND, std::any_of(params.begin(), params.end(), [](Type* t) { return t->hasAny; }) || (ret && ret->hasAny)),
+          params(std::move(params)), ret(ret) {}
     std::string toString() override {
         std::string prms = "";
-        if (!ret){}
         for (size_t i = 0; i < params.size(); ++i) {
             prms += (i == 0 ? "" : ", ") + params[i]->toString();
         }
         return "(" + prms + ")" + " -> " +(ret ? ret->toString() : "_");
         }
-
-    bool operator==(const Type& other) const override {
-        if (const Fn* f = dynamic_cast<const Fn*>(&other)) {
+protected:
+    bool matches(const Type& other) const override {
+        if (const Fn* f = as<Fn>(&other)) {
             if (params.size() != f->params.size()) {
                 return false;
             }
             for (size_t i = 0; i < params.size(); ++i) {
-                if (!params[i]->operator==(*f->params[i])) {
+                if (!(*params[i] == *f->params[i])) {
                     return false;
                 }
             }
             if (ret && f->ret) {
-                return ret->operator==(*f->ret);
+                return *ret == *f->ret;
             }
             return !ret && !f->ret;
         }
-        if (const Any* a = dynamic_cast<const Any*>(&other)) {
-            return true;
-        }
-        return false;
-    }
-    std::unique_ptr<Type> clone() const override {
-        std::vector<std::unique_ptr<Type>> clonedParams;
-        for (const auto& param : params) {
-            if (param) {
-            clonedParams.push_back(param->clone());
-        } else {
-            // Handle or log the null case
-            clonedParams.push_back(nullptr);
-        }
-        }
-        return std::make_unique<Fn>(std::move(clonedParams), ret ? ret->clone() : nullptr);
+        return as<Any>(&other) != nullptr;
     }
 };
 
 // Pointer type
 struct Ptr : Type {
-    std::unique_ptr<Type> ref;
-        Ptr(std::unique_ptr<Type> ref) : ref(std::move(ref)) {}
+    static constexpr TypeKind KIND = TypeKind::Ptr;
+    Type* ref;
+        Ptr(Type* ref) : Type(KIND, ref->hasAny), ref(ref) {}
     std::string toString() override { return "&" + ref->toString(); }
-
-    bool operator==(const Type& other) const override {
-        if (const Ptr* p = dynamic_cast<const Ptr*>(&other)) {
-            return ref->operator==(*p->ref);
+protected:
+    bool matches(const Type& other) const override {
+        if (const Ptr* p = as<Ptr>(&other)) {
+            return *ref == *p->ref;
         }
-        if (const Any* a = dynamic_cast<const Any*>(&other)) {
-            return true;
+        return as<Any>(&other) != nullptr;
+    }
+};
+
+// Hash-consing table for types. Building a type through the context returns the one canonical instance,
+// creating it on first use; the instances live as long as the context.
+class TypeContext {
+public:
+    TypeContext() : nilType(&anyType) {}
+    TypeContext(const TypeContext&) = delete;
+    TypeContext& operator=(const TypeContext&) = delete;
+
+    Any* any() { return &anyType; }
+    Int* integer() { return &intType; }
+    Ptr* nil() { return &nilType; }
+
+    Struct* structure(const StructId& name) {
+        auto& slot = structs[name];
+        if (!slot) slot = std::make_unique<Struct>(name);
+        return slot.get();
+    }
+
+    Ptr* pointer(Type* ref) {
+        if (ref == &anyType) return &nilType;
+        auto& slot = pointers[ref];
+        if (!slot) slot = std::make_unique<Ptr>(ref);
+        return slot.get();
+    }
+
+    Fn* function(const std::vector<Type*>& params, Type* ret) {
+        auto& slot = functions[FnKey{params, ret}];
+        if (!slot) slot = std::make_unique<Fn>(params, ret);
+        return slot.get();
+    }
+
+private:
+    struct FnKey {
+        std::vector<Type*> params;
+        Type* ret;
+        bool operator==(const FnKey& other) const { return ret == other.ret && params == other.params; }
+    };
+    struct FnKeyHash {
+        size_t operator()(const FnKey& key) const {
+            size_t h = std::hash<Type*>()(key.ret);
+            for (Type* param : key.params) h = h * 31 + std::hash<Type*>()(param);
+            return h;
+        }
+    };
+
+    Any anyType;
+    Int intType;
+    Ptr nilType;
+    std::unordered_map<StructId, std::unique_ptr<Struct>> structs;
+    std::unordered_map<Type*, std::unique_ptr<Ptr>> pointers;
+    std::unordered_map<FnKey, std::unique_ptr<Fn>, FnKeyHash> functions;
+};
+
+TypeContext typeContext; // every Type the parser and the checker hand around comes from here
+
+std::string TypeError::detailText() const {
+    std::string text;
+    const char* rest = detail;
+    for (size_t arg = 0; arg < argCount; arg++) {
+        const char* hole = std::strstr(rest, "{}");
+        text.append(rest, hole - rest);
+        const TypeErrorArg& value = args[arg];
+        if (auto name = std::get_if<std::string_view>(&value)) text += *name;
+        else if (auto type = std::get_if<Type*>(&value)) text += (*type)->text();
+        else text += std::to_string(std::get<size_t>(value));
+        rest = hole + 2;
+    }
+    return text += rest;
+}
+
+// Errors print sorted by their message text. Sorting the text itself would mean building every message
+// first, so each error gets a key instead: the rank of its tag, then the rank of its scope name. Both are
+// ranked the way the text would order them - a scope is followed by ':' or ' ' in the message, which
+// decides where "f" goes relative to "f2". Only errors that share a key (same rule, same function) need
+// their detail text compared, and that text is built group by group as the errors get printed.
+//
+// sourcePath : the .cf file the tokens came from (parser --source), errors are then prefixed with file:line:col
+// maxErrors : print at most this many, the count of the rest goes to stderr
+void reportTypeErrors(const std::string& sourcePath = "", size_t maxErrors = SIZE_MAX) {
+    metrics::Scope scope("report");
+    metrics::counter("type errors") += typeErrors.size();
+    constexpr size_t TAGS = sizeof(typeErrorTags) / sizeof(typeErrorTags[0]);
+    uint64_t tagRank[TAGS];
+    std::vector<size_t> byTag(TAGS);
+    for (size_t t = 0; t < TAGS; t++) byTag[t] = t;
+    std::sort(byTag.begin(), byTag.end(), [](size_t a, size_t b) {
+        return std::strcmp(typeErrorTags[a].tag, typeErrorTags[b].tag) < 0;
+    });
+    for (size_t r = 0; r < TAGS; r++) tagRank[byTag[r]] = r;
+
+    // scope names by the character that follows them in the message, ':' for functions and ' ' otherwise
+    std::unordered_map<std::string_view, uint32_t> scopeRank[2];
+    auto ranksFor = [&](const TypeError& error) -> std::unordered_map<std::string_view, uint32_t>& {
+        return scopeRank[typeErrorTags[static_cast<size_t>(error.code)].after[0] == ':'];
+    };
+    for (const auto& error : typeErrors) ranksFor(error).emplace(error.scope, 0);
+    for (int colon = 0; colon < 2; colon++) {
+        const unsigned char follow = colon ? ':' : ' ';
+        std::vector<std::string_view> names;
+        for (const auto& entry : scopeRank[colon]) names.push_back(entry.first);
+        std::sort(names.begin(), names.end(), [follow](std::string_view a, std::string_view b) {
+            size_t n = std::min(a.size(), b.size());
+            int c = a.compare(0, n, b.substr(0, n));
+            if (c != 0 || a.size() == b.size()) return c < 0;
+            unsigned char nextA = a.size() > n ? a[n] : follow;
+            unsigned char nextB = b.size() > n ? b[n] : follow;
+            return nextA < nextB;
+        });
+        for (uint32_t r = 0; r < names.size(); r++) scopeRank[colon][names[r]] = r;
+    }
+
+    // (key, index) pairs sort much faster than the records, the index keeps equal keys in check order
+    std::vector<std::pair<uint64_t, uint32_t>> order(typeErrors.size());
+    for (uint32_t e = 0; e < typeErrors.size(); e++) {
+        TypeError& error = typeErrors[e];
+        error.key = tagRank[static_cast<size_t>(error.code)] << 32 | ranksFor(error)[error.scope];
+        order[e] = {error.key, e};
+    }
+    std::sort(order.begin(), order.end());
+
+    std::unique_ptr<LineTable> lines;
+    size_t printed = 0;
+    std::vector<std::pair<std::string, const TypeError*>> group;
+    for (size_t first = 0; first < order.size() && printed < maxErrors; ) {
+        size_t last = first;
+        group.clear();
+        for (; last < order.size() && order[last].first == order[first].first; last++) {
+            const TypeError& error = typeErrors[order[last].second];
+            group.emplace_back(error.detailText(), &error);
+        }
+        std::stable_sort(group.begin(), group.end(), [](const auto& a, const auto& b) {
+            int c = a.first.compare(b.first);
+            return c != 0 ? c < 0 : a.second->span.offset < b.second->span.offset;
+        });
+        const TypeErrorTag& tag = typeErrorTags[static_cast<size_t>(typeErrors[order[first].second].code)];
+        for (const auto& [detail, error] : group) {
+            if (printed == maxErrors) break;
+            if (!sourcePath.empty() && error->span.valid()) {
+                if (!lines) {
+                    std::ifstream source(sourcePath, std::ios::binary);
+                    lines = std::make_unique<LineTable>(std::string(std::istreambuf_iterator<char>(source), {}));
+                }
+                auto [line, column] = lines->locate(error->span.offset);
+                std::cout << sourcePath << ":" << line << ":" << column << ": ";
+            }
+            std::cout << tag.tag << tag.before << error->scope << tag.after << detail << '\n';
+            printed++;
         }
-        return false;
+        first = last;
     }
-    std::unique_ptr<Type> clone() const override {
-        return std::make_unique<Ptr>(ref->clone());
+    if (printed < typeErrors.size()) {
+        std::cerr << typeErrors.size() - printed << " more type errors not shown (--max-errors " << maxErrors << ")" << std::endl;
     }
-};
+}
 
 
 // Declarations for variables, parameters, etc.
 struct Decl {
     std::string name;
-    std::unique_ptr<Type> type;
+    Type* type = nullptr; // canonical, see TypeContext
+    Span span;
         Decl() = default;
-    Decl(std::string name, std::unique_ptr<Type> type)
-        : name(std::move(name)), type(std::move(type)) {}
+    Decl(std::string name, Type* type)
+        : name(std::move(name)), type(type) {}
+};
+
+// Bump-pointer arena for AST nodes. The Program owns one; every Exp, Lval, Rhs and Stmt, and the child lists
+// inside them, is carved out of its blocks. Nodes are never destroyed one by one (nothing in them owns memory
+// outside the arena), dropping the Program frees a handful of blocks instead of walking the tree.
+class AstArena {
+    static constexpr size_t BLOCK = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* top = nullptr;
+    size_t left = 0;
+    size_t reserved = 0;
+
+public:
+    AstArena() = default;
+    AstArena(const AstArena&) = delete;
+    AstArena& operator=(const AstArena&) = delete;
+
+    void* allocate(size_t size, size_t align) {
+        size_t pad = -reinterpret_cast<uintptr_t>(top) & (align - 1);
+        if (pad + size > left) {
+            size_t block = std::max(BLOCK, size + align);
+            blocks.emplace_back(new char[block]);
+            top = blocks.back().get();
+            left = block;
+            reserved += block;
+            pad = -reinterpret_cast<uintptr_t>(top) & (align - 1);
+        }
+        void* p = top + pad;
+        top += pad + size;
+        left -= pad + size;
+        return p;
+    }
+
+    template <class T, class... Args>
+    T* make(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    size_t bytes() const { return reserved; }
+};
+
+// Fixed-size array of children in the arena, filled once when the parser has collected them.
+template <class T>
+class ArenaList {
+    T* items = nullptr;
+    size_t count = 0;
+
+public:
+    ArenaList() = default;
+    ArenaList(AstArena& arena, const std::vector<T>& from) : count(from.size()) {
+        if (count == 0) return;
+        items = static_cast<T*>(arena.allocate(count * sizeof(T), alignof(T)));
+        std::uninitialized_copy(from.begin(), from.end(), items);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T operator[](size_t i) const { return items[i]; }
+    T* begin() const { return items; }
+    T* end() const { return items + count; }
+};
+
+// What checking one function read from Γ0 and ∆: every global name it looked up and every struct field,
+// with the answer it got. As long as Γ0 and ∆ still give the same answers the function checks the same
+// way, which is how IncrementalChecker decides what to re-check.
+enum class FieldLookup { Found, NoField, NoStruct };
+struct CheckDeps {
+    struct Global {
+        std::string_view name;
+        bool bound;
+        Type* type;
+        bool operator<(const Global& o) const { return name < o.name; }
+        bool operator==(const Global& o) const { return name == o.name; }
+    };
+    struct Field {
+        std::string_view structName, field;
+        FieldLookup result;
+        Type* type;
+        bool operator<(const Field& o) const { return std::tie(structName, field) < std::tie(o.structName, o.field); }
+        bool operator==(const Field& o) const { return structName == o.structName && field == o.field; }
+    };
+    std::vector<Global> globals;
+    std::vector<Field> fields;
+
+    void clear() { globals.clear(); fields.clear(); }
+    void compact() { // one entry per name, any of them has the answer
+        std::sort(globals.begin(), globals.end());
+        globals.erase(std::unique(globals.begin(), globals.end()), globals.end());
+        std::sort(fields.begin(), fields.end());
+        fields.erase(std::unique(fields.begin(), fields.end()), fields.end());
+    }
+};
+thread_local CheckDeps* checkDeps = nullptr; // set while IncrementalChecker checks a function
+
+// ∆(structName)(field), recorded in checkDeps
+FieldLookup lookupField(const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta,
+                        const std::string& structName, const std::string& field, Type*& type) {
+    FieldLookup result = FieldLookup::NoStruct;
+    auto fields = delta.find(structName);
+    if (fields != delta.end()) {    //  not equal to end so we found it
+        auto entry = fields->second.find(field);
+        if (entry != fields->second.end()) {
+            type = entry->second;
+            result = FieldLookup::Found;
+        } else {
+            result = FieldLookup::NoField;
+        }
+    }
+    if (checkDeps) checkDeps->fields.push_back({structName, field, result, type});
+    return result;
+}
+
+// Γ while checking one function: the function's params and locals laid over the program-wide Γ0, which is
+// shared by every function and never copied. A local shadows a global of the same name.
+class Scope {
+public:
+    explicit Scope(const std::unordered_map<std::string, Type*>& globals) : globals(globals) {}
+
+    void bind(const std::string& name, Type* type) { locals[name] = type; } // name must outlive the scope
+
+    // the binding for name, nullptr when it is unbound (the bound type itself may be null, see main)
+    Type* const* find(const std::string& name) const {
+        auto local = locals.find(name);
+        if (local != locals.end()) return &local->second;
+        auto global = globals.find(name);
+        Type* const* binding = global != globals.end() ? &global->second : nullptr;
+        if (checkDeps) checkDeps->globals.push_back({name, binding != nullptr, binding ? *binding : nullptr});
+        return binding;
+    }
+
+    const std::unordered_map<std::string_view, Type*>& bindings() const { return locals; }
+
+private:
+    const std::unordered_map<std::string, Type*>& globals;
+    std::unordered_map<std::string_view, Type*> locals; // names of the function's Decls
 };
 
 // Expression base class
 struct Exp {
+    const ExpKind kind;
+    explicit Exp(ExpKind kind) : kind(kind) {}
     virtual ~Exp() = default;
-    virtual Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma, 
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) = 0;
+    Span span; // set by the parser
+    virtual Type* judgement(const std::string& funcName, const Scope& gamma, 
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) = 0;
 };
 
 struct NumExp : Exp {
+    static constexpr ExpKind KIND = ExpKind::Num;
     int32_t n;
 
-    NumExp(int32_t n) : n(n) {}
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
-        return new Int();
+    NumExp(int32_t n) : Exp(KIND), n(n) {}
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
+        return typeContext.integer();
     }
 };
 
 struct IdExp : Exp {
-    std::string name;
+    static constexpr ExpKind KIND = ExpKind::Id;
+    const std::string& name; // interned, see Program::intern
 
-    IdExp(std::string name) : name(std::move(name)) {}
+    IdExp(const std::string& name) : Exp(KIND), name(name) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma, 
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
-        if (gamma.find(name) != gamma.end()) {
-            return gamma[name].get();
+    Type* judgement(const std::string& funcName, const Scope& gamma, 
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
+        if (Type* const* type = gamma.find(name)) {
+            return *type;
         }
-        addTypeError("[ID] in function " + funcName + ": variable " + name + " undefined");
-        return new Any();
+        addTypeError(TypeErrorCode::Id, funcName, "variable {} undefined", {name}, span);
+        return typeContext.any();
     }
 };
 
 // Nil expression
 struct NilExp : Exp {
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma, 
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
-        return new Ptr(make_unique<Any>());
+    static constexpr ExpKind KIND = ExpKind::Nil;
+    NilExp() : Exp(KIND) {}
+    Type* judgement(const std::string& funcName, const Scope& gamma, 
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
+        return typeContext.nil();
     }
 };
 
 // Unary operation expression
 enum class UnaryOp { Neg, Deref ,Addr};
 struct UnOpExp : Exp {
+    static constexpr ExpKind KIND = ExpKind::UnOp;
     UnaryOp op;
-    std::unique_ptr<Exp> operand;
+    Exp* operand;
 
-        UnOpExp(UnaryOp op, std::unique_ptr<Exp> operand)
-        : op(op), operand(std::move(operand)) {}
+        UnOpExp(UnaryOp op, Exp* operand)
+        : Exp(KIND), op(op), operand(operand) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* operandType = operand->judgement(funcName, gamma, delta);
         if (op == UnaryOp::Neg) {
-            if (auto intType = dynamic_cast<Int*>(operandType)) {
+            if (auto intType = as<Int>(operandType)) {
                 return intType;
             }
-            else if (auto anyType = dynamic_cast<Any*>(operandType)) {
-                return new Int();
+            else if (auto anyType = as<Any>(operandType)) {
+                return typeContext.integer();
             }
-            addTypeError("[NEG] in function " + funcName + ": negating type " + operandType->toString() + " instead of int");
-            return new Int();
+            addTypeError(TypeErrorCode::Neg, funcName, "negating type {} instead of int", {operandType}, span);
+            return typeContext.integer();
         } else if (op == UnaryOp::Deref) {
-            if (auto ptrType = dynamic_cast<Ptr*>(operandType)) {
-                return ptrType->ref.get();
+            if (auto ptrType = as<Ptr>(operandType)) {
+                return ptrType->ref;
             }
-            else if (auto anyType = dynamic_cast<Any*>(operandType)) {
+            else if (auto anyType = as<Any>(operandType)) {
                 return anyType;
             }
-            addTypeError("[DEREF] in function " + funcName + ": dereferencing type " + operandType->toString() + " instead of pointer");
+            addTypeError(TypeErrorCode::Deref, funcName, "dereferencing type {} instead of pointer", {operandType}, span);
         } 
-        return new Any();
+        return typeContext.any();
     }
 };
 
 // Binary operation expression
 enum class BinaryOp { Add, Sub, Mul, Div, Equal, NotEq, Lt, Lte, Gt, Gte };
 struct BinOpExp : Exp {
+    static constexpr ExpKind KIND = ExpKind::BinOp;
     BinaryOp op;
-    std::unique_ptr<Exp> left;
-    std::unique_ptr<Exp> right;
+    Exp* left;
+    Exp* right;
 
 
-        BinOpExp(BinaryOp op, std::unique_ptr<Exp> left, std::unique_ptr<Exp> right)
-        : op(op), left(std::move(left)), right(std::move(right)) {}
+        BinOpExp(BinaryOp op, Exp* left, Exp* right)
+        : Exp(KIND), op(op), left(left), right(right) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* leftType = left->judgement(funcName, gamma, delta);
         Type* rightType = right->judgement(funcName, gamma, delta);
         // split into BINOP-EQ and BINOP-REST
         if (op == BinaryOp::Equal || op == BinaryOp::NotEq) {   //  BINOP-EQ: check left and right are same type, and that both are either Int or Ptr
             if (!(leftType->operator==(*rightType))){
-                addTypeError("[BINOP-EQ] in function " + funcName + ": operands with different types: " + leftType->toString() + " vs " + rightType->toString());
+                addTypeError(TypeErrorCode::BinopEq, funcName, "operands with different types: {} vs {}", {leftType, rightType}, span);
             }
-            if (!(dynamic_cast<Int*>(leftType) || dynamic_cast<Ptr*>(leftType) || dynamic_cast<Any*>(leftType))) {
-                addTypeError("[BINOP-EQ] in function " + funcName + ": operand has non-primitive type " + leftType->toString());
+            if (!(as<Int>(leftType) || as<Ptr>(leftType) || as<Any>(leftType))) {
+                addTypeError(TypeErrorCode::BinopEq, funcName, "operand has non-primitive type {}", {leftType}, span);
             } 
-            if (!(dynamic_cast<Int*>(rightType) || dynamic_cast<Ptr*>(rightType) || dynamic_cast<Any*>(rightType))) {
-                addTypeError("[BINOP-EQ] in function " + funcName + ": operand has non-primitive type " + rightType->toString());
+            if (!(as<Int>(rightType) || as<Ptr>(rightType) || as<Any>(rightType))) {
+                addTypeError(TypeErrorCode::BinopEq, funcName, "operand has non-primitive type {}", {rightType}, span);
             }
             
         } else {        //  BINOP-REST: check left and right are both Int
-            if (!(dynamic_cast<Int*>(leftType) || (dynamic_cast<Any*>(leftType)))) {
-                addTypeError("[BINOP-REST] in function " + funcName + ": operand has type " + leftType->toString() + " instead of int");
+            if (!(as<Int>(leftType) || (as<Any>(leftType)))) {
+                addTypeError(TypeErrorCode::BinopRest, funcName, "operand has type {} instead of int", {leftType}, span);
             }
-            if (!(dynamic_cast<Int*>(rightType) || (dynamic_cast<Any*>(rightType)))) {
-                addTypeError("[BINOP-REST] in function " + funcName + ": operand has type " + rightType->toString() + " instead of int");
+            if (!(as<Int>(rightType) || (as<Any>(rightType)))) {
+                addTypeError(TypeErrorCode::BinopRest, funcName, "operand has type {} instead of int", {rightType}, span);
             }
         }
-        return new Int();
+        return typeContext.integer();
     }
 };
 
 // Array access expression
 struct ArrayAccessExp : Exp {
-    std::unique_ptr<Exp> ptr;
-    std::unique_ptr<Exp> index;
+    static constexpr ExpKind KIND = ExpKind::ArrayAccess;
+    Exp* ptr;
+    Exp* index;
 
-        ArrayAccessExp(std::unique_ptr<Exp> ptr, std::unique_ptr<Exp> index)
-        : ptr(std::move(ptr)), index(std::move(index)) {}
+        ArrayAccessExp(Exp* ptr, Exp* index)
+        : Exp(KIND), ptr(ptr), index(index) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         //Type* ptrType = ptr->judgement(funcName, gamma, delta);
         Type* indexType = index->judgement(funcName, gamma, delta);
-        if (!(dynamic_cast<Int*>(indexType)) && !(dynamic_cast<Any*>(indexType))) {
-            addTypeError("[ARRAY] in function " + funcName + ": array index is type " + indexType->toString() + " instead of int");
+        if (!(as<Int>(indexType)) && !(as<Any>(indexType))) {
+            addTypeError(TypeErrorCode::Array, funcName, "array index is type {} instead of int", {indexType}, span);
         }
         // check if ptr is a pointer type to some type; if so return its ref type
         auto some_type = ptr->judgement(funcName, gamma, delta);
-        if (auto found_ptr = dynamic_cast<Ptr*>(some_type)){
-            return found_ptr->ref.get();
+        if (auto found_ptr = as<Ptr>(some_type)){
+            return found_ptr->ref;
         }
-        else if (auto found_any = dynamic_cast<Any*>(some_type)){
+        else if (auto found_any = as<Any>(some_type)){
             return some_type;
         }
         else{
-            addTypeError("[ARRAY] in function " + funcName + ": dereferencing non-pointer type " + some_type->toString());
-            return new Any();
+            addTypeError(TypeErrorCode::Array, funcName, "dereferencing non-pointer type {}", {some_type}, span);
+            return typeContext.any();
         }
     }
 };
 
 // Field access expression
 struct FieldAccessExp : Exp {
-    std::unique_ptr<Exp> ptr;
-    std::string field;
+    static constexpr ExpKind KIND = ExpKind::FieldAccess;
+    Exp* ptr;
+    const std::string& field; // interned
 
-        FieldAccessExp(std::unique_ptr<Exp> ptr, std::string field)
-        : ptr(std::move(ptr)), field(std::move(field)) {}
+        FieldAccessExp(Exp* ptr, const std::string& field)
+        : Exp(KIND), ptr(ptr), field(field) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* ptrType = ptr->judgement(funcName, gamma, delta);
-        if (!(dynamic_cast<Ptr*>(ptrType) || dynamic_cast<Any*>(ptrType))){
-            addTypeError("[FIELD] in function " + funcName + ": accessing field of incorrect type " + ptrType->toString());
+        if (!(as<Ptr>(ptrType) || as<Any>(ptrType))){
+            addTypeError(TypeErrorCode::Field, funcName, "accessing field of incorrect type {}", {ptrType}, span);
         }
-        else if (auto ptr = dynamic_cast<Ptr*>(ptrType)) {
-            if (!dynamic_cast<Struct*>(ptr->ref.get())) {
-              addTypeError("[FIELD] in function " + funcName + ": accessing field of incorrect type " + ptrType->toString());
+        else if (auto ptr = as<Ptr>(ptrType)) {
+            if (!as<Struct>(ptr->ref)) {
+              addTypeError(TypeErrorCode::Field, funcName, "accessing field of incorrect type {}", {ptrType}, span);
             }
-            else if (auto str = dynamic_cast<Struct*>(ptr->ref.get())) {
-                if (delta.find(str->name) != delta.end()) {    //  not equal to end so we found it
-                    if (delta.at(str->name).find(field) != delta.at(str->name).end()) {
-                        return delta.at(str->name).at(field).get();
-                    }
-                    addTypeError("[FIELD] in function " + funcName + ": accessing non-existent field " + field + " of struct type " + str->name);
+            else if (auto str = as<Struct>(ptr->ref)) {
+                Type* fieldType = nullptr;
+                switch (lookupField(delta, str->name, field, fieldType)) {
+                    case FieldLookup::Found:
+                        return fieldType;
+                    case FieldLookup::NoField:
+                        addTypeError(TypeErrorCode::Field, funcName, "accessing non-existent field {} of struct type {}", {field, str->name}, span);
+                        break;
+                    case FieldLookup::NoStruct:
+                        addTypeError(TypeErrorCode::Field, funcName, "accessing field of non-existent struct type {}", {str->name}, span);
+                        break;
                 }
-                else{addTypeError("[FIELD] in function " + funcName + ": accessing field of non-existent struct type " + str->name);}
             }
         }
-        return new Any();
+        return typeContext.any();
     }
 };
 
 // Function call expression
 
 struct CallExp : Exp {
-    std::unique_ptr<Exp> callee;
-    std::vector<std::unique_ptr<Exp>> args;
-        CallExp(std::unique_ptr<Exp> callee, std::vector<std::unique_ptr<Exp>> args)
-        : callee(std::move(callee)), args(std::move(args)) {}
-
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    static constexpr ExpKind KIND = ExpKind::Call;
+    Exp* callee;
+    ArenaList<Exp*> args;
+        CallExp(Exp* callee, ArenaList<Exp*> args)
+        : Exp(KIND), callee(callee), args(args) {}
+
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* calleeType = callee->judgement(funcName, gamma, delta);    
         bool caughtArgError = false;
         bool isMain = false;
         // check if callee is main ; we can't call judgement on callee again or else it will print the error twice
-        if (auto id = dynamic_cast<IdExp*>(callee.get())) {          //   CHANGED THIS LINE from calleeType to callee.get()
+        if (auto id = as<IdExp>(callee)) {          //   CHANGED THIS LINE from calleeType to callee
             if (id->name == "main") {
-                addTypeError("[ECALL-INTERNAL] in function " + funcName + ": calling main");
+                addTypeError(TypeErrorCode::EcallInternal, funcName, "calling main", {}, span);
                 isMain = true;
             }
         }
-        if (auto ptr = dynamic_cast<Ptr*>(calleeType)) {
-            if (auto fn = dynamic_cast<Fn*>(ptr->ref.get())) {
+        if (auto ptr = as<Ptr>(calleeType)) {
+            if (auto fn = as<Fn>(ptr->ref)) {
                 if (!(fn->ret)) {
-                    addTypeError("[ECALL-INTERNAL] in function " + funcName + ": calling a function with no return value");
+                    addTypeError(TypeErrorCode::EcallInternal, funcName, "calling a function with no return value", {}, span);
                     //retAny = true;
                 }
                 if (fn->params.size() != args.size()) {
-                    addTypeError("[ECALL-INTERNAL] in function " + funcName + ": call number of arguments (" + std::to_string(args.size()) + ") and parameters (" + std::to_string(fn->params.size()) + ") don't match");
+                    addTypeError(TypeErrorCode::EcallInternal, funcName, "call number of arguments ({}) and parameters ({}) don't match", {args.size(), fn->params.size()}, span);
                     //hasError = true;
                 }
                 for (size_t i = 0; i < args.size(); ++i) {
                     if (i < fn->params.size()){
                         Type* argType = args[i]->judgement(funcName, gamma, delta);
                         if (!fn->params[i]->operator==(*argType)) {
-                        addTypeError("[ECALL-INTERNAL] in function " + funcName + ": call argument has type " + argType->toString() + " but parameter has type " + fn->params[i]->toString());
+                        addTypeError(TypeErrorCode::EcallInternal, funcName, "call argument has type {} but parameter has type {}", {argType, fn->params[i]}, span);
                         //hasError = true;
                     }
                     }
@@ -404,28 +792,28 @@ struct CallExp : Exp {
                         continue;
                     }
                 }
-                return fn->ret.get() ? fn->ret.get() : new Any();
+                return fn->ret ? fn->ret : typeContext.any();
             }    //  not internal; check if its external
             else{
-                addTypeError("[ECALL-*] in function " + funcName + ": calling non-function type " + calleeType->toString());
-                return new Any();
+                addTypeError(TypeErrorCode::EcallAny, funcName, "calling non-function type {}", {calleeType}, span);
+                return typeContext.any();
             
             }
         }
-        else if (auto fn = dynamic_cast<Fn*>(calleeType)) {
+        else if (auto fn = as<Fn>(calleeType)) {
             if (!(fn->ret)) {
-                addTypeError("[ECALL-EXTERN] in function " + funcName + ": calling a function with no return value");
+                addTypeError(TypeErrorCode::EcallExtern, funcName, "calling a function with no return value", {}, span);
                 //retAny = true;
             }
             if (fn->params.size() != args.size()) {
-                addTypeError("[ECALL-EXTERN] in function " + funcName + ": call number of arguments (" + std::to_string(args.size()) + ") and parameters (" + std::to_string(fn->params.size()) + ") don't match");
+                addTypeError(TypeErrorCode::EcallExtern, funcName, "call number of arguments ({}) and parameters ({}) don't match", {args.size(), fn->params.size()}, span);
                 //hasError = true;
             }
             for (size_t i = 0; i < args.size(); ++i) {
                 if (i < fn->params.size()){
                     Type* argType = args[i]->judgement(funcName, gamma, delta);
                     if (!(fn->params[i]->operator==(*argType))) {
-                        addTypeError("[ECALL-EXTERN] in function " + funcName + ": call argument has type " + argType->toString() + " but parameter has type " + fn->params[i]->toString());
+                        addTypeError(TypeErrorCode::EcallExtern, funcName, "call argument has type {} but parameter has type {}", {argType, fn->params[i]}, span);
                         caughtArgError = true;
                     }
                 }
@@ -433,189 +821,213 @@ struct CallExp : Exp {
                     continue;
                 }
             }
-            return fn->ret ? fn->ret.get() : new Any();
+            return fn->ret ? fn->ret : typeContext.any();
         } else {
-            if (!dynamic_cast<Any*>(calleeType)){
-            //addTypeError("[ECALL-*] in function " + funcName + ": calling non-function type " + calleeType->toString()); 
+            if (!as<Any>(calleeType)){
+            //addTypeError(TypeErrorCode::EcallAny, funcName, "calling non-function type {}", {calleeType}); 
                 if (!isMain){
                     if (calleeType) {  // Add a null check
-                        addTypeError("[ECALL-*] in function " + funcName + ": calling non-function type " + calleeType->toString());
+                        addTypeError(TypeErrorCode::EcallAny, funcName, "calling non-function type {}", {calleeType}, span);
                     } else {
-                        addTypeError("[ECALL-*] in function " + funcName + ": calling non-function type on null object");
+                        addTypeError(TypeErrorCode::EcallAny, funcName, "calling non-function type on null object", {}, span);
                     }    
                 }    
             }
-            return new Any();
+            return typeContext.any();
         }
     }
 };
 
 // L-values
 struct Lval {
+    const LvalKind kind;
+    explicit Lval(LvalKind kind) : kind(kind) {}
     virtual ~Lval() = default;
-    virtual Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) = 0;
+    Span span; // set by the parser
+    virtual Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) = 0;
 };
 
 struct IdLval : Lval {
-    std::string name;
+    static constexpr LvalKind KIND = LvalKind::Id;
+    const std::string& name; // interned, see Program::intern
 
-    IdLval(std::string name) : name(std::move(name)) {}
+    IdLval(const std::string& name) : Lval(KIND), name(name) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
-        if (gamma.find(name) != gamma.end()) {
-            return gamma[name].get();
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
+        if (Type* const* type = gamma.find(name)) {
+            return *type;
         }
-        addTypeError("[ID] in function " + funcName + ": variable " + name + " undefined");
-        return new Any();
+        addTypeError(TypeErrorCode::Id, funcName, "variable {} undefined", {name}, span);
+        return typeContext.any();
     }
 };
 
 struct DerefLval : Lval {
-    std::unique_ptr<Lval> lval;
+    static constexpr LvalKind KIND = LvalKind::Deref;
+    Lval* lval;
 
-    DerefLval(std::unique_ptr<Lval> lval) : lval(std::move(lval)) {}
+    DerefLval(Lval* lval) : Lval(KIND), lval(lval) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* lvalType = lval->judgement(funcName, gamma, delta);
-        if (auto ptr = dynamic_cast<Ptr*>(lvalType)) {
-            return ptr->ref.get();
+        if (auto ptr = as<Ptr>(lvalType)) {
+            return ptr->ref;
         }
-        else if (auto anyType = dynamic_cast<Any*>(lvalType)) {
+        else if (auto anyType = as<Any>(lvalType)) {
             return anyType;
         }
-        addTypeError("[DEREF] in function " + funcName + ": dereferencing type " + lvalType->toString() + " instead of pointer");
-        return new Any();
+        addTypeError(TypeErrorCode::Deref, funcName, "dereferencing type {} instead of pointer", {lvalType}, span);
+        return typeContext.any();
     }
 };
 
 struct ArrayAccessLval : Lval {
-    std::unique_ptr<Lval> ptr;
-    std::unique_ptr<Exp> index;
+    static constexpr LvalKind KIND = LvalKind::ArrayAccess;
+    Lval* ptr;
+    Exp* index;
 
-    ArrayAccessLval(std::unique_ptr<Lval> ptr, std::unique_ptr<Exp> index)
-        : ptr(std::move(ptr)), index(std::move(index)) {}
+    ArrayAccessLval(Lval* ptr, Exp* index)
+        : Lval(KIND), ptr(ptr), index(index) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* ptrType = ptr->judgement(funcName, gamma, delta);
         Type* indexType = index->judgement(funcName, gamma, delta);
-        if (!(dynamic_cast<Int*>(indexType)) && !(dynamic_cast<Any*>(indexType))) {
-            addTypeError("[ARRAY] in function " + funcName + ": array index is type " + indexType->toString() + " instead of int");
+        if (!(as<Int>(indexType)) && !(as<Any>(indexType))) {
+            addTypeError(TypeErrorCode::Array, funcName, "array index is type {} instead of int", {indexType}, span);
         }
-        if (auto ptr = dynamic_cast<Ptr*>(ptrType)) {
-            return ptr->ref.get();
+        if (auto ptr = as<Ptr>(ptrType)) {
+            return ptr->ref;
         }
-        else if (auto found_any = dynamic_cast<Any*>(ptrType)){
+        else if (auto found_any = as<Any>(ptrType)){
             return found_any;
         }
-        addTypeError("[ARRAY] in function " + funcName + ": dereferencing non-pointer type " + ptrType->toString());
-        return new Any();
+        addTypeError(TypeErrorCode::Array, funcName, "dereferencing non-pointer type {}", {ptrType}, span);
+        return typeContext.any();
     }
 };
 
 struct FieldAccessLval : Lval {
-    std::unique_ptr<Lval> ptr;
-    std::string field;
+    static constexpr LvalKind KIND = LvalKind::FieldAccess;
+    Lval* ptr;
+    const std::string& field; // interned
 
-    FieldAccessLval(std::unique_ptr<Lval> ptr, std::string field)
-        : ptr(std::move(ptr)), field(std::move(field)) {}
+    FieldAccessLval(Lval* ptr, const std::string& field)
+        : Lval(KIND), ptr(ptr), field(field) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* ptrType = ptr->judgement(funcName, gamma, delta);
-        if (!(dynamic_cast<Ptr*>(ptrType) || dynamic_cast<Any*>(ptrType))){
-            addTypeError("[FIELD] in function " + funcName + ": accessing field of incorrect type " + ptrType->toString());
+        if (!(as<Ptr>(ptrType) || as<Any>(ptrType))){
+            addTypeError(TypeErrorCode::Field, funcName, "accessing field of incorrect type {}", {ptrType}, span);
         }
-        else if (auto ptr = dynamic_cast<Ptr*>(ptrType)) {
-            if (!dynamic_cast<Struct*>(ptr->ref.get())) {
-              addTypeError("[FIELD] in function " + funcName + ": accessing field of incorrect type " + ptrType->toString());
+        else if (auto ptr = as<Ptr>(ptrType)) {
+            if (!as<Struct>(ptr->ref)) {
+              addTypeError(TypeErrorCode::Field, funcName, "accessing field of incorrect type {}", {ptrType}, span);
             }
-            else if (auto str = dynamic_cast<Struct*>(ptr->ref.get())) {
-                if (delta.find(str->name) != delta.end()) {    //  not equal to end so we found it
-                    if (delta.at(str->name).find(field) != delta.at(str->name).end()) {
-                        return delta.at(str->name).at(field).get();
-                    }
-                    addTypeError("[FIELD] in function " + funcName + ": accessing non-existent field " + field + " of struct type " + str->name);
+            else if (auto str = as<Struct>(ptr->ref)) {
+                Type* fieldType = nullptr;
+                switch (lookupField(delta, str->name, field, fieldType)) {
+                    case FieldLookup::Found:
+                        return fieldType;
+                    case FieldLookup::NoField:
+                        addTypeError(TypeErrorCode::Field, funcName, "accessing non-existent field {} of struct type {}", {field, str->name}, span);
+                        break;
+                    case FieldLookup::NoStruct:
+                        addTypeError(TypeErrorCode::Field, funcName, "accessing field of non-existent struct type {}", {str->name}, span);
+                        break;
                 }
-                else{addTypeError("[FIELD] in function " + funcName + ": accessing field of non-existent struct type " + str->name);}
             }
         }
-        return new Any();
+        return typeContext.any();
     }
 };
 
 // Right-hand side of assignments
 struct Rhs {
+    const RhsKind kind;
+    explicit Rhs(RhsKind kind) : kind(kind) {}
     virtual ~Rhs() = default;
-    virtual Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) = 0;
+    Span span; // set by the parser
+    virtual Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) = 0;
 };
 
 struct RhsExp : Rhs {
-    std::unique_ptr<Exp> exp;
+    static constexpr RhsKind KIND = RhsKind::Exp;
+    Exp* exp;
 
-    RhsExp(std::unique_ptr<Exp> exp) : exp(std::move(exp)) {}
+    RhsExp(Exp* exp) : Rhs(KIND), exp(exp) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         return exp->judgement(funcName, gamma, delta);
     }
 };
 
 struct NewRhs : Rhs {
-    std::unique_ptr<Type> type;
-    std::unique_ptr<Exp> amount;
+    static constexpr RhsKind KIND = RhsKind::New;
+    Type* type;
+    Exp* amount;
 
-    NewRhs(std::unique_ptr<Type> type, std::unique_ptr<Exp> amount)
-        : type(std::move(type)), amount(std::move(amount)) {}
+    NewRhs(Type* type, Exp* amount)
+        : Rhs(KIND), type(type), amount(amount) {}
 
-    Type* judgement(const std::string funcName, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    Type* judgement(const std::string& funcName, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         return amount->judgement(funcName, gamma, delta);
     }
 };
 
 // Statements
 struct Stmt {
+    const StmtKind kind;
+    explicit Stmt(StmtKind kind) : kind(kind) {}
     virtual ~Stmt() = default;
+    Span span; // set by the parser
     // judgement for stmts need to also take in boolean for loop and optional return type
-    virtual void judgement(const std::string funcName, bool loop, const unique_ptr<Type>& retType, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) = 0;
+    virtual void judgement(const std::string& funcName, bool loop, Type* retType, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) = 0;
 };
 
 struct BreakStmt : Stmt {
-    void judgement(const std::string funcName, bool loop, const unique_ptr<Type>& retType, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    static constexpr StmtKind KIND = StmtKind::Break;
+    BreakStmt() : Stmt(KIND) {}
+    void judgement(const std::string& funcName, bool loop, Type* retType, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         if (!loop) {
-            addTypeError("[BREAK] in function " + funcName + ": break outside of loop");
+            addTypeError(TypeErrorCode::Break, funcName, "break outside of loop", {}, span);
         }
     }
 };
 struct ContinueStmt : Stmt {
-    void judgement(const std::string funcName, bool loop, const unique_ptr<Type>& retType, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    static constexpr StmtKind KIND = StmtKind::Continue;
+    ContinueStmt() : Stmt(KIND) {}
+    void judgement(const std::string& funcName, bool loop, Type* retType, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         if (!loop) {
-            addTypeError("[CONTINUE] in function " + funcName + ": continue outside of loop");
+            addTypeError(TypeErrorCode::Continue, funcName, "continue outside of loop", {}, span);
         }
     }
 };
 
 struct IfStmt : Stmt {
-    std::unique_ptr<Exp> guard;
-    std::vector<std::unique_ptr<Stmt>> tt;
-    std::vector<std::unique_ptr<Stmt>> ff;
+    static constexpr StmtKind KIND = StmtKind::If;
+    Exp* guard;
+    ArenaList<Stmt*> tt;
+    ArenaList<Stmt*> ff;
 
-    IfStmt(std::unique_ptr<Exp> guard, std::vector<std::unique_ptr<Stmt>> tt, std::vector<std::unique_ptr<Stmt>> ff)
-        : guard(std::move(guard)), tt(std::move(tt)), ff(std::move(ff)) {}
+    IfStmt(Exp* guard, ArenaList<Stmt*> tt, ArenaList<Stmt*> ff)
+        : Stmt(KIND), guard(guard), tt(tt), ff(ff) {}
 
-    void judgement(const std::string funcName, bool loop, const unique_ptr<Type>& retType, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    void judgement(const std::string& funcName, bool loop, Type* retType, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* guardType = guard->judgement(funcName, gamma, delta);
-        if (!(dynamic_cast<Int*>(guardType) || dynamic_cast<Any*>(guardType))) {
-            addTypeError("[IF] in function " + funcName + ": if guard has type " + guardType->toString() + " instead of int");
+        if (!(as<Int>(guardType) || as<Any>(guardType))) {
+            addTypeError(TypeErrorCode::If, funcName, "if guard has type {} instead of int", {guardType}, span);
         }
         for (const auto& stmt : tt) {
             stmt->judgement(funcName, loop, retType, gamma, delta);
@@ -627,17 +1039,18 @@ struct IfStmt : Stmt {
 };
 
 struct WhileStmt : Stmt {
-    std::unique_ptr<Exp> guard;
-    std::vector<std::unique_ptr<Stmt>> body;
+    static constexpr StmtKind KIND = StmtKind::While;
+    Exp* guard;
+    ArenaList<Stmt*> body;
 
-    WhileStmt(std::unique_ptr<Exp> guard, std::vector<std::unique_ptr<Stmt>> body)
-        : guard(std::move(guard)), body(std::move(body)) {}
+    WhileStmt(Exp* guard, ArenaList<Stmt*> body)
+        : Stmt(KIND), guard(guard), body(body) {}
 
-    void judgement(const std::string funcName, bool loop, const unique_ptr<Type>& retType, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    void judgement(const std::string& funcName, bool loop, Type* retType, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* guardType = guard->judgement(funcName, gamma, delta);
-        if (!(dynamic_cast<Int*>(guardType) || dynamic_cast<Any*>(guardType))){
-            addTypeError("[WHILE] in function " + funcName + ": while guard has type " + guardType->toString() + " instead of int");
+        if (!(as<Int>(guardType) || as<Any>(guardType))){
+            addTypeError(TypeErrorCode::While, funcName, "while guard has type {} instead of int", {guardType}, span);
         }
         for (const auto& stmt : body) {
             stmt->judgement(funcName, true, retType, gamma, delta);
@@ -646,83 +1059,85 @@ struct WhileStmt : Stmt {
 };
 
 struct ReturnStmt : Stmt {
-    std::unique_ptr<Exp> exp;
+    static constexpr StmtKind KIND = StmtKind::Return;
+    Exp* exp;
 
-    ReturnStmt(std::unique_ptr<Exp> exp) : exp(std::move(exp)) {}
+    ReturnStmt(Exp* exp) : Stmt(KIND), exp(exp) {}
 
-    void judgement(const std::string funcName, bool loop, const unique_ptr<Type>& retType, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    void judgement(const std::string& funcName, bool loop, Type* retType, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         if (retType) {
             if (exp) {
                 Type* retExpType = exp->judgement(funcName, gamma, delta);
-                if (!(retType.get()->operator==(*retExpType))) {
-                    addTypeError("[RETURN-2] in function " + funcName + ": should return " + retType.get()->toString() + " but returning " + retExpType->toString());
+                if (!(retType->operator==(*retExpType))) {
+                    addTypeError(TypeErrorCode::Return2, funcName, "should return {} but returning {}", {retType, retExpType}, span);
                 }
             } else {
-                addTypeError("[RETURN-2] in function " + funcName + ": should return " + retType.get()->toString() + " but returning nothing");
+                addTypeError(TypeErrorCode::Return2, funcName, "should return {} but returning nothing", {retType}, span);
             }
         } else {
             if (exp) {
                 Type* retExpType = exp->judgement(funcName, gamma, delta);
-                addTypeError("[RETURN-1] in function " + funcName + ": should return nothing but returning " + retExpType->toString());
+                addTypeError(TypeErrorCode::Return1, funcName, "should return nothing but returning {}", {retExpType}, span);
             }
         }
     }
 };
 
 struct AssignStmt : Stmt {
-    std::unique_ptr<Lval> lhs;
-    std::unique_ptr<Rhs> rhs;
+    static constexpr StmtKind KIND = StmtKind::Assign;
+    Lval* lhs;
+    Rhs* rhs;
 
-    AssignStmt(std::unique_ptr<Lval> lhs, std::unique_ptr<Rhs> rhs)
-        : lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+    AssignStmt(Lval* lhs, Rhs* rhs)
+        : Stmt(KIND), lhs(lhs), rhs(rhs) {}
 
 // call judgment recursively on lhs and rhs
 // figure out if member rhs is of type RhsExp or NewExp
 // EXP case: lhs and rhs must have same type, cannot be struct or function type
 // NEW case: lhs must be pointer type to the same type in Rhs::New, rhs must be int type, and the lhs ptr type can't be a function type
-    void judgement(const std::string funcName, bool loop, const unique_ptr<Type>& retType, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    void judgement(const std::string& funcName, bool loop, Type* retType, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* lhsType = lhs->judgement(funcName, gamma, delta);    
         Type* rhsType = rhs->judgement(funcName, gamma, delta);    //  if NEW case : returns amount->judgement()
-        if (dynamic_cast<RhsExp*>(rhs.get())){     // ASSIGN-EXP
+        if (as<RhsExp>(rhs)){     // ASSIGN-EXP
             if (!(lhsType->operator==(*rhsType))) {
-                if (auto nilp = dynamic_cast<Ptr*>(lhsType)){     //  dismiss error if lhs has type &_
-                    if (!dynamic_cast<Any*>(nilp->ref.get())){
-                        addTypeError("[ASSIGN-EXP] in function " + funcName + ": assignment lhs has type " + lhsType->toString() +  " but rhs has type " + rhsType->toString());
+                if (auto nilp = as<Ptr>(lhsType)){     //  dismiss error if lhs has type &_
+                    if (!as<Any>(nilp->ref)){
+                        addTypeError(TypeErrorCode::AssignExp, funcName, "assignment lhs has type {} but rhs has type {}", {lhsType, rhsType}, span);
                     }
                 }
-                else{addTypeError("[ASSIGN-EXP] in function " + funcName + ": assignment lhs has type " + lhsType->toString() +  " but rhs has type " + rhsType->toString());}
+                else{addTypeError(TypeErrorCode::AssignExp, funcName, "assignment lhs has type {} but rhs has type {}", {lhsType, rhsType}, span);}
             }
             // check if if lhsType is a struct or function type or if rhsType is a struct or function type
-            if (dynamic_cast<Struct*>(lhsType) || dynamic_cast<Fn*>(lhsType)) {
-                addTypeError("[ASSIGN-EXP] in function " + funcName + ": assignment to struct or function");
+            if (as<Struct>(lhsType) || as<Fn>(lhsType)) {
+                addTypeError(TypeErrorCode::AssignExp, funcName, "assignment to struct or function", {}, span);
             }
-            // else if (dynamic_cast<Struct*>(rhsType) || dynamic_cast<Fn*>(rhsType)) {
-            //     addTypeError("[ASSIGN-EXP] in function " + funcName + ": assignment to a struct or function");
+            // else if (as<Struct>(rhsType) || as<Fn>(rhsType)) {
+            //     addTypeError(TypeErrorCode::AssignExp, funcName, "assignment to a struct or function");
             // }
         }
-        else if (auto newRhs = dynamic_cast<NewRhs*>(rhs.get())){   // ASSIGN-NEW ;  lhsType should be a pointer type to the same type in Rhs::New, rhsType should be int type, and the lhs ptr type or NewRhs.exp can't be a function type
-            if (auto ptr = dynamic_cast<Ptr*>(lhsType)) {
-                if (!(ptr->ref->operator==(*newRhs->type.get()))) {
-                    addTypeError("[ASSIGN-NEW] in function " + funcName + ": assignment lhs has type " + lhsType->toString() +  " but we're allocating type " + newRhs->type.get()->toString());
+        else if (auto newRhs = as<NewRhs>(rhs)){   // ASSIGN-NEW ;  lhsType should be a pointer type to the same type in Rhs::New, rhsType should be int type, and the lhs ptr type or NewRhs.exp can't be a function type
+            if (auto ptr = as<Ptr>(lhsType)) {
+                if (!(ptr->ref->operator==(*newRhs->type))) {
+                    addTypeError(TypeErrorCode::AssignNew, funcName, "assignment lhs has type {} but we're allocating type {}", {lhsType, newRhs->type}, span);
                 }
-                if (dynamic_cast<Fn*>(newRhs->type.get()) || dynamic_cast<Fn*>(ptr->ref.get())) {
-                    addTypeError("[ASSIGN-NEW] in function " + funcName + ": allocating function type " + newRhs->type->toString());
+                if (as<Fn>(newRhs->type) || as<Fn>(ptr->ref)) {
+                    addTypeError(TypeErrorCode::AssignNew, funcName, "allocating function type {}", {newRhs->type}, span);
                 }
-                if (!(dynamic_cast<Int*>(rhsType) || dynamic_cast<Any*>(rhsType))) {
-                    addTypeError("[ASSIGN-NEW] in function " + funcName + ": allocation amount is type " + rhsType->toString() + " instead of int");
+                if (!(as<Int>(rhsType) || as<Any>(rhsType))) {
+                    addTypeError(TypeErrorCode::AssignNew, funcName, "allocation amount is type {} instead of int", {rhsType}, span);
                 }
             }
             else{      //   lhstype is not a pointer type to something
-                if (!(dynamic_cast<Any*>(lhsType))){
-                    addTypeError("[ASSIGN-NEW] in function " + funcName + ": assignment lhs has type " + lhsType->toString() +  " but we're allocating type " + newRhs->type.get()->toString());
+                if (!(as<Any>(lhsType))){
+                    addTypeError(TypeErrorCode::AssignNew, funcName, "assignment lhs has type {} but we're allocating type {}", {lhsType, newRhs->type}, span);
                 }
-                if (dynamic_cast<Fn*>(newRhs->type.get())) {    //  || dynamic_cast<Fn*>(lhsType)
-                    addTypeError("[ASSIGN-NEW] in function " + funcName + ": allocating function type " + newRhs->type->toString());
+                if (as<Fn>(newRhs->type)) {    //  || as<Fn>(lhsType)
+                    addTypeError(TypeErrorCode::AssignNew, funcName, "allocating function type {}", {newRhs->type}, span);
                 }
-                if (!(dynamic_cast<Int*>(rhsType) || dynamic_cast<Any*>(rhsType))) {
-                    addTypeError("[ASSIGN-NEW] in function " + funcName + ": allocation amount is type " + rhsType->toString() + " instead of int");
+                if (!(as<Int>(rhsType) || as<Any>(rhsType))) {
+                    addTypeError(TypeErrorCode::AssignNew, funcName, "allocation amount is type {} instead of int", {rhsType}, span);
                 }
             }
         }
@@ -730,20 +1145,21 @@ struct AssignStmt : Stmt {
 };
 
 struct CallStmt : Stmt {
-    std::unique_ptr<Lval> callee;
-    std::vector<std::unique_ptr<Exp>> args;
+    static constexpr StmtKind KIND = StmtKind::Call;
+    Lval* callee;
+    ArenaList<Exp*> args;
 
-    CallStmt(std::unique_ptr<Lval> callee, std::vector<std::unique_ptr<Exp>> args)
-        : callee(std::move(callee)), args(std::move(args)) {}
+    CallStmt(Lval* callee, ArenaList<Exp*> args)
+        : Stmt(KIND), callee(callee), args(args) {}
         
-    void judgement(const std::string funcName, bool loop, const unique_ptr<Type>& retType, std::unordered_map<std::string, unique_ptr<Type>>& gamma,
-    const std::unordered_map<std::string, std::unordered_map<std::string, unique_ptr<Type>>>& delta) override {
+    void judgement(const std::string& funcName, bool loop, Type* retType, const Scope& gamma,
+    const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) override {
         Type* calleeType = callee->judgement(funcName, gamma, delta);
         // check if callee is main
         bool isMain = false;
-        if (auto id = dynamic_cast<IdLval*>(callee.get())) {
+        if (auto id = as<IdLval>(callee)) {
             if (id->name == "main") {
-                addTypeError("[SCALL-INTERNAL] in function " + funcName + ": calling main");
+                addTypeError(TypeErrorCode::ScallInternal, funcName, "calling main", {}, span);
                 isMain = true;
                 //cout << "found main\n";
                 // print out mapping in gamma for main
@@ -751,44 +1167,44 @@ struct CallStmt : Stmt {
                 //     std::cout << x.first << " " << x.second->toString() << "\n";
                 // } 
                 if (args.size() != 0){
-                    addTypeError("[SCALL-INTERNAL] in function " + funcName + ": call number of arguments (" + std::to_string(args.size()) + ") and parameters (0) don't match");
+                    addTypeError(TypeErrorCode::ScallInternal, funcName, "call number of arguments ({}) and parameters (0) don't match", {args.size()}, span);
                 }       
             }
         } 
 
-        if (auto ptr = dynamic_cast<Ptr*>(calleeType)) {
-            if (auto fn = dynamic_cast<Fn*>(ptr->ref.get())) {
+        if (auto ptr = as<Ptr>(calleeType)) {
+            if (auto fn = as<Fn>(ptr->ref)) {
                 if (fn->params.size() != args.size()) {
-                    addTypeError("[SCALL-INTERNAL] in function " + funcName + ": call number of arguments (" + std::to_string(args.size()) + ") and parameters (" + std::to_string(fn->params.size()) + ") don't match");
+                    addTypeError(TypeErrorCode::ScallInternal, funcName, "call number of arguments ({}) and parameters ({}) don't match", {args.size(), fn->params.size()}, span);
                 }
                 for (size_t i = 0; i < args.size(); ++i) {
                     Type* argType = args[i]->judgement(funcName, gamma, delta);
                     if (!fn->params[i]->operator==(*argType)) {
-                        addTypeError("[SCALL-INTERNAL] in function " + funcName + ": call argument has type " + argType->toString() + " but parameter has type " + fn->params[i]->toString());
+                        addTypeError(TypeErrorCode::ScallInternal, funcName, "call argument has type {} but parameter has type {}", {argType, fn->params[i]}, span);
                     }
                 }
                 return;
             }    //  not internal; check if its external
             else{
-                addTypeError("[SCALL-*] in function " + funcName + ": calling non-function type " + calleeType->toString()); 
+                addTypeError(TypeErrorCode::ScallAny, funcName, "calling non-function type {}", {calleeType}, span); 
                 return;           
             }
         }   
         
-        else if (auto fn = dynamic_cast<Fn*>(calleeType)) {
+        else if (auto fn = as<Fn>(calleeType)) {
             if (fn->params.size() != args.size()) {
-                addTypeError("[SCALL-EXTERN] in function " + funcName + ": call number of arguments (" + std::to_string(args.size()) + ") and parameters (" + std::to_string(fn->params.size()) + ") don't match");
+                addTypeError(TypeErrorCode::ScallExtern, funcName, "call number of arguments ({}) and parameters ({}) don't match", {args.size(), fn->params.size()}, span);
             }
             for (size_t i = 0; i < args.size(); ++i) {
                 Type* argType = args[i]->judgement(funcName, gamma, delta);
                 if (!fn->params[i]->operator==(*argType)) {
-                    addTypeError("[SCALL-EXTERN] in function " + funcName + ": call argument has type " + argType->toString() + " but parameter has type " + fn->params[i]->toString());
+                    addTypeError(TypeErrorCode::ScallExtern, funcName, "call argument has type {} but parameter has type {}", {argType, fn->params[i]}, span);
                 }
             }
         } else {
-            if (!dynamic_cast<Any*>(calleeType)){
+            if (!as<Any>(calleeType)){
                 if (!isMain){     
-                    addTypeError("[SCALL-*] in function " + funcName + ": calling non-function type " + calleeType->toString());         
+                    addTypeError(TypeErrorCode::ScallAny, funcName, "calling non-function type {}", {calleeType}, span);         
                 }
             }
         }
@@ -799,9 +1215,10 @@ struct CallStmt : Stmt {
 struct Function {
     FuncId name;
     std::vector<Decl> params;
-    std::unique_ptr<Type> rettyp;
-    std::vector<std::pair<Decl, std::unique_ptr<Exp>>> locals;
-    std::vector<std::unique_ptr<Stmt>> stmts;
+    Type* rettyp; // nullptr when the function returns nothing
+    std::vector<std::pair<Decl, Exp*>> locals;
+    std::vector<Stmt*> stmts;
+    Span span;
 };
 
 // Program structure
@@ -810,6 +1227,12 @@ struct Program {
     std::vector<Struct> structs;
     std::vector<Decl> externs;
     std::vector<Function> functions;
+
+    AstArena arena;                            // every statement, expression and l-value node
+    size_t nodes = 0;                          // how many of them
+    std::unordered_set<std::string> names;     // identifiers and fields the nodes refer to, one copy each
+
+    const std::string& intern(const std::string& name) { return *names.insert(name).first; }
 };
 #include <iostream>
 #include <vector>
@@ -820,16 +1243,28 @@ struct Program {
 #include <map>
 #include <stdexcept>
 #include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <iomanip>
+#include <sys/resource.h>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 enum class TokenType {
     Fn, Id, OpenParen, CloseParen, Arrow, Int, OpenBrace, CloseBrace, Semicolon,
     Let, Struct, Colon, Comma, Return, Num, Nil, If, Else, While, Break, Continue,
-    Assign, Star, Amp, Plus, Minus, Equal, NotEq, Lt, Lte, Gt, Gte, Dot, New, Extern,Underscore, OpenBracket, CloseBracket,Slash
+    Assign, Star, Amp, Plus, Minus, Equal, NotEq, Lt, Lte, Gt, Gte, Dot, New, Extern,Underscore, OpenBracket, CloseBracket,Slash,
+    Eof // never in the input, what a TokenSource returns past the last token
 };
 
 struct Token {
     TokenType type;
     std::string value;
+    Span span;
     Token(TokenType type, std::string value = "") : type(type), value(std::move(value)) {}
 };
 
@@ -898,92 +1333,352 @@ std::vector<Token> tokenize(const std::string& input) {
     return tokens;
 }
 
+// Binary token stream, written by lex -o (the layout is described next to writeTokenStream in Lexer/lex.cpp).
+// The type byte is a TokenType, so the order of the enum above is part of the format.
+static_assert(static_cast<int>(TokenType::Slash) == 38, "TokenType order is shared with the lexer's tokenStreamTypes");
+
+constexpr uint8_t TOKEN_STREAM_VERSION = 1;
+constexpr uint8_t TOKEN_STREAM_SPANS = 1;
+constexpr uint8_t TOKEN_NUM_TEXT = 0xFE, TOKEN_RAW = 0xFF;
+
+uint64_t readVarint(const uint8_t*& p, const uint8_t* end) {
+    uint64_t v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        v |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return v;
+    }
+    throw std::runtime_error("token stream: truncated varint");
+}
+
+bool isTokenStream(const char* data, size_t size) {
+    return size >= 4 && std::memcmp(data, "CFTK", 4) == 0;
+}
+
+// Thrown for input the token sources cannot make sense of (unknown token text, a corrupt stream), as opposed
+// to the parse errors the Parser itself throws.
+struct TokenStreamError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Pull-based token source. The grammar is LL(1), so the Parser only ever looks at the current token:
+// tokens are produced in batches into a small ring buffer as parsing goes, never all at once.
+class TokenSource {
+public:
+    static constexpr size_t LOOKAHEAD = 2;
+    static constexpr size_t CAPACITY = 256; // refilled a batch at a time
+
+    virtual ~TokenSource() = default;
+
+    const Token& peek(size_t k = 0) {
+        if (k >= LOOKAHEAD) throw std::logic_error("token lookahead past the ring buffer");
+        if (tail - head <= k && !exhausted) refill();
+        return tail - head > k ? ring[(head + k) % CAPACITY] : eof;
+    }
+
+    Token next() {
+        if (peek().type == TokenType::Eof) return eof;
+        last = ring[head % CAPACITY].span;
+        return std::move(ring[head++ % CAPACITY]);
+    }
+
+    bool atEnd() { return peek().type == TokenType::Eof; }
+
+    size_t position() const { return head; } // tokens consumed so far
+
+    Span lastSpan() const { return last; } // of the token next() returned last
+
+protected:
+    virtual bool produce(Token& out) = 0; // the next token of the input, false at its end
+
+private:
+    std::vector<Token> ring = std::vector<Token>(CAPACITY, Token(TokenType::Eof));
+    size_t head = 0, tail = 0;
+    bool exhausted = false;
+    Span last;
+    const Token eof{TokenType::Eof};
+
+    void refill() {
+        while (!exhausted && tail - head < CAPACITY) {
+            if (produce(ring[tail % CAPACITY])) tail++;
+            else exhausted = true;
+        }
+    }
+};
+
+// One token per line, as lex prints them, read through the stream a line at a time (a pipe from lex works too).
+class TextTokenSource : public TokenSource {
+    std::istream& in;
+    std::string line;
+
+protected:
+    bool produce(Token& out) override {
+        while (std::getline(in, line)) {
+            std::istringstream iss(line);
+            std::string tokenStr;
+            if (!(iss >> tokenStr)) continue;
+            if (tokenStr.substr(0, 3) == "Id(") {
+                out = Token(TokenType::Id, tokenStr.substr(3, tokenStr.length() - 4));
+            } else if (tokenStr.substr(0, 4) == "Num(") {
+                out = Token(TokenType::Num, tokenStr.substr(4, tokenStr.length() - 5));
+            } else {
+                auto it = tokenMap.find(tokenStr);
+                if (it == tokenMap.end()) throw TokenStreamError("Unknown token '" + tokenStr + "'");
+                out = Token(it->second);
+            }
+            return true;
+        }
+        return false;
+    }
+
+public:
+    explicit TextTokenSource(std::istream& in) : in(in) {}
+};
+
+// A lex -o token stream, mapped read-only and decoded in place one token at a time.
+class BinaryTokenSource : public TokenSource {
+    void* mapped = MAP_FAILED;
+    size_t size = 0;
+    const uint8_t* p = nullptr;
+    const uint8_t* end = nullptr;
+    bool spans = false;
+    uint64_t start = 0; // spans are delta coded
+    std::vector<std::string_view> strings = std::vector<std::string_view>(1); // ids start at 1
+    uint64_t remaining = 0;
+
+    std::string stringAt(uint64_t id) const {
+        if (id == 0 || id >= strings.size()) throw TokenStreamError("token stream: bad string id");
+        return std::string(strings[id]);
+    }
+
+    uint64_t varint() {
+        try {
+            return readVarint(p, end);
+        } catch (const std::runtime_error& e) {
+            throw TokenStreamError(e.what());
+        }
+    }
+
+protected:
+    bool produce(Token& out) override {
+        if (remaining == 0) return false;
+        remaining--;
+        if (p == end) throw TokenStreamError("token stream: truncated");
+
+        uint8_t type = *p++;
+        if (type == static_cast<uint8_t>(TokenType::Id)) {
+            out = Token(TokenType::Id, stringAt(varint()));
+        } else if (type == static_cast<uint8_t>(TokenType::Num)) {
+            out = Token(TokenType::Num, std::to_string(varint()));
+        } else if (type == TOKEN_NUM_TEXT) {
+            out = Token(TokenType::Num, stringAt(varint()));
+        } else if (type == TOKEN_RAW) {
+            throw TokenStreamError("Unknown token '" + stringAt(varint()) + "'");
+        } else if (type <= static_cast<uint8_t>(TokenType::Slash)) {
+            out = Token(static_cast<TokenType>(type));
+        } else {
+            throw TokenStreamError("token stream: bad token type");
+        }
+        if (spans) {
+            start += varint();
+            uint64_t length = varint();
+            if (start + length > UINT32_MAX) throw TokenStreamError("token stream: span past 4GB");
+            out.span = Span{static_cast<uint32_t>(start), static_cast<uint32_t>(length)};
+        }
+        return true;
+    }
+
+public:
+    BinaryTokenSource(int fd, size_t size) : size(size) {
+        mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) throw TokenStreamError("token stream: mmap failed");
+        madvise(mapped, size, MADV_SEQUENTIAL);
+
+        p = static_cast<const uint8_t*>(mapped);
+        end = p + size;
+        if (!isTokenStream(static_cast<const char*>(mapped), size) || size < 6 || p[4] != TOKEN_STREAM_VERSION) {
+            throw TokenStreamError("token stream: unsupported version");
+        }
+        spans = p[5] & TOKEN_STREAM_SPANS;
+        p += 6;
+
+        uint64_t count = varint();
+        for (uint64_t k = 0; k < count; k++) {
+            uint64_t len = varint();
+            if (len > static_cast<uint64_t>(end - p)) throw TokenStreamError("token stream: truncated string table");
+            strings.emplace_back(reinterpret_cast<const char*>(p), len);
+            p += len;
+        }
+        remaining = varint();
+    }
+
+    ~BinaryTokenSource() override {
+        if (mapped != MAP_FAILED) munmap(mapped, size);
+    }
+
+    BinaryTokenSource(const BinaryTokenSource&) = delete;
+    BinaryTokenSource& operator=(const BinaryTokenSource&) = delete;
+};
+
+// "-" is stdin (text). A regular file starting with the stream magic is mapped, anything else is read as text.
+std::unique_ptr<TokenSource> openTokenSource(const std::string& filename, std::ifstream& file) {
+    if (filename == "-") return std::make_unique<TextTokenSource>(std::cin);
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    char magic[4];
+    bool binary = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= 4
+               && pread(fd, magic, 4, 0) == 4 && isTokenStream(magic, 4);
+    if (binary) {
+        std::unique_ptr<TokenSource> source;
+        try {
+            source = std::make_unique<BinaryTokenSource>(fd, st.st_size);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        return source;
+    }
+    close(fd);
+
+    file.open(filename);
+    if (!file) return nullptr;
+    return std::make_unique<TextTokenSource>(file);
+}
+
+// Tokens already in memory, [begin, end), with spans moved to count from base (see IncrementalChecker).
+class SliceTokenSource : public TokenSource {
+    const Token* p;
+    const Token* end;
+    uint32_t base;
+
+protected:
+    bool produce(Token& out) override {
+        if (p == end) return false;
+        out = *p++;
+        if (out.span.valid()) out.span.offset -= base;
+        return true;
+    }
+
+public:
+    SliceTokenSource(const Token* begin, const Token* end, uint32_t base) : p(begin), end(end), base(base) {}
+};
+
 class Parser {
-    std::vector<Token> tokens;
-    size_t current = 0;
+    TokenSource& tokens;
+    Program* program = nullptr; // the one being parsed, its arena holds the nodes
+
+    template <class Node, class... Args>
+    Node* make(Args&&... args) {
+        program->nodes++;
+        return program->arena.make<Node>(std::forward<Args>(args)...);
+    }
+
+    template <class T>
+    ArenaList<T> list(const std::vector<T>& items) {
+        return ArenaList<T>(program->arena, items);
+    }
+
+    // a node spans from its first token to the last one consumed so far
+    template <class Node>
+    Node* located(Node* node, Span first) {
+        node->span = Span::cover(first, tokens.lastSpan());
+        return node;
+    }
 
 public:
-    explicit Parser(std::vector<Token> tokens) : tokens(std::move(tokens)) {}
+    explicit Parser(TokenSource& tokens) : tokens(tokens) {}
 
     std::unique_ptr<Program> parseProgram() {
+        metrics::Scope scope("parse");
         auto program = std::make_unique<Program>();
-        //std::cout<<"current: "<<current<<" tokens.size(): "<<tokens.size()<<std::endl;
-        while (current < tokens.size()) {
-           // std::cout<<"currenttokentype: "<<(int)tokens[current].type<<std::endl;
-            switch (tokens[current].type) {
+        parseItems(*program);
+        metrics::counter("ast nodes") += program->nodes;
+        return program;
+    }
+
+    // parses top-level items until the tokens run out and appends them to program, whose arena gets the nodes
+    void parseItems(Program& program) {
+        this->program = &program;
+        //std::cout<<"position: "<<tokens.position()<<std::endl;
+        while (!tokens.atEnd()) {
+           // std::cout<<"currenttokentype: "<<(int)tokens.peek().type<<std::endl;
+            switch (tokens.peek().type) {
                 case TokenType::Fn:
                  //   std::cout<<"fn"<<std::endl;
-                    program->functions.push_back(parseFunction());
+                    program.functions.push_back(parseFunction());
                     break;
                 case TokenType::Extern:
-                    program->externs.push_back(parseExtern());
+                    program.externs.push_back(parseExtern());
                     break;
                 case TokenType::Struct:
-                    program->structs.push_back(parseStruct());
+                    program.structs.push_back(parseStruct());
                     break;
                 case TokenType::Let:
                // std::cout<<"let"<<std::endl;
                 expect(TokenType::Let);
-                program->globals.push_back(parseDecl());
+                program.globals.push_back(parseDecl());
                 //  can see a colon (more globals to come) or a semicolon (end of globals)
-                while (tokens[current].type == TokenType::Comma) {
+                while (tokens.peek().type == TokenType::Comma) {
                     expect(TokenType::Comma);
-                    program->globals.push_back(parseDecl());
+                    program.globals.push_back(parseDecl());
                 }
                 expect(TokenType::Semicolon);
                 break;
                 default:
-                //std::cout<<current<<std::endl;
-            throw std::runtime_error("parse error at token " + std::to_string(current));
+                //std::cout<<tokens.position()<<std::endl;
+            throw std::runtime_error("parse error at token " + std::to_string(tokens.position()));
             }
         }
-        return program;
     }
 
 Function parseFunction() {
+    Span first = tokens.peek().span;
     expect(TokenType::Fn);
     auto funcName = expect(TokenType::Id).value;
     expect(TokenType::OpenParen);
     std::vector<Decl> params;
-    if (tokens[current].type != TokenType::CloseParen) {
+    if (tokens.peek().type != TokenType::CloseParen) {
         params.push_back(parseDecl());
-        while (tokens[current].type == TokenType::Comma) {
+        while (tokens.peek().type == TokenType::Comma) {
             expect(TokenType::Comma);
             params.push_back(parseDecl());
         }
     }
     expect(TokenType::CloseParen);
     expect(TokenType::Arrow);
-    std::unique_ptr<Type> returnType = nullptr;
-    if(tokens[current].type== TokenType::Underscore)
+    Type* returnType = nullptr;
+    if(tokens.peek().type== TokenType::Underscore)
     {
         expect(TokenType::Underscore);
     }
-    else if (tokens[current].type != TokenType::OpenBrace) {
+    else if (tokens.peek().type != TokenType::OpenBrace) {
         returnType = parseType();
     }
     expect(TokenType::OpenBrace);
-    std::vector<std::unique_ptr<Stmt>> stmts;
-    std::vector<std::pair<Decl, std::unique_ptr<Exp>>> locals;
-    while (tokens[current].type != TokenType::CloseBrace) {
-        if (tokens[current].type == TokenType::Let) {
+    std::vector<Stmt*> stmts;
+    std::vector<std::pair<Decl, Exp*>> locals;
+    while (tokens.peek().type != TokenType::CloseBrace) {
+        if (tokens.peek().type == TokenType::Let) {
             expect(TokenType::Let);
             auto decl = parseDecl();
-            std::unique_ptr<Exp> init = nullptr;
-            if (tokens[current].type == TokenType::Assign) {
+            Exp* init = nullptr;
+            if (tokens.peek().type == TokenType::Assign) {
                 expect(TokenType::Assign);
                 init = parseExp();
             }
-            locals.push_back(std::make_pair(std::move(decl), std::move(init)));
-            while (tokens[current].type == TokenType::Comma) {
+            locals.push_back(std::make_pair(std::move(decl), init));
+            while (tokens.peek().type == TokenType::Comma) {
                 expect(TokenType::Comma);
                 auto nextDecl = parseDecl();
-                std::unique_ptr<Exp> nextInit = nullptr;
-                if (tokens[current].type == TokenType::Assign) {
+                Exp* nextInit = nullptr;
+                if (tokens.peek().type == TokenType::Assign) {
                     expect(TokenType::Assign);
                     nextInit = parseExp();
                 }
-                locals.push_back(std::make_pair(std::move(nextDecl), std::move(nextInit)));
+                locals.push_back(std::make_pair(std::move(nextDecl), nextInit));
             }
             expect(TokenType::Semicolon);
         } else {
@@ -991,20 +1686,24 @@ Function parseFunction() {
         }
     }
     expect(TokenType::CloseBrace);
-    return Function{funcName, std::move(params), std::move(returnType), std::move(locals), std::move(stmts)};
+    return Function{funcName, std::move(params), std::move(returnType), std::move(locals), std::move(stmts),
+                    Span::cover(first, tokens.lastSpan())};
 }
 
 
 Decl parseExtern() {
+    Span first = tokens.peek().span;
     expect(TokenType::Extern);
     auto name = expect(TokenType::Id).value;
     expect(TokenType::Colon);
-    if(tokens[current].type == TokenType::Underscore)
-        throw std::runtime_error("parse error at token " + std::to_string(current));
+    if(tokens.peek().type == TokenType::Underscore)
+        throw std::runtime_error("parse error at token " + std::to_string(tokens.position()));
     
     auto type = parseType();
     expect(TokenType::Semicolon);
-    return Decl{name, std::move(type)};
+    Decl decl{name, std::move(type)};
+    decl.span = Span::cover(first, tokens.lastSpan());
+    return decl;
 }
 
 
@@ -1012,11 +1711,11 @@ Struct parseStruct() {
     expect(TokenType::Struct);
     auto name = expect(TokenType::Id).value;
     expect(TokenType::OpenBrace);
-    std::vector<std::pair<std::string, std::unique_ptr<Type>>> fields;
-    while (tokens[current].type != TokenType::CloseBrace) {
+    std::vector<std::pair<std::string, Type*>> fields;
+    while (tokens.peek().type != TokenType::CloseBrace) {
         auto decl = parseDecl();
-        fields.emplace_back(decl.name, std::move(decl.type));
-        if (tokens[current].type == TokenType::Comma) {
+        fields.emplace_back(decl.name, decl.type);
+        if (tokens.peek().type == TokenType::Comma) {
             expect(TokenType::Comma);
         }
     }
@@ -1025,110 +1724,115 @@ Struct parseStruct() {
 }
 
 Decl parseDecl() {
+    Span first = tokens.peek().span;
     auto name = expect(TokenType::Id).value;
     expect(TokenType::Colon);
     auto type = parseType();
-    return Decl{name, std::move(type)};
+    Decl decl{name, std::move(type)};
+    decl.span = Span::cover(first, tokens.lastSpan());
+    return decl;
 }
-    std::unique_ptr<Stmt> parseStmt() {
-        switch (tokens[current].type) {
+    Stmt* parseStmt() {
+        Span first = tokens.peek().span;
+        switch (tokens.peek().type) {
             case TokenType::If:
-                return parseIf();
+                return located<Stmt>(parseIf(), first);
             case TokenType::While:
-                return parseWhile();
+                return located<Stmt>(parseWhile(), first);
             case TokenType::Break:
-                return parseBreak();
+                return located<Stmt>(parseBreak(), first);
             case TokenType::Continue:
-                return parseContinue();
+                return located<Stmt>(parseContinue(), first);
             case TokenType::Return:
-                return parseReturn();
+                return located<Stmt>(parseReturn(), first);
             default:
-                return parseAssignOrCall();
+                return located<Stmt>(parseAssignOrCall(), first);
         }
     }
 
-    std::unique_ptr<IfStmt> parseIf() {
+    IfStmt* parseIf() {
         expect(TokenType::If);
         auto guard = parseExp();
         auto tt = parseBlock();
-        std::vector<std::unique_ptr<Stmt>> ff;
-        if (tokens[current].type == TokenType::Else) {
+        std::vector<Stmt*> ff;
+        if (tokens.peek().type == TokenType::Else) {
             expect(TokenType::Else);
             ff = parseBlock();
         }
-        return std::make_unique<IfStmt>(IfStmt{std::move(guard), std::move(tt), std::move(ff)});
+        return make<IfStmt>(guard, list(tt), list(ff));
     }
 
-    std::unique_ptr<WhileStmt> parseWhile() {
+    WhileStmt* parseWhile() {
         expect(TokenType::While);
         auto guard = parseExp();
         auto body = parseBlock();
-        return std::make_unique<WhileStmt>(WhileStmt{std::move(guard), std::move(body)});
+        return make<WhileStmt>(guard, list(body));
     }
 
-    std::unique_ptr<BreakStmt> parseBreak() {
+    BreakStmt* parseBreak() {
         expect(TokenType::Break);
         expect(TokenType::Semicolon);
-        return std::make_unique<BreakStmt>();
+        return make<BreakStmt>();
     }
 
-    std::unique_ptr<ContinueStmt> parseContinue() {
+    ContinueStmt* parseContinue() {
         expect(TokenType::Continue);
         expect(TokenType::Semicolon);
-        return std::make_unique<ContinueStmt>();
+        return make<ContinueStmt>();
     }
 
-    std::unique_ptr<ReturnStmt> parseReturn() {
+    ReturnStmt* parseReturn() {
         expect(TokenType::Return);
-        std::unique_ptr<Exp> exp = nullptr;
-        if (tokens[current].type != TokenType::Semicolon) {
+        Exp* exp = nullptr;
+        if (tokens.peek().type != TokenType::Semicolon) {
             exp = parseExp();
         }
         expect(TokenType::Semicolon);
-        return std::make_unique<ReturnStmt>(ReturnStmt{std::move(exp)});
+        return make<ReturnStmt>(exp);
     }
 
-    std::unique_ptr<Stmt> parseAssignOrCall() {
+    Stmt* parseAssignOrCall() {
         auto lval = parseLval();
-        if (tokens[current].type == TokenType::Assign) {
+        if (tokens.peek().type == TokenType::Assign) {
             expect(TokenType::Assign);
             auto rhs = parseRhs();
             expect(TokenType::Semicolon);
-            return std::make_unique<AssignStmt>(AssignStmt{std::move(lval), std::move(rhs)});
+            return make<AssignStmt>(lval, rhs);
         } else {
             expect(TokenType::OpenParen);
-            std::vector<std::unique_ptr<Exp>> args;
-            if (tokens[current].type != TokenType::CloseParen) {
+            std::vector<Exp*> args;
+            if (tokens.peek().type != TokenType::CloseParen) {
                 args.push_back(parseExp());
-                while (tokens[current].type == TokenType::Comma) {
+                while (tokens.peek().type == TokenType::Comma) {
                     expect(TokenType::Comma);
                     args.push_back(parseExp());
                 }
             }
             expect(TokenType::CloseParen);
             expect(TokenType::Semicolon);
-            return std::make_unique<CallStmt>(CallStmt{std::move(lval), std::move(args)});
+            return make<CallStmt>(lval, list(args));
         }
     }
 
-std::unique_ptr<Lval> parseLval() {
-    std::unique_ptr<Lval> lval;
-    if (tokens[current].type == TokenType::Star) {
+Lval* parseLval() {
+    Span first = tokens.peek().span;
+    Lval* lval;
+    if (tokens.peek().type == TokenType::Star) {
         expect(TokenType::Star);
-        lval = std::make_unique<DerefLval>(DerefLval{parseLval()});
+        lval = located<Lval>(make<DerefLval>(parseLval()), first);
     } else {
-        lval = std::make_unique<IdLval>(IdLval{expect(TokenType::Id).value});
+        lval = located<Lval>(make<IdLval>(program->intern(expect(TokenType::Id).value)), first);
     }
     while (true) {
-        if (tokens[current].type == TokenType::OpenBracket) {
+        if (tokens.peek().type == TokenType::OpenBracket) {
             expect(TokenType::OpenBracket);
             auto index = parseExp();
             expect(TokenType::CloseBracket);
-            lval = std::make_unique<ArrayAccessLval>(ArrayAccessLval{std::move(lval), std::move(index)});
-        } else if (tokens[current].type == TokenType::Dot) {
+            lval = located<Lval>(make<ArrayAccessLval>(lval, index), first);
+        } else if (tokens.peek().type == TokenType::Dot) {
             expect(TokenType::Dot);
             auto field = expect(TokenType::Id).value;
-            lval = std::make_unique<FieldAccessLval>(FieldAccessLval{std::move(lval), field});
+            lval = located<Lval>(make<FieldAccessLval>(lval, program->intern(field)), first);
         } else {
             break;
         }
@@ -1136,108 +1840,115 @@ std::unique_ptr<Lval> parseLval() {
     return lval;
 }
 
-    std::unique_ptr<Rhs> parseRhs() {
-        if (tokens[current].type == TokenType::New) {
+    Rhs* parseRhs() {
+        Span first = tokens.peek().span;
+        if (tokens.peek().type == TokenType::New) {
             expect(TokenType::New);
             auto type = parseType();
-            std::unique_ptr<Exp> amount = nullptr;
-            if (tokens[current].type != TokenType::Semicolon) {
+            Exp* amount = nullptr;
+            if (tokens.peek().type != TokenType::Semicolon) {
                 amount = parseExp();
             }
         else {
             // Handle the default case: amount = Num(1)
-            amount = std::make_unique<NumExp>(NumExp{1});
+            amount = make<NumExp>(1);
         }
-            return std::make_unique<NewRhs>(NewRhs{std::move(type), std::move(amount)});
+            return located<Rhs>(make<NewRhs>(type, amount), first);
         } else {
             auto exp = parseExp();
-            return std::make_unique<RhsExp>(RhsExp{std::move(exp)});
+            return located<Rhs>(make<RhsExp>(exp), first);
         }
     }
 
-    std::unique_ptr<Exp> parseExp() {
+    Exp* parseExp() {
+        Span first = tokens.peek().span;
         auto exp = parseExp1();
-        while (tokens[current].type == TokenType::Equal || tokens[current].type == TokenType::NotEq ||
-               tokens[current].type == TokenType::Lt || tokens[current].type == TokenType::Lte ||
-               tokens[current].type == TokenType::Gt || tokens[current].type == TokenType::Gte) {
+        while (tokens.peek().type == TokenType::Equal || tokens.peek().type == TokenType::NotEq ||
+               tokens.peek().type == TokenType::Lt || tokens.peek().type == TokenType::Lte ||
+               tokens.peek().type == TokenType::Gt || tokens.peek().type == TokenType::Gte) {
             auto op = parseBinOp();
             auto rhs = parseExp1();
-            exp = std::make_unique<BinOpExp>(BinOpExp{op, std::move(exp), std::move(rhs)});
+            exp = located<Exp>(make<BinOpExp>(op, exp, rhs), first);
         }
         return exp;
     }
 
-    std::unique_ptr<Exp> parseExp1() {
+    Exp* parseExp1() {
+        Span first = tokens.peek().span;
         auto exp = parseExp2();
-        while (tokens[current].type == TokenType::Plus || tokens[current].type == TokenType::Minus) {
+        while (tokens.peek().type == TokenType::Plus || tokens.peek().type == TokenType::Minus) {
             auto op = parseBinOp();
             auto rhs = parseExp2();
-            exp = std::make_unique<BinOpExp>(BinOpExp{op, std::move(exp), std::move(rhs)});
+            exp = located<Exp>(make<BinOpExp>(op, exp, rhs), first);
         }
         return exp;
     }
 
-    std::unique_ptr<Exp> parseExp2() {
+    Exp* parseExp2() {
+        Span first = tokens.peek().span;
         auto exp = parseExp3();
-        while (tokens[current].type == TokenType::Star || tokens[current].type == TokenType::Slash) {
+        while (tokens.peek().type == TokenType::Star || tokens.peek().type == TokenType::Slash) {
             auto op = parseBinOp();
             auto rhs = parseExp3();
-            exp = std::make_unique<BinOpExp>(BinOpExp{op, std::move(exp), std::move(rhs)});
+            exp = located<Exp>(make<BinOpExp>(op, exp, rhs), first);
         }
         return exp;
     }
 
-    std::unique_ptr<Exp> parseExp3() {
-        if (tokens[current].type == TokenType::Plus || tokens[current].type == TokenType::Minus ||
-            tokens[current].type == TokenType::Star || tokens[current].type == TokenType::Amp) {
+    Exp* parseExp3() {
+        Span first = tokens.peek().span;
+        if (tokens.peek().type == TokenType::Plus || tokens.peek().type == TokenType::Minus ||
+            tokens.peek().type == TokenType::Star || tokens.peek().type == TokenType::Amp) {
             auto op = parseUnOp();
             auto operand = parseExp3();
-            return std::make_unique<UnOpExp>(UnOpExp{op, std::move(operand)});
+            return located<Exp>(make<UnOpExp>(op, operand), first);
         } else {
             return parseExp4();
         }
     }
 
-std::unique_ptr<Exp> parseExp4() {
+Exp* parseExp4() {
+    Span first = tokens.peek().span;
     auto exp = parseExp5();
     while (true) {
-        if (tokens[current].type == TokenType::OpenBracket) {
+        if (tokens.peek().type == TokenType::OpenBracket) {
             expect(TokenType::OpenBracket);
             auto index = parseExp();
             expect(TokenType::CloseBracket);
-            exp = std::make_unique<ArrayAccessExp>(ArrayAccessExp{std::move(exp), std::move(index)});
-        } else if (tokens[current].type == TokenType::Dot) {
+            exp = located<Exp>(make<ArrayAccessExp>(exp, index), first);
+        } else if (tokens.peek().type == TokenType::Dot) {
             expect(TokenType::Dot);
             auto field = expect(TokenType::Id).value;
-            exp = std::make_unique<FieldAccessExp>(FieldAccessExp{std::move(exp), field});
-        } else if (tokens[current].type == TokenType::OpenParen) {
+            exp = located<Exp>(make<FieldAccessExp>(exp, program->intern(field)), first);
+        } else if (tokens.peek().type == TokenType::OpenParen) {
             expect(TokenType::OpenParen);
-            std::vector<std::unique_ptr<Exp>> args;
-            if (tokens[current].type != TokenType::CloseParen) {
+            std::vector<Exp*> args;
+            if (tokens.peek().type != TokenType::CloseParen) {
                 args.push_back(parseExp());
-                while (tokens[current].type == TokenType::Comma) {
+                while (tokens.peek().type == TokenType::Comma) {
                     expect(TokenType::Comma);
                     args.push_back(parseExp());
                 }
             }
             expect(TokenType::CloseParen);
-            exp = std::make_unique<CallExp>(CallExp{std::move(exp), std::move(args)});
+            exp = located<Exp>(make<CallExp>(exp, list(args)), first);
         } else {
             break;
         }
     }
     return exp;
 }
-    std::unique_ptr<Exp> parseExp5() {
-        switch (tokens[current].type) {
+    Exp* parseExp5() {
+        Span first = tokens.peek().span;
+        switch (tokens.peek().type) {
             case TokenType::Num:
                 //cout<<"numcase in parseexp5"<<endl;
-                return std::make_unique<NumExp>(NumExp{std::stoi(expect(TokenType::Num).value)});
+                return located<Exp>(make<NumExp>(std::stoi(expect(TokenType::Num).value)), first);
             case TokenType::Id:
-                return std::make_unique<IdExp>(IdExp{expect(TokenType::Id).value});
+                return located<Exp>(make<IdExp>(program->intern(expect(TokenType::Id).value)), first);
             case TokenType::Nil:
                 expect(TokenType::Nil);
-                return std::make_unique<NilExp>();
+                return located<Exp>(make<NilExp>(), first);
             case TokenType::OpenParen: {
                 expect(TokenType::OpenParen);
                 auto exp = parseExp();
@@ -1245,12 +1956,12 @@ std::unique_ptr<Exp> parseExp4() {
                 return exp;
             }
             default:
-            throw std::runtime_error("parse error at token " + std::to_string(current));
+            throw std::runtime_error("parse error at token " + std::to_string(tokens.position()));
         }
     }
 
     BinaryOp parseBinOp() {
-        switch (tokens[current].type) {
+        switch (tokens.peek().type) {
             case TokenType::Plus:
                 expect(TokenType::Plus);
                 return BinaryOp::Add;
@@ -1282,12 +1993,12 @@ std::unique_ptr<Exp> parseExp4() {
                 expect(TokenType::Gte);
                 return BinaryOp::Gte;
             default:
-            throw std::runtime_error("parse error at token " + std::to_string(current));
+            throw std::runtime_error("parse error at token " + std::to_string(tokens.position()));
         }
     }
 
     UnaryOp parseUnOp() {
-        switch (tokens[current].type) {
+        switch (tokens.peek().type) {
             case TokenType::Plus:
                 expect(TokenType::Plus);
                 return UnaryOp::Neg;
@@ -1301,88 +2012,88 @@ std::unique_ptr<Exp> parseExp4() {
                 expect(TokenType::Amp);
                 return UnaryOp::Addr;
             default:
-            throw std::runtime_error("parse error at token " + std::to_string(current));
+            throw std::runtime_error("parse error at token " + std::to_string(tokens.position()));
         }
     }
 
-std::unique_ptr<Type> parseType() {
+Type* parseType() {
     //cout<<tokens.size()<<endl;
-    std::unique_ptr<Type> type;
+    Type* type;
     int pointerCount = 0;
-    while (tokens[current].type == TokenType::Amp) {
+    while (tokens.peek().type == TokenType::Amp) {
         expect(TokenType::Amp);
         pointerCount++;
     }
-    switch (tokens[current].type) {
+    switch (tokens.peek().type) {
         case TokenType::Underscore:
             expect(TokenType::Underscore);
-            type = std::make_unique<Int>(); // Placeholder type for underscore
+            type = typeContext.integer(); // Placeholder type for underscore
             break;
         case TokenType::Int:
             expect(TokenType::Int);
-            type = std::make_unique<Int>();
+            type = typeContext.integer();
             break;
         case TokenType::Id: {
             auto structName = expect(TokenType::Id).value;
-            type = std::make_unique<Struct>(Struct{structName, {}});
+            type = typeContext.structure(structName);
             break;
         }
         case TokenType::OpenParen: {
             expect(TokenType::OpenParen);
-            std::vector<std::unique_ptr<Type>> paramTypes;
-            if (tokens[current].type != TokenType::CloseParen) {
-                if (tokens[current].type == TokenType::Underscore&& pointerCount>0)
-                    throw std::runtime_error("parse error at token " + std::to_string(current));
+            std::vector<Type*> paramTypes;
+            if (tokens.peek().type != TokenType::CloseParen) {
+                if (tokens.peek().type == TokenType::Underscore&& pointerCount>0)
+                    throw std::runtime_error("parse error at token " + std::to_string(tokens.position()));
                 paramTypes.push_back(parseType());
-                while (tokens[current].type == TokenType::Comma) {
+                while (tokens.peek().type == TokenType::Comma) {
                     expect(TokenType::Comma);
                     paramTypes.push_back(parseType());
                 }
             }
             expect(TokenType::CloseParen);
-            std::unique_ptr<Type> retType = nullptr;
-            if (tokens[current].type == TokenType::Arrow) {
+            Type* retType = nullptr;
+            if (tokens.peek().type == TokenType::Arrow) {
                 expect(TokenType::Arrow);
-                if (tokens[current].type == TokenType::Underscore) {
+                if (tokens.peek().type == TokenType::Underscore) {
                     expect(TokenType::Underscore);
                     // No return type (void)
                 } else {
                     retType = parseType();
                 }
             }
-            type = std::make_unique<Fn>(Fn{std::move(paramTypes), std::move(retType)});
+            type = typeContext.function(paramTypes, retType);
             break;
         }
         default:
-            throw std::runtime_error("parse error at token " + std::to_string(current));
+            throw std::runtime_error("parse error at token " + std::to_string(tokens.position()));
     }
     while (pointerCount > 0) {
-        type = std::make_unique<Ptr>(Ptr{std::move(type)});
+        type = typeContext.pointer(type);
         pointerCount--;
     }
     return type;
 }
 
-    std::vector<std::unique_ptr<Stmt>> parseBlock() {
+    std::vector<Stmt*> parseBlock() {
         expect(TokenType::OpenBrace);
-        std::vector<std::unique_ptr<Stmt>> stmts;
-        while (tokens[current].type != TokenType::CloseBrace) {
+        std::vector<Stmt*> stmts;
+        while (tokens.peek().type != TokenType::CloseBrace) {
             stmts.push_back(parseStmt());
         }
         expect(TokenType::CloseBrace);
         return stmts;
     }
 
-    Token& expect(TokenType type) {
-        if (tokens[current].type != type) {
-            //std::cout<<"expected: "<<(int)type<<" got: "<<(int)tokens[current].type<<std::endl;
-            if(current==tokens.size())
+    Token expect(TokenType type) {
+        if (tokens.peek().type != type) {
+            //std::cout<<"expected: "<<(int)type<<" got: "<<(int)tokens.peek().type<<std::endl;
+            if(tokens.atEnd())
             {
-                throw std::runtime_error("parse error at token " + std::to_string(current-1));
+                throw std::runtime_error("parse error at token " + std::to_string(tokens.position()-1));
             }
-            throw std::runtime_error("parse error at token " + std::to_string(current));
+            throw std::runtime_error("parse error at token " + std::to_string(tokens.position()));
         }
-        return tokens[current++];
+        return tokens.next();
     }
 };
 
@@ -1423,29 +2134,42 @@ void printStruct(const Struct& s) {
 
 
 void printType(const Type& type) {
-    if (const Int* i = dynamic_cast<const Int*>(&type)) {
-        std::cout << "Int";
-    } else if (const Struct* s = dynamic_cast<const Struct*>(&type)) {
-        std::cout << "Struct(" << s->name << ")";
-    } else if (const Fn* f = dynamic_cast<const Fn*>(&type)) {
-        std::cout << "Fn(";
-        std::cout << "prms = [";
-        for (size_t i = 0; i < f->params.size(); ++i) {
-            if (i > 0) std::cout << ", ";
-            printType(*f->params[i]);
-        }
-        std::cout << "], ";
-        std::cout << "ret = ";
-        if (f->ret) {
-            printType(*f->ret);
-        } else {
-            std::cout << "_";
+    switch (type.kind) {
+        case TypeKind::Any: // only the checker makes `_`
+            break;
+        case TypeKind::Int:
+            std::cout << "Int";
+            break;
+        case TypeKind::Struct: {
+            const Struct* s = static_cast<const Struct*>(&type);
+            std::cout << "Struct(" << s->name << ")";
+            break;
+        }
+        case TypeKind::Fn: {
+            const Fn* f = static_cast<const Fn*>(&type);
+            std::cout << "Fn(";
+            std::cout << "prms = [";
+            for (size_t i = 0; i < f->params.size(); ++i) {
+                if (i > 0) std::cout << ", ";
+                printType(*f->params[i]);
+            }
+            std::cout << "], ";
+            std::cout << "ret = ";
+            if (f->ret) {
+                printType(*f->ret);
+            } else {
+                std::cout << "_";
+            }
+            std::cout << ")";
+            break;
+        }
+        case TypeKind::Ptr: {
+            const Ptr* p = static_cast<const Ptr*>(&type);
+            std::cout << "Ptr(";
+            printType(*p->ref);
+            std::cout << ")";
+            break;
         }
-        std::cout << ")";
-    } else if (const Ptr* p = dynamic_cast<const Ptr*>(&type)) {
-        std::cout << "Ptr(";
-        printType(*p->ref);
-        std::cout << ")";
     }
 }
 
@@ -1517,187 +2241,251 @@ void printBinOp(const BinaryOp& op) {
 }
 
 void printExp(const Exp& exp) {
-    if (const NumExp* n = dynamic_cast<const NumExp*>(&exp)) {
-        std::cout << "Num(" << n->n << ")";
-    } else if (const IdExp* i = dynamic_cast<const IdExp*>(&exp)) {
-        std::cout << "Id(" << i->name << ")";
-    } else if (dynamic_cast<const NilExp*>(&exp)) {
-        std::cout << "Nil";
-    } else if (const UnOpExp* u = dynamic_cast<const UnOpExp*>(&exp)) {
-        switch (u->op) {
-            case UnaryOp::Neg:
-                std::cout << "Neg(";
-                printExp(*u->operand);
-                std::cout << ")";
-                break;
-            case UnaryOp::Deref:
-                std::cout << "Deref(";
-                printExp(*u->operand);
-                std::cout << ")";
-                break;
+    switch (exp.kind) {
+        case ExpKind::Num: {
+            const NumExp* n = static_cast<const NumExp*>(&exp);
+            std::cout << "Num(" << n->n << ")";
+            break;
+        }
+        case ExpKind::Id: {
+            const IdExp* i = static_cast<const IdExp*>(&exp);
+            std::cout << "Id(" << i->name << ")";
+            break;
+        }
+        case ExpKind::Nil: {
+            std::cout << "Nil";
+            break;
+        }
+        case ExpKind::UnOp: {
+            const UnOpExp* u = static_cast<const UnOpExp*>(&exp);
+            switch (u->op) {
+                case UnaryOp::Neg:
+                    std::cout << "Neg(";
+                    printExp(*u->operand);
+                    std::cout << ")";
+                    break;
+                case UnaryOp::Deref:
+                    std::cout << "Deref(";
+                    printExp(*u->operand);
+                    std::cout << ")";
+                    break;
+            }
+            break;
+        }
+        case ExpKind::BinOp: {
+            const BinOpExp* b = static_cast<const BinOpExp*>(&exp);
+            std::cout << "BinOp(" << std::endl;
+            std::cout << "  op = ";
+            switch (b->op) {
+                case BinaryOp::Add: std::cout << "Add"; break;
+                case BinaryOp::Sub: std::cout << "Sub"; break;
+                case BinaryOp::Mul: std::cout << "Mul"; break;
+                case BinaryOp::Div: std::cout << "Div"; break;
+                case BinaryOp::Equal: std::cout << "Equal"; break;
+                case BinaryOp::NotEq: std::cout << "NotEq"; break;
+                case BinaryOp::Lt: std::cout << "Lt"; break;
+                case BinaryOp::Lte: std::cout << "Lte"; break;
+                case BinaryOp::Gt: std::cout << "Gt"; break;
+                case BinaryOp::Gte: std::cout << "Gte"; break;
+            }
+            std::cout << "," << std::endl;
+            std::cout << "  left = ";
+            printExp(*b->left);
+            std::cout << "," << std::endl;
+            std::cout << "  right = ";
+            printExp(*b->right);
+            std::cout << std::endl << ")";
+            break;
+        }
+        case ExpKind::ArrayAccess: {
+            const ArrayAccessExp* a = static_cast<const ArrayAccessExp*>(&exp);
+            std::cout << "ArrayAccess(" << std::endl;
+            std::cout << "  ptr = ";
+            printExp(*a->ptr);
+            std::cout << "," << std::endl;
+            std::cout << "  index = ";
+            printExp(*a->index);
+            std::cout << std::endl << ")";
+            break;
+        }
+        case ExpKind::FieldAccess: {
+            const FieldAccessExp* f = static_cast<const FieldAccessExp*>(&exp);
+            std::cout << "FieldAccess(" << std::endl;
+            std::cout << "  ptr = ";
+            printExp(*f->ptr);
+            std::cout << "," << std::endl;
+            std::cout << "  field = " << f->field << std::endl;
+            std::cout << ")";
+            break;
+        }
+        case ExpKind::Call: {
+            const CallExp* c = static_cast<const CallExp*>(&exp);
+            std::cout << "Call(" << std::endl;
+            std::cout << "  callee = ";
+            printExp(*c->callee);
+            std::cout << "," << std::endl;
+            std::cout << "  args = [";
+            for (size_t i = 0; i < c->args.size(); ++i) {
+                if (i > 0) std::cout << ", ";
+                printExp(*c->args[i]);
+            }
+            std::cout << "]" << std::endl << ")";
+            break;
         }
-    } else if (const BinOpExp* b = dynamic_cast<const BinOpExp*>(&exp)) {
-        std::cout << "BinOp(" << std::endl;
-        std::cout << "  op = ";
-        switch (b->op) {
-            case BinaryOp::Add: std::cout << "Add"; break;
-            case BinaryOp::Sub: std::cout << "Sub"; break;
-            case BinaryOp::Mul: std::cout << "Mul"; break;
-            case BinaryOp::Div: std::cout << "Div"; break;
-            case BinaryOp::Equal: std::cout << "Equal"; break;
-            case BinaryOp::NotEq: std::cout << "NotEq"; break;
-            case BinaryOp::Lt: std::cout << "Lt"; break;
-            case BinaryOp::Lte: std::cout << "Lte"; break;
-            case BinaryOp::Gt: std::cout << "Gt"; break;
-            case BinaryOp::Gte: std::cout << "Gte"; break;
-        }
-        std::cout << "," << std::endl;
-        std::cout << "  left = ";
-        printExp(*b->left);
-        std::cout << "," << std::endl;
-        std::cout << "  right = ";
-        printExp(*b->right);
-        std::cout << std::endl << ")";
-    } else if (const ArrayAccessExp* a = dynamic_cast<const ArrayAccessExp*>(&exp)) {
-        std::cout << "ArrayAccess(" << std::endl;
-        std::cout << "  ptr = ";
-        printExp(*a->ptr);
-        std::cout << "," << std::endl;
-        std::cout << "  index = ";
-        printExp(*a->index);
-        std::cout << std::endl << ")";
-    } else if (const FieldAccessExp* f = dynamic_cast<const FieldAccessExp*>(&exp)) {
-        std::cout << "FieldAccess(" << std::endl;
-        std::cout << "  ptr = ";
-        printExp(*f->ptr);
-        std::cout << "," << std::endl;
-        std::cout << "  field = " << f->field << std::endl;
-        std::cout << ")";
-    } else if (const CallExp* c = dynamic_cast<const CallExp*>(&exp)) {
-        std::cout << "Call(" << std::endl;
-        std::cout << "  callee = ";
-        printExp(*c->callee);
-        std::cout << "," << std::endl;
-        std::cout << "  args = [";
-        for (size_t i = 0; i < c->args.size(); ++i) {
-            if (i > 0) std::cout << ", ";
-            printExp(*c->args[i]);
-        }
-        std::cout << "]" << std::endl << ")";
     }
 }
 
 void printStmt(const Stmt& stmt) {
-    if (dynamic_cast<const BreakStmt*>(&stmt)) {
-        std::cout << "Break";
-    } else if (dynamic_cast<const ContinueStmt*>(&stmt)) {
-        std::cout << "Continue";
-    } else if (const ReturnStmt* r = dynamic_cast<const ReturnStmt*>(&stmt)) {
-        std::cout << "Return(" << std::endl;
-        if (r->exp) {
-            std::cout << "  ";
-            printExp(*r->exp);
-            std::cout << std::endl;
-        }
-        else cout<<"_";
-        std::cout << ")";
-    } else if (const AssignStmt* a = dynamic_cast<const AssignStmt*>(&stmt)) {
-        std::cout << "Assign(" << std::endl;
-        std::cout << "  lhs = ";
-        printLval(*a->lhs);
-        std::cout << "," << std::endl;
-        std::cout << "  rhs = ";
-        printRhs(*a->rhs);
-        std::cout << std::endl << ")";
-    } else if (const CallStmt* c = dynamic_cast<const CallStmt*>(&stmt)) {
-        std::cout << "Call(" << std::endl;
-        std::cout << "  callee = ";
-        printLval(*c->callee);
-        std::cout << "," << std::endl;
-        std::cout << "  args = [";
-        for (size_t i = 0; i < c->args.size(); ++i) {
-            if (i > 0) std::cout << ", ";
-            printExp(*c->args[i]);
-        }
-        std::cout << "]" << std::endl << ")";
-    } else if (const IfStmt* i = dynamic_cast<const IfStmt*>(&stmt)) {
-        std::cout << "If(" << std::endl;
-        std::cout << "  guard = ";
-        printExp(*i->guard);
-        std::cout << "," << std::endl;
-        std::cout << "  tt = [" << std::endl;
-        for (size_t j = 0; j < i->tt.size(); ++j) {
-            std::cout << "    ";
-            printStmt(*i->tt[j]);
-            if (j < i->tt.size() - 1) {
-                std::cout << "," << std::endl;
-            }
-        }
-        std::cout << std::endl << "  ]," << std::endl;
-        std::cout << "  ff = [" << std::endl;
-        for (size_t j = 0; j < i->ff.size(); ++j) {
-            std::cout << "    ";
-            printStmt(*i->ff[j]);
-            if (j < i->ff.size() - 1) {
-                std::cout << "," << std::endl;
-            }
-        }
-        std::cout << std::endl << "  ]" << std::endl;
-        std::cout << ")";
-    } else if (const WhileStmt* w = dynamic_cast<const WhileStmt*>(&stmt)) {
-        std::cout << "While(" << std::endl;
-        std::cout << "  guard = ";
-        printExp(*w->guard);
-        std::cout << "," << std::endl;
-        std::cout << "  body = [" << std::endl;
-        for (size_t i = 0; i < w->body.size(); ++i) {
-            std::cout << "    ";
-            printStmt(*w->body[i]);
-            if (i < w->body.size() - 1) {
-                std::cout << "," << std::endl;
-            }
-        }
-        std::cout << std::endl << "  ]" << std::endl;
-        std::cout << ")";
+    switch (stmt.kind) {
+        case StmtKind::Break: {
+            std::cout << "Break";
+            break;
+        }
+        case StmtKind::Continue: {
+            std::cout << "Continue";
+            break;
+        }
+        case StmtKind::Return: {
+            const ReturnStmt* r = static_cast<const ReturnStmt*>(&stmt);
+            std::cout << "Return(" << std::endl;
+            if (r->exp) {
+                std::cout << "  ";
+                printExp(*r->exp);
+                std::cout << std::endl;
+            }
+            else cout<<"_";
+            std::cout << ")";
+            break;
+        }
+        case StmtKind::Assign: {
+            const AssignStmt* a = static_cast<const AssignStmt*>(&stmt);
+            std::cout << "Assign(" << std::endl;
+            std::cout << "  lhs = ";
+            printLval(*a->lhs);
+            std::cout << "," << std::endl;
+            std::cout << "  rhs = ";
+            printRhs(*a->rhs);
+            std::cout << std::endl << ")";
+            break;
+        }
+        case StmtKind::Call: {
+            const CallStmt* c = static_cast<const CallStmt*>(&stmt);
+            std::cout << "Call(" << std::endl;
+            std::cout << "  callee = ";
+            printLval(*c->callee);
+            std::cout << "," << std::endl;
+            std::cout << "  args = [";
+            for (size_t i = 0; i < c->args.size(); ++i) {
+                if (i > 0) std::cout << ", ";
+                printExp(*c->args[i]);
+            }
+            std::cout << "]" << std::endl << ")";
+            break;
+        }
+        case StmtKind::If: {
+            const IfStmt* i = static_cast<const IfStmt*>(&stmt);
+            std::cout << "If(" << std::endl;
+            std::cout << "  guard = ";
+            printExp(*i->guard);
+            std::cout << "," << std::endl;
+            std::cout << "  tt = [" << std::endl;
+            for (size_t j = 0; j < i->tt.size(); ++j) {
+                std::cout << "    ";
+                printStmt(*i->tt[j]);
+                if (j < i->tt.size() - 1) {
+                    std::cout << "," << std::endl;
+                }
+            }
+            std::cout << std::endl << "  ]," << std::endl;
+            std::cout << "  ff = [" << std::endl;
+            for (size_t j = 0; j < i->ff.size(); ++j) {
+                std::cout << "    ";
+                printStmt(*i->ff[j]);
+                if (j < i->ff.size() - 1) {
+                    std::cout << "," << std::endl;
+                }
+            }
+            std::cout << std::endl << "  ]" << std::endl;
+            std::cout << ")";
+            break;
+        }
+        case StmtKind::While: {
+            const WhileStmt* w = static_cast<const WhileStmt*>(&stmt);
+            std::cout << "While(" << std::endl;
+            std::cout << "  guard = ";
+            printExp(*w->guard);
+            std::cout << "," << std::endl;
+            std::cout << "  body = [" << std::endl;
+            for (size_t i = 0; i < w->body.size(); ++i) {
+                std::cout << "    ";
+                printStmt(*w->body[i]);
+                if (i < w->body.size() - 1) {
+                    std::cout << "," << std::endl;
+                }
+            }
+            std::cout << std::endl << "  ]" << std::endl;
+            std::cout << ")";
+            break;
+        }
     }
 }
 
 void printLval(const Lval& lval) {
-    if (const IdLval* i = dynamic_cast<const IdLval*>(&lval)) {
-        std::cout << "Id(" << i->name << ")";
-    } else if (const DerefLval* d = dynamic_cast<const DerefLval*>(&lval)) {
-        std::cout << "Deref(";
-        printLval(*d->lval);
-        std::cout << ")";
-    } else if (const ArrayAccessLval* a = dynamic_cast<const ArrayAccessLval*>(&lval)) {
-        std::cout << "ArrayAccess(" << std::endl;
-        std::cout << "  ptr = ";
-        printLval(*a->ptr);
-        std::cout << "," << std::endl;
-        std::cout << "  index = ";
-        printExp(*a->index);
-        std::cout << std::endl << ")";
-    } else if (const FieldAccessLval* f = dynamic_cast<const FieldAccessLval*>(&lval)) {
-        std::cout << "FieldAccess(" << std::endl;
-        std::cout << "  ptr = ";
-        printLval(*f->ptr);
-        std::cout << "," << std::endl;
-        std::cout << "  field = " << f->field << std::endl;
-        std::cout << ")";
+    switch (lval.kind) {
+        case LvalKind::Id: {
+            const IdLval* i = static_cast<const IdLval*>(&lval);
+            std::cout << "Id(" << i->name << ")";
+            break;
+        }
+        case LvalKind::Deref: {
+            const DerefLval* d = static_cast<const DerefLval*>(&lval);
+            std::cout << "Deref(";
+            printLval(*d->lval);
+            std::cout << ")";
+            break;
+        }
+        case LvalKind::ArrayAccess: {
+            const ArrayAccessLval* a = static_cast<const ArrayAccessLval*>(&lval);
+            std::cout << "ArrayAccess(" << std::endl;
+            std::cout << "  ptr = ";
+            printLval(*a->ptr);
+            std::cout << "," << std::endl;
+            std::cout << "  index = ";
+            printExp(*a->index);
+            std::cout << std::endl << ")";
+            break;
+        }
+        case LvalKind::FieldAccess: {
+            const FieldAccessLval* f = static_cast<const FieldAccessLval*>(&lval);
+            std::cout << "FieldAccess(" << std::endl;
+            std::cout << "  ptr = ";
+            printLval(*f->ptr);
+            std::cout << "," << std::endl;
+            std::cout << "  field = " << f->field << std::endl;
+            std::cout << ")";
+            break;
+        }
     }
 }
 
 void printRhs(const Rhs& rhs) {
-    if (const RhsExp* e = dynamic_cast<const RhsExp*>(&rhs)) {
-        printExp(*e->exp);
-    } else if (const NewRhs* n = dynamic_cast<const NewRhs*>(&rhs)) {
-        std::cout << "New(";
-        printType(*n->type);
-        if (n->amount) {
-            std::cout << ", ";
-            printExp(*n->amount);
+    switch (rhs.kind) {
+        case RhsKind::Exp: {
+            const RhsExp* e = static_cast<const RhsExp*>(&rhs);
+            printExp(*e->exp);
+            break;
+        }
+        case RhsKind::New: {
+            const NewRhs* n = static_cast<const NewRhs*>(&rhs);
+            std::cout << "New(";
+            printType(*n->type);
+            if (n->amount) {
+                std::cout << ", ";
+                printExp(*n->amount);
+            }
+            std::cout << ")";
+            break;
         }
-        std::cout << ")";
     }
 }
 void printProgram(const Program& program) {
@@ -1741,178 +2529,459 @@ void printProgram(const Program& program) {
 
 [FUNCTION] in function {}: variable {} with type {} has initializer of type {}
 */
-void function_check(const Program& program, std::unordered_map<std::string, std::unique_ptr<Type>>& gammaR0, const std::unordered_map<std::string, std::unordered_map<std::string, std::unique_ptr<Type>>>& delta) {
-    // initialize Γ′ = prms ⊔ locals.decls
-    for (const auto& func : program.functions) {
-        std::unordered_map<std::string, std::unique_ptr<Type>> gammaPrime;
-        for (const auto& param : func.params) {
-            gammaPrime[param.name] = param.type->clone();
-        }
-        for (const auto& local : func.locals) {
-            gammaPrime[local.first.name] = local.first.type->clone();    //  if the local declaration overrides a parameter declaration with the same name
-        }
-
-    // type check each Decl in gammaPrime
-        for (const auto& decl : gammaPrime) {
-            if (dynamic_cast<Struct*>(decl.second.get()) || dynamic_cast<Fn*>(decl.second.get())) {
-                addTypeError("[FUNCTION] in function " + func.name + ": variable " + decl.first + " has a struct or function type");
-            }
-        }
-
+// the [FUNCTION] rules and the judgements of one function's initializers and statements
+void check_function(const Function& func, const std::unordered_map<std::string, Type*>& gammaR0, const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) {
+    // initialize Γ′ = prms ⊔ locals.decls, and Γ′′ = Γ⊔Γ′ where any entry from Γ′ overrides an entry with the
+    // same name in Γ. Γ′ is the scope's own layer, Γ stays shared.
+    Scope gammaDoublePrime(gammaR0);
+    for (const auto& param : func.params) {
+        gammaDoublePrime.bind(param.name, param.type);
+    }
+    for (const auto& local : func.locals) {
+        gammaDoublePrime.bind(local.first.name, local.first.type);    //  if the local declaration overrides a parameter declaration with the same name
+    }
 
-         // similarily, define Γ′′ = Γ⊔Γ′ where any entry from Γ′ overrides an entry with the same name in Γ
-        std::unordered_map<std::string, std::unique_ptr<Type>> gammaDoublePrime;
-        for (auto& entry : gammaR0) {
-            gammaDoublePrime[entry.first] = entry.second->clone();
-        }
-        for (auto& entry : gammaPrime) {
-            gammaDoublePrime[entry.first] = std::move(entry.second);
+    // type check each Decl in Γ′
+    for (const auto& decl : gammaDoublePrime.bindings()) {
+        if (as<Struct>(decl.second) || as<Fn>(decl.second)) {
+            addTypeError(TypeErrorCode::Function, func.name, "variable {} has a struct or function type", {decl.first}, func.span);
         }
+    }
 
-        // for (const auto& entry : gammaDoublePrime) {
-        //     string second;
-        //     if (!entry.second.get()) {
-        //         second = "NULL";
-        //     }
-        //     else{
-        //         second = entry.second.get()->toString();
-        //     }
-        //     std::cout << entry.first << " : " << second << std::endl;
-        // }
     // run judgement on the EXP of each local variable in the function using judgement method
-        for (const auto& local : func.locals) {
-            // report error if the type of the initializer does not match the type of the variable
-            if (local.second) {
-                auto init_type = local.second->judgement(func.name, gammaDoublePrime, delta);
-                if (dynamic_cast<Any*>(local.first.type.get()) || dynamic_cast<Any*>(init_type)){
-                    continue;
-                }
-                else if (!(local.first.type.get()->operator==(*init_type))) {
-                    addTypeError("[FUNCTION] in function " + func.name + ": variable " + local.first.name +
-                     " with type " + local.first.type->toString() + " has initializer of type " +
-                      init_type->toString());
-                }
-            }
-        }
-        
-        for (const auto& stmt : func.stmts) {
-            if (func.rettyp){
-                // run judgement on the EXP of each stmt in the function using judgement method
-                stmt->judgement(func.name, false, func.rettyp->clone(), gammaDoublePrime, delta);
+    for (const auto& local : func.locals) {
+        // report error if the type of the initializer does not match the type of the variable
+        if (local.second) {
+            auto init_type = local.second->judgement(func.name, gammaDoublePrime, delta);
+            if (as<Any>(local.first.type) || as<Any>(init_type)){
+                continue;
             }
-            else{
-                // run judgement on the EXP of each stmt in the function using judgement method
-                stmt->judgement(func.name, false, nullptr, gammaDoublePrime, delta);
+            else if (!(local.first.type->operator==(*init_type))) {
+                addTypeError(TypeErrorCode::Function, func.name, "variable {} with type {} has initializer of type {}", {local.first.name, local.first.type, init_type}, local.first.span);
             }
         }
     }
+    
+    for (const auto& stmt : func.stmts) {
+        // run judgement on the EXP of each stmt in the function using judgement method
+        stmt->judgement(func.name, false, func.rettyp, gammaDoublePrime, delta);
+    }
+}
+
+const size_t PARALLEL_MIN_FUNCTIONS = 32; // per thread, below this a thread costs more than it checks
+unsigned checkThreads = parallel::hardwareThreads();
+
+// Functions only read Γ0, ∆ and the type context, so they are checked independently (see Common/parallel.hpp).
+// Each sends its errors to a buffer of its own; the buffers are appended in function order, so typeErrors
+// ends up as if the functions were checked one after another and reportTypeErrors sorts it the same way.
+void function_check(const Program& program, const std::unordered_map<std::string, Type*>& gammaR0, const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) {
+    const size_t count = program.functions.size();
+    std::vector<std::vector<TypeError>> errors(count);
+    parallel::forEach(count, parallel::threadsFor(checkThreads, count, PARALLEL_MIN_FUNCTIONS), [&](size_t f) {
+        errorSink = &errors[f];
+        check_function(program.functions[f], gammaR0, delta);
+        errorSink = nullptr;
+    });
+
+    for (auto& buffer : errors) {
+        typeErrors.insert(typeErrors.end(), std::make_move_iterator(buffer.begin()), std::make_move_iterator(buffer.end()));
+    }
+}
+
+
+// Check that the type of the Decl is not a struct type or a function type
+void check_global(const Decl& decl) {
+    if (as<Struct>(decl.type) || as<Fn>(decl.type)){
+        addTypeError(TypeErrorCode::Global, decl.name, "has a struct or function type", {}, decl.span);
+    }
 }
 
+// check that for each Decl in fields of the struct, the type is not a struct type or a function type
+void check_struct(const Struct& s) {
+    for (const auto& field : s.fields) {
+        if (as<Struct>(field.second) || as<Fn>(field.second)) {
+            addTypeError(TypeErrorCode::Struct, s.name, "field {} has a struct or function type", {field.first});
+        } 
+    }
+}
 
-void global_struct_check(const Program& program, const std::unordered_map<std::string, std::unique_ptr<Type>>& gammaR0, const std::unordered_map<std::string, std::unordered_map<std::string, std::unique_ptr<Type>>>& delta) {
-    // Check that the type of the Decl is not a struct type or a function type
+void global_struct_check(const Program& program, const std::unordered_map<std::string, Type*>& gammaR0, const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) {
     for (const auto& decl : program.globals) {
-        if (dynamic_cast<Struct*>(decl.type.get()) || dynamic_cast<Fn*>(decl.type.get())){
-            addTypeError("[GLOBAL] global " + decl.name + " has a struct or function type");
-        }
+        check_global(decl);
     }
-    // check that for each Decl in fields of each struct, the type is not a struct type or a function type
     for (const auto& s : program.structs) {
-        for (const auto& field : s.fields) {
-            if (dynamic_cast<Struct*>(field.second.get()) || dynamic_cast<Fn*>(field.second.get())) {
-                addTypeError("[STRUCT] struct " + s.name + " field " + field.first + " has a struct or function type");
-            } 
-        }
+        check_struct(s);
     }
 }
 
 // ** gammaR0 holds string->type info for: 
 //global variables  |  extern declared functions  |  internal defined functions (except main)
 
-void type_check(const Program& program, std::unordered_map<std::string, std::unique_ptr<Type>>& gammaR0, const std::unordered_map<std::string, std::unordered_map<std::string, std::unique_ptr<Type>>>& delta) {
+void type_check(const Program& program, const std::unordered_map<std::string, Type*>& gammaR0, const std::unordered_map<std::string, std::unordered_map<std::string, Type*>>& delta) {
+    metrics::Scope scope("check");
     global_struct_check(program, gammaR0, delta);   
     function_check(program, gammaR0, delta);
 }
 
+// initialize Γ0 and ∆ (see the note at the end of the file)
+void initialize_environment(const Program& program, std::unordered_map<std::string, Type*>& gammaR0, std::unordered_map<StructId, std::unordered_map<std::string, Type*>>& delta) {
+    for (const auto& decl : program.globals) {
+        gammaR0[decl.name] = decl.type;  
+    }
+    for (const auto& str : program.structs) {
+        std::unordered_map<std::string, Type*> fields;
+        for (const auto& field : str.fields) {
+            fields[field.first] = field.second;
+        }
+        delta[str.name] = std::move(fields);
+    }
+    for (const auto& ext : program.externs) {    // map the function name to its function type
+        gammaR0[ext.name] = ext.type;
+    }
+    for (const auto& func : program.functions) {
+        if (func.name == "main") {
+            gammaR0[func.name] = func.rettyp;      // continue;  // we can add main function to emit Exp errors if we need the return Type for main
+        }                                              // but need to check if main is called in the body of another function
+        //  map the function name to a pointer to its function type
+        else {
+            std::vector<Type*> prms;    //  extract the parameter types to build fn type
+            for (const auto& param : func.params) {
+                prms.push_back(param.type);
+            }
+            gammaR0[func.name] = typeContext.pointer(typeContext.function(prms, func.rettyp));
+        }
+    }
+}
+
+// Parses and checks successive versions of one program (parser --incremental), redoing only what an edit
+// touched. Each version's tokens are split into the top-level items parseItems() dispatches on - a `let`,
+// `struct`, `extern` or `fn` at brace depth 0 starts the next one - and every item is fingerprinted by its
+// token types and text. An item seen before reuses its AST; a function additionally reuses its errors while
+// every Γ0 / ∆ lookup it made (CheckDeps) still gives the same answer.
+//
+// Items are parsed with spans counted from their first token, so the cached AST and errors hold wherever
+// the item moves to; errors are moved back to file offsets when they are reported. Cache entries no
+// version uses any more are dropped, their nodes stay in the arena until the checker goes away.
+class IncrementalChecker {
+public:
+    struct Stats {
+        size_t items = 0, parsed = 0, functions = 0, checked = 0;
+    };
+
+    // Parses filename into a Program for printing and leaves its type errors in typeErrors. Returns null when
+    // the tokens do not split into items or an item does not parse; a full run then reports the error.
+    std::unique_ptr<Program> update(const std::string& filename, Stats& stats) {
+        std::ifstream file;
+        auto source = openTokenSource(filename, file);
+        if (!source) throw std::runtime_error("Failed to open file: " + filename);
+
+        generation++;
+        std::vector<Use> uses;
+        auto program = std::make_unique<Program>();
+        std::vector<Token> item; // tokens of the item being read, parsed only when its fingerprint is new
+        uint64_t print = 0;
+        auto finish = [&]() {
+            uint32_t base = item.front().span.valid() ? item.front().span.offset : 0;
+            auto [found, fresh] = cache.try_emplace(print);
+            Entry& entry = found->second;
+            if (fresh && !parse(entry, item.data(), item.data() + item.size(), base)) {
+                cache.erase(found);
+                return false;
+            }
+            if (fresh) stats.parsed++;
+            entry.generation = generation;
+            uses.push_back({&entry, base});
+
+            for (const auto& decl : entry.globals) program->globals.push_back(decl);
+            for (const auto& decl : entry.externs) program->externs.push_back(decl);
+            for (const auto& str : entry.structs) program->structs.emplace_back(str.name, str.fields);
+            for (const auto& func : entry.functions) program->functions.push_back(func);
+            return true;
+        };
+        int depth = 0;
+        while (!source->atEnd()) {
+            Token token = source->next();
+            TokenType type = token.type;
+            if (depth == 0 && (type == TokenType::Let || type == TokenType::Struct ||
+                               type == TokenType::Extern || type == TokenType::Fn)) {
+                if (!item.empty() && !finish()) return nullptr;
+                item.clear();
+                print = FNV_BASIS;
+            } else if (item.empty()) {
+                return nullptr;
+            }
+            if (type == TokenType::OpenBrace) depth++;
+            if (type == TokenType::CloseBrace && --depth < 0) return nullptr;
+            print = fingerprint(print, token);
+            item.push_back(std::move(token));
+        }
+        if (!item.empty() && !finish()) return nullptr;
+        stats.items = uses.size();
+
+        std::unordered_map<std::string, Type*> gammaR0;
+        std::unordered_map<StructId, std::unordered_map<std::string, Type*>> delta;
+        initialize_environment(*program, gammaR0, delta);
+        std::vector<TypeError> errors;
+        for (const Use& use : uses) {
+            Entry& entry = *use.entry;
+            errors.clear();
+            errorSink = &errors;
+            for (const auto& decl : entry.globals) check_global(decl);
+            for (const auto& str : entry.structs) check_struct(str);
+            errorSink = nullptr;
+            if (!entry.functions.empty()) {
+                stats.functions++;
+                if (!entry.checked || !holds(entry.deps, gammaR0, delta)) {
+                    entry.errors.clear();
+                    entry.deps.clear();
+                    errorSink = &entry.errors;
+                    checkDeps = &entry.deps;
+                    check_function(entry.functions.front(), gammaR0, delta);
+                    errorSink = nullptr;
+                    checkDeps = nullptr;
+                    entry.deps.compact();
+                    entry.checked = true;
+                    stats.checked++;
+                }
+                errors.insert(errors.end(), entry.errors.begin(), entry.errors.end());
+            }
+            for (TypeError& error : errors) {
+                if (error.span.valid()) error.span.offset += use.base;
+                typeErrors.push_back(error);
+            }
+        }
+
+        for (auto it = cache.begin(); it != cache.end(); ) {
+            it = it->second.generation == generation ? std::next(it) : cache.erase(it);
+        }
+        return program;
+    }
+
+private:
+    struct Entry {
+        std::vector<Decl> globals, externs;
+        std::vector<Struct> structs;
+        std::vector<Function> functions;
+        bool checked = false;           // fn: errors and deps are from the last check
+        std::vector<TypeError> errors;  // spans relative to the item
+        CheckDeps deps;
+        uint64_t generation = 0;        // the last version that had this item
+    };
+    struct Use {
+        Entry* entry;
+        uint32_t base; // file offset of the item's first token
+    };
+
+    Program store; // arena and names of every item parsed so far, its lists are only a staging area
+    std::unordered_map<uint64_t, Entry> cache; // by fingerprint, the nodes never move
+    uint64_t generation = 0;
+
+    static constexpr uint64_t FNV_BASIS = 14695981039346656037ull;
+
+    static uint64_t fingerprint(uint64_t hash, const Token& token) { // FNV-1a over type and text
+        hash = (hash ^ static_cast<uint64_t>(token.type)) * 1099511628211ull;
+        for (unsigned char c : token.value) hash = (hash ^ c) * 1099511628211ull;
+        return (hash ^ 0xFF) * 1099511628211ull;
+    }
+
+    bool parse(Entry& entry, const Token* begin, const Token* end, uint32_t base) {
+        SliceTokenSource source(begin, end, base);
+        Parser parser(source);
+        try {
+            parser.parseItems(store);
+        } catch (const std::exception&) {
+            store.globals.clear();
+            store.externs.clear();
+            store.structs.clear();
+            store.functions.clear();
+            return false;
+        }
+        entry.globals = std::move(store.globals);
+        entry.externs = std::move(store.externs);
+        entry.structs = std::move(store.structs);
+        entry.functions = std::move(store.functions);
+        store.globals.clear();
+        store.externs.clear();
+        store.structs.clear();
+        store.functions.clear();
+        return true;
+    }
+
+    static bool holds(const CheckDeps& deps, const std::unordered_map<std::string, Type*>& gammaR0,
+                      const std::unordered_map<StructId, std::unordered_map<std::string, Type*>>& delta) {
+        for (const auto& global : deps.globals) {
+            auto now = gammaR0.find(std::string(global.name));
+            bool bound = now != gammaR0.end();
+            if (bound != global.bound || (bound && now->second != global.type)) return false;
+        }
+        for (const auto& field : deps.fields) {
+            Type* type = nullptr;
+            if (lookupField(delta, std::string(field.structName), std::string(field.field), type) != field.result
+                || type != field.type) return false;
+        }
+        return true;
+    }
+};
+
+// parser --bench <tokens> : time to parse the tokens into an AST, to type check it and to tear it down
+// again, and the peak RSS it took. Token decoding is part of the parse time. Parse errors abort the
+// benchmark; type errors are counted but not printed.
+void benchmark_parser(const std::string& filename) {
+    using clock = std::chrono::steady_clock;
+
+    double parseSeconds = 0, checkSeconds = 0, teardownSeconds = 0;
+    size_t arenaBytes = 0, nodes = 0, errors = 0;
+    int reps = 0;
+    while (reps < 3 || parseSeconds + checkSeconds + teardownSeconds < 1.0) {
+        std::ifstream file;
+        auto tokens = openTokenSource(filename, file);
+        if (!tokens) throw std::runtime_error("Failed to open file: " + filename);
+        Parser parser(*tokens);
+
+        auto start = clock::now();
+        auto program = parser.parseProgram();
+        auto parsed = clock::now();
+        std::unordered_map<std::string, Type*> gammaR0;
+        std::unordered_map<StructId, std::unordered_map<std::string, Type*>> delta;
+        initialize_environment(*program, gammaR0, delta);
+        type_check(*program, gammaR0, delta);
+        auto checked = clock::now();
+        arenaBytes = program->arena.bytes();
+        nodes = program->nodes;
+        errors = typeErrors.size();
+        typeErrors.clear();
+        program.reset();
+        auto freed = clock::now();
+
+        parseSeconds += std::chrono::duration<double>(parsed - start).count();
+        checkSeconds += std::chrono::duration<double>(checked - parsed).count();
+        teardownSeconds += std::chrono::duration<double>(freed - checked).count();
+        reps++;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cerr << std::fixed << std::setprecision(2)
+              << "parse    : " << parseSeconds * 1000 / reps << " ms/run, " << reps << " runs" << std::endl
+              << "check    : " << checkSeconds * 1000 / reps << " ms/run on " << checkThreads << " thread(s), " << nodes << " nodes, "
+              << nodes * reps / checkSeconds / 1e6 << " M nodes/s, " << errors << " type errors" << std::endl
+              << "teardown : " << teardownSeconds * 1000 / reps << " ms/run" << std::endl
+              << "arena    : " << arenaBytes / 1024 << " KB" << std::endl
+              << "peak rss : " << usage.ru_maxrss << " KB" << std::endl;
+}
+
 
 
 int main(int argc, char* argv[]) {
 
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <filename>" << std::endl;
-        return 1;
+    std::string filename, sourcePath;
+    std::vector<std::string> versions, versionSources;
+    bool bench = false, incremental = false;
+    size_t maxErrors = SIZE_MAX;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "--source" && a + 1 < argc) versionSources.push_back(sourcePath = argv[++a]); // type errors get file:line:col
+        else if (arg == "--bench") bench = true;
+        else if (arg == "--incremental") incremental = true;
+        else if (incremental) versions.push_back(filename = arg);
+        else if (arg == "-j" && a + 1 < argc) checkThreads = std::max(1, atoi(argv[++a]));
+        else if (arg == "--max-errors" && a + 1 < argc) maxErrors = std::max(0, atoi(argv[++a]));
+        else if (filename.empty()) filename = arg;
+        else {
+            filename.clear(); // more than one input, print the usage
+            break;
+        }
     }
 
-    std::string filename = argv[1];
-    std::ifstream inputFile(filename);
-    if (!inputFile) {
-        std::cerr << "Error: Failed to open file " << filename << std::endl;
+    if (filename.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [-j threads] [--max-errors N] [--source <file.cf>] <tokens>   (lex text output, a lex -o token stream, or - for text on stdin)" << std::endl;
+        std::cerr << "       " << argv[0] << " [-j threads] --bench <tokens>" << std::endl;
+        std::cerr << "       " << argv[0] << " [--max-errors N] [--source <file.cf>]... --incremental <tokens>...   (versions of one program, in order)" << std::endl;
         return 1;
     }
 
-    std::vector<Token> tokens;
-    std::string line;
-    while (std::getline(inputFile, line)) {
-        if (line.empty()) continue;
-        std::istringstream iss(line);
-        std::string tokenStr;
-        if (iss >> tokenStr) {
-            if (tokenStr.substr(0, 3) == "Id(") {
-                tokens.emplace_back(TokenType::Id, tokenStr.substr(3, tokenStr.length() - 4));
-            } else if (tokenStr.substr(0, 4) == "Num(") {
-                tokens.emplace_back(TokenType::Num, tokenStr.substr(4, tokenStr.length() - 5));
-            } else {
-                auto it = tokenMap.find(tokenStr);
-                if (it != tokenMap.end()) {
-                    tokens.emplace_back(it->second);
-                } else {
-                    std::cerr << "Error: Unknown token '" << tokenStr << "'" << std::endl;
-                    return 1;
+    if (incremental) {
+        // Each version prints what a run on it alone would; what was redone goes to stderr. A version a run
+        // alone would fail on fails the session, but the versions after it are still checked.
+        IncrementalChecker checker;
+        int status = 0;
+        for (size_t v = 0; v < versions.size(); v++) {
+            std::string source = v < versionSources.size() ? versionSources[v] : "";
+            IncrementalChecker::Stats stats;
+            typeErrors.clear();
+            auto start = std::chrono::steady_clock::now();
+            double seconds = 0;
+            try {
+                std::unique_ptr<Program> program = checker.update(versions[v], stats);
+                if (!program) {
+                    // Let the full parser report what is wrong with this version.
+                    std::ifstream inputFile;
+                    auto tokens = openTokenSource(versions[v], inputFile);
+                    if (!tokens) throw std::runtime_error("Failed to open file: " + versions[v]);
+                    Parser parser(*tokens);
+                    program = parser.parseProgram();
+                    std::unordered_map<std::string, Type*> gammaR0;
+                    std::unordered_map<StructId, std::unordered_map<std::string, Type*>> delta;
+                    initialize_environment(*program, gammaR0, delta);
+                    type_check(*program, gammaR0, delta);
+                    stats.items = stats.parsed = program->globals.size() + program->externs.size()
+                                               + program->structs.size() + program->functions.size();
+                    stats.functions = stats.checked = program->functions.size();
                 }
+                seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                printProgram(*program);
+                reportTypeErrors(source, maxErrors);
+            } catch (const TokenStreamError& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                status = 1;
+                continue;
+            } catch (const std::exception& e) {
+                cout << e.what() << endl;
             }
+            std::cerr << versions[v] << ": " << stats.items << " items, " << stats.parsed << " parsed, "
+                      << stats.checked << " of " << stats.functions << " functions checked in "
+                      << seconds * 1000 << " ms" << std::endl;
         }
+        return status;
     }
 
-    Parser parser(std::move(tokens));
+    if (bench) {
+        try {
+            benchmark_parser(filename);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    std::ifstream inputFile;
+    std::unique_ptr<TokenSource> tokens;
     try {
-        auto program = parser.parseProgram();
-        printProgram(*program);
-        std::unordered_map<std::string, std::unique_ptr<Type>> gammaR0;
-        std::unordered_map<StructId, std::unordered_map<std::string, std::unique_ptr<Type>>> delta;
-
-        // initialize Γ0 and ∆
-        for (const auto& decl : program->globals) {
-            gammaR0[decl.name] = decl.type->clone();  
-        }
-        for (const auto& str : program->structs) {
-            std::unordered_map<std::string, std::unique_ptr<Type>> fields;
-            for (const auto& field : str.fields) {
-                fields[field.first] = field.second->clone();
-            }
-            delta[str.name] = std::move(fields);
-        }
-        for (const auto& ext : program->externs) {    // map the function name to its function type
-            gammaR0[ext.name] = ext.type->clone();
-        }
-        for (const auto& func : program->functions) {
-            if (func.name == "main") {
-                gammaR0[func.name] = func.rettyp->clone();      // continue;  // we can add main function to emit Exp errors if we need the return Type for main
-            }                                              // but need to check if main is called in the body of another function
-            //  map the function name to a pointer to its function type
-            else {
-                std::vector<std::unique_ptr<Type>> prms;    //  extract the parameter types to build fn type
-                for (const auto& param : func.params) {
-                    prms.push_back(param.type->clone());
-                }
-                unique_ptr<Type> ret = nullptr;
-                if (func.rettyp){
-                    ret = func.rettyp->clone();
-                }
-                auto funcType = std::make_unique<Fn>(std::move(prms), std::move(ret));    // segfault
-                auto ptrType = std::make_unique<Ptr>(std::move(funcType));
-                gammaR0[func.name] = std::move(ptrType);
-            }
+        tokens = openTokenSource(filename, inputFile); // lex -o output or lex text, pulled as the parser goes
+    } catch (const TokenStreamError& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    if (!tokens) {
+        std::cerr << "Error: Failed to open file " << filename << std::endl;
+        return 1;
+    }
+
+    Parser parser(*tokens);
+    try {
+        std::unique_ptr<Program> program;
+        try {
+            program = parser.parseProgram();
+        } catch (const TokenStreamError& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
         }
+        printProgram(*program);
+        std::unordered_map<std::string, Type*> gammaR0;
+        std::unordered_map<StructId, std::unordered_map<std::string, Type*>> delta;
+
+        initialize_environment(*program, gammaR0, delta);
         // print contents of gamma 
         // for (const auto& entry : gammaR0) {
         //     std::cout << entry.first << " -> ";
@@ -1921,7 +2990,7 @@ int main(int argc, char* argv[]) {
         // }
 
         type_check(*program, gammaR0, delta);
-        reportTypeErrors();
+        reportTypeErrors(sourcePath, maxErrors);
         //print out gamma's contents
         // for (const auto& entry : gammaR0) {
         //     if (entry.first == "foo1"){
@@ -1929,7 +2998,7 @@ int main(int argc, char* argv[]) {
         //     printType(*entry.second);
         //     std::cout << std::endl;
         //     std::cout << "printing out all param types for foo1" << std::endl;
-        //     auto fn = dynamic_cast<Fn*>(entry.second.get());
+        //     auto fn = as<Fn>(entry.second.get());
         //     for (const auto& param : fn->params) {
         //         printType(*param);
         //         std::cout << std::endl;
@@ -5,6 +5,7 @@
 #include <unordered_set>
 #include <queue>
 #include "json.hpp"
+#include "../Common/metrics.hpp"
 #include <map>
 #include <string>
 #include <cctype>
@@ -437,7 +438,10 @@ int main(int argc, char *argv[]) {
     // read in json data
     std::ifstream file(argv[1]);
     json jsonData;
-    file >> jsonData;
+    {
+        metrics::Scope scope("load");
+        file >> jsonData;
+    }
     file.close();
 
     // init
@@ -489,8 +493,11 @@ int main(int argc, char *argv[]) {
     }
 
     // dfa/optimization
+    metrics::Scope dfa("dfa");
+    metrics::Counter& iterations = metrics::counter("dfa iterations");
     while (!worklist.empty())
     {
+        iterations += 1;
         lbl = worklist.front().first;
         pred = worklist.front().second;
         worklist.pop();